@@ -0,0 +1,608 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_START@
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ * @APPLE_APACHE_LICENSE_HEADER_END@
+ */
+
+/* bench-launchdata: measures the launch_data paths that every launchd
+ * request goes through, i.e. packing, unpacking, copying, dictionary lookup
+ * and a full request/reply over a socketpair, at a handful of tree shapes.
+ *
+ * Output is one tab-separated line per case, after a header line:
+ *
+ *	shape op nodes bytes iterations ns_per_op mb_per_sec
+ *
+ * 'bytes' is the encoded size of the tree for the wire version the op uses
+ * (version 1 for copy and lookup). 'mb_per_sec' is that size times the
+ * number of operations per second, and is 0 for lookups.
+ */
+
+#include "launch.h"
+#include "launch_priv.h"
+#include "launch_internal.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+struct bench_shape {
+	const char *name;
+	launch_data_t (*build)(size_t);
+	size_t arg;
+};
+
+struct bench_case {
+	launch_data_t tree;
+	size_t nodes;
+	size_t size_v1;
+	size_t size_v2;
+	void *packed;
+	void *scratch;
+	const char **keys;
+	size_t nkeys;
+	size_t next_key;
+	launch_t client;
+	launch_t server;
+	bool replied;
+};
+
+struct bench_op {
+	const char *name;
+	int wire_version;
+	bool needs_dict;
+	void (*run)(struct bench_case *, size_t);
+};
+
+static launch_data_t bench_build_job(size_t which);
+static launch_data_t bench_build_jobs(size_t n);
+static launch_data_t bench_build_flat(size_t n);
+static launch_data_t bench_build_array(size_t n);
+static launch_data_t bench_build_deep(size_t depth);
+static size_t bench_count_nodes(launch_data_t d);
+static void bench_count_pair(launch_data_t obj, const char *key, void *context);
+static void bench_collect_key(launch_data_t obj, const char *key, void *context);
+static void bench_pack(struct bench_case *bc, size_t iters);
+static void bench_pack_v2(struct bench_case *bc, size_t iters);
+static void bench_unpack(struct bench_case *bc, size_t iters);
+static void bench_unpack_v2(struct bench_case *bc, size_t iters);
+static void bench_copy(struct bench_case *bc, size_t iters);
+static void bench_lookup(struct bench_case *bc, size_t iters);
+static void bench_lookup_miss(struct bench_case *bc, size_t iters);
+static void bench_roundtrip(struct bench_case *bc, size_t iters);
+static void bench_server_cb(launch_data_t msg, void *context);
+static void bench_client_cb(launch_data_t msg, void *context);
+static void bench_pump(struct bench_case *bc);
+static uint64_t bench_now(void);
+static void bench_fail(const char *what);
+static void usage(void);
+
+static const struct bench_shape bench_shapes[] = {
+	{ "job", bench_build_job, 0 },
+	{ "jobs-100", bench_build_jobs, 100 },
+	{ "jobs-1000", bench_build_jobs, 1000 },
+	{ "flat-16", bench_build_flat, 16 },
+	{ "flat-256", bench_build_flat, 256 },
+	{ "flat-4096", bench_build_flat, 4096 },
+	{ "flat-65536", bench_build_flat, 65536 },
+	{ "array-4096", bench_build_array, 4096 },
+	{ "deep-64", bench_build_deep, 64 },
+};
+
+static const struct bench_op bench_ops[] = {
+	{ "pack", 1, false, bench_pack },
+	{ "pack-v2", 2, false, bench_pack_v2 },
+	{ "unpack", 1, false, bench_unpack },
+	{ "unpack-v2", 2, false, bench_unpack_v2 },
+	{ "copy", 1, false, bench_copy },
+	{ "lookup", 1, true, bench_lookup },
+	{ "lookup-miss", 1, true, bench_lookup_miss },
+	{ "roundtrip", 1, false, bench_roundtrip },
+	{ "roundtrip-v2", 2, false, bench_roundtrip },
+};
+
+#define BENCH_COUNT(a)	(sizeof(a) / sizeof((a)[0]))
+
+static const char *bench_progname;
+
+int
+main(int argc, char *const argv[])
+{
+	const char *only_shape = NULL, *only_op = NULL;
+	double min_secs = 0.2;
+	size_t i, j, k, iters;
+	int ch;
+
+	bench_progname = argv[0];
+
+	while ((ch = getopt(argc, argv, "s:o:t:l")) != -1) {
+		switch (ch) {
+		case 's':
+			only_shape = optarg;
+			break;
+		case 'o':
+			only_op = optarg;
+			break;
+		case 't':
+			min_secs = strtod(optarg, NULL);
+			break;
+		case 'l':
+			for (i = 0; i < BENCH_COUNT(bench_shapes); i++) {
+				printf("shape\t%s\n", bench_shapes[i].name);
+			}
+			for (i = 0; i < BENCH_COUNT(bench_ops); i++) {
+				printf("op\t%s\n", bench_ops[i].name);
+			}
+			return EXIT_SUCCESS;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || min_secs < 0) {
+		usage();
+	}
+	for (i = 0; only_shape && i < BENCH_COUNT(bench_shapes) && strcmp(only_shape, bench_shapes[i].name) != 0; i++);
+	for (j = 0; only_op && j < BENCH_COUNT(bench_ops) && strcmp(only_op, bench_ops[j].name) != 0; j++);
+	if (i == BENCH_COUNT(bench_shapes) || j == BENCH_COUNT(bench_ops)) {
+		fprintf(stderr, "%s: unknown %s; -l lists them\n", bench_progname, i == BENCH_COUNT(bench_shapes) ? "shape" : "op");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("shape\top\tnodes\tbytes\titerations\tns_per_op\tmb_per_sec\n");
+
+	for (i = 0; i < BENCH_COUNT(bench_shapes); i++) {
+		const struct bench_shape *bs = &bench_shapes[i];
+		struct bench_case bc;
+		int sv[2];
+
+		if (only_shape && strcmp(only_shape, bs->name) != 0) {
+			continue;
+		}
+
+		memset(&bc, 0, sizeof(bc));
+		if (!(bc.tree = bs->build(bs->arg))) {
+			bench_fail("build");
+		}
+		bc.nodes = bench_count_nodes(bc.tree);
+		bc.size_v1 = launch_data_packed_size(bc.tree, NULL);
+		if (!(bc.packed = malloc(bc.size_v1)) || !(bc.scratch = malloc(bc.size_v1))) {
+			bench_fail("malloc");
+		}
+		/* No v2 node is larger than its v1 form. */
+		if (!(bc.size_v2 = launch_data_pack_v2(bc.tree, bc.scratch, bc.size_v1, NULL, NULL))) {
+			bench_fail("launch_data_pack_v2");
+		}
+
+		if (launch_data_get_type(bc.tree) == LAUNCH_DATA_DICTIONARY) {
+			if (!(bc.keys = calloc(launch_data_dict_get_count(bc.tree), sizeof(char *)))) {
+				bench_fail("calloc");
+			}
+			launch_data_dict_iterate(bc.tree, bench_collect_key, &bc);
+			/* Look the keys up in a fixed but scattered order. */
+			srandom(1);
+			for (k = bc.nkeys; k > 1; k--) {
+				size_t r = (size_t)random() % k;
+				const char *t = bc.keys[k - 1];
+				bc.keys[k - 1] = bc.keys[r];
+				bc.keys[r] = t;
+			}
+		}
+
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+			bench_fail("socketpair");
+		}
+		if (!(bc.client = launchd_fdopen(sv[0], -1)) || !(bc.server = launchd_fdopen(sv[1], -1))) {
+			bench_fail("launchd_fdopen");
+		}
+
+		for (j = 0; j < BENCH_COUNT(bench_ops); j++) {
+			const struct bench_op *bo = &bench_ops[j];
+			uint64_t start, elapsed;
+			size_t bytes;
+
+			if (only_op && strcmp(only_op, bo->name) != 0) {
+				continue;
+			}
+			if (bo->needs_dict && bc.nkeys == 0) {
+				continue;
+			}
+
+			launchd_set_wire_version(bc.client, bo->wire_version);
+			bytes = bo->wire_version == 2 ? bc.size_v2 : bc.size_v1;
+
+			/* Warm up, then double the batch until it runs long enough to
+			 * be worth reporting.
+			 */
+			bo->run(&bc, 1);
+			for (iters = 1; ; iters *= 2) {
+				start = bench_now();
+				bo->run(&bc, iters);
+				elapsed = bench_now() - start;
+				if (elapsed >= (uint64_t)(min_secs * 1e9) || iters >= (SIZE_MAX / 4)) {
+					break;
+				}
+			}
+
+			printf("%s\t%s\t%zu\t%zu\t%zu\t%.1f\t%.1f\n", bs->name, bo->name, bc.nodes, bytes, iters,
+					(double)elapsed / iters, bo->needs_dict ? 0.0 : (double)bytes * iters * 1e9 / elapsed / (1024 * 1024));
+			fflush(stdout);
+		}
+
+		launchd_close(bc.client, close);
+		launchd_close(bc.server, close);
+		free(bc.keys);
+		free(bc.packed);
+		free(bc.scratch);
+		launch_data_free(bc.tree);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+launch_data_t
+bench_build_job(size_t which)
+{
+	launch_data_t job = launch_data_alloc(LAUNCH_DATA_DICTIONARY);
+	launch_data_t args = launch_data_alloc(LAUNCH_DATA_ARRAY);
+	launch_data_t env = launch_data_alloc(LAUNCH_DATA_DICTIONARY);
+	launch_data_t ms = launch_data_alloc(LAUNCH_DATA_DICTIONARY);
+	launch_data_t cal = launch_data_alloc(LAUNCH_DATA_DICTIONARY);
+	char buf[128];
+	size_t i;
+
+	/* Roughly what a typical daemon's plist turns into, plus the keys
+	 * launchd adds when it exports a job.
+	 */
+	snprintf(buf, sizeof(buf), "com.example.daemon.%zu", which);
+	launch_data_dict_insert(job, launch_data_new_string(buf), LAUNCH_JOBKEY_LABEL);
+	launch_data_dict_insert(job, launch_data_new_string("_example"), LAUNCH_JOBKEY_USERNAME);
+
+	snprintf(buf, sizeof(buf), "/usr/libexec/exampled%zu", which);
+	launch_data_array_set_index(args, launch_data_new_string(buf), 0);
+	launch_data_array_set_index(args, launch_data_new_string("--launchd"), 1);
+	launch_data_array_set_index(args, launch_data_new_string("--config=/etc/example.conf"), 2);
+	launch_data_dict_insert(job, args, LAUNCH_JOBKEY_PROGRAMARGUMENTS);
+
+	for (i = 0; i < 6; i++) {
+		snprintf(buf, sizeof(buf), "EXAMPLE_SETTING_%zu", i);
+		launch_data_dict_insert(env, launch_data_new_string("/private/var/db/example"), buf);
+	}
+	launch_data_dict_insert(job, env, LAUNCH_JOBKEY_ENVIRONMENTVARIABLES);
+
+	snprintf(buf, sizeof(buf), "com.example.daemon.%zu.xpc", which);
+	launch_data_dict_insert(ms, launch_data_new_bool(true), buf);
+	launch_data_dict_insert(job, ms, LAUNCH_JOBKEY_MACHSERVICES);
+
+	launch_data_dict_insert(cal, launch_data_new_integer(3), LAUNCH_JOBKEY_CAL_HOUR);
+	launch_data_dict_insert(cal, launch_data_new_integer(15), LAUNCH_JOBKEY_CAL_MINUTE);
+	launch_data_dict_insert(job, cal, LAUNCH_JOBKEY_STARTCALENDARINTERVAL);
+
+	launch_data_dict_insert(job, launch_data_new_bool(true), LAUNCH_JOBKEY_KEEPALIVE);
+	launch_data_dict_insert(job, launch_data_new_bool(true), LAUNCH_JOBKEY_RUNATLOAD);
+	launch_data_dict_insert(job, launch_data_new_integer(10), LAUNCH_JOBKEY_THROTTLEINTERVAL);
+	launch_data_dict_insert(job, launch_data_new_string("/private/var/log/example.log"), LAUNCH_JOBKEY_STANDARDOUTPATH);
+	launch_data_dict_insert(job, launch_data_new_integer(100 + which), LAUNCH_JOBKEY_PID);
+	launch_data_dict_insert(job, launch_data_new_integer(0), LAUNCH_JOBKEY_LASTEXITSTATUS);
+	launch_data_dict_insert(job, launch_data_new_integer(1), LAUNCH_JOBKEY_TIMEOUT);
+
+	return job;
+}
+
+launch_data_t
+bench_build_jobs(size_t n)
+{
+	launch_data_t all = launch_data_alloc(LAUNCH_DATA_DICTIONARY);
+	char label[128];
+	size_t i;
+
+	/* The shape of a full job export, keyed by label. */
+	for (i = 0; i < n; i++) {
+		snprintf(label, sizeof(label), "com.example.daemon.%zu", i);
+		launch_data_dict_insert(all, bench_build_job(i), label);
+	}
+
+	return all;
+}
+
+launch_data_t
+bench_build_flat(size_t n)
+{
+	launch_data_t d = launch_data_alloc(LAUNCH_DATA_DICTIONARY);
+	char key[64], val[64];
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		snprintf(key, sizeof(key), "Com.Example.Key.%zu", i);
+		snprintf(val, sizeof(val), "value-%zu", i);
+		launch_data_dict_insert(d, launch_data_new_string(val), key);
+	}
+
+	return d;
+}
+
+launch_data_t
+bench_build_array(size_t n)
+{
+	launch_data_t a = launch_data_alloc(LAUNCH_DATA_ARRAY);
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		launch_data_array_set_index(a, launch_data_new_integer(i), i);
+	}
+
+	return a;
+}
+
+launch_data_t
+bench_build_deep(size_t depth)
+{
+	launch_data_t d = launch_data_alloc(LAUNCH_DATA_DICTIONARY);
+	size_t i;
+
+	launch_data_dict_insert(d, launch_data_new_string("leaf"), "Name");
+	for (i = 0; i < depth; i++) {
+		launch_data_t up = launch_data_alloc(LAUNCH_DATA_DICTIONARY);
+
+		launch_data_dict_insert(up, launch_data_new_integer(i), "Level");
+		launch_data_dict_insert(up, d, "Child");
+		d = up;
+	}
+
+	return d;
+}
+
+size_t
+bench_count_nodes(launch_data_t d)
+{
+	size_t i, n = 1;
+
+	switch (launch_data_get_type(d)) {
+	case LAUNCH_DATA_ARRAY:
+		for (i = 0; i < launch_data_array_get_count(d); i++) {
+			n += bench_count_nodes(launch_data_array_get_index(d, i));
+		}
+		break;
+	case LAUNCH_DATA_DICTIONARY:
+		launch_data_dict_iterate(d, bench_count_pair, &n);
+		break;
+	default:
+		break;
+	}
+
+	return n;
+}
+
+void
+bench_count_pair(launch_data_t obj, const char *key __attribute__((unused)), void *context)
+{
+	/* The key is a string node of its own on the wire. */
+	*(size_t *)context += 1 + bench_count_nodes(obj);
+}
+
+void
+bench_collect_key(launch_data_t obj __attribute__((unused)), const char *key, void *context)
+{
+	struct bench_case *bc = context;
+
+	bc->keys[bc->nkeys++] = key;
+}
+
+void
+bench_pack(struct bench_case *bc, size_t iters)
+{
+	while (iters--) {
+		if (launch_data_pack(bc->tree, bc->packed, bc->size_v1, NULL, NULL) != bc->size_v1) {
+			bench_fail("launch_data_pack");
+		}
+	}
+}
+
+void
+bench_pack_v2(struct bench_case *bc, size_t iters)
+{
+	while (iters--) {
+		if (launch_data_pack_v2(bc->tree, bc->packed, bc->size_v1, NULL, NULL) != bc->size_v2) {
+			bench_fail("launch_data_pack_v2");
+		}
+	}
+}
+
+void
+bench_unpack(struct bench_case *bc, size_t iters)
+{
+	size_t data_offset, fd_offset;
+
+	if (launch_data_pack(bc->tree, bc->packed, bc->size_v1, NULL, NULL) != bc->size_v1) {
+		bench_fail("launch_data_pack");
+	}
+
+	/* Version 1 decodes in place and rewrites the buffer as it goes, so
+	 * each pass starts from a fresh copy of the packed image. The copy is
+	 * part of what gets timed, as it is for a real receive.
+	 */
+	while (iters--) {
+		memcpy(bc->scratch, bc->packed, bc->size_v1);
+		data_offset = fd_offset = 0;
+		if (!launch_data_unpack(bc->scratch, bc->size_v1, NULL, 0, &data_offset, &fd_offset)) {
+			bench_fail("launch_data_unpack");
+		}
+	}
+}
+
+void
+bench_unpack_v2(struct bench_case *bc, size_t iters)
+{
+	size_t data_offset, fd_offset;
+	launch_data_t d;
+
+	if (launch_data_pack_v2(bc->tree, bc->packed, bc->size_v1, NULL, NULL) != bc->size_v2) {
+		bench_fail("launch_data_pack_v2");
+	}
+
+	/* Copied each pass to match bench_unpack(), and freed since version 2
+	 * builds a tree of its own.
+	 */
+	while (iters--) {
+		memcpy(bc->scratch, bc->packed, bc->size_v2);
+		data_offset = fd_offset = 0;
+		if (!(d = launch_data_unpack_v2(bc->scratch, bc->size_v2, NULL, 0, &data_offset, &fd_offset))) {
+			bench_fail("launch_data_unpack_v2");
+		}
+		launch_data_free(d);
+	}
+}
+
+void
+bench_copy(struct bench_case *bc, size_t iters)
+{
+	launch_data_t d;
+
+	while (iters--) {
+		if (!(d = launch_data_copy(bc->tree))) {
+			bench_fail("launch_data_copy");
+		}
+		launch_data_free(d);
+	}
+}
+
+void
+bench_lookup(struct bench_case *bc, size_t iters)
+{
+	while (iters--) {
+		if (!launch_data_dict_lookup(bc->tree, bc->keys[bc->next_key])) {
+			bench_fail("launch_data_dict_lookup");
+		}
+		if (++bc->next_key == bc->nkeys) {
+			bc->next_key = 0;
+		}
+	}
+}
+
+void
+bench_lookup_miss(struct bench_case *bc, size_t iters)
+{
+	char key[128];
+
+	while (iters--) {
+		/* Same length and prefix as a hit, different last character. */
+		strlcpy(key, bc->keys[bc->next_key], sizeof(key) - 1);
+		strcat(key, "~");
+		if (launch_data_dict_lookup(bc->tree, key)) {
+			bench_fail("launch_data_dict_lookup");
+		}
+		if (++bc->next_key == bc->nkeys) {
+			bc->next_key = 0;
+		}
+	}
+}
+
+void
+bench_roundtrip(struct bench_case *bc, size_t iters)
+{
+	/* The server side answers in whatever version the client used, as
+	 * launchd does, so a round trip is a request and a reply of the same
+	 * size.
+	 */
+	while (iters--) {
+		bc->replied = false;
+		if (launchd_msg_send(bc->client, bc->tree) == -1 && errno != EAGAIN) {
+			bench_fail("launchd_msg_send");
+		}
+		while (!bc->replied) {
+			bench_pump(bc);
+		}
+	}
+}
+
+void
+bench_server_cb(launch_data_t msg, void *context)
+{
+	struct bench_case *bc = context;
+
+	if (launchd_msg_send(bc->server, msg) == -1 && errno != EAGAIN) {
+		bench_fail("launchd_msg_send");
+	}
+}
+
+void
+bench_client_cb(launch_data_t msg __attribute__((unused)), void *context)
+{
+	struct bench_case *bc = context;
+
+	bc->replied = true;
+}
+
+void
+bench_pump(struct bench_case *bc)
+{
+	struct pollfd pfd[2];
+
+	pfd[0].fd = launchd_getfd(bc->client);
+	pfd[0].events = POLLIN | (launchd_msg_sendlen(bc->client) ? POLLOUT : 0);
+	pfd[1].fd = launchd_getfd(bc->server);
+	pfd[1].events = POLLIN | (launchd_msg_sendlen(bc->server) ? POLLOUT : 0);
+
+	if (poll(pfd, 2, -1) == -1) {
+		if (errno == EINTR) {
+			return;
+		}
+		bench_fail("poll");
+	}
+
+	if ((pfd[0].revents & POLLOUT) && launchd_msg_send(bc->client, NULL) == -1 && errno != EAGAIN) {
+		bench_fail("launchd_msg_send");
+	}
+	if ((pfd[1].revents & POLLIN) && launchd_msg_recv(bc->server, bench_server_cb, bc) == -1 && errno != EAGAIN) {
+		bench_fail("launchd_msg_recv");
+	}
+	if ((pfd[1].revents & POLLOUT) && launchd_msg_send(bc->server, NULL) == -1 && errno != EAGAIN) {
+		bench_fail("launchd_msg_send");
+	}
+	if ((pfd[0].revents & POLLIN) && launchd_msg_recv(bc->client, bench_client_cb, bc) == -1 && errno != EAGAIN) {
+		bench_fail("launchd_msg_recv");
+	}
+}
+
+uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void
+bench_fail(const char *what)
+{
+	fprintf(stderr, "%s: %s: %s\n", bench_progname, what, strerror(errno));
+	exit(EXIT_FAILURE);
+}
+
+void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-l] [-s shape] [-o op] [-t seconds]\n", bench_progname);
+	exit(EXIT_FAILURE);
+}
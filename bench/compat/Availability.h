@@ -0,0 +1,8 @@
+/* Portable build shim. See bench/Makefile. */
+#ifndef __BENCH_COMPAT_AVAILABILITY_H__
+#define __BENCH_COMPAT_AVAILABILITY_H__
+
+#define __OSX_AVAILABLE_STARTING(mac, iphone)
+#define __OSX_AVAILABLE_BUT_DEPRECATED(macIntro, macDep, iphoneIntro, iphoneDep)
+
+#endif /* __BENCH_COMPAT_AVAILABILITY_H__ */
@@ -0,0 +1,13 @@
+/* Portable build shim. See bench/Makefile. */
+#ifndef __BENCH_COMPAT_AVAILABILITYMACROS_H__
+#define __BENCH_COMPAT_AVAILABILITYMACROS_H__
+
+#include <Availability.h>
+
+#define AVAILABLE_MAC_OS_X_VERSION_10_5_AND_LATER
+#define AVAILABLE_MAC_OS_X_VERSION_10_6_AND_LATER
+#define DEPRECATED_IN_MAC_OS_X_VERSION_10_5_AND_LATER
+#define AVAILABLE_MAC_OS_X_VERSION_10_0_AND_LATER_BUT_DEPRECATED_IN_MAC_OS_X_VERSION_10_5
+#define AVAILABLE_MAC_OS_X_VERSION_10_0_AND_LATER_BUT_DEPRECATED_IN_MAC_OS_X_VERSION_10_6
+
+#endif /* __BENCH_COMPAT_AVAILABILITYMACROS_H__ */
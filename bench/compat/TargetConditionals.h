@@ -0,0 +1,9 @@
+/* Portable build shim. See bench/Makefile. */
+#ifndef __BENCH_COMPAT_TARGETCONDITIONALS_H__
+#define __BENCH_COMPAT_TARGETCONDITIONALS_H__
+
+#define TARGET_OS_MAC 1
+#define TARGET_OS_EMBEDDED 0
+#define TARGET_OS_IPHONE 0
+
+#endif /* __BENCH_COMPAT_TARGETCONDITIONALS_H__ */
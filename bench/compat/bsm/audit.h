@@ -0,0 +1,9 @@
+/* Portable build shim. See bench/Makefile. */
+#ifndef __BENCH_COMPAT_BSM_AUDIT_H__
+#define __BENCH_COMPAT_BSM_AUDIT_H__
+
+#include <sys/types.h>
+
+typedef int au_asid_t;
+
+#endif /* __BENCH_COMPAT_BSM_AUDIT_H__ */
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_START@
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ * @APPLE_APACHE_LICENSE_HEADER_END@
+ */
+
+/* Stand-ins for the Darwin-only pieces liblaunch.c links against, so that
+ * the platform-neutral parts of it (launch_data, packing, message framing)
+ * can be built and measured elsewhere. Everything here fails the way it
+ * would with no launchd to talk to.
+ */
+
+#include <mach/mach.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+
+#include "launch.h"
+#include "bootstrap.h"
+#include "vproc.h"
+#include "vproc_priv.h"
+#include "vproc_internal.h"
+
+mach_port_t bootstrap_port = MACH_PORT_NULL;
+
+mach_port_t
+mach_task_self(void)
+{
+	return MACH_PORT_NULL;
+}
+
+kern_return_t
+mach_port_deallocate(mach_port_t task __attribute__((unused)), mach_port_t name __attribute__((unused)))
+{
+	return KERN_SUCCESS;
+}
+
+kern_return_t
+bootstrap_check_in(mach_port_t bp __attribute__((unused)), const name_t service_name __attribute__((unused)), mach_port_t *sp __attribute__((unused)))
+{
+	return BOOTSTRAP_NOT_PRIVILEGED;
+}
+
+kern_return_t
+vproc_mig_set_security_session(mach_port_t bp __attribute__((unused)), uuid_t uuid __attribute__((unused)), mach_port_t session __attribute__((unused)))
+{
+	return KERN_FAILURE;
+}
+
+kern_return_t
+_vprocmgr_getsocket(name_t sockpath __attribute__((unused)))
+{
+	return KERN_FAILURE;
+}
+
+vproc_err_t
+_vprocmgr_init(const char *session_type __attribute__((unused)))
+{
+	return (vproc_err_t)_vprocmgr_init;
+}
+
+vproc_err_t
+_vprocmgr_move_subset_to_user(uid_t target_user __attribute__((unused)), const char *session_type __attribute__((unused)), uint64_t flags __attribute__((unused)))
+{
+	return (vproc_err_t)_vprocmgr_move_subset_to_user;
+}
+
+vproc_err_t
+vproc_swap_complex(vproc_t vp __attribute__((unused)), vproc_gsk_t key __attribute__((unused)), launch_data_t inval __attribute__((unused)), launch_data_t *outval __attribute__((unused)))
+{
+	return (vproc_err_t)vproc_swap_complex;
+}
+
+size_t
+strlcpy(char *dst, const char *src, size_t size)
+{
+	size_t len = strlen(src);
+
+	if (size) {
+		size_t n = len < size - 1 ? len : size - 1;
+		memcpy(dst, src, n);
+		dst[n] = '\0';
+	}
+
+	return len;
+}
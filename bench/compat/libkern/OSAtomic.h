@@ -0,0 +1,19 @@
+/* Portable build shim. See bench/Makefile. */
+#ifndef __BENCH_COMPAT_OSATOMIC_H__
+#define __BENCH_COMPAT_OSATOMIC_H__
+
+#include <stdint.h>
+
+static inline int32_t
+OSAtomicAdd32(int32_t amount, volatile int32_t *value)
+{
+	return __sync_add_and_fetch(value, amount);
+}
+
+static inline int32_t
+OSAtomicAdd32Barrier(int32_t amount, volatile int32_t *value)
+{
+	return __sync_add_and_fetch(value, amount);
+}
+
+#endif /* __BENCH_COMPAT_OSATOMIC_H__ */
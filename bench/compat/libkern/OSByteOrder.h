@@ -0,0 +1,14 @@
+/* Portable build shim. See bench/Makefile. */
+#ifndef __BENCH_COMPAT_OSBYTEORDER_H__
+#define __BENCH_COMPAT_OSBYTEORDER_H__
+
+#include <endian.h>
+
+#define OSSwapHostToLittleInt16(x)	htole16(x)
+#define OSSwapHostToLittleInt32(x)	htole32(x)
+#define OSSwapHostToLittleInt64(x)	htole64(x)
+#define OSSwapLittleToHostInt16(x)	le16toh(x)
+#define OSSwapLittleToHostInt32(x)	le32toh(x)
+#define OSSwapLittleToHostInt64(x)	le64toh(x)
+
+#endif /* __BENCH_COMPAT_OSBYTEORDER_H__ */
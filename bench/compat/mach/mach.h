@@ -0,0 +1,49 @@
+/* Portable build shim. See bench/Makefile.
+ *
+ * Just enough of the Mach types for liblaunch's headers to parse. The
+ * functions behind them are stubbed out in compat.c and always fail.
+ */
+#ifndef __BENCH_COMPAT_MACH_H__
+#define __BENCH_COMPAT_MACH_H__
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+
+typedef unsigned int mach_port_t;
+typedef mach_port_t *mach_port_array_t;
+typedef int kern_return_t;
+typedef int boolean_t;
+typedef int cpu_type_t;
+typedef char name_t[128];
+typedef unsigned int mach_msg_type_number_t;
+
+#define KERN_SUCCESS	0
+#define KERN_FAILURE	5
+
+#define MACH_PORT_NULL	((mach_port_t)0)
+
+/* BSD errno values that Linux doesn't define. */
+#ifndef EBADRPC
+#define EBADRPC		72
+#endif
+#ifndef ENEEDAUTH
+#define ENEEDAUTH	81
+#endif
+
+#ifndef SYS_audit_session_self
+#define SYS_audit_session_self	(-1)
+#endif
+#ifndef SYS_audit_session_join
+#define SYS_audit_session_join	(-1)
+#endif
+
+extern mach_port_t bootstrap_port;
+
+mach_port_t mach_task_self(void);
+kern_return_t mach_port_deallocate(mach_port_t task, mach_port_t name);
+
+size_t strlcpy(char *dst, const char *src, size_t size);
+
+#endif /* __BENCH_COMPAT_MACH_H__ */
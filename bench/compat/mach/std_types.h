@@ -0,0 +1,2 @@
+/* Portable build shim. See bench/Makefile. */
+#include <mach/mach.h>
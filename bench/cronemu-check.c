@@ -0,0 +1,575 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_START@
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ * @APPLE_APACHE_LICENSE_HEADER_END@
+ */
+
+/* cronemu-check: checks cronemu() and cronemu_wday() from src/cronemu.c
+ * against an independent oracle, and counts where they differ from the
+ * mktime(3)-stepping implementation they replaced.
+ *
+ * The oracle walks forward one local calendar day at a time, doing its
+ * calendar arithmetic with timegm(3) so that no time zone rules are
+ * involved, and only converts the wall-clock times that match the entry.
+ * It encodes the intended behavior:
+ *
+ * - Candidates are wall-clock times, taken in wall-clock order from the
+ *   minute after the current local time.
+ * - A candidate that occurs twice (fall-back) fires at its first
+ *   occurrence that is still ahead.
+ * - A candidate that does not occur (spring-forward) fires the length of
+ *   the gap after it, i.e. at the same distance past the change.
+ * - A Month and Day that never exist together, like February 30, roll
+ *   over into the next month, as mktime(3) would.
+ *
+ * Every zone is swept twice: once with 'now' every ~5.3 days across
+ * 2008-2017, and once with 'now' every 7 minutes within 3 hours of each
+ * UTC offset change in those years. Zones missing from the system's time
+ * zone database are skipped. The exit status is nonzero if the new code
+ * and the oracle disagree anywhere.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cronemu.h"
+
+#define CHECK_YEAR_FIRST	2008
+#define CHECK_YEAR_LAST		2017
+#define CHECK_STEP_COARSE	(5 * 86400 + 7 * 3600 + 13 * 60 + 17)
+#define CHECK_STEP_FINE		(7 * 60)
+#define CHECK_NEAR_CHANGE	(3 * 3600)
+#define CHECK_SCAN_DAYS		(9 * 366)
+#define CHECK_REPORT_MAX	10
+
+struct check_stats {
+	unsigned long cases;
+	unsigned long new_vs_oracle;
+	unsigned long old_vs_new;
+};
+
+static void check_zone(const char *zone, struct check_stats *st);
+static void check_at(time_t now, struct check_stats *st);
+static void check_one(time_t now, int wday, int mon, int mday, int hour, int min, struct check_stats *st);
+static time_t check_find_change(time_t lo, time_t hi);
+static time_t oracle(time_t now, int wday, int mon, int mday, int hour, int min);
+static time_t oracle_convert(time_t now, const struct tm *wall);
+static bool oracle_same_wall(const struct tm *a, const struct tm *b);
+static int oracle_mdays(int year, int mon);
+static time_t old_cronemu(time_t now, int mon, int mday, int hour, int min);
+static time_t old_cronemu_wday(time_t now, int wday, int hour, int min);
+static bool old_cronemu_mon(struct tm *wtm, int mon, int mday, int hour, int min);
+static bool old_cronemu_mday(struct tm *wtm, int mday, int hour, int min);
+static bool old_cronemu_hour(struct tm *wtm, int hour, int min);
+static bool old_cronemu_min(struct tm *wtm, int min);
+
+static const char *check_zones[] = {
+	"UTC",
+	"America/Los_Angeles",
+	"Europe/London",
+	"Australia/Lord_Howe",
+	"America/Sao_Paulo",
+	"Asia/Kolkata",
+};
+
+/* -1 means the key is absent from the StartCalendarInterval entry. */
+static const int check_mons[] = { -1, 0, 1, 2, 3, 9, 10, 11 };
+static const int check_mdays[] = { -1, 1, 2, 15, 28, 29, 30, 31 };
+static const int check_hours[] = { -1, 0, 1, 2, 3, 23 };
+static const int check_mins[] = { -1, 0, 1, 30, 59 };
+static const int check_wdays[] = { 0, 1, 3, 6, 7 };
+
+#define CHECK_COUNT(a)	(sizeof(a) / sizeof((a)[0]))
+
+static const char *check_zone_name;
+static unsigned long check_reported;
+
+int
+main(int argc, char *const argv[] __attribute__((unused)))
+{
+	struct check_stats total = { 0, 0, 0 };
+	char path[256];
+	size_t i;
+
+	if (argc != 1) {
+		fprintf(stderr, "usage: cronemu-check\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("zone\tcases\tnew_vs_oracle\told_vs_new\n");
+
+	for (i = 0; i < CHECK_COUNT(check_zones); i++) {
+		struct check_stats st = { 0, 0, 0 };
+
+		snprintf(path, sizeof(path), "/usr/share/zoneinfo/%s", check_zones[i]);
+		if (strcmp(check_zones[i], "UTC") != 0 && access(path, R_OK) == -1) {
+			fprintf(stderr, "cronemu-check: %s: not in the time zone database, skipped\n", check_zones[i]);
+			continue;
+		}
+
+		check_zone(check_zones[i], &st);
+		printf("%s\t%lu\t%lu\t%lu\n", check_zones[i], st.cases, st.new_vs_oracle, st.old_vs_new);
+		fflush(stdout);
+
+		total.cases += st.cases;
+		total.new_vs_oracle += st.new_vs_oracle;
+		total.old_vs_new += st.old_vs_new;
+	}
+
+	printf("total\t%lu\t%lu\t%lu\n", total.cases, total.new_vs_oracle, total.old_vs_new);
+
+	return total.new_vs_oracle ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+void
+check_zone(const char *zone, struct check_stats *st)
+{
+	struct tm tm;
+	time_t first, last, now, prev, change;
+
+	check_zone_name = zone;
+	setenv("TZ", zone, 1);
+	tzset();
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = CHECK_YEAR_FIRST - 1900;
+	tm.tm_mday = 1;
+	first = timegm(&tm);
+	tm.tm_year = CHECK_YEAR_LAST + 1 - 1900;
+	last = timegm(&tm);
+
+	for (now = first; now < last; now += CHECK_STEP_COARSE) {
+		check_at(now, st);
+	}
+
+	/* Hourly is fine enough to see every change in these zones. */
+	for (prev = first, now = first + 3600; now < last; prev = now, now += 3600) {
+		if (localtime_r(&prev, &tm)->tm_gmtoff == localtime_r(&now, &tm)->tm_gmtoff) {
+			continue;
+		}
+		change = check_find_change(prev, now);
+		for (prev = change - CHECK_NEAR_CHANGE; prev < change + CHECK_NEAR_CHANGE; prev += CHECK_STEP_FINE) {
+			check_at(prev, st);
+		}
+		prev = now;
+	}
+}
+
+time_t
+check_find_change(time_t lo, time_t hi)
+{
+	struct tm tm;
+	long off = localtime_r(&lo, &tm)->tm_gmtoff;
+
+	/* The first second with the new offset. */
+	while (hi - lo > 1) {
+		time_t mid = lo + (hi - lo) / 2;
+
+		if (localtime_r(&mid, &tm)->tm_gmtoff == off) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return hi;
+}
+
+void
+check_at(time_t now, struct check_stats *st)
+{
+	size_t a, b, c, d;
+
+	for (a = 0; a < CHECK_COUNT(check_mons); a++) {
+		for (b = 0; b < CHECK_COUNT(check_mdays); b++) {
+			for (c = 0; c < CHECK_COUNT(check_hours); c++) {
+				for (d = 0; d < CHECK_COUNT(check_mins); d++) {
+					check_one(now, -1, check_mons[a], check_mdays[b], check_hours[c], check_mins[d], st);
+				}
+			}
+		}
+	}
+
+	for (a = 0; a < CHECK_COUNT(check_wdays); a++) {
+		for (c = 0; c < CHECK_COUNT(check_hours); c++) {
+			for (d = 0; d < CHECK_COUNT(check_mins); d++) {
+				check_one(now, check_wdays[a], -1, -1, check_hours[c], check_mins[d], st);
+			}
+		}
+	}
+}
+
+void
+check_one(time_t now, int wday, int mon, int mday, int hour, int min, struct check_stats *st)
+{
+	time_t want, got, old;
+	char nowbuf[64], wantbuf[64], gotbuf[64];
+	struct tm tm;
+
+	if (wday == -1) {
+		got = cronemu(now, mon, mday, hour, min);
+		old = old_cronemu(now, mon, mday, hour, min);
+	} else {
+		got = cronemu_wday(now, wday, hour, min);
+		old = old_cronemu_wday(now, wday, hour, min);
+	}
+	want = oracle(now, wday, mon, mday, hour, min);
+
+	st->cases++;
+	if (old != got) {
+		st->old_vs_new++;
+	}
+	if (want == got) {
+		return;
+	}
+
+	st->new_vs_oracle++;
+	if (check_reported++ < CHECK_REPORT_MAX) {
+		strftime(nowbuf, sizeof(nowbuf), "%Y-%m-%d %H:%M:%S %Z", localtime_r(&now, &tm));
+		strftime(wantbuf, sizeof(wantbuf), "%Y-%m-%d %H:%M %Z", localtime_r(&want, &tm));
+		strftime(gotbuf, sizeof(gotbuf), "%Y-%m-%d %H:%M %Z", localtime_r(&got, &tm));
+		fprintf(stderr, "%s: now %s, Weekday %d Month %d Day %d Hour %d Minute %d: want %s, got %s\n",
+				check_zone_name, nowbuf, wday, mon, mday, hour, min, wantbuf, gotbuf);
+	}
+}
+
+time_t
+oracle(time_t now, int wday, int mon, int mday, int hour, int min)
+{
+	struct tm start, day, wall;
+	time_t t, first, daystart, limit;
+	int h, m;
+
+	/* The minute after the current local time, with wall-clock carries. */
+	localtime_r(&now, &start);
+	start.tm_sec = 0;
+	start.tm_min++;
+	start.tm_isdst = 0;
+	t = timegm(&start);
+	gmtime_r(&t, &start);
+
+	if (wday == 7) {
+		wday = 0;
+	}
+
+	if (wday == -1 && mon != -1 && mday > oracle_mdays(2000, mon)) {
+		/* Never a real date. The old code let mktime(3) carry it into
+		 * the next month, and that is kept.
+		 */
+		memset(&wall, 0, sizeof(wall));
+		wall.tm_year = start.tm_year + (start.tm_mon > mon);
+		wall.tm_mon = mon;
+		wall.tm_mday = mday;
+		wall.tm_hour = hour == -1 ? 0 : hour;
+		wall.tm_min = min == -1 ? 0 : min;
+		t = timegm(&wall);
+		gmtime_r(&t, &wall);
+		return oracle_convert(now, &wall);
+	}
+
+	memset(&day, 0, sizeof(day));
+	day.tm_year = start.tm_year;
+	day.tm_mon = start.tm_mon;
+	day.tm_mday = start.tm_mday;
+	daystart = timegm(&day);
+	first = timegm(&start);
+	limit = daystart + CHECK_SCAN_DAYS * 86400;
+
+	while (daystart < limit) {
+		gmtime_r(&daystart, &day);
+
+		/* Skip whole months, or straight to the day, where that is
+		 * obviously safe. Otherwise go a day at a time.
+		 */
+		if ((mon != -1 && day.tm_mon != mon) || (mday != -1 && day.tm_mday > mday)) {
+			daystart += (oracle_mdays(day.tm_year + 1900, day.tm_mon) - day.tm_mday + 1) * 86400;
+			continue;
+		}
+		if (mday != -1 && day.tm_mday < mday) {
+			daystart += (mday - day.tm_mday) * 86400;
+			continue;
+		}
+		if (wday != -1 && day.tm_wday != wday) {
+			daystart += 86400;
+			continue;
+		}
+
+		for (h = 0; h < 24; h++) {
+			if (hour != -1 && h != hour) {
+				continue;
+			}
+			for (m = 0; m < 60; m++) {
+				if (min != -1 && m != min) {
+					continue;
+				}
+
+				t = daystart + h * 3600 + m * 60;
+				if (t < first) {
+					continue;
+				}
+				gmtime_r(&t, &wall);
+				if ((t = oracle_convert(now, &wall)) != -1) {
+					return t;
+				}
+			}
+		}
+
+		daystart += 86400;
+	}
+
+	return -1;
+}
+
+time_t
+oracle_convert(time_t now, const struct tm *wall)
+{
+	struct tm w = *wall, lt;
+	time_t base, t, best = -1;
+	long offs[3], lo;
+	bool exists = false;
+	int i;
+
+	w.tm_isdst = 0;
+	base = timegm(&w);
+
+	/* The offsets in force around that wall-clock time. */
+	t = base - 86400;
+	offs[0] = localtime_r(&t, &lt)->tm_gmtoff;
+	offs[1] = localtime_r(&base, &lt)->tm_gmtoff;
+	t = base + 86400;
+	offs[2] = localtime_r(&t, &lt)->tm_gmtoff;
+
+	for (i = 0; i < 3; i++) {
+		t = base - offs[i];
+		if (!oracle_same_wall(localtime_r(&t, &lt), wall)) {
+			continue;
+		}
+		exists = true;
+		if (t > now && (best == -1 || t < best)) {
+			best = t;
+		}
+	}
+
+	if (exists) {
+		return best;
+	}
+
+	/* In a gap: read it with the offset from before the change. */
+	lo = offs[0] < offs[2] ? offs[0] : offs[2];
+	t = base - lo;
+
+	return t > now ? t : -1;
+}
+
+bool
+oracle_same_wall(const struct tm *a, const struct tm *b)
+{
+	return a->tm_year == b->tm_year && a->tm_mon == b->tm_mon && a->tm_mday == b->tm_mday
+			&& a->tm_hour == b->tm_hour && a->tm_min == b->tm_min && a->tm_sec == b->tm_sec;
+}
+
+int
+oracle_mdays(int year, int mon)
+{
+	struct tm tm;
+	time_t t;
+
+	/* Day zero of the next month is the last day of this one. */
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = year - 1900;
+	tm.tm_mon = mon + 1;
+	t = timegm(&tm);
+	gmtime_r(&t, &tm);
+
+	return tm.tm_mday;
+}
+
+/* What follows is the implementation cronemu() replaced, as it stood before,
+ * except that it takes 'now' instead of calling time(3).
+ */
+time_t
+old_cronemu(time_t now, int mon, int mday, int hour, int min)
+{
+	struct tm workingtm;
+
+	workingtm = *localtime(&now);
+
+	workingtm.tm_isdst = -1;
+	workingtm.tm_sec = 0;
+	workingtm.tm_min++;
+
+	while (!old_cronemu_mon(&workingtm, mon, mday, hour, min)) {
+		workingtm.tm_year++;
+		workingtm.tm_mon = 0;
+		workingtm.tm_mday = 1;
+		workingtm.tm_hour = 0;
+		workingtm.tm_min = 0;
+		mktime(&workingtm);
+	}
+
+	return mktime(&workingtm);
+}
+
+time_t
+old_cronemu_wday(time_t now, int wday, int hour, int min)
+{
+	struct tm workingtm;
+
+	workingtm = *localtime(&now);
+
+	workingtm.tm_isdst = -1;
+	workingtm.tm_sec = 0;
+	workingtm.tm_min++;
+
+	if (wday == 7) {
+		wday = 0;
+	}
+
+	while (!(workingtm.tm_wday == wday && old_cronemu_hour(&workingtm, hour, min))) {
+		workingtm.tm_mday++;
+		workingtm.tm_hour = 0;
+		workingtm.tm_min = 0;
+		mktime(&workingtm);
+	}
+
+	return mktime(&workingtm);
+}
+
+bool
+old_cronemu_mon(struct tm *wtm, int mon, int mday, int hour, int min)
+{
+	if (mon == -1) {
+		struct tm workingtm = *wtm;
+		int carrytest;
+
+		while (!old_cronemu_mday(&workingtm, mday, hour, min)) {
+			workingtm.tm_mon++;
+			workingtm.tm_mday = 1;
+			workingtm.tm_hour = 0;
+			workingtm.tm_min = 0;
+			carrytest = workingtm.tm_mon;
+			mktime(&workingtm);
+			if (carrytest != workingtm.tm_mon) {
+				return false;
+			}
+		}
+		*wtm = workingtm;
+		return true;
+	}
+
+	if (mon < wtm->tm_mon) {
+		return false;
+	}
+
+	if (mon > wtm->tm_mon) {
+		wtm->tm_mon = mon;
+		wtm->tm_mday = 1;
+		wtm->tm_hour = 0;
+		wtm->tm_min = 0;
+	}
+
+	return old_cronemu_mday(wtm, mday, hour, min);
+}
+
+bool
+old_cronemu_mday(struct tm *wtm, int mday, int hour, int min)
+{
+	if (mday == -1) {
+		struct tm workingtm = *wtm;
+		int carrytest;
+
+		while (!old_cronemu_hour(&workingtm, hour, min)) {
+			workingtm.tm_mday++;
+			workingtm.tm_hour = 0;
+			workingtm.tm_min = 0;
+			carrytest = workingtm.tm_mday;
+			mktime(&workingtm);
+			if (carrytest != workingtm.tm_mday) {
+				return false;
+			}
+		}
+		*wtm = workingtm;
+		return true;
+	}
+
+	if (mday < wtm->tm_mday) {
+		return false;
+	}
+
+	if (mday > wtm->tm_mday) {
+		wtm->tm_mday = mday;
+		wtm->tm_hour = 0;
+		wtm->tm_min = 0;
+	}
+
+	return old_cronemu_hour(wtm, hour, min);
+}
+
+bool
+old_cronemu_hour(struct tm *wtm, int hour, int min)
+{
+	if (hour == -1) {
+		struct tm workingtm = *wtm;
+		int carrytest;
+
+		while (!old_cronemu_min(&workingtm, min)) {
+			workingtm.tm_hour++;
+			workingtm.tm_min = 0;
+			carrytest = workingtm.tm_hour;
+			mktime(&workingtm);
+			if (carrytest != workingtm.tm_hour) {
+				return false;
+			}
+		}
+		*wtm = workingtm;
+		return true;
+	}
+
+	if (hour < wtm->tm_hour) {
+		return false;
+	}
+
+	if (hour > wtm->tm_hour) {
+		wtm->tm_hour = hour;
+		wtm->tm_min = 0;
+	}
+
+	return old_cronemu_min(wtm, min);
+}
+
+bool
+old_cronemu_min(struct tm *wtm, int min)
+{
+	if (min == -1) {
+		return true;
+	}
+
+	if (min < wtm->tm_min) {
+		return false;
+	}
+
+	if (min > wtm->tm_min) {
+		wtm->tm_min = min;
+	}
+
+	return true;
+}
@@ -191,6 +191,19 @@ __ld_setter
 void
 launch_data_free(launch_data_t);
 
+/* launch_data_retain() returns the object with one more reference, and
+ * launch_data_release() (or launch_data_free()) drops one. A retained object
+ * is shared, not copied: changes made through one reference are seen through
+ * all of them. Use launch_data_copy() for an independent, deep copy.
+ */
+__ld_normal
+launch_data_t
+launch_data_retain(launch_data_t);
+
+__ld_setter
+void
+launch_data_release(launch_data_t);
+
 __ld_setter
 bool
 launch_data_dict_insert(launch_data_t, const launch_data_t, const char *);
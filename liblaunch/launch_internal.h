@@ -38,11 +38,32 @@ launch_data_t launch_data_new_errno(int);
 bool launch_data_set_errno(launch_data_t, int);
 
 int launchd_msg_send(launch_t, launch_data_t);
+/* Appends a message behind anything still unsent without writing to the
+ * socket. launchd_msg_send(lh, NULL) flushes the queue.
+ */
+int launchd_msg_queue(launch_t, launch_data_t);
+/* Bytes queued but not yet written. */
+size_t launchd_msg_sendlen(launch_t);
 int launchd_msg_recv(launch_t, void (*)(launch_data_t, void *), void *);
 
+/* Exactly the number of bytes launch_data_pack() will write for 'd'. If
+ * 'fd_cnt' is not NULL, it is incremented by the number of descriptors
+ * that will travel with it.
+ */
+size_t launch_data_packed_size(launch_data_t d, size_t *fd_cnt);
 size_t launch_data_pack(launch_data_t d, void *where, size_t len, int *fd_where, size_t *fdslotsleft);
 launch_data_t launch_data_unpack(void *data, size_t data_size, int *fds, size_t fd_cnt, size_t *data_offset, size_t *fdoffset);
 
+/* The compact version 2 encoding. Connections speak version 1 until the
+ * Hello exchange settles on something newer, and always answer in the
+ * version the peer last used.
+ */
+#define LAUNCHD_WIRE_VERSION_MAX 2
+
+size_t launch_data_pack_v2(launch_data_t d, void *where, size_t len, int *fd_where, size_t *fdslotsleft);
+launch_data_t launch_data_unpack_v2(void *data, size_t data_size, int *fds, size_t fd_cnt, size_t *data_offset, size_t *fdoffset);
+void launchd_set_wire_version(launch_t, int);
+
 #pragma GCC visibility pop
 
 #endif /*  __LAUNCH_INTERNAL_H__*/
@@ -41,10 +41,21 @@ __BEGIN_DECLS
 #define LAUNCH_KEY_GETRUSAGESELF "GetResourceUsageSelf"
 #define LAUNCH_KEY_GETRUSAGECHILDREN "GetResourceUsageChildren"
 #define LAUNCH_KEY_SETPRIORITYLIST "SetPriorityList"
+/* Sent by liblaunch when it connects. The value is a dictionary of the
+ * extensions the client can use, and launchd answers with the subset it
+ * also supports. Older launchds answer with an errno.
+ */
+#define LAUNCH_KEY_HELLO "Hello"
+#define LAUNCH_HELLO_KEY_TAGS "Tags"
+#define LAUNCH_HELLO_KEY_WIREVERSION "WireVersion"
 
 #define LAUNCHD_SOCKET_ENV "LAUNCHD_SOCKET"
 #define LAUNCHD_SOCK_PREFIX _PATH_VARTMP "launchd"
 #define LAUNCHD_TRUSTED_FD_ENV "__LAUNCHD_FD"
+/* Set to "2" to have launch_msg() ask for the compact wire encoding. It is
+ * only used if launchd agrees to it in answer to the Hello.
+ */
+#define LAUNCHD_WIRE_FORMAT_ENV "LAUNCHD_WIRE_FORMAT"
 #define LAUNCHD_ASYNC_MSG_KEY "_AsyncMessage"
 #define LAUNCH_KEY_BATCHCONTROL "BatchControl"
 #define LAUNCH_KEY_BATCHQUERY "BatchQuery"
@@ -61,6 +72,7 @@ __BEGIN_DECLS
 #define LAUNCH_JOBKEY_DISABLEASLR "DisableASLR"
 #define LAUNCH_JOBKEY_XPCDOMAIN "XPCDomain"
 #define LAUNCH_JOBKEY_POSIXSPAWNTYPE "POSIXSpawnType"
+#define LAUNCH_JOBKEY_STARTINTERVALJITTER "StartIntervalJitter"
 
 #define LAUNCH_KEY_JETSAMLABEL "JetsamLabel"
 #define LAUNCH_KEY_JETSAMFRONTMOST "JetsamFrontmost"
@@ -152,6 +164,46 @@ mpm_uncork_fork(mach_port_t ajob);
 launch_data_t
 launch_socket_service_check_in(void);
 
+/* Like launch_msg(), but the response is not deep-copied out of the receive
+ * buffer. The caller gets the tree as it was decoded in place, together with
+ * ownership of the memory behind it; launch_data_free() on the returned object
+ * releases all of it at once. The tree must be treated as read-only, and
+ * launch_data_free() on any object inside it does nothing.
+ */
+launch_data_t
+launch_msg_borrowed(launch_data_t);
+
+/* Sends all 'n' requests back to back and then collects the replies, in
+ * order, into 'resps'. This costs one round trip instead of 'n'. Returns 0
+ * once every reply is in. On failure it returns -1 with errno set, and any
+ * replies that did arrive are left in 'resps' for the caller to free (the
+ * rest are NULL). CheckIn requests cannot be batched.
+ */
+int
+launch_msg_batch(launch_data_t *reqs, size_t n, launch_data_t *resps);
+
+/* Arena allocation for launch_data trees.
+ *
+ * While an arena is current on a thread, every launch_data object that thread
+ * creates (including strings, array storage and copies) is carved out of the
+ * arena's large blocks. launch_data_free() on such objects does nothing; the
+ * whole tree goes away at once with launch_data_arena_free(), and
+ * launch_data_retain() on them is likewise a no-op. Objects created outside
+ * the arena must not be inserted into an arena-backed tree, since they would
+ * never be freed.
+ */
+typedef struct _launch_data_arena *launch_data_arena_t;
+
+launch_data_arena_t
+launch_data_arena_create(size_t size_hint);
+
+void
+launch_data_arena_free(launch_data_arena_t arena);
+
+/* Returns the previously current arena. Pass NULL to go back to the heap. */
+launch_data_arena_t
+launch_data_arena_set_current(launch_data_arena_t arena);
+
 __END_DECLS
 
 #pragma GCC visibility pop
@@ -26,15 +26,19 @@
 
 #include <mach/mach.h>
 #include <libkern/OSByteOrder.h>
+#include <libkern/OSAtomic.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/fcntl.h>
 #include <sys/un.h>
 #include <sys/uio.h>
+#include <sys/queue.h>
 #include <sys/stat.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <ctype.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <errno.h>
@@ -61,7 +65,12 @@
 #endif
 
 struct _launch_data {
-	uint64_t type;
+	/* On the wire, 'type' is a 64-bit little-endian quantity. We split it so
+	 * that the high word can carry in-memory flags; it is always zero when
+	 * packed.
+	 */
+	uint32_t type;
+	uint32_t flags;
 	union {
 		struct {
 			union {
@@ -85,6 +94,58 @@ struct _launch_data {
 	};
 };
 
+/* The node was decoded in-place by launch_data_unpack() and lives inside
+ * somebody else's buffer.
+ */
+#define LAUNCH_DATA_F_PACKED	0x1
+/* The node and everything it owns were carved from a launch_data_arena_t.
+ * The owning arena pointer sits immediately in front of the node.
+ */
+#define LAUNCH_DATA_F_ARENA	0x2
+/* Set on the root of a PACKED message that owns its receive buffer. The
+ * buffer's base address is stored over the message header in front of it.
+ */
+#define LAUNCH_DATA_F_OWNSBUF	0x4
+/* Set on the root of an arena-backed tree that owns its arena outright, so
+ * that launch_data_free() on it releases the arena.
+ */
+#define LAUNCH_DATA_F_OWNSARENA	0x8
+/* Heap nodes keep a count of extra references, from launch_data_retain(), in
+ * the upper bits of the flags word. launch_data_free() drops one and only
+ * frees the node once the count goes negative.
+ */
+#define LAUNCH_DATA_F_REF	0x100
+#define LAUNCH_DATA_F_REFMASK	0xffffff00
+
+/* Heap-allocated array and dictionary storage is prefixed by this header.
+ * Dictionaries with more than LAUNCH_DATA_DICT_INDEX_MIN keys also carry an
+ * open-addressed index of case-folded key hashes. Each index slot holds the
+ * pair number plus one, so zero means "empty". The _array layout itself, and
+ * therefore iteration order and the wire format, is unchanged.
+ */
+struct _launch_array_hdr {
+	size_t capacity;
+	size_t index_size;
+	uint32_t *index;
+};
+
+#define LAUNCH_DATA_ARRAY_HDR(d)	(((struct _launch_array_hdr *)(d)->_array) - 1)
+#define LAUNCH_DATA_DICT_INDEX_MIN	16
+
+struct _launch_arena_chunk {
+	struct _launch_arena_chunk *next;
+	size_t size;
+	size_t used;
+};
+
+struct _launch_data_arena {
+	struct _launch_arena_chunk *chunks;
+	size_t chunk_size;
+};
+
+#define LAUNCH_DATA_ARENA_OF(d)		(((launch_data_arena_t *)(d))[-1])
+#define LAUNCH_DATA_ARENA_CHUNK_MIN	(64 * 1024)
+
 #include "bootstrap.h"
 #include "vproc.h"
 #include "vproc_priv.h"
@@ -169,43 +230,125 @@ struct launch_msg_header {
 	uint64_t len;
 };
 
+/* A tagged message carries a request ID after the plain header. Replies
+ * carry the ID of the request they answer, which lets several threads keep
+ * requests in flight on one connection.
+ */
+struct launch_msg_header_tagged {
+	struct launch_msg_header hdr;
+	uint64_t tag;
+};
+
 #define LAUNCH_MSG_HEADER_MAGIC 0xD2FEA02366B39A41ull
+#define LAUNCH_MSG_HEADER_MAGIC_V2 0xD2FEA02366B39A42ull
+/* Or'ed into either magic above. */
+#define LAUNCH_MSG_HEADER_F_TAGGED 0x10ull
 
 enum {
 	LAUNCHD_USE_CHECKIN_FD,
 	LAUNCHD_USE_OTHER_FD,
 };
+#define LAUNCHD_MSG_SENDBUF_KEEP	(64 * 1024)
+#define LAUNCHD_MSG_RECVBUF_KEEP	(64 * 1024)
+#define LAUNCHD_MSG_RECV_MIN		(8 * 1024)
+#define LAUNCHD_MSG_RECV_DRAIN		16
+/* Largest message either side will accept. The length in a header comes from
+ * the peer, so nothing is reserved for a message until it passes this check.
+ */
+#define LAUNCHD_MSG_MAX			(16 * 1024 * 1024)
+
 struct _launch {
 	void	*sendbuf;
 	int	*sendfds;
 	void	*recvbuf;
 	int	*recvfds;
+	size_t	sendbufsz;
+	size_t	sendfdsz;
+	size_t	sendoff;
 	size_t	sendlen;
 	size_t	sendfdcnt;
+	size_t	recvbufsz;
+	size_t	recvoff;
 	size_t	recvlen;
+	size_t	recvfdoff;
 	size_t	recvfdcnt;
+	int	wire_version;
+	uint64_t	sendtag;
+	uint64_t	recvtag;
 	int which;
 	int cifd;
 	int	fd;
 };
 
 static launch_data_t launch_data_array_pop_first(launch_data_t where);
+static bool launch_data_array_reserve(launch_data_t where, size_t cnt);
+static void *launch_data_storage_alloc(launch_data_t d, size_t sz);
+static void launch_data_storage_free(launch_data_t d, void *p);
+static void *launch_data_arena_alloc(launch_data_arena_t arena, size_t sz);
+static void launch_data_arena_key_init(void);
+static launch_data_t launch_data_alloc_from(launch_data_arena_t arena, launch_data_type_t t);
+static void launch_data_dict_index_drop(launch_data_t dict);
+static ssize_t launch_data_dict_find(launch_data_t dict, const char *key);
 static int _fd(int fd);
+static int launchd_msg_recv_reserve(launch_t lh, size_t want);
+static void launchd_msg_recv_trim(launch_t lh);
 static void launch_client_init(void);
+static void launch_client_hello(void);
+static void launch_msg_kick(void);
 static void launch_msg_getmsgs(launch_data_t m, void *context);
-static launch_data_t launch_msg_internal(launch_data_t d);
+struct launch_msg_waiter;
+static int launch_msg_wait(struct launch_msg_waiter *w, size_t n);
+static int launch_msg_select_fd(launch_data_t d);
+static launch_data_t launch_msg_common(launch_data_t d, bool borrow);
+static launch_data_t launch_msg_internal(launch_data_t d, bool borrow);
+#if !TARGET_OS_EMBEDDED
+static size_t launch_msg_session_prepare(launch_data_t d, uuid_t uuid);
+static void launch_msg_session_finish(launch_data_t resp, uuid_t uuid, size_t jobs_that_need_sessions);
+#endif
+static launch_data_t launchd_msg_recv_take(launch_t lh, launch_data_t m);
+static void launch_data_relocate(launch_data_t d, ptrdiff_t delta);
 static void launch_mach_checkin_service(launch_data_t obj, const char *key, void *context);
 
 static int64_t s_am_embedded_god = false;
 static launch_t in_flight_msg_recv_client;
+static bool in_flight_msg_taken;
 static pthread_once_t _lc_once = PTHREAD_ONCE_INIT;
+static pthread_once_t _arena_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t _arena_key;
 
 bool launchd_apple_internal = false;
 
+/* One request in flight. Waiters live on their callers' stacks and sit on
+ * _lc->waiters in the order their requests were queued on the socket.
+ */
+struct launch_msg_waiter {
+	TAILQ_ENTRY(launch_msg_waiter) tqe;
+	uint64_t tag;
+	launch_data_arena_t arena;
+	launch_data_t resp;
+	bool borrow;
+	bool done;
+};
+
+/* Any number of threads may have requests in flight on the one connection.
+ * Whoever holds mtx may queue requests; one waiting thread at a time (the
+ * one that sets 'reading') blocks on the socket and hands out every reply
+ * that arrives, while the others sleep on 'cond'. A request queued while
+ * somebody is reading pokes 'wakefd' so that the reader sends it.
+ *
+ * Requests are only tagged once launchd has said, in answer to the Hello
+ * sent when connecting, that it understands tagged headers.
+ */
 static struct _launch_client {
 	pthread_mutex_t mtx;
+	pthread_cond_t	cond;
 	launch_t	l;
 	launch_data_t	async_resp;
+	TAILQ_HEAD(, launch_msg_waiter) waiters;
+	uint64_t	next_tag;
+	int	wakefd[2];
+	bool	reading;
+	bool	tags;
 } *_lc = NULL;
 
 void
@@ -223,6 +366,9 @@ launch_client_init(void)
 		return;
 
 	pthread_mutex_init(&_lc->mtx, NULL);
+	pthread_cond_init(&_lc->cond, NULL);
+	TAILQ_INIT(&_lc->waiters);
+	_lc->wakefd[0] = _lc->wakefd[1] = -1;
 
 	if (_launchd_fd) {
 		cifd = strtol(_launchd_fd, NULL, 10);
@@ -287,9 +433,24 @@ launch_client_init(void)
 		goto out_bad;
 	}
 
-	if (!(_lc->async_resp = launch_data_alloc(LAUNCH_DATA_ARRAY))) {
+	/* The async queue outlives whatever arena the caller may have set. */
+	launch_data_arena_t arena = launch_data_arena_set_current(NULL);
+	_lc->async_resp = launch_data_alloc(LAUNCH_DATA_ARRAY);
+	launch_data_arena_set_current(arena);
+
+	if (!_lc->async_resp) {
+		goto out_bad;
+	}
+
+	if (pipe(_lc->wakefd) == -1) {
 		goto out_bad;
 	}
+	_fd(_lc->wakefd[0]);
+	_fd(_lc->wakefd[1]);
+	fcntl(_lc->wakefd[0], F_SETFL, O_NONBLOCK);
+	fcntl(_lc->wakefd[1], F_SETFL, O_NONBLOCK);
+
+	launch_client_hello();
 
 	return;
 out_bad:
@@ -300,25 +461,217 @@ out_bad:
 	if (cifd != -1) {
 		close(cifd);
 	}
+	if (_lc->wakefd[0] != -1) {
+		close(_lc->wakefd[0]);
+		close(_lc->wakefd[1]);
+	}
 	if (_lc)
 		free(_lc);
 	_lc = NULL;
 }
 
+/* Called once, before anybody else can use the connection. An older launchd
+ * answers the unknown request with an errno, which leaves every extension
+ * off; it would drop the connection on a tagged header or a v2 message.
+ */
+void
+launch_client_hello(void)
+{
+	struct launch_msg_waiter w = { .tag = 0 };
+	launch_data_t hello, caps, v;
+	launch_data_arena_t arena;
+	int which = _lc->l->which;
+	long long wire = 1;
+	char *pref;
+
+	/* v1 decodes in place and is cheaper on a local socket, so anything
+	 * newer is only asked for.
+	 */
+	if ((pref = getenv(LAUNCHD_WIRE_FORMAT_ENV))) {
+		wire = strtol(pref, NULL, 10);
+		wire = wire < 1 ? 1 : wire > LAUNCHD_WIRE_VERSION_MAX ? LAUNCHD_WIRE_VERSION_MAX : wire;
+	}
+
+	arena = launch_data_arena_set_current(NULL);
+	hello = launch_data_alloc(LAUNCH_DATA_DICTIONARY);
+	caps = launch_data_alloc(LAUNCH_DATA_DICTIONARY);
+	if (!hello || !caps) {
+		goto out;
+	}
+	launch_data_dict_insert(caps, launch_data_new_bool(true), LAUNCH_HELLO_KEY_TAGS);
+	launch_data_dict_insert(caps, launch_data_new_integer(wire), LAUNCH_HELLO_KEY_WIREVERSION);
+	launch_data_dict_insert(hello, caps, LAUNCH_KEY_HELLO);
+	caps = NULL;
+
+	pthread_mutex_lock(&_lc->mtx);
+
+	_lc->l->which = _lc->l->fd != -1 ? LAUNCHD_USE_OTHER_FD : LAUNCHD_USE_CHECKIN_FD;
+	if (launchd_getfd(_lc->l) != -1 && launchd_msg_queue(_lc->l, hello) == 0) {
+		TAILQ_INSERT_TAIL(&_lc->waiters, &w, tqe);
+		if (launch_msg_wait(&w, 1) == 0 && w.resp) {
+			if (launch_data_get_type(w.resp) == LAUNCH_DATA_DICTIONARY) {
+				v = launch_data_dict_lookup(w.resp, LAUNCH_HELLO_KEY_TAGS);
+				_lc->tags = v && launch_data_get_type(v) == LAUNCH_DATA_BOOL && launch_data_get_bool(v);
+				v = launch_data_dict_lookup(w.resp, LAUNCH_HELLO_KEY_WIREVERSION);
+				if (v && launch_data_get_type(v) == LAUNCH_DATA_INTEGER && launch_data_get_integer(v) == 2 && wire >= 2) {
+					launchd_set_wire_version(_lc->l, 2);
+				}
+			}
+			launch_data_free(w.resp);
+		}
+	}
+	_lc->l->which = which;
+
+	pthread_mutex_unlock(&_lc->mtx);
+
+out:
+	if (caps) {
+		launch_data_free(caps);
+	}
+	if (hello) {
+		launch_data_free(hello);
+	}
+	launch_data_arena_set_current(arena);
+}
+
+void
+launch_data_arena_key_init(void)
+{
+	(void)pthread_key_create(&_arena_key, NULL);
+}
+
+launch_data_arena_t
+launch_data_arena_create(size_t size_hint)
+{
+	launch_data_arena_t arena = calloc(1, sizeof(struct _launch_data_arena));
+
+	if (arena) {
+		arena->chunk_size = size_hint > LAUNCH_DATA_ARENA_CHUNK_MIN ? size_hint : LAUNCH_DATA_ARENA_CHUNK_MIN;
+	}
+
+	return arena;
+}
+
+void
+launch_data_arena_free(launch_data_arena_t arena)
+{
+	struct _launch_arena_chunk *c, *cn;
+
+	pthread_once(&_arena_key_once, launch_data_arena_key_init);
+	if (pthread_getspecific(_arena_key) == arena) {
+		(void)pthread_setspecific(_arena_key, NULL);
+	}
+
+	for (c = arena->chunks; c; c = cn) {
+		cn = c->next;
+		free(c);
+	}
+	free(arena);
+}
+
+launch_data_arena_t
+launch_data_arena_set_current(launch_data_arena_t arena)
+{
+	launch_data_arena_t prev;
+
+	pthread_once(&_arena_key_once, launch_data_arena_key_init);
+	prev = pthread_getspecific(_arena_key);
+	(void)pthread_setspecific(_arena_key, arena);
+
+	return prev;
+}
+
+void *
+launch_data_arena_alloc(launch_data_arena_t arena, size_t sz)
+{
+	struct _launch_arena_chunk *c = arena->chunks;
+	size_t csz;
+	void *r;
+
+	sz = (sz + 7) & ~7;
+
+	if (!c || c->size - c->used < sz) {
+		/* Oversized requests get a private chunk behind the current one, so
+		 * the free space in the current chunk is not wasted.
+		 */
+		csz = sizeof(struct _launch_arena_chunk) + sz;
+		if (csz < arena->chunk_size) {
+			csz = arena->chunk_size;
+		}
+		if (!(c = malloc(csz))) {
+			return NULL;
+		}
+		c->size = csz - sizeof(struct _launch_arena_chunk);
+		c->used = 0;
+		if (arena->chunks && sz > arena->chunk_size / 4) {
+			c->next = arena->chunks->next;
+			arena->chunks->next = c;
+		} else {
+			c->next = arena->chunks;
+			arena->chunks = c;
+		}
+	}
+
+	r = (char *)(c + 1) + c->used;
+	c->used += sz;
+
+	return r;
+}
+
+void *
+launch_data_storage_alloc(launch_data_t d, size_t sz)
+{
+	if (d->flags & LAUNCH_DATA_F_ARENA) {
+		return launch_data_arena_alloc(LAUNCH_DATA_ARENA_OF(d), sz);
+	}
+	return malloc(sz);
+}
+
+void
+launch_data_storage_free(launch_data_t d, void *p)
+{
+	if (!(d->flags & LAUNCH_DATA_F_ARENA)) {
+		free(p);
+	}
+}
+
 launch_data_t
 launch_data_alloc(launch_data_type_t t)
 {
-	launch_data_t d = calloc(1, sizeof(struct _launch_data));
+	pthread_once(&_arena_key_once, launch_data_arena_key_init);
+	return launch_data_alloc_from(pthread_getspecific(_arena_key), t);
+}
+
+launch_data_t
+launch_data_alloc_from(launch_data_arena_t arena, launch_data_type_t t)
+{
+	launch_data_t d = NULL;
+
+	if (arena) {
+		launch_data_arena_t *ap = launch_data_arena_alloc(arena, sizeof(launch_data_arena_t) + sizeof(struct _launch_data));
+
+		if (ap) {
+			*ap = arena;
+			d = (launch_data_t)(ap + 1);
+			memset(d, 0, sizeof(struct _launch_data));
+			d->flags = LAUNCH_DATA_F_ARENA;
+		}
+	} else {
+		d = calloc(1, sizeof(struct _launch_data));
+	}
 
 	if (d) {
 		d->type = t;
 		switch (t) {
 		case LAUNCH_DATA_DICTIONARY:
 		case LAUNCH_DATA_ARRAY:
-			d->_array = malloc(0);
+			if (!launch_data_array_reserve(d, 0)) {
+				launch_data_storage_free(d, d);
+				return NULL;
+			}
 			break;
 		case LAUNCH_DATA_OPAQUE:
-			d->opaque = malloc(0);
+			d->opaque = launch_data_storage_alloc(d, 0);
 		default:
 			break;
 		}
@@ -333,11 +686,49 @@ launch_data_get_type(launch_data_t d)
 	return d->type;
 }
 
+launch_data_t
+launch_data_retain(launch_data_t d)
+{
+	if (d->flags & (LAUNCH_DATA_F_PACKED | LAUNCH_DATA_F_ARENA)) {
+		/* Lives exactly as long as its buffer or arena. */
+		return d;
+	}
+
+	OSAtomicAdd32Barrier(LAUNCH_DATA_F_REF, (volatile int32_t *)&d->flags);
+
+	return d;
+}
+
+void
+launch_data_release(launch_data_t d)
+{
+	launch_data_free(d);
+}
+
 void
 launch_data_free(launch_data_t d)
 {
 	size_t i;
 
+	if (d->flags & LAUNCH_DATA_F_OWNSBUF) {
+		free(*(void **)((void *)d - sizeof(struct launch_msg_header)));
+		return;
+	}
+
+	if (d->flags & LAUNCH_DATA_F_OWNSARENA) {
+		launch_data_arena_free(LAUNCH_DATA_ARENA_OF(d));
+		return;
+	}
+
+	if (d->flags & (LAUNCH_DATA_F_PACKED | LAUNCH_DATA_F_ARENA)) {
+		/* The owner of the buffer or arena frees it. */
+		return;
+	}
+
+	if ((d->flags & LAUNCH_DATA_F_REFMASK) && OSAtomicAdd32Barrier(-LAUNCH_DATA_F_REF, (volatile int32_t *)&d->flags) >= 0) {
+		return;
+	}
+
 	switch (d->type) {
 	case LAUNCH_DATA_DICTIONARY:
 	case LAUNCH_DATA_ARRAY:
@@ -346,7 +737,8 @@ launch_data_free(launch_data_t d)
 				launch_data_free(d->_array[i]);
 			}
 		}
-		free(d->_array);
+		launch_data_dict_index_drop(d);
+		free(LAUNCH_DATA_ARRAY_HDR(d));
 		break;
 	case LAUNCH_DATA_STRING:
 		if (d->string)
@@ -368,57 +760,173 @@ launch_data_dict_get_count(launch_data_t dict)
 	return dict->_array_cnt / 2;
 }
 
+static uint32_t
+launch_data_dict_hash(const char *key)
+{
+	uint32_t hash = 5381;
+	int c;
+
+	/* djb2 over the case-folded key, to agree with strcasecmp(). */
+	while ((c = (unsigned char)*key++)) {
+		hash = ((hash << 5) + hash) + tolower(c);
+	}
+
+	return hash;
+}
+
+void
+launch_data_dict_index_drop(launch_data_t dict)
+{
+	struct _launch_array_hdr *h;
+
+	if (dict->type != LAUNCH_DATA_DICTIONARY || (dict->flags & LAUNCH_DATA_F_PACKED)) {
+		return;
+	}
+
+	h = LAUNCH_DATA_ARRAY_HDR(dict);
+	launch_data_storage_free(dict, h->index);
+	h->index = NULL;
+	h->index_size = 0;
+}
+
+static void
+launch_data_dict_index_add(struct _launch_array_hdr *h, launch_data_t *pairs, size_t pair)
+{
+	size_t slot = launch_data_dict_hash(pairs[pair * 2]->string) & (h->index_size - 1);
+
+	while (h->index[slot]) {
+		slot = (slot + 1) & (h->index_size - 1);
+	}
+	h->index[slot] = (uint32_t)(pair + 1);
+}
+
+static bool
+launch_data_dict_index_build(launch_data_t dict, size_t want)
+{
+	struct _launch_array_hdr *h = LAUNCH_DATA_ARRAY_HDR(dict);
+	size_t i, pairs = dict->_array_cnt / 2;
+	size_t sz = LAUNCH_DATA_DICT_INDEX_MIN * 2;
+	uint32_t *idx;
+
+	/* Keep the load factor at or below one half. */
+	while (sz < want * 2) {
+		sz *= 2;
+	}
+
+	if (!(idx = launch_data_storage_alloc(dict, sz * sizeof(uint32_t)))) {
+		return false;
+	}
+	bzero(idx, sz * sizeof(uint32_t));
+
+	launch_data_storage_free(dict, h->index);
+	h->index = idx;
+	h->index_size = sz;
+
+	for (i = 0; i < pairs; i++) {
+		launch_data_dict_index_add(h, dict->_array, i);
+	}
+
+	return true;
+}
+
+/* Returns the position of the key string in _array, or -1. */
+ssize_t
+launch_data_dict_find(launch_data_t dict, const char *key)
+{
+	struct _launch_array_hdr *h;
+	size_t i, slot, pairs = dict->_array_cnt / 2;
+
+	if (pairs > LAUNCH_DATA_DICT_INDEX_MIN && !(dict->flags & LAUNCH_DATA_F_PACKED)) {
+		h = LAUNCH_DATA_ARRAY_HDR(dict);
+		if (h->index || launch_data_dict_index_build(dict, pairs)) {
+			slot = launch_data_dict_hash(key) & (h->index_size - 1);
+			while (h->index[slot]) {
+				i = (h->index[slot] - 1) * 2;
+				if (!strcasecmp(key, dict->_array[i]->string)) {
+					return i;
+				}
+				slot = (slot + 1) & (h->index_size - 1);
+			}
+			return -1;
+		}
+	}
+
+	for (i = 0; i < dict->_array_cnt; i += 2) {
+		if (!strcasecmp(key, dict->_array[i]->string)) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
 bool
 launch_data_dict_insert(launch_data_t dict, launch_data_t what, const char *key)
 {
-	size_t i;
+	struct _launch_array_hdr *h;
+	ssize_t i = launch_data_dict_find(dict, key);
 	launch_data_t thekey = launch_data_alloc(LAUNCH_DATA_STRING);
 
 	launch_data_set_string(thekey, key);
 
-	for (i = 0; i < dict->_array_cnt; i += 2) {
-		if (!strcasecmp(key, dict->_array[i]->string)) {
-			launch_data_array_set_index(dict, thekey, i);
-			launch_data_array_set_index(dict, what, i + 1);
-			return true;
+	if (i != -1) {
+		launch_data_free(dict->_array[i]);
+		launch_data_free(dict->_array[i + 1]);
+		dict->_array[i] = thekey;
+		dict->_array[i + 1] = what;
+		return true;
+	}
+
+	i = dict->_array_cnt;
+	if (!launch_data_array_reserve(dict, i + 2)) {
+		launch_data_free(thekey);
+		return false;
+	}
+	dict->_array[i] = thekey;
+	dict->_array[i + 1] = what;
+	dict->_array_cnt += 2;
+
+	h = LAUNCH_DATA_ARRAY_HDR(dict);
+	if (h->index) {
+		if (dict->_array_cnt > h->index_size) {
+			if (!launch_data_dict_index_build(dict, dict->_array_cnt)) {
+				launch_data_dict_index_drop(dict);
+			}
+		} else {
+			launch_data_dict_index_add(h, dict->_array, i / 2);
 		}
 	}
-	launch_data_array_set_index(dict, thekey, i);
-	launch_data_array_set_index(dict, what, i + 1);
+
 	return true;
 }
 
 launch_data_t
 launch_data_dict_lookup(launch_data_t dict, const char *key)
 {
-	size_t i;
+	ssize_t i;
 
 	if (LAUNCH_DATA_DICTIONARY != dict->type)
 		return NULL;
 
-	for (i = 0; i < dict->_array_cnt; i += 2) {
-		if (!strcasecmp(key, dict->_array[i]->string))
-			return dict->_array[i + 1];
-	}
+	if ((i = launch_data_dict_find(dict, key)) == -1)
+		return NULL;
 
-	return NULL;
+	return dict->_array[i + 1];
 }
 
 bool
 launch_data_dict_remove(launch_data_t dict, const char *key)
 {
-	size_t i;
+	ssize_t i = launch_data_dict_find(dict, key);
 
-	for (i = 0; i < dict->_array_cnt; i += 2) {
-		if (!strcasecmp(key, dict->_array[i]->string))
-			break;
-	}
-	if (i == dict->_array_cnt)
+	if (i == -1)
 		return false;
 	launch_data_free(dict->_array[i]);
 	launch_data_free(dict->_array[i + 1]);
 	memmove(dict->_array + i, dict->_array + i + 2, (dict->_array_cnt - (i + 2)) * sizeof(launch_data_t));
 	dict->_array_cnt -= 2;
+	/* Every later pair moved; the index is rebuilt on the next lookup. */
+	launch_data_dict_index_drop(dict);
 	return true;
 }
 
@@ -436,11 +944,56 @@ launch_data_dict_iterate(launch_data_t dict, void (*cb)(launch_data_t, const cha
 	}
 }
 
+bool
+launch_data_array_reserve(launch_data_t where, size_t cnt)
+{
+	struct _launch_array_hdr *h = NULL;
+	size_t cap = 0;
+
+	if (where->_array) {
+		h = LAUNCH_DATA_ARRAY_HDR(where);
+		cap = h->capacity;
+		if (cnt <= cap) {
+			return true;
+		}
+	}
+
+	/* Grow geometrically so that appending is amortized O(1). */
+	while (cap < cnt) {
+		cap = cap ? cap * 2 : 4;
+	}
+
+	if (where->flags & LAUNCH_DATA_F_ARENA) {
+		struct _launch_array_hdr *nh = launch_data_arena_alloc(LAUNCH_DATA_ARENA_OF(where), sizeof(struct _launch_array_hdr) + cap * sizeof(launch_data_t));
+
+		if (!nh) {
+			return false;
+		}
+		if (h) {
+			memcpy(nh, h, sizeof(struct _launch_array_hdr) + where->_array_cnt * sizeof(launch_data_t));
+		}
+		h = nh;
+	} else if (!(h = realloc(h, sizeof(struct _launch_array_hdr) + cap * sizeof(launch_data_t)))) {
+		return false;
+	}
+
+	if (!where->_array) {
+		h->index_size = 0;
+		h->index = NULL;
+	}
+	h->capacity = cap;
+	where->_array = (launch_data_t *)(h + 1);
+
+	return true;
+}
+
 bool
 launch_data_array_set_index(launch_data_t where, launch_data_t what, size_t ind)
 {
 	if ((ind + 1) >= where->_array_cnt) {
-		where->_array = reallocf(where->_array, (ind + 1) * sizeof(launch_data_t));
+		if (!launch_data_array_reserve(where, ind + 1)) {
+			return false;
+		}
 		memset(where->_array + where->_array_cnt, 0, (ind + 1 - where->_array_cnt) * sizeof(launch_data_t));
 		where->_array_cnt = ind + 1;
 	}
@@ -450,6 +1003,8 @@ launch_data_array_set_index(launch_data_t where, launch_data_t what, size_t ind)
 	}
 
 	where->_array[ind] = what;
+	/* Raw stores into a dictionary invalidate its key index. */
+	launch_data_dict_index_drop(where);
 	return true;
 }
 
@@ -529,11 +1084,14 @@ launch_data_set_real(launch_data_t d, double n)
 bool
 launch_data_set_string(launch_data_t d, const char *s)
 {
+	size_t len = strlen(s);
+
 	if (d->string)
-		free(d->string);
-	d->string = strdup(s);
+		launch_data_storage_free(d, d->string);
+	d->string = launch_data_storage_alloc(d, len + 1);
 	if (d->string) {
-		d->string_len = strlen(d->string);
+		memcpy(d->string, s, len + 1);
+		d->string_len = len;
 		return true;
 	}
 	return false;
@@ -544,8 +1102,8 @@ launch_data_set_opaque(launch_data_t d, const void *o, size_t os)
 {
 	d->opaque_size = os;
 	if (d->opaque)
-		free(d->opaque);
-	d->opaque = malloc(os);
+		launch_data_storage_free(d, d->opaque);
+	d->opaque = launch_data_storage_alloc(d, os);
 	if (d->opaque) {
 		memcpy(d->opaque, o, os);
 		return true;
@@ -617,6 +1175,12 @@ launchd_getfd(launch_t l)
 	return (l->which == LAUNCHD_USE_CHECKIN_FD) ? l->cifd : l->fd;
 }
 
+size_t
+launchd_msg_sendlen(launch_t l)
+{
+	return l->sendlen;
+}
+
 launch_t
 launchd_fdopen(int fd, int cifd)
 {
@@ -638,33 +1202,16 @@ launchd_fdopen(int fd, int cifd)
 	fcntl(fd, F_SETFL, O_NONBLOCK);
 	fcntl(cifd, F_SETFL, O_NONBLOCK);
 
-	if ((c->sendbuf = malloc(0)) == NULL)
-		goto out_bad;
-	if ((c->sendfds = malloc(0)) == NULL)
-		goto out_bad;
-	if ((c->recvbuf = malloc(0)) == NULL)
-		goto out_bad;
-	if ((c->recvfds = malloc(0)) == NULL)
-		goto out_bad;
+	c->wire_version = 1;
 
 	return c;
-
-out_bad:
-	if (c->sendbuf)
-		free(c->sendbuf);
-	if (c->sendfds)
-		free(c->sendfds);
-	if (c->recvbuf)
-		free(c->recvbuf);
-	if (c->recvfds)
-		free(c->recvfds);
-	free(c);
-	return NULL;
 }
 
 void
 launchd_close(launch_t lh, typeof(close) closefunc)
 {
+	size_t i;
+
 	if (in_flight_msg_recv_client == lh) {
 		in_flight_msg_recv_client = NULL;
 	}
@@ -675,8 +1222,13 @@ launchd_close(launch_t lh, typeof(close) closefunc)
 		free(lh->sendfds);
 	if (lh->recvbuf)
 		free(lh->recvbuf);
-	if (lh->recvfds)
+	if (lh->recvfds) {
+		/* Descriptors that arrived ahead of a message we never finished. */
+		for (i = 0; i < lh->recvfdcnt; i++) {
+			closefunc(lh->recvfds[lh->recvfdoff + i]);
+		}
 		free(lh->recvfds);
+	}
 	closefunc(lh->fd);
 	closefunc(lh->cifd);
 	free(lh);
@@ -685,25 +1237,57 @@ launchd_close(launch_t lh, typeof(close) closefunc)
 #define ROUND_TO_64BIT_WORD_SIZE(x)	((x + 7) & ~7)
 
 size_t
-launch_data_pack(launch_data_t d, void *where, size_t len, int *fd_where, size_t *fd_cnt)
+launch_data_packed_size(launch_data_t d, size_t *fd_cnt)
 {
-	launch_data_t o_in_w = where;
-	size_t i, rsz, node_data_len = sizeof(struct _launch_data);
-
-	if (node_data_len > len) {
-		return 0;
-	}
-
-	where += node_data_len;
-
-	o_in_w->type = host2wire(d->type);
+	size_t i, sz = sizeof(struct _launch_data);
 
-	size_t pad_len = 0;
 	switch (d->type) {
-	case LAUNCH_DATA_INTEGER:
-		o_in_w->number = host2wire(d->number);
+	case LAUNCH_DATA_FD:
+		if (fd_cnt && d->fd != -1) {
+			(*fd_cnt)++;
+		}
 		break;
-	case LAUNCH_DATA_REAL:
+	case LAUNCH_DATA_STRING:
+		sz += ROUND_TO_64BIT_WORD_SIZE(d->string_len + 1);
+		break;
+	case LAUNCH_DATA_OPAQUE:
+		sz += ROUND_TO_64BIT_WORD_SIZE(d->opaque_size);
+		break;
+	case LAUNCH_DATA_DICTIONARY:
+	case LAUNCH_DATA_ARRAY:
+		sz += d->_array_cnt * sizeof(uint64_t);
+		for (i = 0; i < d->_array_cnt; i++) {
+			sz += launch_data_packed_size(d->_array[i], fd_cnt);
+		}
+		break;
+	default:
+		break;
+	}
+
+	return sz;
+}
+
+size_t
+launch_data_pack(launch_data_t d, void *where, size_t len, int *fd_where, size_t *fd_cnt)
+{
+	launch_data_t o_in_w = where;
+	size_t i, rsz, node_data_len = sizeof(struct _launch_data);
+
+	if (node_data_len > len) {
+		return 0;
+	}
+
+	where += node_data_len;
+
+	o_in_w->type = host2wire(d->type);
+	o_in_w->flags = 0;
+
+	size_t pad_len = 0;
+	switch (d->type) {
+	case LAUNCH_DATA_INTEGER:
+		o_in_w->number = host2wire(d->number);
+		break;
+	case LAUNCH_DATA_REAL:
 		o_in_w->float_num = host2wire_f(d->float_num);
 		break;
 	case LAUNCH_DATA_BOOL:
@@ -845,240 +1429,833 @@ launch_data_unpack(void *data, size_t data_size, int *fds, size_t fd_cnt, size_t
 	}
 
 	r->type = big2wire(r->type);
+	r->flags = LAUNCH_DATA_F_PACKED;
 
 	return r;
 }
 
-int
-launchd_msg_send(launch_t lh, launch_data_t d)
+/* Version 2 wire encoding.
+ *
+ * There is no per-node struct. Every node starts with a varint tag whose low
+ * four bits are the launch_data_type_t and whose remaining bits are an
+ * immediate:
+ *
+ *	DICTIONARY, ARRAY	element count (key/value pairs for dictionaries)
+ *	STRING, OPAQUE		byte count; the bytes follow, unpadded and unterminated
+ *	BOOL, ERRNO, MACHPORT	the value itself
+ *	FD			1 if a descriptor travels with the message, else 0
+ *	INTEGER			0; a zigzag varint follows
+ *	REAL			0; eight little-endian bytes follow
+ *
+ * Each dictionary key is a varint. Zero introduces a new key, followed by a
+ * varint length and the key bytes; N > 0 repeats the Nth distinct key already
+ * seen in this message, so job dictionaries don't resend "Label", "PID" and
+ * friends thousands of times.
+ *
+ * Decoding cannot be done in place, so v2 messages are decoded into an arena
+ * that is thrown away after the receive callback.
+ */
+struct _launch_v2_writer {
+	uint8_t *buf;
+	size_t len;
+	size_t off;
+	int *fd_where;
+	size_t *fd_cnt;
+	const char **keys;
+	uint32_t *key_slots;
+	size_t key_cnt;
+	size_t key_size;
+};
+
+struct _launch_v2_reader {
+	const uint8_t *buf;
+	size_t len;
+	size_t off;
+	int *fds;
+	size_t fd_cnt;
+	size_t *fd_offset;
+	launch_data_arena_t arena;
+	launch_data_t *keys;
+	size_t key_cnt;
+	size_t key_cap;
+};
+
+static bool
+launch_v2_put(struct _launch_v2_writer *w, const void *p, size_t n)
 {
-	struct launch_msg_header lmh;
-	struct cmsghdr *cm = NULL;
-	struct msghdr mh;
-	struct iovec iov[2];
-	size_t sentctrllen = 0;
-	int r;
+	if (w->buf) {
+		if (w->len - w->off < n) {
+			return false;
+		}
+		memcpy(w->buf + w->off, p, n);
+	}
+	w->off += n;
+	return true;
+}
 
-	int fd2use = launchd_getfd(lh);
-	if (fd2use == -1) {
-		errno = EPERM;
-		return -1;
+static bool
+launch_v2_put_varint(struct _launch_v2_writer *w, uint64_t v)
+{
+	uint8_t tmp[10];
+	size_t n = 0;
+
+	do {
+		tmp[n] = v & 0x7f;
+		v >>= 7;
+		if (v) {
+			tmp[n] |= 0x80;
+		}
+		n++;
+	} while (v);
+
+	return launch_v2_put(w, tmp, n);
+}
+
+static uint32_t
+launch_v2_key_hash(const char *key)
+{
+	uint32_t h = 5381;
+
+	while (*key) {
+		h = (h << 5) + h + (unsigned char)*key++;
 	}
 
-	memset(&mh, 0, sizeof(mh));
+	return h;
+}
 
-	/* confirm that the next hack works */
-	assert((d && lh->sendlen == 0) || (!d && lh->sendlen));
+static bool
+launch_v2_put_key(struct _launch_v2_writer *w, const char *key)
+{
+	size_t i, slot, klen = strlen(key);
+	uint32_t *nslots;
 
-	if (d) {
-		size_t fd_slots_used = 0;
-		size_t good_enough_size = 10 * 1024 * 1024;
-		uint64_t msglen;
+	if (w->key_cnt * 2 >= w->key_size) {
+		size_t nsz = w->key_size ? w->key_size * 2 : 64;
+		const char **nkeys;
 
-		/* hack, see the above assert to verify "correctness" */
-		free(lh->sendbuf);
-		lh->sendbuf = malloc(good_enough_size);
-		if (!lh->sendbuf) {
-			errno = ENOMEM;
-			return -1;
+		if (!(nslots = calloc(nsz, sizeof(uint32_t))) || !(nkeys = realloc(w->keys, (nsz / 2) * sizeof(char *)))) {
+			free(nslots);
+			return false;
 		}
-
-		free(lh->sendfds);
-		lh->sendfds = malloc(4 * 1024);
-		if (!lh->sendfds) {
-			free(lh->sendbuf);
-			lh->sendbuf = NULL;
-			errno = ENOMEM;
-			return -1;
+		w->keys = nkeys;
+		for (i = 0; i < w->key_cnt; i++) {
+			slot = launch_v2_key_hash(w->keys[i]) & (nsz - 1);
+			while (nslots[slot]) {
+				slot = (slot + 1) & (nsz - 1);
+			}
+			nslots[slot] = (uint32_t)(i + 1);
 		}
+		free(w->key_slots);
+		w->key_slots = nslots;
+		w->key_size = nsz;
+	}
 
-		lh->sendlen = launch_data_pack(d, lh->sendbuf, good_enough_size, lh->sendfds, &fd_slots_used);
-
-		if (lh->sendlen == 0) {
-			errno = ENOMEM;
-			return -1;
+	/* Back-references must reproduce the key exactly, so match case too. */
+	slot = launch_v2_key_hash(key) & (w->key_size - 1);
+	while (w->key_slots[slot]) {
+		if (!strcmp(w->keys[w->key_slots[slot] - 1], key)) {
+			return launch_v2_put_varint(w, w->key_slots[slot]);
 		}
+		slot = (slot + 1) & (w->key_size - 1);
+	}
 
-		lh->sendfdcnt = fd_slots_used;
+	w->keys[w->key_cnt++] = key;
+	w->key_slots[slot] = (uint32_t)w->key_cnt;
 
-		msglen = lh->sendlen + sizeof(struct launch_msg_header); /* type promotion to make the host2wire() macro work right */
-		lmh.len = host2wire(msglen);
-		lmh.magic = host2wire(LAUNCH_MSG_HEADER_MAGIC);
+	return launch_v2_put_varint(w, 0) && launch_v2_put_varint(w, klen) && launch_v2_put(w, key, klen);
+}
 
-		iov[0].iov_base = &lmh;
-		iov[0].iov_len = sizeof(lmh);
-		mh.msg_iov = iov;
-		mh.msg_iovlen = 2;
-	} else {
-		mh.msg_iov = iov + 1;
-		mh.msg_iovlen = 1;
+static bool
+launch_v2_put_node(struct _launch_v2_writer *w, launch_data_t d)
+{
+	union _launch_double_u u;
+	uint64_t zz;
+	size_t i;
+
+	switch (d->type) {
+	case LAUNCH_DATA_DICTIONARY:
+		if (!launch_v2_put_varint(w, d->type | ((uint64_t)(d->_array_cnt / 2) << 4))) {
+			return false;
+		}
+		for (i = 0; i < d->_array_cnt; i += 2) {
+			if (!launch_v2_put_key(w, d->_array[i]->string) || !launch_v2_put_node(w, d->_array[i + 1])) {
+				return false;
+			}
+		}
+		return true;
+	case LAUNCH_DATA_ARRAY:
+		if (!launch_v2_put_varint(w, d->type | ((uint64_t)d->_array_cnt << 4))) {
+			return false;
+		}
+		for (i = 0; i < d->_array_cnt; i++) {
+			if (!launch_v2_put_node(w, d->_array[i])) {
+				return false;
+			}
+		}
+		return true;
+	case LAUNCH_DATA_STRING:
+		return launch_v2_put_varint(w, d->type | (d->string_len << 4)) && launch_v2_put(w, d->string, d->string_len);
+	case LAUNCH_DATA_OPAQUE:
+		return launch_v2_put_varint(w, d->type | (d->opaque_size << 4)) && launch_v2_put(w, d->opaque, d->opaque_size);
+	case LAUNCH_DATA_BOOL:
+		return launch_v2_put_varint(w, d->type | ((uint64_t)(d->boolean ? 1 : 0) << 4));
+	case LAUNCH_DATA_ERRNO:
+		return launch_v2_put_varint(w, d->type | ((uint64_t)(uint32_t)d->err << 4));
+	case LAUNCH_DATA_MACHPORT:
+		return launch_v2_put_varint(w, d->type | ((uint64_t)(uint32_t)d->mp << 4));
+	case LAUNCH_DATA_FD:
+		if (d->fd != -1 && w->fd_cnt) {
+			if (w->fd_where) {
+				w->fd_where[*w->fd_cnt] = d->fd;
+			}
+			(*w->fd_cnt)++;
+		}
+		return launch_v2_put_varint(w, d->type | ((uint64_t)(d->fd != -1 ? 1 : 0) << 4));
+	case LAUNCH_DATA_INTEGER:
+		zz = ((uint64_t)d->number << 1) ^ (uint64_t)(d->number >> 63);
+		return launch_v2_put_varint(w, d->type) && launch_v2_put_varint(w, zz);
+	case LAUNCH_DATA_REAL:
+		u.dv = d->float_num;
+		u.iv = host2wire(u.iv);
+		return launch_v2_put_varint(w, d->type) && launch_v2_put(w, &u.iv, sizeof(u.iv));
+	default:
+		return false;
 	}
+}
 
-	iov[1].iov_base = lh->sendbuf;
-	iov[1].iov_len = lh->sendlen;
+/* Same contract as launch_data_pack(). With 'where' set to NULL, nothing is
+ * written and the return value is the exact encoded size.
+ */
+size_t
+launch_data_pack_v2(launch_data_t d, void *where, size_t len, int *fd_where, size_t *fd_cnt)
+{
+	struct _launch_v2_writer w = {
+		.buf = where,
+		.len = len,
+		.fd_where = fd_where,
+		.fd_cnt = fd_cnt,
+	};
+	bool r = launch_v2_put_node(&w, d);
 
+	free(w.keys);
+	free(w.key_slots);
 
-	if (lh->sendfdcnt > 0) {
-		sentctrllen = mh.msg_controllen = CMSG_SPACE(lh->sendfdcnt * sizeof(int));
-		cm = alloca(mh.msg_controllen);
-		mh.msg_control = cm;
+	return r ? w.off : 0;
+}
 
-		memset(cm, 0, mh.msg_controllen);
+static bool
+launch_v2_get_varint(struct _launch_v2_reader *r, uint64_t *v)
+{
+	unsigned int shift = 0;
+	uint8_t b;
 
-		cm->cmsg_len = CMSG_LEN(lh->sendfdcnt * sizeof(int));
-		cm->cmsg_level = SOL_SOCKET;
-		cm->cmsg_type = SCM_RIGHTS;
+	*v = 0;
+	do {
+		if (r->off >= r->len || shift > 63) {
+			return false;
+		}
+		b = r->buf[r->off++];
+		*v |= (uint64_t)(b & 0x7f) << shift;
+		shift += 7;
+	} while (b & 0x80);
 
-		memcpy(CMSG_DATA(cm), lh->sendfds, lh->sendfdcnt * sizeof(int));
+	return true;
+}
+
+static launch_data_t
+launch_v2_get_string(struct _launch_v2_reader *r, launch_data_type_t t, uint64_t n)
+{
+	launch_data_t d;
+	char *p;
+
+	if (n > r->len - r->off || !(d = launch_data_alloc_from(r->arena, t))) {
+		return NULL;
 	}
 
-	if ((r = sendmsg(fd2use, &mh, 0)) == -1) {
-		return -1;
-	} else if (r == 0) {
-		errno = ECONNRESET;
-		return -1;
-	} else if (sentctrllen != mh.msg_controllen) {
-		errno = ECONNRESET;
-		return -1;
+	if (t == LAUNCH_DATA_STRING) {
+		if (!(p = launch_data_storage_alloc(d, n + 1))) {
+			return NULL;
+		}
+		memcpy(p, r->buf + r->off, n);
+		p[n] = '\0';
+		d->string = p;
+		d->string_len = n;
+	} else {
+		if (!(p = launch_data_storage_alloc(d, n))) {
+			return NULL;
+		}
+		memcpy(p, r->buf + r->off, n);
+		d->opaque = p;
+		d->opaque_size = n;
 	}
+	r->off += n;
 
-	if (d) {
-		r -= sizeof(struct launch_msg_header);
+	return d;
+}
+
+static launch_data_t
+launch_v2_get_key(struct _launch_v2_reader *r)
+{
+	launch_data_t *nkeys, k;
+	uint64_t ref, n;
+
+	if (!launch_v2_get_varint(r, &ref)) {
+		return NULL;
 	}
 
-	lh->sendlen -= r;
-	if (lh->sendlen > 0) {
-		memmove(lh->sendbuf, lh->sendbuf + r, lh->sendlen);
-	} else {
-		free(lh->sendbuf);
-		lh->sendbuf = malloc(0);
+	/* Arena nodes are never freed one by one, so a repeated key can share
+	 * the node decoded for its first occurrence.
+	 */
+	if (ref) {
+		return ref <= r->key_cnt ? r->keys[ref - 1] : NULL;
 	}
 
-	lh->sendfdcnt = 0;
-	free(lh->sendfds);
-	lh->sendfds = malloc(0);
+	if (!launch_v2_get_varint(r, &n) || !(k = launch_v2_get_string(r, LAUNCH_DATA_STRING, n))) {
+		return NULL;
+	}
 
-	if (lh->sendlen > 0) {
-		errno = EAGAIN;
-		return -1;
+	if (r->key_cnt == r->key_cap) {
+		r->key_cap = r->key_cap ? r->key_cap * 2 : 32;
+		if (!(nkeys = realloc(r->keys, r->key_cap * sizeof(launch_data_t)))) {
+			return NULL;
+		}
+		r->keys = nkeys;
 	}
+	r->keys[r->key_cnt++] = k;
 
-	return 0;
+	return k;
 }
 
-int
-launch_get_fd(void)
+static launch_data_t
+launch_v2_get_node(struct _launch_v2_reader *r)
 {
-	pthread_once(&_lc_once, launch_client_init);
+	union _launch_double_u u;
+	launch_data_t d, k, v;
+	uint64_t tag, imm, zz;
+	size_t i;
 
-	if (!_lc) {
-		errno = ENOTCONN;
-		return -1;
+	if (!launch_v2_get_varint(r, &tag)) {
+		return NULL;
 	}
+	imm = tag >> 4;
 
-	return _lc->l->fd;
+	switch (tag & 0xf) {
+	case LAUNCH_DATA_DICTIONARY:
+	case LAUNCH_DATA_ARRAY:
+		/* Every element takes at least a byte, which bounds the count. */
+		if (imm > r->len - r->off || !(d = launch_data_alloc_from(r->arena, tag & 0xf))) {
+			return NULL;
+		}
+		if ((tag & 0xf) == LAUNCH_DATA_DICTIONARY) {
+			if (!launch_data_array_reserve(d, imm * 2)) {
+				return NULL;
+			}
+			for (i = 0; i < imm; i++) {
+				if (!(k = launch_v2_get_key(r)) || !(v = launch_v2_get_node(r))) {
+					return NULL;
+				}
+				d->_array[d->_array_cnt++] = k;
+				d->_array[d->_array_cnt++] = v;
+			}
+		} else {
+			if (!launch_data_array_reserve(d, imm)) {
+				return NULL;
+			}
+			for (i = 0; i < imm; i++) {
+				if (!(v = launch_v2_get_node(r))) {
+					return NULL;
+				}
+				d->_array[d->_array_cnt++] = v;
+			}
+		}
+		return d;
+	case LAUNCH_DATA_STRING:
+	case LAUNCH_DATA_OPAQUE:
+		return launch_v2_get_string(r, tag & 0xf, imm);
+	case LAUNCH_DATA_BOOL:
+		if ((d = launch_data_alloc_from(r->arena, LAUNCH_DATA_BOOL))) {
+			d->boolean = imm ? 1 : 0;
+		}
+		return d;
+	case LAUNCH_DATA_ERRNO:
+		if ((d = launch_data_alloc_from(r->arena, LAUNCH_DATA_ERRNO))) {
+			d->err = (int)imm;
+		}
+		return d;
+	case LAUNCH_DATA_MACHPORT:
+		if ((d = launch_data_alloc_from(r->arena, LAUNCH_DATA_MACHPORT))) {
+			d->mp = (mach_port_t)imm;
+		}
+		return d;
+	case LAUNCH_DATA_FD:
+		if ((d = launch_data_alloc_from(r->arena, LAUNCH_DATA_FD))) {
+			d->fd = -1;
+			if (imm && r->fd_cnt > *r->fd_offset) {
+				d->fd = _fd(r->fds[*r->fd_offset]);
+				*r->fd_offset += 1;
+			}
+		}
+		return d;
+	case LAUNCH_DATA_INTEGER:
+		if (!launch_v2_get_varint(r, &zz) || !(d = launch_data_alloc_from(r->arena, LAUNCH_DATA_INTEGER))) {
+			return NULL;
+		}
+		d->number = (int64_t)(zz >> 1) ^ -(int64_t)(zz & 1);
+		return d;
+	case LAUNCH_DATA_REAL:
+		if (r->len - r->off < sizeof(u.iv) || !(d = launch_data_alloc_from(r->arena, LAUNCH_DATA_REAL))) {
+			return NULL;
+		}
+		memcpy(&u.iv, r->buf + r->off, sizeof(u.iv));
+		r->off += sizeof(u.iv);
+		u.iv = big2wire(u.iv);
+		d->float_num = u.dv;
+		return d;
+	default:
+		return NULL;
+	}
 }
 
-void
-launch_msg_getmsgs(launch_data_t m, void *context)
+/* Same contract as launch_data_unpack(), except that the result is a new
+ * tree carved from its own arena. Free it with launch_data_free().
+ */
+launch_data_t
+launch_data_unpack_v2(void *data, size_t data_size, int *fds, size_t fd_cnt, size_t *data_offset, size_t *fdoffset)
 {
-	launch_data_t async_resp, *sync_resp = context;
+	struct _launch_v2_reader r = {
+		.buf = data,
+		.len = data_size,
+		.off = *data_offset,
+		.fds = fds,
+		.fd_cnt = fd_cnt,
+		.fd_offset = fdoffset,
+	};
+	launch_data_t d = NULL;
 
-	if ((LAUNCH_DATA_DICTIONARY == launch_data_get_type(m)) && (async_resp = launch_data_dict_lookup(m, LAUNCHD_ASYNC_MSG_KEY))) {
-		launch_data_array_set_index(_lc->async_resp, launch_data_copy(async_resp), launch_data_array_get_count(_lc->async_resp));
+	if (!(r.arena = launch_data_arena_create(data_size * 2))) {
+		return NULL;
+	}
+
+	if ((d = launch_v2_get_node(&r))) {
+		d->flags |= LAUNCH_DATA_F_OWNSARENA;
+		*data_offset = r.off;
 	} else {
-		*sync_resp = launch_data_copy(m);
+		launch_data_arena_free(r.arena);
+		errno = EBADRPC;
 	}
+	free(r.keys);
+
+	return d;
 }
 
 void
-launch_mach_checkin_service(launch_data_t obj, const char *key, void *context __attribute__((unused)))
+launchd_set_wire_version(launch_t lh, int version)
 {
-	kern_return_t result;
-	mach_port_t p;
-	name_t srvnm;
-
-	strlcpy(srvnm, key, sizeof(srvnm));
-
-	result = bootstrap_check_in(bootstrap_port, srvnm, &p);
-
-	if (result == BOOTSTRAP_SUCCESS)
-		launch_data_set_machport(obj, p);
+	lh->wire_version = version;
 }
 
-launch_data_t
-launch_msg(launch_data_t d)
+int
+launchd_msg_queue(launch_t lh, launch_data_t d)
 {
-	launch_data_t mps, r = launch_msg_internal(d);
+	struct launch_msg_header *lmhp;
+	size_t fd_cnt = 0, fd_slots_used = 0;
+	size_t base, hdrsz;
+	uint64_t msglen, magic;
 
-	if (launch_data_get_type(d) == LAUNCH_DATA_STRING) {
-		if (strcmp(launch_data_get_string(d), LAUNCH_KEY_CHECKIN) != 0)
-			return r;
-		if (r == NULL)
-			return r;
-		if (launch_data_get_type(r) != LAUNCH_DATA_DICTIONARY)
-			return r;
-		mps = launch_data_dict_lookup(r, LAUNCH_JOBKEY_MACHSERVICES);
-		if (mps == NULL)
-			return r;
-		launch_data_dict_iterate(mps, launch_mach_checkin_service, NULL);
+	/* Anything still unsent moves to the front, and the new message goes
+	 * right behind it.
+	 */
+	if (lh->sendoff) {
+		memmove(lh->sendbuf, lh->sendbuf + lh->sendoff, lh->sendlen);
+		lh->sendoff = 0;
 	}
+	base = lh->sendlen;
 
-	return r;
-}
+	/* No v2 node is ever larger than its v1 form, so the v1 size is a
+	 * safe (and much cheaper) bound for both encodings.
+	 */
+	hdrsz = lh->sendtag ? sizeof(struct launch_msg_header_tagged) : sizeof(struct launch_msg_header);
+	msglen = hdrsz + launch_data_packed_size(d, &fd_cnt);
 
-extern kern_return_t vproc_mig_set_security_session(mach_port_t, uuid_t, mach_port_t);
+	/* The peer would drop the connection on it anyway. */
+	if (msglen > LAUNCHD_MSG_MAX) {
+		errno = EMSGSIZE;
+		return -1;
+	}
 
-static inline bool
-uuid_data_is_null(launch_data_t d)
-{
-	bool result = false;
-	if (launch_data_get_type(d) == LAUNCH_DATA_OPAQUE && launch_data_get_opaque_size(d) == sizeof(uuid_t)) {
-		uuid_t existing_uuid;
-		memcpy(existing_uuid, launch_data_get_opaque(d), sizeof(uuid_t));
+	if (base + msglen > lh->sendbufsz) {
+		size_t nsz = lh->sendbufsz ? lh->sendbufsz : msglen;
+		void *nbuf;
 
-		/* A NULL UUID tells us to keep the session inherited from the parent. */
-		result = (bool)uuid_is_null(existing_uuid);
+		/* Grow geometrically only when appending to a backlog. */
+		while (base && nsz < base + msglen) {
+			nsz *= 2;
+		}
+		if (nsz < base + msglen) {
+			nsz = base + msglen;
+		}
+		if (!(nbuf = malloc(nsz))) {
+			errno = ENOMEM;
+			return -1;
+		}
+		if (base) {
+			memcpy(nbuf, lh->sendbuf, base);
+		}
+		free(lh->sendbuf);
+		lh->sendbuf = nbuf;
+		lh->sendbufsz = nsz;
 	}
 
-	return result;
+	if (lh->sendfdcnt + fd_cnt > lh->sendfdsz) {
+		int *nfds = realloc(lh->sendfds, (lh->sendfdcnt + fd_cnt) * sizeof(int));
+		if (!nfds) {
+			errno = ENOMEM;
+			return -1;
+		}
+		lh->sendfds = nfds;
+		lh->sendfdsz = lh->sendfdcnt + fd_cnt;
+	}
+
+	if (lh->wire_version == 2) {
+		if ((msglen = launch_data_pack_v2(d, lh->sendbuf + base + hdrsz, msglen - hdrsz, lh->sendfds + lh->sendfdcnt, &fd_slots_used)) == 0) {
+			errno = ENOMEM;
+			return -1;
+		}
+		msglen += hdrsz;
+	} else if (launch_data_pack(d, lh->sendbuf + base + hdrsz, msglen - hdrsz, lh->sendfds + lh->sendfdcnt, &fd_slots_used) == 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	magic = lh->wire_version == 2 ? LAUNCH_MSG_HEADER_MAGIC_V2 : LAUNCH_MSG_HEADER_MAGIC;
+	lmhp = lh->sendbuf + base;
+	if (lh->sendtag) {
+		((struct launch_msg_header_tagged *)lmhp)->tag = host2wire(lh->sendtag);
+		magic |= LAUNCH_MSG_HEADER_F_TAGGED;
+	}
+	lmhp->len = host2wire(msglen);
+	lmhp->magic = host2wire(magic);
+
+	lh->sendlen += msglen;
+	lh->sendfdcnt += fd_slots_used;
+
+	return 0;
 }
 
-launch_data_t
-launch_msg_internal(launch_data_t d)
+int
+launchd_msg_send(launch_t lh, launch_data_t d)
 {
-	launch_data_t resp = NULL;
+	struct cmsghdr *cm = NULL;
+	struct msghdr mh;
+	struct iovec iov;
+	size_t sentctrllen = 0;
+	int r;
 
-	if (d && (launch_data_get_type(d) == LAUNCH_DATA_STRING)
-			&& (strcmp(launch_data_get_string(d), LAUNCH_KEY_GETJOBS) == 0)
-			&& vproc_swap_complex(NULL, VPROC_GSK_ALLJOBS, NULL, &resp) == NULL) {
-		return resp;
+	int fd2use = launchd_getfd(lh);
+	if (fd2use == -1) {
+		errno = EPERM;
+		return -1;
+	}
+
+	memset(&mh, 0, sizeof(mh));
+
+	/* A NULL message means "keep flushing whatever is already queued". */
+	if (d && launchd_msg_queue(lh, d) == -1) {
+		return -1;
+	}
+
+	if (lh->sendlen == 0) {
+		return 0;
 	}
 
+	iov.iov_base = lh->sendbuf + lh->sendoff;
+	iov.iov_len = lh->sendlen;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+
+	if (lh->sendfdcnt > 0) {
+		sentctrllen = mh.msg_controllen = CMSG_SPACE(lh->sendfdcnt * sizeof(int));
+		cm = alloca(mh.msg_controllen);
+		mh.msg_control = cm;
+
+		memset(cm, 0, mh.msg_controllen);
+
+		cm->cmsg_len = CMSG_LEN(lh->sendfdcnt * sizeof(int));
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+
+		memcpy(CMSG_DATA(cm), lh->sendfds, lh->sendfdcnt * sizeof(int));
+	}
+
+	if ((r = sendmsg(fd2use, &mh, 0)) == -1) {
+		return -1;
+	} else if (r == 0) {
+		errno = ECONNRESET;
+		return -1;
+	} else if (sentctrllen != mh.msg_controllen) {
+		errno = ECONNRESET;
+		return -1;
+	}
+
+	/* The descriptors ride along with the first chunk. */
+	lh->sendfdcnt = 0;
+	lh->sendoff += r;
+	lh->sendlen -= r;
+
+	if (lh->sendlen > 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	lh->sendoff = 0;
+
+	/* Keep a modest buffer around for the next message, but don't sit on the
+	 * memory from a one-off huge reply.
+	 */
+	if (lh->sendbufsz > LAUNCHD_MSG_SENDBUF_KEEP) {
+		free(lh->sendbuf);
+		lh->sendbuf = NULL;
+		lh->sendbufsz = 0;
+	}
+
+	return 0;
+}
+
+int
+launch_get_fd(void)
+{
 	pthread_once(&_lc_once, launch_client_init);
+
 	if (!_lc) {
 		errno = ENOTCONN;
-		return NULL;
+		return -1;
+	}
+
+	return _lc->l->fd;
+}
+
+void
+launch_msg_getmsgs(launch_data_t m, void *context __attribute__((unused)))
+{
+	uint64_t tag = in_flight_msg_recv_client->recvtag;
+	struct launch_msg_waiter *w;
+	launch_data_arena_t arena;
+	launch_data_t async_resp;
+
+	if ((LAUNCH_DATA_DICTIONARY == launch_data_get_type(m)) && (async_resp = launch_data_dict_lookup(m, LAUNCHD_ASYNC_MSG_KEY))) {
+		arena = launch_data_arena_set_current(NULL);
+		launch_data_array_set_index(_lc->async_resp, launch_data_copy(async_resp), launch_data_array_get_count(_lc->async_resp));
+		launch_data_arena_set_current(arena);
+		return;
+	}
+
+	/* An untagged reply can only be for the oldest request; launchd answers
+	 * in order.
+	 */
+	TAILQ_FOREACH(w, &_lc->waiters, tqe) {
+		if (!tag || w->tag == tag) {
+			break;
+		}
+	}
+	if (!w) {
+		return;
 	}
 
-	int fd2use = -1;
-	if ((launch_data_get_type(d) == LAUNCH_DATA_STRING && strcmp(launch_data_get_string(d), LAUNCH_KEY_CHECKIN) == 0) || s_am_embedded_god) {
-		_lc->l->which = LAUNCHD_USE_CHECKIN_FD;
+	TAILQ_REMOVE(&_lc->waiters, w, tqe);
+	if (w->borrow) {
+		w->resp = launchd_msg_recv_take(in_flight_msg_recv_client, m);
 	} else {
-		_lc->l->which = LAUNCHD_USE_OTHER_FD;
+		/* This may be some other thread's reply; copy it into their arena. */
+		arena = launch_data_arena_set_current(w->arena);
+		w->resp = launch_data_copy(m);
+		launch_data_arena_set_current(arena);
 	}
+	w->done = true;
+}
 
-	fd2use = launchd_getfd(_lc->l);
+int
+launch_msg_wait(struct launch_msg_waiter *w, size_t n)
+{
+	fd_set rfds, wfds;
+	char buf[64];
+	size_t i;
+	int fd2use, r;
 
-	if (fd2use == -1) {
+	for (;;) {
+		for (i = 0; i < n && w[i].done; i++);
+		if (i == n) {
+			return 0;
+		}
+
+		if (_lc->reading) {
+			pthread_cond_wait(&_lc->cond, &_lc->mtx);
+			continue;
+		}
+
+		if (launchd_msg_send(_lc->l, NULL) == -1 && errno != EAGAIN) {
+			goto out_bad;
+		}
+		if (launchd_msg_recv(_lc->l, launch_msg_getmsgs, NULL) == -1 && errno != EAGAIN) {
+			goto out_bad;
+		}
+		pthread_cond_broadcast(&_lc->cond);
+
+		for (i = 0; i < n && w[i].done; i++);
+		if (i == n) {
+			return 0;
+		}
+
+		fd2use = launchd_getfd(_lc->l);
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_SET(fd2use, &rfds);
+		FD_SET(_lc->wakefd[0], &rfds);
+		if (_lc->l->sendlen) {
+			FD_SET(fd2use, &wfds);
+		}
+
+		_lc->reading = true;
+		pthread_mutex_unlock(&_lc->mtx);
+		r = select((fd2use > _lc->wakefd[0] ? fd2use : _lc->wakefd[0]) + 1, &rfds, &wfds, NULL, NULL);
+		pthread_mutex_lock(&_lc->mtx);
+		_lc->reading = false;
+
+		if (r > 0 && FD_ISSET(_lc->wakefd[0], &rfds)) {
+			while (read(_lc->wakefd[0], buf, sizeof(buf)) > 0);
+		}
+	}
+
+out_bad:
+	for (i = 0; i < n; i++) {
+		if (!w[i].done) {
+			TAILQ_REMOVE(&_lc->waiters, &w[i], tqe);
+		}
+	}
+	/* Let somebody else find out about the failure for themselves. */
+	pthread_cond_broadcast(&_lc->cond);
+	return -1;
+}
+
+/* Called with _lc->mtx held, right after queueing. The reader only watches
+ * for writability if something was unsent when it went into select(), so
+ * push what fits now and wake it up to send the rest. Without a reader, the
+ * caller's own launch_msg_wait() does the sending.
+ */
+void
+launch_msg_kick(void)
+{
+	if (!_lc->reading) {
+		return;
+	}
+
+	(void)launchd_msg_send(_lc->l, NULL);
+	if (_lc->l->sendlen) {
+		(void)write(_lc->wakefd[1], "", 1);
+	}
+}
+
+/* Called with _lc->mtx held. CheckIn goes over a different descriptor than
+ * everything else, but both share the connection's buffers, so switching
+ * waits until nothing is in flight on the other one.
+ */
+int
+launch_msg_select_fd(launch_data_t d)
+{
+	int which = LAUNCHD_USE_OTHER_FD;
+
+	if ((d && launch_data_get_type(d) == LAUNCH_DATA_STRING && strcmp(launch_data_get_string(d), LAUNCH_KEY_CHECKIN) == 0) || s_am_embedded_god) {
+		which = LAUNCHD_USE_CHECKIN_FD;
+	}
+
+	while (_lc->l->which != which && !TAILQ_EMPTY(&_lc->waiters)) {
+		pthread_cond_wait(&_lc->cond, &_lc->mtx);
+	}
+	_lc->l->which = which;
+
+	if (launchd_getfd(_lc->l) == -1) {
 		errno = EPERM;
-		return NULL;
+		return -1;
 	}
 
+	return 0;
+}
+
+void
+launch_mach_checkin_service(launch_data_t obj, const char *key, void *context __attribute__((unused)))
+{
+	kern_return_t result;
+	mach_port_t p;
+	name_t srvnm;
+
+	strlcpy(srvnm, key, sizeof(srvnm));
+
+	result = bootstrap_check_in(bootstrap_port, srvnm, &p);
+
+	if (result == BOOTSTRAP_SUCCESS)
+		launch_data_set_machport(obj, p);
+}
+
+launch_data_t
+launch_msg(launch_data_t d)
+{
+	return launch_msg_common(d, false);
+}
+
+launch_data_t
+launch_msg_borrowed(launch_data_t d)
+{
+	return launch_msg_common(d, true);
+}
+
+launch_data_t
+launch_msg_common(launch_data_t d, bool borrow)
+{
+	launch_data_t mps, r = launch_msg_internal(d, borrow);
+
+	if (d && launch_data_get_type(d) == LAUNCH_DATA_STRING) {
+		if (strcmp(launch_data_get_string(d), LAUNCH_KEY_CHECKIN) != 0)
+			return r;
+		if (r == NULL)
+			return r;
+		if (launch_data_get_type(r) != LAUNCH_DATA_DICTIONARY)
+			return r;
+		mps = launch_data_dict_lookup(r, LAUNCH_JOBKEY_MACHSERVICES);
+		if (mps == NULL)
+			return r;
+		launch_data_dict_iterate(mps, launch_mach_checkin_service, NULL);
+	}
+
+	return r;
+}
+
+extern kern_return_t vproc_mig_set_security_session(mach_port_t, uuid_t, mach_port_t);
+
+static inline bool
+uuid_data_is_null(launch_data_t d)
+{
+	bool result = false;
+	if (launch_data_get_type(d) == LAUNCH_DATA_OPAQUE && launch_data_get_opaque_size(d) == sizeof(uuid_t)) {
+		uuid_t existing_uuid;
+		memcpy(existing_uuid, launch_data_get_opaque(d), sizeof(uuid_t));
+
+		/* A NULL UUID tells us to keep the session inherited from the parent. */
+		result = (bool)uuid_is_null(existing_uuid);
+	}
+
+	return result;
+}
+
 #if !TARGET_OS_EMBEDDED
-	uuid_t uuid;
+/* Jobs submitted without a security session get a fresh session UUID. Returns
+ * how many jobs need that session set up once launchd has answered.
+ */
+size_t
+launch_msg_session_prepare(launch_data_t d, uuid_t uuid)
+{
 	launch_data_t uuid_d = NULL;
 	size_t jobs_that_need_sessions = 0;
+
+	uuid_clear(uuid);
 	if (d && launch_data_get_type(d) == LAUNCH_DATA_DICTIONARY) {
 		launch_data_t v = launch_data_dict_lookup(d, LAUNCH_KEY_SUBMITJOB);
 
@@ -1092,8 +2269,8 @@ launch_msg_internal(launch_data_t d)
 				if (launch_data_get_type(ji) == LAUNCH_DATA_DICTIONARY) {
 					launch_data_t existing_v = launch_data_dict_lookup(ji, LAUNCH_JOBKEY_SECURITYSESSIONUUID);
 					if (!existing_v) {
-						/* I really wish these were reference-counted. Sigh... */
-						uuid_d = launch_data_new_opaque(uuid, sizeof(uuid));
+						/* Every job in the batch shares the one UUID object. */
+						uuid_d = uuid_d ? launch_data_retain(uuid_d) : launch_data_new_opaque(uuid, sizeof(uuid_t));
 						launch_data_dict_insert(ji, uuid_d, LAUNCH_JOBKEY_SECURITYSESSIONUUID);
 						jobs_that_need_sessions++;
 					} else if (launch_data_get_type(existing_v) == LAUNCH_DATA_OPAQUE) {
@@ -1105,7 +2282,7 @@ launch_msg_internal(launch_data_t d)
 			launch_data_t existing_v = launch_data_dict_lookup(v, LAUNCH_JOBKEY_SECURITYSESSIONUUID);
 			if (!existing_v) {
 				uuid_generate(uuid);
-				uuid_d = launch_data_new_opaque(uuid, sizeof(uuid));
+				uuid_d = launch_data_new_opaque(uuid, sizeof(uuid_t));
 				launch_data_dict_insert(v, uuid_d, LAUNCH_JOBKEY_SECURITYSESSIONUUID);
 				jobs_that_need_sessions++;
 			} else {
@@ -1113,41 +2290,13 @@ launch_msg_internal(launch_data_t d)
 			}
 		}
 	}
-#endif
-
-	pthread_mutex_lock(&_lc->mtx);
-
-	if (d && launchd_msg_send(_lc->l, d) == -1) {
-		do {
-			if (errno != EAGAIN)
-				goto out;
-		} while (launchd_msg_send(_lc->l, NULL) == -1);
-	}
-
-	while (resp == NULL) {
-		if (d == NULL && launch_data_array_get_count(_lc->async_resp) > 0) {
-			resp = launch_data_array_pop_first(_lc->async_resp);
-			goto out;
-		}
-		if (launchd_msg_recv(_lc->l, launch_msg_getmsgs, &resp) == -1) {
-			if (errno != EAGAIN) {
-				goto out;
-			} else if (d == NULL) {
-				errno = 0;
-				goto out;
-			} else {
-				fd_set rfds;
 
-				FD_ZERO(&rfds);
-				FD_SET(fd2use, &rfds);
-
-				select(fd2use + 1, &rfds, NULL, NULL, NULL);
-			}
-		}
-	}
+	return jobs_that_need_sessions;
+}
 
-out:
-#if !TARGET_OS_EMBEDDED
+void
+launch_msg_session_finish(launch_data_t resp, uuid_t uuid, size_t jobs_that_need_sessions)
+{
 	if (!uuid_is_null(uuid) && resp && jobs_that_need_sessions > 0) {
 		mach_port_t session_port = _audit_session_self();
 		launch_data_type_t resp_type = launch_data_get_type(resp);
@@ -1182,6 +2331,74 @@ out:
 
 		mach_port_deallocate(mach_task_self(), session_port);
 	}
+}
+#endif
+
+launch_data_t
+launch_msg_internal(launch_data_t d, bool borrow)
+{
+	struct launch_msg_waiter w = { .borrow = borrow };
+	launch_data_t resp = NULL;
+
+	if (d && (launch_data_get_type(d) == LAUNCH_DATA_STRING)
+			&& (strcmp(launch_data_get_string(d), LAUNCH_KEY_GETJOBS) == 0)
+			&& vproc_swap_complex(NULL, VPROC_GSK_ALLJOBS, NULL, &resp) == NULL) {
+		return resp;
+	}
+
+	pthread_once(&_lc_once, launch_client_init);
+	if (!_lc) {
+		errno = ENOTCONN;
+		return NULL;
+	}
+
+#if !TARGET_OS_EMBEDDED
+	uuid_t uuid;
+	size_t jobs_that_need_sessions = launch_msg_session_prepare(d, uuid);
+#endif
+
+	pthread_mutex_lock(&_lc->mtx);
+
+	if (launch_msg_select_fd(d) == -1) {
+		goto out;
+	}
+
+	if (d == NULL) {
+		/* Just poll for asynchronous messages. */
+		if (launch_data_array_get_count(_lc->async_resp) == 0 && !_lc->reading) {
+			if (launchd_msg_recv(_lc->l, launch_msg_getmsgs, NULL) == -1 && errno != EAGAIN) {
+				goto out;
+			}
+			pthread_cond_broadcast(&_lc->cond);
+		}
+		if (launch_data_array_get_count(_lc->async_resp) > 0) {
+			resp = launch_data_array_pop_first(_lc->async_resp);
+		} else {
+			errno = 0;
+		}
+		goto out;
+	}
+
+	pthread_once(&_arena_key_once, launch_data_arena_key_init);
+	w.arena = pthread_getspecific(_arena_key);
+	w.tag = _lc->tags ? ++_lc->next_tag : 0;
+
+	_lc->l->sendtag = w.tag;
+	if (launchd_msg_queue(_lc->l, d) == -1) {
+		_lc->l->sendtag = 0;
+		goto out;
+	}
+	_lc->l->sendtag = 0;
+	TAILQ_INSERT_TAIL(&_lc->waiters, &w, tqe);
+	launch_msg_kick();
+
+	if (launch_msg_wait(&w, 1) == 0) {
+		resp = w.resp;
+	}
+
+out:
+#if !TARGET_OS_EMBEDDED
+	launch_msg_session_finish(resp, uuid, jobs_that_need_sessions);
 #endif
 
 	pthread_mutex_unlock(&_lc->mtx);
@@ -1189,14 +2406,165 @@ out:
 	return resp;
 }
 
+int
+launch_msg_batch(launch_data_t *reqs, size_t n, launch_data_t *resps)
+{
+	struct launch_msg_waiter *w;
+	launch_data_arena_t arena;
+	int queue_err = 0, r = -1;
+	size_t i, queued;
+
+	for (i = 0; i < n; i++) {
+		resps[i] = NULL;
+		/* Check-ins go over a different descriptor; they can't share the pipe. */
+		if (launch_data_get_type(reqs[i]) == LAUNCH_DATA_STRING && strcmp(launch_data_get_string(reqs[i]), LAUNCH_KEY_CHECKIN) == 0) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	if (n == 0) {
+		return 0;
+	}
+
+	pthread_once(&_lc_once, launch_client_init);
+	if (!_lc) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	if (!(w = calloc(n, sizeof(*w)))) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+#if !TARGET_OS_EMBEDDED
+	struct {
+		uuid_t uuid;
+		size_t jobs_that_need_sessions;
+	} *sessions;
+
+	if (!(sessions = malloc(n * sizeof(*sessions)))) {
+		free(w);
+		errno = ENOMEM;
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		sessions[i].jobs_that_need_sessions = launch_msg_session_prepare(reqs[i], sessions[i].uuid);
+	}
+#endif
+
+	pthread_once(&_arena_key_once, launch_data_arena_key_init);
+	arena = pthread_getspecific(_arena_key);
+
+	pthread_mutex_lock(&_lc->mtx);
+
+	if (launch_msg_select_fd(reqs[0]) == -1) {
+		goto out;
+	}
+
+	/* Every request is queued up front, and launchd answers them in order.
+	 * launch_msg_wait() keeps the socket moving in both directions until
+	 * every answer is in, so that neither side stalls on a full buffer.
+	 */
+	for (queued = 0; queued < n; queued++) {
+		w[queued].arena = arena;
+		w[queued].tag = _lc->tags ? ++_lc->next_tag : 0;
+		_lc->l->sendtag = w[queued].tag;
+		if (launchd_msg_queue(_lc->l, reqs[queued]) == -1) {
+			/* Still wait for the answers to whatever did get queued,
+			 * so that nobody mistakes them for their own.
+			 */
+			queue_err = errno;
+			break;
+		}
+		TAILQ_INSERT_TAIL(&_lc->waiters, &w[queued], tqe);
+	}
+	_lc->l->sendtag = 0;
+	launch_msg_kick();
+
+	if ((r = launch_msg_wait(w, queued)) == 0 && queue_err) {
+		errno = queue_err;
+		r = -1;
+	}
+
+	for (i = 0; i < queued; i++) {
+		resps[i] = w[i].resp;
+	}
+
+out:
+#if !TARGET_OS_EMBEDDED
+	for (i = 0; i < n; i++) {
+		launch_msg_session_finish(resps[i], sessions[i].uuid, sessions[i].jobs_that_need_sessions);
+	}
+	free(sessions);
+#endif
+
+	pthread_mutex_unlock(&_lc->mtx);
+	free(w);
+
+	return r;
+}
+
+int
+launchd_msg_recv_reserve(launch_t lh, size_t want)
+{
+	size_t nsz;
+	void *nbuf;
+
+	if (lh->recvbufsz - (lh->recvoff + lh->recvlen) >= want) {
+		return 0;
+	}
+
+	/* Messages are decoded in place, so the one in progress has to stay
+	 * contiguous. Only its already-received prefix is ever moved, and only
+	 * when the tail of the buffer runs out.
+	 */
+	if (lh->recvbufsz - lh->recvlen >= want) {
+		memmove(lh->recvbuf, lh->recvbuf + lh->recvoff, lh->recvlen);
+		lh->recvoff = 0;
+		return 0;
+	}
+
+	if (want > LAUNCHD_MSG_MAX || lh->recvlen > LAUNCHD_MSG_MAX) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	nsz = lh->recvbufsz ? lh->recvbufsz : LAUNCHD_MSG_RECV_MIN;
+	while (nsz < lh->recvlen + want) {
+		if (nsz > SIZE_MAX / 2) {
+			errno = ENOMEM;
+			return -1;
+		}
+		nsz *= 2;
+	}
+
+	if (!(nbuf = malloc(nsz))) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if (lh->recvlen) {
+		memcpy(nbuf, lh->recvbuf + lh->recvoff, lh->recvlen);
+	}
+	free(lh->recvbuf);
+	lh->recvbuf = nbuf;
+	lh->recvbufsz = nsz;
+	lh->recvoff = 0;
+
+	return 0;
+}
+
 int
 launchd_msg_recv(launch_t lh, void (*cb)(launch_data_t, void *), void *context)
 {
 	struct cmsghdr *cm = alloca(4096); 
 	launch_data_t rmsg = NULL;
-	size_t data_offset, fd_offset;
+	size_t data_offset, fd_offset, want;
+	unsigned int reads = 0;
 	struct msghdr mh;
 	struct iovec iov;
+	bool filled;
 	int r;
 
 	int fd2use = launchd_getfd(lh);
@@ -1205,14 +2573,41 @@ launchd_msg_recv(launch_t lh, void (*cb)(launch_data_t, void *), void *context)
 		return -1;
 	}
 
+read_more:
+	/* If we already have the header of the next message, make room for all
+	 * of it so that the rest arrives in as few reads as the socket allows.
+	 */
+	want = LAUNCHD_MSG_RECV_MIN;
+	if (lh->recvlen >= sizeof(struct launch_msg_header)) {
+		struct launch_msg_header *lmhp = lh->recvbuf + lh->recvoff;
+		uint64_t tmplen = big2wire(lmhp->len);
+
+		uint64_t magic = big2wire(lmhp->magic);
+
+		magic &= ~LAUNCH_MSG_HEADER_F_TAGGED;
+		if (magic != LAUNCH_MSG_HEADER_MAGIC && magic != LAUNCH_MSG_HEADER_MAGIC_V2) {
+			errno = EBADRPC;
+			return -1;
+		}
+		if (tmplen > LAUNCHD_MSG_MAX) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+		if (tmplen > lh->recvlen && tmplen - lh->recvlen > want) {
+			want = tmplen - lh->recvlen;
+		}
+	}
+
+	if (launchd_msg_recv_reserve(lh, want) == -1) {
+		return -1;
+	}
+
 	memset(&mh, 0, sizeof(mh));
 	mh.msg_iov = &iov;
 	mh.msg_iovlen = 1;
 
-	lh->recvbuf = reallocf(lh->recvbuf, lh->recvlen + 8*1024);
-
-	iov.iov_base = lh->recvbuf + lh->recvlen;
-	iov.iov_len = 8*1024;
+	iov.iov_base = lh->recvbuf + lh->recvoff + lh->recvlen;
+	iov.iov_len = lh->recvbufsz - (lh->recvoff + lh->recvlen);
 	mh.msg_control = cm;
 	mh.msg_controllen = 4096;
 
@@ -1226,18 +2621,31 @@ launchd_msg_recv(launch_t lh, void (*cb)(launch_data_t, void *), void *context)
 		errno = ECONNABORTED;
 		return -1;
 	}
+	filled = (size_t)r == iov.iov_len;
 	lh->recvlen += r;
 	if (mh.msg_controllen > 0) {
-		lh->recvfds = reallocf(lh->recvfds, lh->recvfdcnt * sizeof(int) + mh.msg_controllen - sizeof(struct cmsghdr));
-		memcpy(lh->recvfds + lh->recvfdcnt, CMSG_DATA(cm), mh.msg_controllen - sizeof(struct cmsghdr));
-		lh->recvfdcnt += (mh.msg_controllen - sizeof(struct cmsghdr)) / sizeof(int);
+		size_t i, nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		int *nrecvfds = realloc(lh->recvfds, (lh->recvfdoff + lh->recvfdcnt + nfds) * sizeof(int));
+		if (!nrecvfds) {
+			/* Leave the ones already queued where they are, for
+			 * launchd_close() to close. Nothing else will ever see these.
+			 */
+			for (i = 0; i < nfds; i++) {
+				(void)close(((int *)CMSG_DATA(cm))[i]);
+			}
+			errno = ENOMEM;
+			return -1;
+		}
+		lh->recvfds = nrecvfds;
+		memcpy(lh->recvfds + lh->recvfdoff + lh->recvfdcnt, CMSG_DATA(cm), nfds * sizeof(int));
+		lh->recvfdcnt += nfds;
 	}
 
 	r = 0;
 
 	while (lh->recvlen > 0) {
-		struct launch_msg_header *lmhp = lh->recvbuf;
-		uint64_t tmplen;
+		struct launch_msg_header *lmhp = lh->recvbuf + lh->recvoff;
+		uint64_t tmplen, magic;
 		data_offset = sizeof(struct launch_msg_header);
 		fd_offset = 0;
 
@@ -1245,80 +2653,227 @@ launchd_msg_recv(launch_t lh, void (*cb)(launch_data_t, void *), void *context)
 			goto need_more_data;
 
 		tmplen = big2wire(lmhp->len);
+		magic = big2wire(lmhp->magic);
+
+		if (magic & LAUNCH_MSG_HEADER_F_TAGGED) {
+			magic &= ~LAUNCH_MSG_HEADER_F_TAGGED;
+			data_offset = sizeof(struct launch_msg_header_tagged);
+		}
 
-		if (big2wire(lmhp->magic) != LAUNCH_MSG_HEADER_MAGIC || tmplen <= sizeof(struct launch_msg_header)) {
+		if ((magic != LAUNCH_MSG_HEADER_MAGIC && magic != LAUNCH_MSG_HEADER_MAGIC_V2) || tmplen <= data_offset) {
 			errno = EBADRPC;
 			goto out_bad;
 		}
 
+		if (tmplen > LAUNCHD_MSG_MAX) {
+			errno = EMSGSIZE;
+			goto out_bad;
+		}
+
 		if (lh->recvlen < tmplen) {
 			goto need_more_data;
 		}
 
-		if ((rmsg = launch_data_unpack(lh->recvbuf, lh->recvlen, lh->recvfds, lh->recvfdcnt, &data_offset, &fd_offset)) == NULL) {
+		/* Anything sent from inside the callback answers this message. */
+		lh->recvtag = 0;
+		if (data_offset == sizeof(struct launch_msg_header_tagged)) {
+			lh->recvtag = big2wire(((struct launch_msg_header_tagged *)lmhp)->tag);
+		}
+		lh->sendtag = lh->recvtag;
+
+		/* Answer in whatever encoding the peer last spoke. */
+		if (magic == LAUNCH_MSG_HEADER_MAGIC_V2) {
+			rmsg = launch_data_unpack_v2(lmhp, tmplen, lh->recvfds + lh->recvfdoff, lh->recvfdcnt, &data_offset, &fd_offset);
+			lh->wire_version = 2;
+		} else {
+			rmsg = launch_data_unpack(lmhp, tmplen, lh->recvfds + lh->recvfdoff, lh->recvfdcnt, &data_offset, &fd_offset);
+			lh->wire_version = 1;
+		}
+
+		if (rmsg == NULL) {
 			errno = EBADRPC;
 			goto out_bad;
 		}
 
+		/* The message's descriptors belong to the callback from here on. */
+		lh->recvfdoff += fd_offset;
+		lh->recvfdcnt -= fd_offset;
+
 		in_flight_msg_recv_client = lh;
+		in_flight_msg_taken = false;
 
 		cb(rmsg, context);
 
+		/* A v2 message's arena dies with the callback unless it was taken. */
+		if ((rmsg->flags & LAUNCH_DATA_F_OWNSARENA) && !in_flight_msg_taken) {
+			launch_data_free(rmsg);
+		}
+
 		/* launchd and only launchd can call launchd_close() as a part of the callback */
 		if (in_flight_msg_recv_client == NULL) {
-			r = 0;
-			break;
+			return 0;
 		}
 
-		lh->recvlen -= data_offset;
-		if (lh->recvlen > 0) {
-			memmove(lh->recvbuf, lh->recvbuf + data_offset, lh->recvlen);
-		} else {
-			free(lh->recvbuf);
-			lh->recvbuf = malloc(0);
-		}
+		lh->sendtag = 0;
 
-		lh->recvfdcnt -= fd_offset;
-		if (lh->recvfdcnt > 0) {
-			memmove(lh->recvfds, lh->recvfds + fd_offset, lh->recvfdcnt * sizeof(int));
-		} else {
-			free(lh->recvfds);
-			lh->recvfds = malloc(0);
-		}
+		lh->recvoff += tmplen;
+		lh->recvlen -= tmplen;
 	}
 
+	launchd_msg_recv_trim(lh);
+	/* A read that filled the buffer probably left more queued behind it,
+	 * e.g. from a client pipelining requests. Drain a bounded amount now
+	 * instead of going back through the caller's event loop for each chunk,
+	 * but not while the answers to what was already read are backing up.
+	 */
+	if (filled && ++reads < LAUNCHD_MSG_RECV_DRAIN && lh->sendlen < LAUNCHD_MSG_SENDBUF_KEEP) {
+		goto read_more;
+	}
 	return r;
 
 need_more_data:
+	launchd_msg_recv_trim(lh);
+	if (filled && ++reads < LAUNCHD_MSG_RECV_DRAIN && lh->sendlen < LAUNCHD_MSG_SENDBUF_KEEP) {
+		goto read_more;
+	}
 	errno = EAGAIN;
 out_bad:
 	return -1;
 }
 
+void
+launch_data_relocate(launch_data_t d, ptrdiff_t delta)
+{
+	size_t i;
+
+	switch (d->type) {
+	case LAUNCH_DATA_DICTIONARY:
+	case LAUNCH_DATA_ARRAY:
+		d->_array = (void *)d->_array + delta;
+		for (i = 0; i < d->_array_cnt; i++) {
+			d->_array[i] = (void *)d->_array[i] + delta;
+			launch_data_relocate(d->_array[i], delta);
+		}
+		break;
+	case LAUNCH_DATA_STRING:
+		d->string += delta;
+		break;
+	case LAUNCH_DATA_OPAQUE:
+		d->opaque += delta;
+		break;
+	default:
+		break;
+	}
+}
+
+/* Called from a launchd_msg_recv() callback to keep the in-place message 'm'
+ * alive past the callback. If 'm' is the last thing in the receive buffer, the
+ * whole buffer is handed over. Otherwise the message bytes are copied once and
+ * the tree's internal pointers rebased; no nodes are allocated either way.
+ * The result is released with launch_data_free().
+ */
+launch_data_t
+launchd_msg_recv_take(launch_t lh, launch_data_t m)
+{
+	struct launch_msg_header *lmhp;
+	uint64_t tmplen;
+	size_t hdrsz;
+	void *base;
+
+	if (m->flags & LAUNCH_DATA_F_OWNSARENA) {
+		/* Decoded from the v2 encoding; it already owns its memory. */
+		in_flight_msg_taken = true;
+		return m;
+	}
+
+	lmhp = lh->recvbuf + lh->recvoff;
+	tmplen = big2wire(lmhp->len);
+	hdrsz = (void *)m - (void *)lmhp;
+
+	if (tmplen == lh->recvlen) {
+		base = lh->recvbuf;
+		lh->recvbuf = NULL;
+		lh->recvbufsz = 0;
+	} else {
+		if (!(base = malloc(tmplen))) {
+			return launch_data_copy(m);
+		}
+		memcpy(base, lmhp, tmplen);
+		launch_data_relocate(base + hdrsz, (base + hdrsz) - (void *)m);
+		m = base + hdrsz;
+	}
+
+	/* launch_data_free() finds the base where a plain header would start. */
+	*(void **)((void *)m - sizeof(struct launch_msg_header)) = base;
+	m->flags |= LAUNCH_DATA_F_OWNSBUF;
+
+	return m;
+}
+
+void
+launchd_msg_recv_trim(launch_t lh)
+{
+	/* Shift the descriptors still owed to a partial message down over the
+	 * ones already handed out, as the byte buffer is, so that a peer
+	 * trickling descriptors can't grow the array without bound.
+	 */
+	if (lh->recvfdcnt == 0) {
+		lh->recvfdoff = 0;
+	} else if (lh->recvfdoff > 0) {
+		memmove(lh->recvfds, lh->recvfds + lh->recvfdoff, lh->recvfdcnt * sizeof(int));
+		lh->recvfdoff = 0;
+	}
+
+	if (lh->recvlen > 0) {
+		return;
+	}
+
+	lh->recvoff = 0;
+
+	/* Don't hold on to the memory from a one-off huge message. */
+	if (lh->recvbufsz > LAUNCHD_MSG_RECVBUF_KEEP) {
+		free(lh->recvbuf);
+		lh->recvbuf = NULL;
+		lh->recvbufsz = 0;
+	}
+}
+
 launch_data_t
 launch_data_copy(launch_data_t o)
 {
-	launch_data_t r = launch_data_alloc(o->type);
+	launch_data_t r, *array;
+	uint32_t flags;
 	size_t i;
 
-	free(r->_array);
+	if (!(r = launch_data_alloc(o->type))) {
+		return NULL;
+	}
+	array = r->_array;
+	flags = r->flags;
+
 	memcpy(r, o, sizeof(struct _launch_data));
+	r->flags = flags;
 
 	switch (o->type) {
 	case LAUNCH_DATA_DICTIONARY:
 	case LAUNCH_DATA_ARRAY:
-		r->_array = calloc(1, o->_array_cnt * sizeof(launch_data_t));
+		r->_array = array;
+		r->_array_cnt = 0;
+		if (!launch_data_array_reserve(r, o->_array_cnt)) {
+			break;
+		}
 		for (i = 0; i < o->_array_cnt; i++) {
-			if (o->_array[i])
-				r->_array[i] = launch_data_copy(o->_array[i]);
+			r->_array[i] = o->_array[i] ? launch_data_copy(o->_array[i]) : NULL;
 		}
+		r->_array_cnt = o->_array_cnt;
 		break;
 	case LAUNCH_DATA_STRING:
-		r->string = strdup(o->string);
+		r->string = NULL;
+		launch_data_set_string(r, o->string);
 		break;
 	case LAUNCH_DATA_OPAQUE:
-		r->opaque = malloc(o->opaque_size);
-		memcpy(r->opaque, o->opaque, o->opaque_size);
+		r->opaque = array;
+		launch_data_set_opaque(r, o->opaque, o->opaque_size);
 		break;
 	default:
 		break;
@@ -476,7 +476,7 @@ _vprocmgr_init(const char *session_type)
 pid_t
 _spawn_via_launchd(const char *label, const char *const *argv, const struct spawn_via_launchd_attr *spawn_attrs, int struct_version)
 {
-	size_t i, good_enough_size = 10*1024*1024;
+	size_t i, packed_size;
 	mach_msg_type_number_t indata_cnt = 0;
 	vm_offset_t indata = 0;
 	mach_port_t obsvr_port = MACH_PORT_NULL;
@@ -607,11 +607,12 @@ _spawn_via_launchd(const char *label, const char *const *argv, const struct spaw
 		break;
 	}
 
-	if (!(buf = malloc(good_enough_size))) {
+	packed_size = launch_data_packed_size(in_obj, NULL);
+	if (!(buf = malloc(packed_size))) {
 		goto out;
 	}
 
-	if ((indata_cnt = launch_data_pack(in_obj, buf, good_enough_size, NULL, NULL)) == 0) {
+	if ((indata_cnt = launch_data_pack(in_obj, buf, packed_size, NULL, NULL)) == 0) {
 		goto out;
 	}
 
@@ -803,7 +804,7 @@ vproc_swap_integer(vproc_t vp, vproc_gsk_t key, int64_t *inval, int64_t *outval)
 vproc_err_t
 vproc_swap_complex(vproc_t vp, vproc_gsk_t key, launch_data_t inval, launch_data_t *outval)
 {
-	size_t data_offset = 0, good_enough_size = 10*1024*1024;
+	size_t data_offset = 0, packed_size;
 	mach_msg_type_number_t indata_cnt = 0, outdata_cnt;
 	vm_offset_t indata = 0, outdata = 0;
 	launch_data_t out_obj;
@@ -811,11 +812,12 @@ vproc_swap_complex(vproc_t vp, vproc_gsk_t key, launch_data_t inval, launch_data
 	void *buf = NULL;
 
 	if (inval) {
-		if (!(buf = malloc(good_enough_size))) {
+		packed_size = launch_data_packed_size(inval, NULL);
+		if (!(buf = malloc(packed_size))) {
 			goto out;
 		}
 
-		if ((indata_cnt = launch_data_pack(inval, buf, good_enough_size, NULL, NULL)) == 0) {
+		if ((indata_cnt = launch_data_pack(inval, buf, packed_size, NULL, NULL)) == 0) {
 			goto out;
 		}
 
@@ -119,6 +119,7 @@ extern int gL1CacheEnabled;
 #include "job_reply.h"
 #include "job_forward.h"
 #include "mach_excServer.h"
+#include "cronemu.h"
 
 #define POSIX_SPAWN_IOS_INTERACTIVE 0
 
@@ -158,6 +159,8 @@ struct machservice {
 	SLIST_ENTRY(machservice) special_port_sle;
 	LIST_ENTRY(machservice) name_hash_sle;
 	LIST_ENTRY(machservice) port_hash_sle;
+	struct machservice_hash *name_table;
+	size_t name_hashval;
 	struct machservice *alias;
 	job_t job;
 	unsigned int gen_num;
@@ -186,10 +189,46 @@ struct machservice {
 // HACK: This should be per jobmgr_t
 static SLIST_HEAD(, machservice) special_ports;
 
-#define PORT_HASH_SIZE 32
-#define HASH_PORT(x) (IS_POWER_OF_TWO(PORT_HASH_SIZE) ? (MACH_PORT_INDEX(x) & (PORT_HASH_SIZE - 1)) : (MACH_PORT_INDEX(x) % PORT_HASH_SIZE))
+/* Both the per-manager service name index and the global port index grow
+ * the same way the label hash does: the bucket count doubles once the average
+ * chain is MACHSERVICE_HASH_LOAD long, and the old buckets are drained a few
+ * at a time by later inserts and lookups. Per-PID and MultipleInstances
+ * services can push either one into the tens of thousands.
+ */
+#define MACHSERVICE_HASH_SIZE 64
+#define MACHSERVICE_HASH_LOAD 2
+#define MACHSERVICE_HASH_MIGRATE 8
+LIST_HEAD(machservice_list, machservice);
+struct machservice_hash {
+	struct machservice_list *buckets;
+	struct machservice_list *old_buckets;
+	size_t size;
+	size_t old_size;
+	size_t old_next;
+	size_t count;
+	size_t per_pid_count;
+	size_t peak_count;
+	unsigned int resizes;
+	bool by_port;
+	struct machservice_list initial[MACHSERVICE_HASH_SIZE];
+};
+
+static struct machservice_hash port_hash = {
+	.buckets = port_hash.initial,
+	.size = MACHSERVICE_HASH_SIZE,
+	.by_port = true,
+};
 
-static LIST_HEAD(, machservice) port_hash[PORT_HASH_SIZE];
+static void machservice_hash_init(struct machservice_hash *h);
+static void machservice_hash_destroy(struct machservice_hash *h);
+static void machservice_hash_insert(struct machservice_hash *h, struct machservice *ms);
+static void machservice_hash_remove(struct machservice_hash *h, struct machservice *ms);
+static void machservice_hash_migrate(struct machservice_hash *h, size_t nbuckets);
+static size_t machservice_hash_key(struct machservice_hash *h, struct machservice *ms);
+static void machservice_hash_link(struct machservice_hash *h, struct machservice_list *bucket, struct machservice *ms);
+static struct machservice *machservice_hash_find_name(struct machservice_hash *h, const char *name);
+static struct machservice *machservice_hash_find_recv(mach_port_t p);
+static void machservice_hash_log_stats(jobmgr_t jm, struct machservice_hash *h, const char *what);
 
 static void machservice_setup(launch_data_t obj, const char *key, void *context);
 static void machservice_setup_options(launch_data_t obj, const char *key, void *context);
@@ -228,22 +267,37 @@ static void socketgroup_setup(launch_data_t obj, const char *key, void *context)
 static void socketgroup_kevent_mod(job_t j, struct socketgroup *sg, bool do_add);
 
 struct calendarinterval {
-	LIST_ENTRY(calendarinterval) global_sle;
 	SLIST_ENTRY(calendarinterval) sle;
 	job_t job;
 	struct tm when;
 	time_t when_next;
+	size_t heap_index;
 };
 
-static LIST_HEAD(, calendarinterval) sorted_calendar_events;
+/* Pending calendar intervals live in a binary min-heap ordered by when_next,
+ * so loading, firing and deleting an interval are all O(log n). One
+ * EVFILT_TIMER, identified by the address of calendar_heap, is armed for the
+ * root of the heap. calendar_armed_at remembers what it was last armed for so
+ * that inserts which don't change the root don't have to touch the kqueue.
+ */
+static struct calendarinterval **calendar_heap;
+static size_t calendar_heap_cnt;
+static size_t calendar_heap_size;
+static time_t calendar_armed_at;
 
 static bool calendarinterval_new(job_t j, struct tm *w);
 static bool calendarinterval_new_from_obj(job_t j, launch_data_t obj);
 static void calendarinterval_new_from_obj_dict_walk(launch_data_t obj, const char *key, void *context);
 static void calendarinterval_delete(job_t j, struct calendarinterval *ci);
 static void calendarinterval_setalarm(job_t j, struct calendarinterval *ci);
+static bool calendarinterval_schedule(job_t j, struct calendarinterval *ci);
+static void calendarinterval_arm(void);
 static void calendarinterval_callback(void);
 static void calendarinterval_sanity_check(void);
+static void calendar_heap_sift_up(size_t i);
+static void calendar_heap_sift_down(size_t i);
+static bool calendar_heap_insert(struct calendarinterval *ci);
+static void calendar_heap_remove(struct calendarinterval *ci);
 
 struct envitem {
 	SLIST_ENTRY(envitem) sle;
@@ -290,6 +344,16 @@ struct semaphoreitem {
 	SLIST_ENTRY(semaphoreitem) sle;
 	semaphore_reason_t why;
 
+	/* The OTHER_JOB_* criteria are also kept in s_semaphore_watchers, keyed
+	 * by the label they watch. "other" is the root job currently carrying
+	 * that label, kept current as jobs enter and leave the root label hash.
+	 */
+	LIST_ENTRY(semaphoreitem) watch_sle;
+	job_t job;
+	job_t other;
+	size_t what_hashval;
+	unsigned int watch_pass;
+
 	union {
 		const char what[0];
 		char what_init[0];
@@ -307,6 +371,8 @@ static void semaphoreitem_delete(job_t j, struct semaphoreitem *si);
 static void semaphoreitem_setup(launch_data_t obj, const char *key, void *context);
 static void semaphoreitem_setup_dict_iter(launch_data_t obj, const char *key, void *context);
 static void semaphoreitem_runtime_mod_ref(struct semaphoreitem *si, bool add);
+static bool semaphoreitem_watches(struct semaphoreitem *si);
+static job_t semaphoreitem_find_cycle(job_t other, const char *label, unsigned int pass);
 
 struct externalevent {
 	LIST_ENTRY(externalevent) sys_le;
@@ -346,15 +412,51 @@ static void eventsystem_setup(launch_data_t obj, const char *key, void *context)
 static struct eventsystem *eventsystem_find(const char *name);
 static void eventsystem_ping(void);
 
-#define ACTIVE_JOB_HASH_SIZE 32
-#define ACTIVE_JOB_HASH(x) (IS_POWER_OF_TWO(ACTIVE_JOB_HASH_SIZE) ? (x & (ACTIVE_JOB_HASH_SIZE - 1)) : (x % ACTIVE_JOB_HASH_SIZE))
-
-#define MACHSERVICE_HASH_SIZE	37
+/* Every job with a running process, in every job manager, is indexed here by
+ * PID, so that reaping and PID lookups don't have to visit each manager. A PID
+ * can appear more than once, since a process that talks to several bootstraps
+ * gets an anonymous job in each of them. The table doubles, rehashing in one
+ * go, when the average chain reaches two.
+ */
+#define PID_HASH_SIZE 64
+static LIST_HEAD(pid_hash_head, job_s) s_pid_hash_initial[PID_HASH_SIZE];
+static struct pid_hash_head *s_pid_hash = s_pid_hash_initial;
+static size_t s_pid_hash_size = PID_HASH_SIZE;
+static size_t s_pid_hash_cnt;
+static unsigned int s_pid_hash_resizes;
+static unsigned int s_reap_pass;
+
+// Job managers in shutdown with jobs that need to be looked at again.
+static LIST_HEAD(, jobmgr_s) s_gc_queue;
+static uint64_t s_gc_passes;
+static uint64_t s_gc_job_visits;
+#define PID_HASH(x) ((size_t)(x) & (s_pid_hash_size - 1))
+
+/* The label hash starts out at LABEL_HASH_SIZE buckets and doubles whenever
+ * the average chain grows past LABEL_HASH_LOAD. Growing is incremental: the
+ * old bucket array is kept around and LABEL_HASH_MIGRATE of its buckets are
+ * moved over on every insert, removal and lookup, so no single operation has
+ * to rehash the whole table. The root job manager holds every imported label,
+ * so this table can easily reach tens of thousands of entries.
+ */
+#define LABEL_HASH_SIZE 64
+#define LABEL_HASH_LOAD 2
+#define LABEL_HASH_MIGRATE 8
+LIST_HEAD(label_hash_head, job_s);
+struct label_hash {
+	struct label_hash_head *buckets;
+	struct label_hash_head *old_buckets;
+	size_t size;
+	size_t old_size;
+	size_t old_next;
+	size_t count;
+	struct label_hash_head initial[LABEL_HASH_SIZE];
+};
 
-#define LABEL_HASH_SIZE 53
 struct jobmgr_s {
 	kq_callback kqjobmgr_callback;
 	LIST_ENTRY(jobmgr_s) xpc_le;
+	LIST_ENTRY(jobmgr_s) mig_port_sle;
 	SLIST_ENTRY(jobmgr_s) sle;
 	SLIST_HEAD(, jobmgr_s) submgrs;
 	LIST_HEAD(, job_s) jobs;
@@ -364,15 +466,24 @@ struct jobmgr_s {
 	 * its own label hash that is separate from the "global" one stored in the
 	 * root job manager.
 	 */
-	LIST_HEAD(, job_s) label_hash[LABEL_HASH_SIZE];
-	LIST_HEAD(, job_s) active_jobs[ACTIVE_JOB_HASH_SIZE];
-	LIST_HEAD(, machservice) ms_hash[MACHSERVICE_HASH_SIZE];
+	struct label_hash label_hash;
+	struct machservice_hash ms_hash;
 	LIST_HEAD(, job_s) global_env_jobs;
 	mach_port_t jm_port;
 	mach_port_t req_port;
 	jobmgr_t parentmgr;
 	int reboot_flags;
 	time_t shutdown_time;
+	/* Garbage collection during shutdown only looks at the jobs on gc_jobs,
+	 * whose state changed since the last pass. gc_active_cnt counts the jobs
+	 * that shutdown is still waiting on.
+	 */
+	LIST_ENTRY(jobmgr_s) gc_sle;
+	LIST_HEAD(, job_s) gc_jobs;
+	size_t gc_active_cnt;
+	uint64_t shutdown_began;
+	uint64_t shutdown_jobs_exited;
+	uint64_t shutdown_drained;
 	unsigned int global_on_demand_cnt;
 	unsigned int normal_active_cnt;
 	unsigned int 
@@ -382,7 +493,10 @@ struct jobmgr_s {
 		monitor_shutdown:1,
 		shutdown_jobs_dirtied:1,
 		shutdown_jobs_cleaned:1,
-		xpc_singleton:1;
+		xpc_singleton:1,
+		mig_port_hashed:1,
+		gc_queued:1,
+		gc_all_jobs:1;
 	uint32_t properties;
 	// XPC-specific properties.
 	char owner[MAXCOMLEN];
@@ -409,6 +523,25 @@ static jobmgr_t _s_xpc_system_domain;
 static LIST_HEAD(, jobmgr_s) _s_xpc_user_domains;
 static LIST_HEAD(, jobmgr_s) _s_xpc_session_domains;
 
+/* MIG requests arrive on either a job manager's bootstrap port or a job's
+ * privileged port. This index maps those port names back to their owners so
+ * that job_mig_intran() doesn't have to walk every job in every job manager.
+ * There is one entry per job manager plus one per job that has asked for a
+ * privileged port, so the table is rehashed in one go when it doubles.
+ */
+#define MIG_PORT_HASH_SIZE 64
+struct mig_port_bucket {
+	LIST_HEAD(, jobmgr_s) mgrs;
+	LIST_HEAD(, job_s) jobs;
+};
+
+static struct mig_port_bucket s_mig_port_initial[MIG_PORT_HASH_SIZE];
+static struct mig_port_bucket *s_mig_port_hash = s_mig_port_initial;
+static size_t s_mig_port_hash_size = MIG_PORT_HASH_SIZE;
+static size_t s_mig_port_cnt;
+static uint64_t s_mig_intran_cnt;
+static uint64_t s_mig_intran_slow_cnt;
+
 #define jobmgr_assumes(jm, e) osx_assumes_ctx(jobmgr_log_bug, jm, (e))
 #define jobmgr_assumes_zero(jm, e) osx_assumes_zero_ctx(jobmgr_log_bug, jm, (e))
 #define jobmgr_assumes_zero_p(jm, e) posix_assumes_zero_ctx(jobmgr_log_bug, jm, (e))
@@ -420,22 +553,49 @@ static jobmgr_t jobmgr_find_xpc_per_session_domain(jobmgr_t jm, au_asid_t asid);
 static job_t jobmgr_import2(jobmgr_t jm, launch_data_t pload);
 static jobmgr_t jobmgr_parent(jobmgr_t jm);
 static jobmgr_t jobmgr_do_garbage_collection(jobmgr_t jm);
+static jobmgr_t jobmgr_collect(jobmgr_t jm);
+static void jobmgr_gc_queue(jobmgr_t jm, bool all_jobs);
 static bool jobmgr_label_test(jobmgr_t jm, const char *str);
 static void jobmgr_reap_bulk(jobmgr_t jm, struct kevent *kev);
 static void jobmgr_log_stray_children(jobmgr_t jm, bool kill_strays);
 static void jobmgr_kill_stray_children(jobmgr_t jm, pid_t *p, size_t np);
 static void jobmgr_remove(jobmgr_t jm);
-static void jobmgr_dispatch_all(jobmgr_t jm, bool newmounthack);
+static void jobmgr_dispatch_all(jobmgr_t jm);
 static job_t jobmgr_init_session(jobmgr_t jm, const char *session_type, bool sflag);
 static job_t jobmgr_find_by_pid_deep(jobmgr_t jm, pid_t p, bool anon_okay);
+static bool jobmgr_contains(jobmgr_t jm, jobmgr_t jmi);
+static void pid_hash_grow(void);
+static void job_pid_hash_insert(job_t j);
+static void job_pid_hash_remove(job_t j);
 static job_t jobmgr_find_by_pid(jobmgr_t jm, pid_t p, bool create_anon);
 static jobmgr_t jobmgr_find_by_name(jobmgr_t jm, const char *where);
 static job_t job_mig_intran2(jobmgr_t jm, mach_port_t mport, pid_t upid);
+static job_t job_mig_intran_port(mach_port_t mport, pid_t upid);
+static void mig_port_hash_grow(void);
+static void jobmgr_mig_port_add(jobmgr_t jm);
+static void jobmgr_mig_port_del(jobmgr_t jm);
 static job_t jobmgr_lookup_per_user_context_internal(job_t j, uid_t which_user, mach_port_t *mp);
 static void job_export_all2(jobmgr_t jm, launch_data_t where);
+static launch_data_t job_export_argv(job_t j);
 static void jobmgr_callback(void *obj, struct kevent *kev);
 static void jobmgr_setup_env_from_other_jobs(jobmgr_t jm);
 static void jobmgr_export_env_from_other_jobs(jobmgr_t jm, launch_data_t dict);
+static bool jobmgr_envp_from_other_jobs(jobmgr_t jm, char ***envp, size_t *cnt);
+static bool envp_has(char **envp, size_t cnt, const char *key);
+static char *envp_take(char **envp, size_t *cnt, const char *key);
+static bool envp_set(char ***envp, size_t *cnt, const char *key, const char *value);
+static void envp_free(char **envp);
+
+/* The environment each job is started with is built once and kept in the job
+ * until something it was built from changes. Changes to the job's own
+ * environment only throw away its own copy. Anything that could affect other
+ * jobs as well (global environment items, launchd's own environment and jobs
+ * moving between managers) bumps s_envp_gen, which every copy is checked
+ * against.
+ */
+static uint64_t s_envp_gen = 1;
+static uint64_t s_envp_rebuild_cnt;
+static uint64_t s_envp_reuse_cnt;
 static struct machservice *jobmgr_lookup_service(jobmgr_t jm, const char *name, bool check_parent, pid_t target_pid);
 static void jobmgr_logv(jobmgr_t jm, int pri, int err, const char *msg, va_list ap) __attribute__((format(printf, 4, 0)));
 static void jobmgr_log(jobmgr_t jm, int pri, const char *msg, ...) __attribute__((format(printf, 3, 4)));
@@ -461,8 +621,11 @@ struct job_s {
 	LIST_ENTRY(job_s) jetsam_sle;
 	LIST_ENTRY(job_s) pid_hash_sle;
 	LIST_ENTRY(job_s) label_hash_sle;
+	LIST_ENTRY(job_s) mig_port_sle;
 	LIST_ENTRY(job_s) global_env_sle;
-	SLIST_ENTRY(job_s) curious_jobs_sle;
+	LIST_ENTRY(job_s) gc_sle;
+	LIST_ENTRY(job_s) keepalive_sle[KEEPALIVE_EVENT_CNT];
+	LIST_ENTRY(job_s) spawn_helper_sle;
 	LIST_HEAD(, suspended_peruser) suspended_perusers;
 	LIST_HEAD(, waiting_for_exit) exit_watchers;
 	LIST_HEAD(, job_s) subjobs;
@@ -476,6 +639,11 @@ struct job_s {
 	SLIST_HEAD(, semaphoreitem) semaphores;
 	SLIST_HEAD(, waiting_for_removal) removal_watchers;
 	job_t alias;
+	struct label_hash *label_table;
+	size_t label_hashval;
+	unsigned int watch_pass;
+	job_t watch_next;
+	unsigned int keepalive_events;
 	struct rusage ru;
 	cpu_type_t *j_binpref;
 	size_t j_binpref_cnt;
@@ -487,6 +655,7 @@ struct job_s {
 	jobmgr_t mgr;
 	size_t argc;
 	char **argv;
+	launch_data_t argv_export;
 	char *prog;
 	char *rootdir;
 	char *workingdir;
@@ -497,6 +666,7 @@ struct job_s {
 	char *stderrpath;
 	char *alt_exc_handler;
 	unsigned int nruns;
+	unsigned int reap_pass;
 	uint64_t trt;
 #if HAVE_SANDBOX
 	char *seatbelt_profile;
@@ -510,6 +680,14 @@ struct job_s {
 	int last_exit_status;
 	int stdin_fd;
 	int fork_fd;
+	int spawn_helper_ipc_fd;
+	uint64_t spawn_helper_seq;
+	uint64_t spawn_helper_start;
+	struct usercred_s *cred;
+	gid_t cred_gid;
+	char **envp;
+	size_t envp_cnt;
+	uint64_t envp_gen;
 	int nice;
 	uint32_t pstype;
 	int32_t jetsam_priority;
@@ -521,7 +699,15 @@ struct job_s {
 	uint64_t start_time;
 	uint32_t min_run_time;
 	uint32_t start_interval;
+	uint32_t start_interval_jitter;
 	uint32_t peruser_suspend_count;
+	struct runtime_timer_s start_interval_timer;
+	struct runtime_timer_s exit_timeout_timer;
+	struct runtime_timer_s respawn_timer;
+	struct runtime_timer_s spawn_settle_timer;
+	TAILQ_ENTRY(job_s) spawn_sched_tqe;
+	uint64_t spawn_sched_enqueued;
+	unsigned int spawn_sched_class;
 	uuid_t instance_id;
 	mode_t mask;
 	pid_t tracing_pid;
@@ -621,8 +807,6 @@ struct job_s {
 		enable_transactions:1,
 		// The job was sent SIGKILL because it was clean.
 		clean_kill:1,
-		// The job has an OtherJobEnabled KeepAlive criterion.
-		nosy:1,
 		// The job exited due to a crash.
 		crashed:1,
 		// We've received NOTE_EXIT for the job and reaped it.
@@ -696,14 +880,260 @@ struct job_s {
 		// etc.).
 		waiting4ok:1,
 		// The job was implicitly reaped by the kernel.
-		implicit_reap:1;
+		implicit_reap:1,
+		// j_port is in the MIG port index.
+		mig_port_hashed:1,
+		// The job is on its manager's gc_jobs list.
+		gc_dirty:1,
+		// The job is included in its manager's gc_active_cnt.
+		gc_counted:1,
+		// The spawn helper is forking the job for us.
+		spawn_helper_pending:1,
+		// In the child, environ is already the job's envp.
+		envp_in_environ:1,
+		// The job's envp takes SECURITYSESSIONID from its own or global EnvironmentVariables.
+		envp_sets_sessionid:1,
+		// man launchd.plist --> ProcessType == Interactive
+		spawn_interactive:1,
+		// man launchd.plist --> ProcessType == Background
+		spawn_background:1,
+		// The job is waiting for the spawn scheduler to start it.
+		spawn_sched_queued:1,
+		// The job holds one of the spawn scheduler's slots.
+		spawn_sched_slot:1;
 
 	const char label[0];
 };
 
-static size_t hash_label(const char *label) __attribute__((pure));
-static size_t hash_ms(const char *msstr) __attribute__((pure));
-static SLIST_HEAD(, job_s) s_curious_jobs;
+static void label_hash_init(struct label_hash *lh);
+static void label_hash_destroy(struct label_hash *lh);
+static void label_hash_insert(struct label_hash *lh, job_t j);
+static void label_hash_remove(job_t j);
+static void label_hash_migrate(struct label_hash *lh, size_t nbuckets);
+
+#define SEMAPHORE_WATCH_HASH_SIZE 64
+static LIST_HEAD(, semaphoreitem) s_semaphore_watchers[SEMAPHORE_WATCH_HASH_SIZE];
+static unsigned int s_semaphore_watch_pass;
+static void semaphore_watchers_bind(job_t j);
+static void semaphore_watchers_unbind(job_t j);
+
+static LIST_HEAD(, job_s) s_keepalive_subscribers[KEEPALIVE_EVENT_CNT];
+static size_t s_keepalive_subscriber_cnt[KEEPALIVE_EVENT_CNT];
+static uint64_t s_keepalive_event_cnt;
+static uint64_t s_keepalive_dispatch_cnt;
+static void job_subscribe(job_t j, keepalive_event_t ev);
+static void job_unsubscribe(job_t j, keepalive_event_t ev);
+
+/* Job launches, split by whether launchd spawned the program itself or had to
+ * fork a copy of itself to set the job up. Times are in opaque units.
+ */
+static uint64_t s_spawn_direct_cnt;
+static uint64_t s_spawn_direct_time;
+static uint64_t s_spawn_fork_cnt;
+static uint64_t s_spawn_fork_time;
+
+#define SPAWN_HELPER_MAX_MSG (256 * 1024)
+
+#define SPAWN_HELPER_SETNICE			0x0001
+#define SPAWN_HELPER_SETMASK			0x0002
+#define SPAWN_HELPER_INETCOMPAT			0x0004
+#define SPAWN_HELPER_SESSION_CREATE		0x0008
+#define SPAWN_HELPER_LOW_PRI_IO			0x0010
+#define SPAWN_HELPER_NO_INIT_GROUPS		0x0020
+#define SPAWN_HELPER_GLOBARGV			0x0040
+#define SPAWN_HELPER_WAIT4DEBUGGER		0x0080
+#define SPAWN_HELPER_LEGACY_LS_JOB		0x0100
+#define SPAWN_HELPER_DISABLE_ASLR		0x0200
+#define SPAWN_HELPER_APP				0x0400
+#define SPAWN_HELPER_JETSAM_PROPERTIES	0x0800
+#define SPAWN_HELPER_TRUSTED_FD			0x1000
+#define SPAWN_HELPER_STDIN_FD			0x2000
+#define SPAWN_HELPER_CRED				0x4000
+#define SPAWN_HELPER_ENVP_SESSIONID		0x8000
+
+/* A request to the spawn helper. It is followed by shm_len bytes holding, in
+ * order: the label, program, arguments and environment, the user, group, root
+ * and working directories, the standard I/O paths and the sandbox profile as
+ * strings, then the resource limits, binary preferences and quarantine data,
+ * and the credentials launchd resolved for the job, if any. The descriptors
+ * for the uncork socket, the trusted socket and standard input ride along, in
+ * that order.
+ */
+struct spawn_helper_msg_s {
+	uint64_t shm_seq;
+	uint64_t shm_seatbelt_flags;
+	uint32_t shm_len;
+	uint32_t shm_flags;
+	uint32_t shm_argc;
+	uint32_t shm_envc;
+	uint32_t shm_limit_cnt;
+	uint32_t shm_binpref_cnt;
+	uint32_t shm_quarantine_sz;
+	uint32_t shm_pstype;
+	uid_t shm_mach_uid;
+	mode_t shm_mask;
+	int32_t shm_nice;
+	int32_t shm_jetsam_priority;
+	int32_t shm_jetsam_memlimit;
+	int32_t shm_main_thread_priority;
+};
+
+struct spawn_helper_limit_s {
+	struct rlimit shl_lim;
+	int32_t shl_which;
+	uint32_t shl_setsoft:1, shl_sethard:1;
+};
+
+// Followed by the login name, home directory and shell as strings.
+struct spawn_helper_cred_s {
+	int64_t shc_expire;
+	uid_t shc_uid;
+	gid_t shc_gid;
+	int32_t shc_ngroups;
+	int32_t shc_groups[NGROUPS];
+};
+
+struct spawn_helper_reply_s {
+	uint64_t shr_seq;
+	pid_t shr_pid;
+	int shr_errno;
+};
+
+/* A request we gave up on while the helper was still working on it. The
+ * helper may already have forked the job, so we hold on to the sequence
+ * number until the reply shows up and reap whatever PID it carries.
+ */
+struct spawn_helper_orphan_s {
+	SLIST_ENTRY(spawn_helper_orphan_s) sho_sle;
+	uint64_t sho_seq;
+};
+
+struct spawn_helper_buf_s {
+	char *sb_buf;
+	size_t sb_len;
+	size_t sb_size;
+	bool sb_failed;
+};
+
+static int s_spawn_helper_fd = -1;
+static pid_t s_spawn_helper_pid;
+static uint64_t s_spawn_helper_seq;
+static LIST_HEAD(, job_s) s_spawn_helper_pending;
+static SLIST_HEAD(, spawn_helper_orphan_s) s_spawn_helper_orphans;
+static size_t s_spawn_helper_inflight;
+static size_t s_spawn_helper_inflight_max;
+static uint64_t s_spawn_helper_cnt;
+static uint64_t s_spawn_helper_time;
+static void spawn_helper_callback(void *obj, struct kevent *kev);
+static kq_callback kqspawn_helper_callback = spawn_helper_callback;
+static bool spawn_helper_start(void);
+static void spawn_helper_stop(void);
+static bool spawn_helper_drain(void);
+static void spawn_helper_reap_orphan(pid_t p);
+static void spawn_helper_main(int fd) __attribute__((noreturn));
+static void spawn_helper_put(struct spawn_helper_buf_s *sb, const void *p, size_t sz);
+static void spawn_helper_put_str(struct spawn_helper_buf_s *sb, const char *s);
+static ssize_t spawn_helper_send(int fd, struct spawn_helper_msg_s *shm, const void *body, size_t body_len, int *fds, int fd_cnt);
+static bool spawn_helper_read(int fd, void *buf, size_t len);
+static void *spawn_helper_get(struct spawn_helper_buf_s *sb, size_t sz);
+static char *spawn_helper_get_str(struct spawn_helper_buf_s *sb);
+static job_t spawn_helper_decode(struct spawn_helper_msg_s *shm, struct spawn_helper_buf_s *sb, char ***envpp);
+static void spawn_helper_free(job_t j);
+static pid_t spawn_helper_fork(job_t j, char **envp, int *fds, uint32_t flags);
+
+/* Who jobs run as, looked up by launchd ahead of the fork(2) so that the child
+ * need not go to Directory Services for every job with a UserName or GroupName.
+ * Entries go stale after USERCRED_TTL seconds, and SIGHUP throws all of them
+ * away. Lookups that fail are not cached; the child then looks the account up
+ * itself and reports the failure, just as it always has.
+ */
+#define USERCRED_TTL 60
+
+struct usercred_s {
+	LIST_ENTRY(usercred_s) uc_sle;
+	uint64_t uc_resolved;
+	time_t uc_expire;
+	uid_t uc_uid;
+	gid_t uc_gid;
+	// What we were asked for; uc_key is NULL for lookups by UID.
+	const char *uc_key;
+	uid_t uc_key_uid;
+	const char *uc_login;
+	const char *uc_dir;
+	const char *uc_shell;
+	// The supplementary groups for uc_groups_gid, or -1 if the child has to
+	// look them up itself.
+	int uc_ngroups;
+	gid_t uc_groups_gid;
+	int uc_groups[NGROUPS];
+	char uc_strings[0];
+};
+
+struct groupcred_s {
+	LIST_ENTRY(groupcred_s) gc_sle;
+	uint64_t gc_resolved;
+	gid_t gc_gid;
+	char gc_name[0];
+};
+
+static LIST_HEAD(, usercred_s) s_usercreds;
+static LIST_HEAD(, groupcred_s) s_groupcreds;
+static size_t s_usercred_cnt;
+static uint64_t s_usercred_hits;
+static uint64_t s_usercred_misses;
+static uint64_t s_usercred_flushes;
+static struct usercred_s *usercred_lookup(const char *name, uid_t uid);
+static bool usercred_groups(struct usercred_s *uc, gid_t gid);
+static bool groupcred_lookup(const char *name, gid_t *gid);
+static bool usercred_stale(uint64_t resolved);
+static void usercred_search_local(bool local);
+static void usercred_flush(void);
+
+/* Jobs that come due on their own (RunAtLoad, KeepAlive and the like) are
+ * started at most launchd_spawn_concurrency at a time, so that loading a pile
+ * of jobs at once doesn't have all of them fighting over the CPU and disk. A
+ * job holds its slot until it checks in, exits or has had SPAWN_SCHED_SETTLE
+ * seconds to check in; a job with nothing to check in gives it up once it has
+ * exec(3)ed. The rest wait in a queue per class, and the classes are served in
+ * order, so that the jobs others are waiting on come up first. Demand launches
+ * never wait, but they do take up a slot.
+ */
+#define SPAWN_SCHED_SETTLE 3
+
+typedef enum {
+	// ProcessType Interactive, and apps.
+	SPAWN_CLASS_INTERACTIVE,
+	// Anything with MachServices or Sockets that others may be waiting on.
+	SPAWN_CLASS_IPC,
+	SPAWN_CLASS_STANDARD,
+	// ProcessType Background, and LowPriorityIO.
+	SPAWN_CLASS_BACKGROUND,
+	SPAWN_CLASS_CNT,
+} spawn_class_t;
+
+static const char *const s_spawn_class_names[SPAWN_CLASS_CNT] = {
+	"Interactive",
+	"IPC",
+	"Standard",
+	"Background",
+};
+static TAILQ_HEAD(, job_s) s_spawn_sched_queue[SPAWN_CLASS_CNT] = {
+	TAILQ_HEAD_INITIALIZER(s_spawn_sched_queue[SPAWN_CLASS_INTERACTIVE]),
+	TAILQ_HEAD_INITIALIZER(s_spawn_sched_queue[SPAWN_CLASS_IPC]),
+	TAILQ_HEAD_INITIALIZER(s_spawn_sched_queue[SPAWN_CLASS_STANDARD]),
+	TAILQ_HEAD_INITIALIZER(s_spawn_sched_queue[SPAWN_CLASS_BACKGROUND]),
+};
+static size_t s_spawn_sched_inflight;
+static size_t s_spawn_sched_inflight_max;
+static size_t s_spawn_sched_depth;
+static size_t s_spawn_sched_depth_max;
+static bool s_spawn_sched_drain_armed;
+static uint64_t s_spawn_sched_settle_cnt;
+// Per class, for the jobs that had to wait. Times are in opaque units.
+static uint64_t s_spawn_sched_wait_cnt[SPAWN_CLASS_CNT];
+static uint64_t s_spawn_sched_wait_time[SPAWN_CLASS_CNT];
+static uint64_t s_spawn_sched_wait_max[SPAWN_CLASS_CNT];
+static void spawn_sched_drain(void);
 
 #define job_assumes(j, e) osx_assumes_ctx(job_log_bug, j, (e))
 #define job_assumes_zero(j, e) osx_assumes_zero_ctx(job_log_bug, j, (e))
@@ -722,21 +1152,51 @@ static void job_watch(job_t j);
 static void job_ignore(job_t j);
 static void job_reap(job_t j);
 static bool job_useless(job_t j);
+static bool job_dispatch_check(job_t j);
 static bool job_keepalive(job_t j);
-static void job_dispatch_curious_jobs(job_t j);
+static void job_gc_mark(job_t j);
+static void job_gc_forget(job_t j);
+static void job_gc_count(job_t j, bool count);
+static void job_collect(job_t j);
+static void job_dispatch_watchers(job_t j, bool activity);
 static void job_start(job_t j);
+static spawn_class_t job_spawn_class(job_t j);
+static void job_spawn_sched_start(job_t j, bool kickstart);
+static void job_spawn_sched_dequeue(job_t j);
+static void job_spawn_sched_claim(job_t j);
+static void job_spawn_sched_release(job_t j);
 static void job_start_child(job_t j) __attribute__((noreturn));
+static void job_start_parent(job_t j, pid_t c, int ipc_fd, bool did_exec);
+static bool job_spawn_helper_submit(job_t j, int *spair);
+static void job_spawn_helper_done(job_t j, pid_t c, int error);
+static void job_spawn_helper_cancel(job_t j);
+static void job_spawn_helper_close(job_t j);
+static const char *job_needs_fork(job_t j);
+static pid_t job_spawn(job_t j, int trusted_fd);
+static void job_did_exec(job_t j);
+static bool job_setup_argv(job_t j, glob_t *g, const char ***argvp, const char **file2exec);
+static void job_free_argv(job_t j, glob_t *g, const char **argv);
+static void job_setup_spawnattr(job_t j, posix_spawnattr_t *spattr, short spflags);
+static char **job_setup_envp(job_t j, size_t *cnt);
+static char **job_envp(job_t j);
+static void job_envp_flush(job_t j);
 static void job_setup_attributes(job_t j);
 static bool job_setup_machport(job_t j);
+static void job_mig_port_add(job_t j);
+static void job_mig_port_del(job_t j);
 static kern_return_t job_setup_exit_port(job_t j);
 static void job_setup_fd(job_t j, int target_fd, const char *path, int flags);
+static int job_open_fd(job_t j, const char *path, int flags);
+static void job_resolve_cred(job_t j);
 static void job_postfork_become_user(job_t j);
 static void job_postfork_test_user(job_t j);
 static void job_log_pids_with_weird_uids(job_t j);
 static void job_setup_exception_port(job_t j, task_t target_task);
+static bool job_exception_port(job_t j, mach_port_t *port, thread_state_flavor_t *f);
 static void job_callback(void *obj, struct kevent *kev);
 static void job_callback_proc(job_t j, struct kevent *kev);
 static void job_callback_timer(job_t j, void *ident);
+static void job_arm_start_interval(job_t j);
 static void job_callback_read(job_t j, int ident);
 static void job_log_stray_pg(job_t j);
 static void job_log_children_without_exec(job_t j);
@@ -774,13 +1234,6 @@ static const struct {
 	{ LAUNCH_JOBKEY_RESOURCELIMIT_STACK,	RLIMIT_STACK	},
 };
 
-static time_t cronemu(int mon, int mday, int hour, int min);
-static time_t cronemu_wday(int wday, int hour, int min);
-static bool cronemu_mon(struct tm *wtm, int mon, int mday, int hour, int min);
-static bool cronemu_mday(struct tm *wtm, int mday, int hour, int min);
-static bool cronemu_hour(struct tm *wtm, int hour, int min);
-static bool cronemu_min(struct tm *wtm, int min);
-
 // miscellaneous file local functions
 static size_t get_kern_max_proc(void);
 static char **mach_cmd2argv(const char *string);
@@ -933,16 +1386,14 @@ job_stop(job_t j)
 			 * job's MachServices back, so we cannot safely respawn it.
 			 */
 			if (j->mgr->shutting_down) {
-				error = kevent_mod((uintptr_t)&j->exit_timeout, EVFILT_TIMER, EV_ADD|EV_ONESHOT, NOTE_SECONDS, LAUNCHD_SIGKILL_TIMER, j);
-				(void)job_assumes_zero_p(j, error);
+				runtime_timer_arm(&j->exit_timeout_timer, (uintptr_t)&j->exit_timeout, LAUNCHD_SIGKILL_TIMER, 0, j);
 			}
 
 			job_log(j, LOG_DEBUG | LOG_CONSOLE, "Sent job SIGKILL.");
 			break;
 		case SIGTERM:
 			if (j->exit_timeout) {
-				error = kevent_mod((uintptr_t)&j->exit_timeout, EVFILT_TIMER, EV_ADD|EV_ONESHOT, NOTE_SECONDS, j->exit_timeout, j);
-				(void)job_assumes_zero_p(j, error);
+				runtime_timer_arm(&j->exit_timeout_timer, (uintptr_t)&j->exit_timeout, j->exit_timeout, 0, j);
 			} else {
 				job_log(j, LOG_NOTICE, "This job has an infinite exit timeout");
 			}
@@ -996,15 +1447,7 @@ job_export(job_t j)
 	if (j->stderrpath && (tmp = launch_data_new_string(j->stderrpath))) {
 		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_STANDARDERRORPATH);
 	}
-	if (likely(j->argv) && (tmp = launch_data_alloc(LAUNCH_DATA_ARRAY))) {
-		size_t i;
-
-		for (i = 0; i < j->argc; i++) {
-			if ((tmp2 = launch_data_new_string(j->argv[i]))) {
-				launch_data_array_set_index(tmp, tmp2, i);
-			}
-		}
-
+	if (likely(j->argv) && (tmp = job_export_argv(j))) {
 		launch_data_dict_insert(r, tmp, LAUNCH_JOBKEY_PROGRAMARGUMENTS);
 	}
 
@@ -1071,6 +1514,40 @@ job_export(job_t j)
 	return r;
 }
 
+launch_data_t
+job_export_argv(job_t j)
+{
+	launch_data_arena_t arena = launch_data_arena_set_current(NULL);
+	launch_data_t r, tmp;
+	size_t i;
+
+	/* A job's arguments never change once it is created, so every heap export
+	 * shares one array by reference. Arena exports are thrown away without
+	 * walking their children and would leak the reference, so they still get
+	 * a copy of their own.
+	 */
+	if (!arena && j->argv_export) {
+		return launch_data_retain(j->argv_export);
+	}
+
+	launch_data_arena_set_current(arena);
+	if (!(r = launch_data_alloc(LAUNCH_DATA_ARRAY))) {
+		return NULL;
+	}
+
+	for (i = 0; i < j->argc; i++) {
+		if ((tmp = launch_data_new_string(j->argv[i]))) {
+			launch_data_array_set_index(r, tmp, i);
+		}
+	}
+
+	if (!arena) {
+		j->argv_export = launch_data_retain(r);
+	}
+
+	return r;
+}
+
 static void
 jobmgr_log_active_jobs(jobmgr_t jm)
 {
@@ -1150,12 +1627,16 @@ jobmgr_shutdown(jobmgr_t jm)
 	}
 
 	jm->shutting_down = true;
+	jm->shutdown_began = runtime_get_opaque_time();
+	jobmgr_gc_queue(jm, true);
 
 	SLIST_FOREACH_SAFE(jmi, &jm->submgrs, sle, jmn) {
 		jobmgr_shutdown(jmi);
 	}
 
 	if (!jm->parentmgr) {
+		spawn_helper_stop();
+
 		if (pid1_magic) {
 			// Spawn the shutdown monitor.
 			if (_launchd_shutdown_monitor && !_launchd_shutdown_monitor->p) {
@@ -1188,6 +1669,9 @@ jobmgr_remove(jobmgr_t jm)
 	}
 
 	while ((ji = LIST_FIRST(&jm->jobs))) {
+		if (ji->spawn_helper_pending) {
+			job_spawn_helper_cancel(ji);
+		}
 		if (!ji->anonymous && ji->p != 0) {
 			job_log(ji, LOG_ERR, "Job is still active at job manager teardown.");
 			ji->p = 0;
@@ -1198,6 +1682,7 @@ jobmgr_remove(jobmgr_t jm)
 	if (jm->req_port) {
 		(void)jobmgr_assumes_zero(jm, launchd_mport_deallocate(jm->req_port));
 	}
+	jobmgr_mig_port_del(jm);
 	if (jm->jm_port) {
 		(void)jobmgr_assumes_zero(jm, launchd_mport_close_recv(jm->jm_port));
 	}
@@ -1241,9 +1726,24 @@ jobmgr_remove(jobmgr_t jm)
 		jobmgr_log(jm, LOG_DEBUG, "Job manager shutdown took approximately %ld second%s.", delta, (delta != 1) ? "s" : "");
 	}
 
+	if (jm->shutdown_drained) {
+		uint64_t now = runtime_get_opaque_time();
+
+		jobmgr_log(jm, LOG_PERF, "Shutdown phases: jobs %llu ms, dirty-at-shutdown jobs and submanagers %llu ms, shutdown monitor %llu ms",
+				runtime_opaque_time_to_nano(jm->shutdown_jobs_exited - jm->shutdown_began) / NSEC_PER_MSEC,
+				runtime_opaque_time_to_nano(jm->shutdown_drained - jm->shutdown_jobs_exited) / NSEC_PER_MSEC,
+				runtime_opaque_time_to_nano(now - jm->shutdown_drained) / NSEC_PER_MSEC);
+	}
+
+	if (jm->gc_queued) {
+		LIST_REMOVE(jm, gc_sle);
+		jm->gc_queued = false;
+	}
+
 	if (jm->parentmgr) {
 		runtime_del_weak_ref();
 		SLIST_REMOVE(&jm->parentmgr->submgrs, jm, jobmgr_s, sle);
+		jobmgr_gc_queue(jm->parentmgr, false);
 	} else if (pid1_magic) {
 		eliminate_double_reboot();
 		launchd_log_vm_stats();
@@ -1257,6 +1757,8 @@ jobmgr_remove(jobmgr_t jm)
 		exit(EXIT_SUCCESS);
 	}
 
+	label_hash_destroy(&jm->label_hash);
+	machservice_hash_destroy(&jm->ms_hash);
 	free(jm);
 }
 
@@ -1281,7 +1783,8 @@ job_remove(job_t j)
 		}
 
 		LIST_REMOVE(j, sle);
-		LIST_REMOVE(j, label_hash_sle);
+		label_hash_remove(j);
+		job_gc_forget(j);
 		free(j);
 		return;
 	}
@@ -1314,7 +1817,7 @@ job_remove(job_t j)
 		j->former_subjob = true;
 	}
 
-	if (unlikely(j->p)) {
+	if (unlikely(j->p || j->spawn_helper_pending)) {
 		if (j->anonymous) {
 			job_reap(j);
 		} else {
@@ -1331,7 +1834,7 @@ job_remove(job_t j)
 
 	if (!j->removing) {
 		j->removing = true;
-		job_dispatch_curious_jobs(j);
+		job_dispatch_watchers(j, false);
 	}
 
 	ipc_close_all_with_job(j);
@@ -1348,6 +1851,7 @@ job_remove(job_t j)
 		(void)posix_assumes_zero(runtime_close(j->stdin_fd));
 	}
 
+	job_mig_port_del(j);
 	if (j->j_port) {
 		(void)job_assumes_zero(j, launchd_mport_close_recv(j->j_port));
 	}
@@ -1364,6 +1868,7 @@ job_remove(job_t j)
 	while ((ei = SLIST_FIRST(&j->global_env))) {
 		envitem_delete(j, ei, true);
 	}
+	job_envp_flush(j);
 	while ((li = SLIST_FIRST(&j->limits))) {
 		limititem_delete(j, li);
 	}
@@ -1373,6 +1878,7 @@ job_remove(job_t j)
 	while ((si = SLIST_FIRST(&j->semaphores))) {
 		semaphoreitem_delete(j, si);
 	}
+	job_unsubscribe(j, KEEPALIVE_EVENT_MOUNT);
 	while ((w4r = SLIST_FIRST(&j->removal_watchers))) {
 		waiting4removal_delete(j, w4r);
 	}
@@ -1395,6 +1901,9 @@ job_remove(job_t j)
 	if (j->argv) {
 		free(j->argv);
 	}
+	if (j->argv_export) {
+		launch_data_free(j->argv_export);
+	}
 	if (j->rootdir) {
 		free(j->rootdir);
 	}
@@ -1434,14 +1943,9 @@ job_remove(job_t j)
 	}
 	if (j->start_interval) {
 		runtime_del_weak_ref();
-		(void)job_assumes_zero_p(j, kevent_mod((uintptr_t)&j->start_interval, EVFILT_TIMER, EV_DELETE, 0, 0, NULL));
-	}
-	if (j->exit_timeout) {
-		/* If this fails, it just means the timer's already fired, so no need to
-		 * wrap it in an assumes() macro.
-		 */
-		(void)kevent_mod((uintptr_t)&j->exit_timeout, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
 	}
+	runtime_timer_disarm(&j->start_interval_timer);
+	runtime_timer_disarm(&j->exit_timeout_timer);
 	if (j->asport != MACH_PORT_NULL) {
 		(void)job_assumes_zero(j, launchd_mport_deallocate(j->asport));
 	}
@@ -1455,10 +1959,12 @@ job_remove(job_t j)
 		_launchd_shutdown_monitor = NULL;
 	}
 
-	(void)kevent_mod((uintptr_t)j, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+	runtime_timer_disarm(&j->respawn_timer);
+	job_spawn_sched_dequeue(j);
+	job_spawn_sched_release(j);
 
 	LIST_REMOVE(j, sle);
-	LIST_REMOVE(j, label_hash_sle);
+	label_hash_remove(j);
 
 	job_t ji = NULL;
 	job_t jit = NULL;
@@ -1466,6 +1972,7 @@ job_remove(job_t j)
 		job_remove(ji);
 	}
 
+	job_gc_forget(j);
 	job_log(j, LOG_DEBUG, "Removed");
 
 	j->kqjob_callback = (kq_callback)0x8badf00d;
@@ -1517,7 +2024,7 @@ job_set_global_on_demand(job_t j, bool val)
 	}
 
 	if (j->mgr->global_on_demand_cnt == 0) {
-		jobmgr_dispatch_all(j->mgr, false);
+		jobmgr_dispatch_all(j->mgr);
 	}
 
 	return true;
@@ -1539,6 +2046,8 @@ job_setup_machport(job_t j)
 		goto out_bad;
 	}
 
+	job_mig_port_add(j);
+
 	return true;
 out_bad2:
 	(void)job_assumes_zero(j, launchd_mport_close_recv(j->j_port));
@@ -1696,7 +2205,7 @@ job_new_anonymous(jobmgr_t jm, pid_t anonpid)
 		jr->p = anonpid;
 
 		// Anonymous process reaping is messy.
-		LIST_INSERT_HEAD(&jm->active_jobs[ACTIVE_JOB_HASH(jr->p)], jr, pid_hash_sle);
+		job_pid_hash_insert(jr);
 
 		if (unlikely(kevent_mod(jr->p, EVFILT_PROC, EV_ADD, proc_fflags, 0, root_jobmgr) == -1)) {
 			if (errno != ESRCH) {
@@ -1776,6 +2285,8 @@ job_new_subjob(job_t j, uuid_t identifier)
 		nj->ondemand = j->ondemand;
 		nj->checkedin = true;
 		nj->low_pri_io = j->low_pri_io;
+		nj->spawn_interactive = j->spawn_interactive;
+		nj->spawn_background = j->spawn_background;
 		nj->setmask = j->setmask;
 		nj->wait4debugger = j->wait4debugger;
 		nj->internal_exc_handler = j->internal_exc_handler;
@@ -1916,7 +2427,7 @@ job_new_subjob(job_t j, uuid_t identifier)
 		if (j->mgr->properties & BOOTSTRAP_PROPERTY_XPC_DOMAIN) {
 			where2put = j->mgr;
 		}
-		LIST_INSERT_HEAD(&where2put->label_hash[hash_label(nj->label)], nj, label_hash_sle);
+		label_hash_insert(&where2put->label_hash, nj);
 		LIST_INSERT_HEAD(&j->subjobs, nj, subjob_sle);
 	} else {
 		(void)osx_assumes_zero(errno);
@@ -2056,12 +2567,13 @@ job_new(jobmgr_t jm, const char *label, const char *prog, const char *const *arg
 	}
 
 	LIST_INSERT_HEAD(&jm->jobs, j, sle);
+	job_gc_mark(j);
 
 	jobmgr_t where2put_label = root_jobmgr;
 	if (j->mgr->properties & BOOTSTRAP_PROPERTY_XPC_DOMAIN) {
 		where2put_label = j->mgr;
 	}
-	LIST_INSERT_HEAD(&where2put_label->label_hash[hash_label(j->label)], j, label_hash_sle);
+	label_hash_insert(&where2put_label->label_hash, j);
 	uuid_clear(j->expected_audit_uuid);
 
 	job_log(j, LOG_DEBUG, "Conceived");
@@ -2093,7 +2605,7 @@ job_new_alias(jobmgr_t jm, job_t src)
 
 	(void)strcpy((char *)j->label, src->label);
 	LIST_INSERT_HEAD(&jm->jobs, j, sle);
-	LIST_INSERT_HEAD(&jm->label_hash[hash_label(j->label)], j, label_hash_sle);
+	label_hash_insert(&jm->label_hash, j);
 	/* Bad jump address. The kqueue callback for aliases should never be
 	 * invoked.
 	 */
@@ -2133,7 +2645,7 @@ job_import(launch_data_t pload)
 	 * job "enabled" as far as other jobs with the OtherJobEnabled KeepAlive
 	 * criterion set.
 	 */
-	job_dispatch_curious_jobs(j);
+	job_dispatch_watchers(j, false);
 	return job_dispatch(j, false);
 }
 
@@ -2155,7 +2667,7 @@ job_import_bulk(launch_data_t pload)
 
 	for (i = 0; i < c; i++) {
 		if (likely(ja[i])) {
-			job_dispatch_curious_jobs(ja[i]);
+			job_dispatch_watchers(ja[i], false);
 			job_dispatch(ja[i], false);
 		}
 	}
@@ -2224,7 +2736,11 @@ job_import_bool(job_t j, const char *key, bool value)
 			j->session_create = value;
 			found_key = true;
 		} else if (strcasecmp(key, LAUNCH_JOBKEY_STARTONMOUNT) == 0) {
-			j->start_on_mount = value;
+			if ((j->start_on_mount = value)) {
+				job_subscribe(j, KEEPALIVE_EVENT_MOUNT);
+			} else {
+				job_unsubscribe(j, KEEPALIVE_EVENT_MOUNT);
+			}
 			found_key = true;
 		} else if (strcasecmp(key, LAUNCH_JOBKEY_SERVICEIPC) == 0) {
 			// this only does something on Mac OS X 10.4 "Tiger"
@@ -2372,22 +2888,27 @@ job_import_string(job_t j, const char *key, const char *value)
 #if !TARGET_OS_EMBEDDED
 				j->pstype = POSIX_SPAWN_OSX_TALAPP_START;
 #endif
+				j->spawn_interactive = true;
 			} else if (strcasecmp(value, LAUNCH_KEY_POSIXSPAWNTYPE_WIDGET) == 0) {
 #if !TARGET_OS_EMBEDDED
 				j->pstype = POSIX_SPAWN_OSX_DBCLIENT_START;
 #endif
+				j->spawn_interactive = true;
 			} else if (strcasecmp(value, LAUNCH_KEY_POSIXSPAWNTYPE_IOSAPP) == 0) {
 #if TARGET_OS_EMBEDDED
 				j->pstype = POSIX_SPAWN_IOS_APP_START;
 #endif
+				j->spawn_interactive = true;
 			} else if (strcasecmp(value, LAUNCH_KEY_POSIXSPAWNTYPE_INTERACTIVE) == 0) {
 #if TARGET_OS_EMBEDDED
 				j->pstype = POSIX_SPAWN_IOS_INTERACTIVE;
 #endif
+				j->spawn_interactive = true;
 			} else if (strcasecmp(value, LAUNCH_KEY_POSIXSPAWNTYPE_BACKGROUND) == 0) {
 #if TARGET_OS_EMBEDDED
 				j->pstype = POSIX_SPAWN_IOS_APPLE_DAEMON_START;
 #endif
+				j->spawn_background = true;
 			} else if (strcasecmp(value, "Adaptive") == 0) {
 				// Hack.
 			} else {
@@ -2577,7 +3098,18 @@ job_import_integer(job_t j, const char *key, long long value)
 				runtime_add_weak_ref();
 				j->start_interval = (typeof(j->start_interval)) value;
 
-				(void)job_assumes_zero_p(j, kevent_mod((uintptr_t)&j->start_interval, EVFILT_TIMER, EV_ADD, NOTE_SECONDS, j->start_interval, j));
+				job_arm_start_interval(j);
+			}
+		} else if (strcasecmp(key, LAUNCH_JOBKEY_STARTINTERVALJITTER) == 0) {
+			if (unlikely(value < 0)) {
+				job_log(j, LOG_WARNING, "%s less than zero. Ignoring.", LAUNCH_JOBKEY_STARTINTERVALJITTER);
+			} else if (unlikely(value > UINT32_MAX)) {
+				job_log(j, LOG_WARNING, "%s is too large. Ignoring.", LAUNCH_JOBKEY_STARTINTERVALJITTER);
+			} else {
+				j->start_interval_jitter = (typeof(j->start_interval_jitter)) value;
+				if (j->start_interval) {
+					job_arm_start_interval(j);
+				}
 			}
 #if HAVE_SANDBOX
 		} else if (strcasecmp(key, LAUNCH_JOBKEY_SANDBOXFLAGS) == 0) {
@@ -3048,46 +3580,75 @@ jobmgr_label_test(jobmgr_t jm, const char *str)
 job_t 
 job_find(jobmgr_t jm, const char *label)
 {
+	struct label_hash *lh;
+	size_t h = our_strhash(label);
 	job_t ji;
 
 	if (!jm) {
 		jm = root_jobmgr;
 	}
 
-	LIST_FOREACH(ji, &jm->label_hash[hash_label(label)], label_hash_sle) {
+	lh = &jm->label_hash;
+	if (unlikely(lh->old_buckets != NULL)) {
+		label_hash_migrate(lh, LABEL_HASH_MIGRATE);
+	}
+
+	LIST_FOREACH(ji, &lh->buckets[h & (lh->size - 1)], label_hash_sle) {
 		if (unlikely(ji->removal_pending || ji->mgr->shutting_down)) {
 			// 5351245 and 5488633 respectively
 			continue;
 		}
 
-		if (strcmp(ji->label, label) == 0) {
+		if (ji->label_hashval == h && strcmp(ji->label, label) == 0) {
 			return ji;
 		}
 	}
 
+	// While the table is growing, the label may not have been moved yet.
+	if (lh->old_buckets) {
+		LIST_FOREACH(ji, &lh->old_buckets[h & (lh->old_size - 1)], label_hash_sle) {
+			if (unlikely(ji->removal_pending || ji->mgr->shutting_down)) {
+				continue;
+			}
+
+			if (ji->label_hashval == h && strcmp(ji->label, label) == 0) {
+				return ji;
+			}
+		}
+	}
+
 	errno = ESRCH;
 	return NULL;
 }
 
-// Should try and consolidate with job_mig_intran2() and jobmgr_find_by_pid().
-job_t
-jobmgr_find_by_pid_deep(jobmgr_t jm, pid_t p, bool anon_okay)
+bool
+jobmgr_contains(jobmgr_t jm, jobmgr_t jmi)
 {
-	job_t ji = NULL;
-	LIST_FOREACH(ji, &jm->active_jobs[ACTIVE_JOB_HASH(p)], pid_hash_sle) {
-		if (ji->p == p && (!ji->anonymous || (ji->anonymous && anon_okay))) {
-			return ji;
+	for (; jmi; jmi = jmi->parentmgr) {
+		if (jmi == jm) {
+			return true;
 		}
 	}
 
-	jobmgr_t jmi = NULL;
-	SLIST_FOREACH(jmi, &jm->submgrs, sle) {
-		if ((ji = jobmgr_find_by_pid_deep(jmi, p, anon_okay))) {
-			break;
+	return false;
+}
+
+job_t
+jobmgr_find_by_pid_deep(jobmgr_t jm, pid_t p, bool anon_okay)
+{
+	job_t ji = NULL, found = NULL;
+
+	// Prefer a job in the given job manager over one in a submanager.
+	LIST_FOREACH(ji, &s_pid_hash[PID_HASH(p)], pid_hash_sle) {
+		if (ji->p == p && (!ji->anonymous || anon_okay) && jobmgr_contains(jm, ji->mgr)) {
+			if (ji->mgr == jm) {
+				return ji;
+			}
+			found = found ? found : ji;
 		}
 	}
 
-	return ji;
+	return found;
 }
 
 job_t
@@ -3095,8 +3656,8 @@ jobmgr_find_by_pid(jobmgr_t jm, pid_t p, bool create_anon)
 {
 	job_t ji;
 
-	LIST_FOREACH(ji, &jm->active_jobs[ACTIVE_JOB_HASH(p)], pid_hash_sle) {
-		if (ji->p == p) {
+	LIST_FOREACH(ji, &s_pid_hash[PID_HASH(p)], pid_hash_sle) {
+		if (ji->p == p && ji->mgr == jm) {
 			return ji;
 		}
 	}
@@ -3131,13 +3692,124 @@ job_mig_intran2(jobmgr_t jm, mach_port_t mport, pid_t upid)
 	return NULL;
 }
 
+job_t
+job_mig_intran_port(mach_port_t mport, pid_t upid)
+{
+	struct mig_port_bucket *b = &s_mig_port_hash[MACH_PORT_INDEX(mport) & (s_mig_port_hash_size - 1)];
+	jobmgr_t jmi;
+	job_t ji;
+
+	s_mig_intran_cnt++;
+
+	LIST_FOREACH(jmi, &b->mgrs, mig_port_sle) {
+		if (jmi->jm_port == mport) {
+			return jobmgr_find_by_pid(jmi, upid, true);
+		}
+	}
+
+	LIST_FOREACH(ji, &b->jobs, mig_port_sle) {
+		if (ji->j_port == mport) {
+			return ji;
+		}
+	}
+
+	/* Anything that reaches this point is either not one of our ports or was
+	 * missed by the index. Keep the walk around so that the latter is only a
+	 * performance bug, and count it so that it shows up in the statistics.
+	 */
+	s_mig_intran_slow_cnt++;
+	return job_mig_intran2(root_jobmgr, mport, upid);
+}
+
+void
+mig_port_hash_grow(void)
+{
+	size_t i, nsize = s_mig_port_hash_size * 2;
+	struct mig_port_bucket *nb = calloc(nsize, sizeof(*nb));
+	if (!nb) {
+		return;
+	}
+
+	for (i = 0; i < s_mig_port_hash_size; i++) {
+		jobmgr_t jmi;
+		job_t ji;
+
+		while ((jmi = LIST_FIRST(&s_mig_port_hash[i].mgrs))) {
+			LIST_REMOVE(jmi, mig_port_sle);
+			LIST_INSERT_HEAD(&nb[MACH_PORT_INDEX(jmi->jm_port) & (nsize - 1)].mgrs, jmi, mig_port_sle);
+		}
+		while ((ji = LIST_FIRST(&s_mig_port_hash[i].jobs))) {
+			LIST_REMOVE(ji, mig_port_sle);
+			LIST_INSERT_HEAD(&nb[MACH_PORT_INDEX(ji->j_port) & (nsize - 1)].jobs, ji, mig_port_sle);
+		}
+	}
+
+	if (s_mig_port_hash != s_mig_port_initial) {
+		free(s_mig_port_hash);
+	}
+	s_mig_port_hash = nb;
+	s_mig_port_hash_size = nsize;
+}
+
+void
+jobmgr_mig_port_add(jobmgr_t jm)
+{
+	if (jm->mig_port_hashed || !MACH_PORT_VALID(jm->jm_port)) {
+		return;
+	}
+
+	if (unlikely(s_mig_port_cnt >= s_mig_port_hash_size * 2)) {
+		mig_port_hash_grow();
+	}
+
+	LIST_INSERT_HEAD(&s_mig_port_hash[MACH_PORT_INDEX(jm->jm_port) & (s_mig_port_hash_size - 1)].mgrs, jm, mig_port_sle);
+	jm->mig_port_hashed = true;
+	s_mig_port_cnt++;
+}
+
+void
+jobmgr_mig_port_del(jobmgr_t jm)
+{
+	if (jm->mig_port_hashed) {
+		LIST_REMOVE(jm, mig_port_sle);
+		jm->mig_port_hashed = false;
+		s_mig_port_cnt--;
+	}
+}
+
+void
+job_mig_port_add(job_t j)
+{
+	if (j->mig_port_hashed || !MACH_PORT_VALID(j->j_port)) {
+		return;
+	}
+
+	if (unlikely(s_mig_port_cnt >= s_mig_port_hash_size * 2)) {
+		mig_port_hash_grow();
+	}
+
+	LIST_INSERT_HEAD(&s_mig_port_hash[MACH_PORT_INDEX(j->j_port) & (s_mig_port_hash_size - 1)].jobs, j, mig_port_sle);
+	j->mig_port_hashed = true;
+	s_mig_port_cnt++;
+}
+
+void
+job_mig_port_del(job_t j)
+{
+	if (j->mig_port_hashed) {
+		LIST_REMOVE(j, mig_port_sle);
+		j->mig_port_hashed = false;
+		s_mig_port_cnt--;
+	}
+}
+
 job_t 
 job_mig_intran(mach_port_t p)
 {
 	struct ldcred *ldc = runtime_get_caller_creds();
 	job_t jr;
 
-	jr = job_mig_intran2(root_jobmgr, p, ldc->pid);
+	jr = job_mig_intran_port(p, ldc->pid);
 
 	if (!jr) {
 		struct proc_bsdshortinfo proc;
@@ -3156,15 +3828,9 @@ job_mig_intran(mach_port_t p)
 job_t
 job_find_by_service_port(mach_port_t p)
 {
-	struct machservice *ms;
-
-	LIST_FOREACH(ms, &port_hash[HASH_PORT(p)], port_hash_sle) {
-		if (ms->recv && (ms->port == p)) {
-			return ms->job;
-		}
-	}
+	struct machservice *ms = machservice_hash_find_recv(p);
 
-	return NULL;
+	return ms ? ms->job : NULL;
 }
 
 void
@@ -3272,6 +3938,8 @@ job_reap(job_t j)
 
 	job_log(j, LOG_DEBUG, "Reaping");
 
+	job_spawn_sched_release(j);
+
 	if (unlikely(j->weird_bootstrap)) {
 		int64_t junk = 0;
 		job_mig_swap_integer(j, VPROC_GSK_WEIRD_BOOTSTRAP, 0, 0, &junk);
@@ -3348,11 +4016,9 @@ job_reap(job_t j)
 		}
 	}
 
-	if (j->exit_timeout) {
-		(void)kevent_mod((uintptr_t)&j->exit_timeout, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
-	}
+	runtime_timer_disarm(&j->exit_timeout_timer);
 
-	LIST_REMOVE(j, pid_hash_sle);
+	job_pid_hash_remove(j);
 
 	if (j->sent_signal_time) {
 		uint64_t td_sec, td_usec, td = runtime_get_nanoseconds_since(j->sent_signal_time);
@@ -3564,10 +4230,13 @@ job_reap(job_t j)
 	j->clean_kill = false;
 	j->event_monitor_ready2signal = false;
 	j->p = 0;
+
+	job_gc_mark(j);
+	job_dispatch_watchers(j, true);
 }
 
 void
-jobmgr_dispatch_all(jobmgr_t jm, bool newmounthack)
+jobmgr_dispatch_all(jobmgr_t jm)
 {
 	jobmgr_t jmi, jmn;
 	job_t ji, jn;
@@ -3577,50 +4246,65 @@ jobmgr_dispatch_all(jobmgr_t jm, bool newmounthack)
 	}
 
 	SLIST_FOREACH_SAFE(jmi, &jm->submgrs, sle, jmn) {
-		jobmgr_dispatch_all(jmi, newmounthack);
+		jobmgr_dispatch_all(jmi);
 	}
 
 	LIST_FOREACH_SAFE(ji, &jm->jobs, sle, jn) {
-		if (newmounthack && ji->start_on_mount) {
-			ji->start_pending = true;
-		}
-
 		job_dispatch(ji, false);
 	}
 }
 
+/* Dispatch the jobs with an OtherJob KeepAlive criterion on j. Enabling and
+ * disabling wake the OtherJobEnabled watchers, starting and exiting wake the
+ * OtherJobActive ones.
+ */
 void
-job_dispatch_curious_jobs(job_t j)
-{	
-	job_t ji = NULL, jt = NULL;
-	SLIST_FOREACH_SAFE(ji, &s_curious_jobs, curious_jobs_sle, jt) {
-		struct semaphoreitem *si = NULL;
-		SLIST_FOREACH(si, &ji->semaphores, sle) {			
-			if (!(si->why == OTHER_JOB_ENABLED || si->why == OTHER_JOB_DISABLED)) {
-				continue;
-			}
+job_dispatch_watchers(job_t j, bool activity)
+{
+	struct semaphoreitem *si, *sii;
+	unsigned int pass;
+	job_t ji;
 
-			if (strcmp(si->what, j->label) == 0) {
-				job_log(ji, LOG_DEBUG, "Dispatching out of interest in \"%s\".", j->label);
+	if (!j->label_table) {
+		return;
+	}
 
-				if (!ji->removing) {
-					job_dispatch(ji, false);
-				} else {
-					job_log(ji, LOG_NOTICE, "The following job is circularly dependent upon this one: %s", j->label);
-				}
+	/* Dispatching a watcher may remove it, and with it any of the items in
+	 * this bucket, so start over after each one. The pass number marks the
+	 * items already handled. Nested passes only ever use higher numbers.
+	 */
+	pass = ++s_semaphore_watch_pass;
+again:
+	LIST_FOREACH(si, &s_semaphore_watchers[j->label_hashval & (SEMAPHORE_WATCH_HASH_SIZE - 1)], watch_sle) {
+		if (si->other != j || si->watch_pass >= pass) {
+			continue;
+		}
+		if (activity != (si->why == OTHER_JOB_ACTIVE || si->why == OTHER_JOB_INACTIVE)) {
+			continue;
+		}
 
-				/* ji could be removed here, so don't do anything with it or its semaphores
-				 * after this point.
-				 */
-				break;
+		ji = si->job;
+		SLIST_FOREACH(sii, &ji->semaphores, sle) {
+			if (sii->other == j) {
+				sii->watch_pass = pass;
 			}
 		}
+
+		if (ji == j || ji->removing) {
+			continue;
+		}
+
+		job_log(ji, LOG_DEBUG, "Dispatching out of interest in \"%s\".", j->label);
+		job_dispatch(ji, false);
+		goto again;
 	}
 }
 
 job_t
 job_dispatch(job_t j, bool kickstart)
 {
+	job_gc_mark(j);
+
 	// Don't dispatch a job if it has no audit session set.
 	if (!uuid_is_null(j->expected_audit_uuid)) {
 		job_log(j, LOG_DEBUG, "Job is still awaiting its audit session UUID. Not dispatching.");
@@ -3662,19 +4346,13 @@ job_dispatch(job_t j, bool kickstart)
 	 * This is a classic example. The act of dispatching a job may delete it.
 	 */	
 	if (!job_active(j)) {
-		if (job_useless(j)) {
-			job_log(j, LOG_DEBUG, "Job is useless. Removing.");
-			job_remove(j);
-			return NULL;
-		}
-		if (unlikely(j->per_user && j->peruser_suspend_count > 0)) {
-			job_log(j, LOG_DEBUG, "Per-user launchd is suspended. Not dispatching.");
+		if (!job_dispatch_check(j)) {
 			return NULL;
 		}
 
 		if (kickstart || job_keepalive(j)) {
 			job_log(j, LOG_DEBUG, "%starting job", kickstart ? "Kicks" : "S");
-			job_start(j);
+			job_spawn_sched_start(j, kickstart);
 		} else {
 			job_log(j, LOG_DEBUG, "Watching job.");
 			job_watch(j);
@@ -3686,7 +4364,7 @@ job_dispatch(job_t j, bool kickstart)
 			 * We should clean this up post Leopard.
 			 */
 			if (job_keepalive(j)) {
-				job_start(j);
+				job_spawn_sched_start(j, false);
 			}
 		}
 	} else {
@@ -3706,7 +4384,7 @@ job_kill(job_t j)
 	(void)job_assumes_zero_p(j, kill2(j->p, SIGKILL));
 
 	j->sent_sigkill = true;
-	(void)job_assumes_zero_p(j, kevent_mod((uintptr_t)&j->exit_timeout, EVFILT_TIMER, EV_ADD|EV_ONESHOT, NOTE_SECONDS, LAUNCHD_SIGKILL_TIMER, j));
+	runtime_timer_arm(&j->exit_timeout_timer, (uintptr_t)&j->exit_timeout, LAUNCHD_SIGKILL_TIMER, 0, j);
 
 	job_log(j, LOG_DEBUG, "Sent SIGKILL signal");
 }
@@ -3789,37 +4467,19 @@ job_callback_proc(job_t j, struct kevent *kev)
 
 				job_log(j, LOG_INFO, "Program changed. Updating the label to: %s", newlabel);
 
-				LIST_REMOVE(j, label_hash_sle);
+				label_hash_remove(j);
 				strcpy((char *)j->label, newlabel);
 
 				jobmgr_t where2put = root_jobmgr;
 				if (j->mgr->properties & BOOTSTRAP_PROPERTY_XPC_DOMAIN) {
 					where2put = j->mgr;
 				}
-				LIST_INSERT_HEAD(&where2put->label_hash[hash_label(j->label)], j, label_hash_sle);
+				label_hash_insert(&where2put->label_hash, j);
 			} else if (errno != ESRCH) {
 				(void)job_assumes_zero(j, errno);
 			}
 		} else {
-			if (j->spawn_reply_port) {
-				errno = job_mig_spawn2_reply(j->spawn_reply_port, BOOTSTRAP_SUCCESS, j->p, j->exit_status_port);
-				if (errno) {
-					if (errno != MACH_SEND_INVALID_DEST) {
-						(void)job_assumes_zero(j, errno);
-					}
-					(void)job_assumes_zero(j, launchd_mport_close_recv(j->exit_status_port));
-				}
-
-				j->spawn_reply_port = MACH_PORT_NULL;
-				j->exit_status_port = MACH_PORT_NULL;
-			}
-
-			if (j->xpc_service && j->did_exec) {
-				j->xpcproxy_did_exec = true;
-			}
-
-			j->did_exec = true;
-			job_log(j, LOG_DEBUG, "Program changed");
+			job_did_exec(j);
 		}
 	}
 
@@ -3847,6 +4507,58 @@ job_callback_proc(job_t j, struct kevent *kev)
 	}
 }
 
+void
+job_did_exec(job_t j)
+{
+	if (j->spawn_reply_port) {
+		errno = job_mig_spawn2_reply(j->spawn_reply_port, BOOTSTRAP_SUCCESS, j->p, j->exit_status_port);
+		if (errno) {
+			if (errno != MACH_SEND_INVALID_DEST) {
+				(void)job_assumes_zero(j, errno);
+			}
+			(void)job_assumes_zero(j, launchd_mport_close_recv(j->exit_status_port));
+		}
+
+		j->spawn_reply_port = MACH_PORT_NULL;
+		j->exit_status_port = MACH_PORT_NULL;
+	}
+
+	if (j->xpc_service && j->did_exec) {
+		j->xpcproxy_did_exec = true;
+	}
+
+	j->did_exec = true;
+	job_log(j, LOG_DEBUG, "Program changed");
+
+	// There is nothing more for the spawn scheduler to wait for.
+	if (SLIST_EMPTY(&j->machservices) && SLIST_EMPTY(&j->sockets)) {
+		job_spawn_sched_release(j);
+	}
+}
+
+void
+job_arm_start_interval(job_t j)
+{
+	uint32_t first = j->start_interval;
+	uint32_t jitter = j->start_interval_jitter;
+
+	/* StartIntervalJitter delays the first run by a random amount, up to one
+	 * interval, so that a pile of jobs loaded together with the same interval
+	 * do not all run in the same second forever after.
+	 */
+	if (jitter > first) {
+		jitter = first;
+	}
+	if (jitter > UINT32_MAX - first) {
+		jitter = UINT32_MAX - first;
+	}
+	if (jitter) {
+		first += arc4random_uniform(jitter + 1);
+	}
+
+	runtime_timer_arm(&j->start_interval_timer, (uintptr_t)&j->start_interval, first, j->start_interval, j);
+}
+
 void
 job_callback_timer(job_t j, void *ident)
 {
@@ -3860,6 +4572,10 @@ job_callback_timer(job_t j, void *ident)
 		job_log(j, LOG_DEBUG, "&j->start_interval == ident (%p)", ident);
 		j->start_pending = true;
 		job_dispatch(j, false);
+	} else if (&j->spawn_settle_timer == ident) {
+		job_log(j, LOG_DEBUG, "Did not check in within %d seconds. Giving up the spawn slot.", SPAWN_SCHED_SETTLE);
+		s_spawn_sched_settle_cnt++;
+		job_spawn_sched_release(j);
 	} else if (&j->exit_timeout == ident) {
 		if (!job_assumes(j, j->p != 0)) {
 			return;
@@ -3931,23 +4647,74 @@ job_callback_read(job_t j, int ident)
 void
 jobmgr_reap_bulk(jobmgr_t jm, struct kevent *kev)
 {
-	jobmgr_t jmi;
+	pid_t p = (pid_t)kev->ident;
+	unsigned int pass = ++s_reap_pass;
 	job_t j;
 
-	SLIST_FOREACH(jmi, &jm->submgrs, sle) {
-		jobmgr_reap_bulk(jmi, kev);
-	}
-
-	if ((j = jobmgr_find_by_pid(jm, (pid_t)kev->ident, false))) {
-		kev->udata = j;
-		job_callback(j, kev);
+	/* Every job for this PID under the given job manager gets the event. The
+	 * callback can reap or remove the job, or create new ones, so start over
+	 * from the head of the bucket each time and use the pass number to skip
+	 * jobs that have already been handled.
+	 */
+again:
+	LIST_FOREACH(j, &s_pid_hash[PID_HASH(p)], pid_hash_sle) {
+		if (j->p == p && j->reap_pass != pass && jobmgr_contains(jm, j->mgr)) {
+			j->reap_pass = pass;
+			kev->udata = j;
+			job_callback(j, kev);
+			goto again;
+		}
 	}
 }
 
 void
-jobmgr_callback(void *obj, struct kevent *kev)
+pid_hash_grow(void)
 {
-	jobmgr_t jm = obj;
+	size_t i, nsize = s_pid_hash_size * 2;
+	struct pid_hash_head *nb = calloc(nsize, sizeof(*nb));
+	job_t ji;
+
+	if (!nb) {
+		return;
+	}
+
+	for (i = 0; i < s_pid_hash_size; i++) {
+		while ((ji = LIST_FIRST(&s_pid_hash[i]))) {
+			LIST_REMOVE(ji, pid_hash_sle);
+			LIST_INSERT_HEAD(&nb[(size_t)ji->p & (nsize - 1)], ji, pid_hash_sle);
+		}
+	}
+
+	if (s_pid_hash != s_pid_hash_initial) {
+		free(s_pid_hash);
+	}
+	s_pid_hash = nb;
+	s_pid_hash_size = nsize;
+	s_pid_hash_resizes++;
+}
+
+void
+job_pid_hash_insert(job_t j)
+{
+	if (unlikely(s_pid_hash_cnt >= s_pid_hash_size * 2)) {
+		pid_hash_grow();
+	}
+
+	LIST_INSERT_HEAD(&s_pid_hash[PID_HASH(j->p)], j, pid_hash_sle);
+	s_pid_hash_cnt++;
+}
+
+void
+job_pid_hash_remove(job_t j)
+{
+	LIST_REMOVE(j, pid_hash_sle);
+	s_pid_hash_cnt--;
+}
+
+void
+jobmgr_callback(void *obj, struct kevent *kev)
+{
+	jobmgr_t jm = obj;
 
 #if TARGET_OS_EMBEDDED
 	int flag2check = VQ_MOUNT;
@@ -3976,6 +4743,10 @@ jobmgr_callback(void *obj, struct kevent *kev)
 			 * It's just a debugging facility.
 			 */
 			return jobmgr_log_perf_statistics(jm);
+		case SIGHUP:
+			// Someone changed an account and wants us to notice now.
+			jobmgr_log(jm, LOG_DEBUG, "Got SIGHUP. Forgetting cached credentials.");
+			return usercred_flush();
 		default:
 			jobmgr_log(jm, LOG_ERR, "Unrecognized signal: %lu: %s", kev->ident, strsignal(kev->ident));
 		}
@@ -3989,18 +4760,27 @@ jobmgr_callback(void *obj, struct kevent *kev)
 				}
 			}
 		} else if (kev->fflags & VQ_MOUNT) {
-			jobmgr_dispatch_all(jm, true);
+			job_dispatch_subscribers(KEEPALIVE_EVENT_MOUNT);
 		}
-		jobmgr_dispatch_all_semaphores(jm);
 		break;
 	case EVFILT_TIMER:
-		if (kev->ident == (uintptr_t)&sorted_calendar_events) {
+		if (kev->ident == (uintptr_t)&calendar_heap) {
 			calendarinterval_callback();
+		} else if (kev->ident == (uintptr_t)&s_spawn_sched_queue) {
+			spawn_sched_drain();
 		} else if (kev->ident == (uintptr_t)jm) {
 			jobmgr_log(jm, LOG_DEBUG, "Shutdown timer firing.");
 			jobmgr_still_alive_with_check(jm);
+
+			/* Every job state change that matters to shutdown should have
+			 * queued its job manager already. As a backstop, have the next
+			 * pass look at every job anyway.
+			 */
+			jobmgr_gc_queue(jm, true);
+			root_jobmgr = jobmgr_do_garbage_collection(root_jobmgr);
 		} else if (kev->ident == (uintptr_t)&jm->reboot_flags) {
-			jobmgr_do_garbage_collection(jm);
+			jobmgr_gc_queue(jm, true);
+			root_jobmgr = jobmgr_do_garbage_collection(root_jobmgr);
 		} else if (kev->ident == (uintptr_t)&launchd_runtime_busy_time) {
 			jobmgr_log(jm, LOG_DEBUG, "Idle exit timer fired. Shutting down.");
 			if (jobmgr_assumes_zero(jm, runtime_busy_cnt) == 0) {
@@ -4054,16 +4834,172 @@ job_callback(void *obj, struct kevent *kev)
 	}
 }
 
+spawn_class_t
+job_spawn_class(job_t j)
+{
+	if (j->spawn_interactive || j->app || j->embedded_god) {
+		return SPAWN_CLASS_INTERACTIVE;
+	}
+	if (j->spawn_background || j->low_pri_io) {
+		return SPAWN_CLASS_BACKGROUND;
+	}
+	if (!SLIST_EMPTY(&j->machservices) || !SLIST_EMPTY(&j->sockets)) {
+		return SPAWN_CLASS_IPC;
+	}
+
+	return SPAWN_CLASS_STANDARD;
+}
+
+void
+job_spawn_sched_start(job_t j, bool kickstart)
+{
+	spawn_class_t c;
+
+	if (kickstart) {
+		job_spawn_sched_dequeue(j);
+	} else if (j->spawn_sched_queued) {
+		job_log(j, LOG_DEBUG, "Already waiting to be started.");
+		return;
+	} else if (launchd_spawn_concurrency && (s_spawn_sched_inflight >= launchd_spawn_concurrency || s_spawn_sched_depth)) {
+		// Anyone already waiting goes first.
+		c = job_spawn_class(j);
+		j->spawn_sched_class = c;
+		j->spawn_sched_enqueued = runtime_get_opaque_time();
+		j->spawn_sched_queued = true;
+		TAILQ_INSERT_TAIL(&s_spawn_sched_queue[c], j, spawn_sched_tqe);
+		if (++s_spawn_sched_depth > s_spawn_sched_depth_max) {
+			s_spawn_sched_depth_max = s_spawn_sched_depth;
+		}
+
+		job_log(j, LOG_DEBUG, "Waiting to be started: %lu in flight, %lu waiting, class %s",
+				s_spawn_sched_inflight, s_spawn_sched_depth, s_spawn_class_names[c]);
+
+		// A demand for the job's services will still start it right away.
+		job_watch(j);
+		return;
+	}
+
+	job_start(j);
+	job_spawn_sched_claim(j);
+}
+
+void
+job_spawn_sched_dequeue(job_t j)
+{
+	if (!j->spawn_sched_queued) {
+		return;
+	}
+
+	TAILQ_REMOVE(&s_spawn_sched_queue[j->spawn_sched_class], j, spawn_sched_tqe);
+	j->spawn_sched_queued = false;
+	s_spawn_sched_depth--;
+}
+
+void
+job_spawn_sched_claim(job_t j)
+{
+	if (!launchd_spawn_concurrency || j->spawn_sched_slot || !(j->p || j->spawn_helper_pending)) {
+		return;
+	}
+	// A spawned job has already exec(3)ed; see job_did_exec().
+	if (j->did_exec && SLIST_EMPTY(&j->machservices) && SLIST_EMPTY(&j->sockets)) {
+		return;
+	}
+
+	j->spawn_sched_slot = true;
+	if (++s_spawn_sched_inflight > s_spawn_sched_inflight_max) {
+		s_spawn_sched_inflight_max = s_spawn_sched_inflight;
+	}
+	runtime_timer_arm(&j->spawn_settle_timer, (uintptr_t)&j->spawn_settle_timer, SPAWN_SCHED_SETTLE, 0, j);
+}
+
+void
+job_spawn_sched_release(job_t j)
+{
+	if (!j->spawn_sched_slot) {
+		return;
+	}
+
+	j->spawn_sched_slot = false;
+	runtime_timer_disarm(&j->spawn_settle_timer);
+	s_spawn_sched_inflight--;
+
+	/* We may be in the middle of reaping or removing a job here, so start the
+	 * next ones from the top of the run loop instead.
+	 */
+	if (s_spawn_sched_depth && !s_spawn_sched_drain_armed && root_jobmgr) {
+		if (job_assumes_zero_p(j, kevent_mod((uintptr_t)&s_spawn_sched_queue, EVFILT_TIMER, EV_ADD|EV_ONESHOT, 0, 0, root_jobmgr)) != -1) {
+			s_spawn_sched_drain_armed = true;
+		}
+	}
+}
+
+/* The checks a job that isn't running has to pass before it is started, made
+ * both by job_dispatch() and by the spawn scheduler when a queued job's turn
+ * comes. A useless job is removed, in which case it must not be touched
+ * again.
+ */
+bool
+job_dispatch_check(job_t j)
+{
+	if (job_useless(j)) {
+		job_log(j, LOG_DEBUG, "Job is useless. Removing.");
+		job_remove(j);
+		return false;
+	}
+	if (unlikely(j->per_user && j->peruser_suspend_count > 0)) {
+		job_log(j, LOG_DEBUG, "Per-user launchd is suspended. Not dispatching.");
+		return false;
+	}
+
+	return true;
+}
+
+void
+spawn_sched_drain(void)
+{
+	unsigned int c = SPAWN_CLASS_INTERACTIVE;
+	uint64_t waited;
+	job_t j;
+
+	s_spawn_sched_drain_armed = false;
+
+	while (c < SPAWN_CLASS_CNT && s_spawn_sched_inflight < launchd_spawn_concurrency) {
+		if (!(j = TAILQ_FIRST(&s_spawn_sched_queue[c]))) {
+			c++;
+			continue;
+		}
+
+		waited = runtime_get_opaque_time() - j->spawn_sched_enqueued;
+		s_spawn_sched_wait_cnt[c]++;
+		s_spawn_sched_wait_time[c] += waited;
+		if (waited > s_spawn_sched_wait_max[c]) {
+			s_spawn_sched_wait_max[c] = waited;
+		}
+
+		job_spawn_sched_dequeue(j);
+
+		// Things may have changed while it was waiting.
+		if (job_active(j) || !job_dispatch_check(j) || !job_keepalive(j)) {
+			continue;
+		}
+
+		job_start(j);
+		job_spawn_sched_claim(j);
+	}
+}
+
 void
 job_start(job_t j)
 {
-	uint64_t td;
+	uint64_t td, st;
 	int spair[2];
 	int execspair[2];
 	char nbuf[64];
+	char **envp;
+	const char *why;
 	pid_t c;
 	bool sipc = false;
-	u_int proc_fflags = NOTE_EXIT|NOTE_FORK|NOTE_EXEC|NOTE_EXITSTATUS;
 
 	if (!job_assumes(j, j->mgr != NULL)) {
 		return;
@@ -4089,7 +5025,7 @@ job_start(job_t j)
 		 * but we're not directly tracking the 'throttled' state at the moment.
 		 */
 		job_log(j, LOG_NOTICE, "Throttling respawn: Will start in %ld seconds", respawn_delta);
-		(void)job_assumes_zero_p(j, kevent_mod((uintptr_t)j, EVFILT_TIMER, EV_ADD|EV_ONESHOT, NOTE_SECONDS, respawn_delta, j));
+		runtime_timer_arm(&j->respawn_timer, (uintptr_t)j, (uint32_t)respawn_delta, 0, j);
 		job_ignore(j);
 		return;
 	}
@@ -4102,12 +5038,47 @@ job_start(job_t j)
 		(void)job_assumes_zero_p(j, socketpair(AF_UNIX, SOCK_STREAM, 0, spair));
 	}
 
+	/* Most jobs can be launched with a single posix_spawn(2) from launchd
+	 * itself, which spares us duplicating launchd's address space for every
+	 * job we start. Anything that has to be done as the child before exec(3)
+	 * still needs a fork(2), which the spawn helper does for us if it is
+	 * running, or the path below otherwise. Jobs we fail to spawn also go
+	 * through the path below, so that the child reports the failure just as it
+	 * always has.
+	 */
+	st = runtime_get_opaque_time();
+	if ((why = job_needs_fork(j)) == NULL) {
+		if ((c = job_spawn(j, sipc ? spair[1] : -1)) != -1) {
+			s_spawn_direct_cnt++;
+			s_spawn_direct_time += runtime_get_opaque_time() - st;
+
+			if (sipc) {
+				(void)job_assumes_zero(j, runtime_close(spair[1]));
+			}
+			job_start_parent(j, c, sipc ? spair[0] : -1, true);
+			if (j->p) {
+				job_dispatch_watchers(j, true);
+			}
+			return;
+		}
+		job_log_error(j, LOG_DEBUG, "Could not spawn directly, forking instead");
+	} else {
+		job_resolve_cred(j);
+		if (job_spawn_helper_submit(j, sipc ? spair : NULL)) {
+			// job_spawn_helper_done() picks up from here.
+			j->cred = NULL;
+			return;
+		}
+		job_log(j, LOG_DEBUG, "Forking to start: %s", why);
+	}
+
 	(void)job_assumes_zero_p(j, socketpair(AF_UNIX, SOCK_STREAM, 0, execspair));
+	envp = job_envp(j);
 
 	switch (c = runtime_fork(j->weird_bootstrap ? j->j_port : j->mgr->jm_port)) {
 	case -1:
 		job_log_error(j, LOG_ERR, "fork() failed, will try again in one second");
-		(void)job_assumes_zero_p(j, kevent_mod((uintptr_t)j, EVFILT_TIMER, EV_ADD|EV_ONESHOT, NOTE_SECONDS, 1, j));
+		runtime_timer_arm(&j->respawn_timer, (uintptr_t)j, 1, 0, j);
 		job_ignore(j);
 
 		(void)job_assumes_zero(j, runtime_close(execspair[0]));
@@ -4126,6 +5097,10 @@ job_start(job_t j)
 		// wait for our parent to say they've attached a kevent to us
 		read(_fd(execspair[1]), &c, sizeof(c));
 
+		if (envp) {
+			environ = envp;
+			j->envp_in_environ = true;
+		}
 		if (sipc) {
 			(void)job_assumes_zero(j, runtime_close(spair[0]));
 			snprintf(nbuf, sizeof(nbuf), "%d", spair[1]);
@@ -4134,243 +5109,1548 @@ job_start(job_t j)
 		job_start_child(j);
 		break;
 	default:
-		j->start_time = runtime_get_opaque_time();
-
-		job_log(j, LOG_DEBUG, "Started as PID: %u", c);
-
-		j->did_exec = false;
-		j->xpcproxy_did_exec = false;
-		j->checkedin = false;
-		j->start_pending = false;
-		j->reaped = false;
-		j->crashed = false;
-		j->stopped = false;
-		j->workaround9359725 = false;
-		j->implicit_reap = false;
-		if (j->needs_kickoff) {
-			j->needs_kickoff = false;
-
-			if (SLIST_EMPTY(&j->semaphores)) {
-				j->ondemand = false;
-			}
-		}
-
-		if (j->has_console) {
-			launchd_wsp = c;
-		}
-
-		job_log(j, LOG_PERF, "Job started.");
-		runtime_add_ref();
-		total_children++;
-		LIST_INSERT_HEAD(&j->mgr->active_jobs[ACTIVE_JOB_HASH(c)], j, pid_hash_sle);
-		j->p = c;
+		s_spawn_fork_cnt++;
+		s_spawn_fork_time += runtime_get_opaque_time() - st;
 
-		j->mgr->normal_active_cnt++;
 		j->fork_fd = _fd(execspair[0]);
 		(void)job_assumes_zero(j, runtime_close(execspair[1]));
 		if (sipc) {
 			(void)job_assumes_zero(j, runtime_close(spair[1]));
-			ipc_open(_fd(spair[0]), j);
-		}
-		if (kevent_mod(c, EVFILT_PROC, EV_ADD, proc_fflags, 0, root_jobmgr ? root_jobmgr : j->mgr) != -1) {
-			job_ignore(j);
-		} else {
-			if (errno == ESRCH) {
-				job_log(j, LOG_ERR, "Child was killed before we could attach a kevent.");
-			} else {
-				(void)job_assumes(j, errno == ESRCH);
-			}
-			job_reap(j);
-
-			/* If we have reaped this job within this same run loop pass, then
-			 * it will be currently ignored. So if there's a failure to attach a
-			 * kevent, we need to make sure that we watch the job so that we can
-			 * respawn it.
-			 *
-			 * See <rdar://problem/10140809>.
-			 */
-			job_watch(j);
 		}
+		job_start_parent(j, c, sipc ? spair[0] : -1, false);
 
-		j->wait4debugger_oneshot = false;
 		if (likely(!j->stall_before_exec)) {
 			job_uncork_fork(j);
 		}
+		if (j->p) {
+			job_dispatch_watchers(j, true);
+		}
 		break;
 	}
+
+	// The child has its own copy now, and the cache entry may not outlive this.
+	j->cred = NULL;
 }
 
 void
-job_start_child(job_t j)
+job_start_parent(job_t j, pid_t c, int ipc_fd, bool did_exec)
 {
-	typeof(posix_spawn) *psf;
-	const char *file2exec = "/usr/libexec/launchproxy";
-	const char **argv;
-	posix_spawnattr_t spattr;
-	int gflags = GLOB_NOSORT|GLOB_NOCHECK|GLOB_TILDE|GLOB_DOOFFS;
-	glob_t g;
-	short spflags = POSIX_SPAWN_SETEXEC;
-	size_t binpref_out_cnt = 0;
-	size_t i;
+	u_int proc_fflags = NOTE_EXIT|NOTE_FORK|NOTE_EXEC|NOTE_EXITSTATUS;
 
-	(void)job_assumes_zero(j, posix_spawnattr_init(&spattr));
+	j->start_time = runtime_get_opaque_time();
 
-	job_setup_attributes(j);
+	job_log(j, LOG_DEBUG, "Started as PID: %u", c);
 
-	if (unlikely(j->argv && j->globargv)) {
-		g.gl_offs = 1;
-		for (i = 0; i < j->argc; i++) {
-			if (i > 0) {
-				gflags |= GLOB_APPEND;
-			}
-			if (glob(j->argv[i], gflags, NULL, &g) != 0) {
-				job_log_error(j, LOG_ERR, "glob(\"%s\")", j->argv[i]);
-				exit(EXIT_FAILURE);
-			}
-		}
-		g.gl_pathv[0] = (char *)file2exec;
-		argv = (const char **)g.gl_pathv;
-	} else if (likely(j->argv)) {
-		argv = alloca((j->argc + 2) * sizeof(char *));
-		argv[0] = file2exec;
-		for (i = 0; i < j->argc; i++) {
-			argv[i + 1] = j->argv[i];
+	j->did_exec = false;
+	j->xpcproxy_did_exec = false;
+	j->checkedin = false;
+	j->start_pending = false;
+	j->reaped = false;
+	j->crashed = false;
+	j->stopped = false;
+	j->workaround9359725 = false;
+	j->implicit_reap = false;
+	if (j->needs_kickoff) {
+		j->needs_kickoff = false;
+
+		if (SLIST_EMPTY(&j->semaphores)) {
+			j->ondemand = false;
 		}
-		argv[i + 1] = NULL;
-	} else {
-		argv = alloca(3 * sizeof(char *));
-		argv[0] = file2exec;
-		argv[1] = j->prog;
-		argv[2] = NULL;
 	}
 
-	if (likely(!j->inetcompat)) {
-		argv++;
+	if (j->has_console) {
+		launchd_wsp = c;
 	}
 
-	if (unlikely(j->wait4debugger || j->wait4debugger_oneshot)) {
-		if (!j->legacy_LS_job) {
-			job_log(j, LOG_WARNING, "Spawned and waiting for the debugger to attach before continuing...");
+	job_log(j, LOG_PERF, "Job started.");
+	runtime_add_ref();
+	total_children++;
+	j->p = c;
+	job_pid_hash_insert(j);
+
+	j->mgr->normal_active_cnt++;
+	if (ipc_fd != -1) {
+		ipc_open(_fd(ipc_fd), j);
+	}
+
+	/* A spawned job has already exec(3)ed by the time we get here, so there
+	 * will be no NOTE_EXEC for it.
+	 */
+	if (did_exec) {
+		job_did_exec(j);
+	}
+
+	if (kevent_mod(c, EVFILT_PROC, EV_ADD, proc_fflags, 0, root_jobmgr ? root_jobmgr : j->mgr) != -1) {
+		job_ignore(j);
+	} else {
+		if (errno == ESRCH) {
+			/* A spawned child has been running since posix_spawn(2)
+			 * returned, so it may simply have finished already.
+			 */
+			job_log(j, did_exec ? LOG_DEBUG : LOG_ERR, "Child was killed before we could attach a kevent.");
+		} else {
+			(void)job_assumes(j, errno == ESRCH);
 		}
-		spflags |= POSIX_SPAWN_START_SUSPENDED;
+		job_reap(j);
+
+		/* If we have reaped this job within this same run loop pass, then
+		 * it will be currently ignored. So if there's a failure to attach a
+		 * kevent, we need to make sure that we watch the job so that we can
+		 * respawn it.
+		 *
+		 * See <rdar://problem/10140809>.
+		 */
+		job_watch(j);
 	}
 
-#if !TARGET_OS_EMBEDDED
-	if (unlikely(j->disable_aslr)) {
-		spflags |= _POSIX_SPAWN_DISABLE_ASLR;
+	j->wait4debugger_oneshot = false;
+}
+
+const char *
+job_needs_fork(job_t j)
+{
+	if (unlikely(j->stall_before_exec)) {
+		return "stall before exec";
+	}
+	/* xpcproxy exec(3)s the service right away, and that NOTE_EXEC could
+	 * fire before we have attached a kevent to the spawned process.
+	 */
+	if (unlikely(j->xpc_service)) {
+		return "XPC service";
+	}
+	if (unlikely(!SLIST_EMPTY(&j->limits))) {
+		return "resource limits";
+	}
+	if (unlikely(!j->inetcompat && j->session_create)) {
+		return "SessionCreate";
+	}
+	if (unlikely(j->low_pri_io)) {
+		return "LowPriorityIO";
+	}
+	if (unlikely(j->rootdir)) {
+		return "RootDirectory";
+	}
+	if (unlikely(j->workingdir)) {
+		return "WorkingDirectory";
+	}
+	/* posix_spawn(2) has no way to give the child a umask of its own, and
+	 * it runs its file actions inside the call, so opening a path that
+	 * blocks (a FIFO, a hung network volume) would block launchd with it.
+	 */
+	if (unlikely(j->setmask)) {
+		return "Umask";
+	}
+	if (unlikely(j->stdinpath || j->stdoutpath || j->stderrpath)) {
+		return "standard I/O paths";
+	}
+	if (getuid() == 0 && (j->username || j->groupname || j->mach_uid)) {
+		return "UserName or GroupName";
+	}
+#if TARGET_OS_EMBEDDED
+	if (unlikely(j->main_thread_priority != 0)) {
+		return "main thread priority";
+	}
+#else
+	if (unlikely(j->jetsam_properties)) {
+		return "process control";
+	}
+#endif
+#if HAVE_QUARANTINE
+	if (unlikely(j->quarantine_data)) {
+		return "quarantine";
+	}
+#endif
+#if HAVE_SANDBOX
+	if (unlikely(j->seatbelt_profile)) {
+		return "sandbox";
+	}
+#endif
+#ifndef POSIX_SPAWN_SETSID
+	if (pid1_magic) {
+		return "new session";
 	}
 #endif
-	spflags |= j->pstype;
 
-	(void)job_assumes_zero(j, posix_spawnattr_setflags(&spattr, spflags));
-	if (unlikely(j->j_binpref_cnt)) {
-		(void)job_assumes_zero(j, posix_spawnattr_setbinpref_np(&spattr, j->j_binpref_cnt, j->j_binpref, &binpref_out_cnt));
-		(void)job_assumes(j, binpref_out_cnt == j->j_binpref_cnt);
+	return NULL;
+}
+
+pid_t
+job_spawn(job_t j, int trusted_fd)
+{
+	const char *file2exec;
+	const char **argv = NULL;
+	char **envp = NULL;
+	posix_spawnattr_t spattr;
+	posix_spawn_file_actions_t fa;
+	thread_state_flavor_t f = 0;
+	mach_port_t exc_port = MACH_PORT_NULL;
+	struct machservice *ms;
+	glob_t g;
+	short spflags = POSIX_SPAWN_SETPGROUP;
+	char tfd[64];
+	pid_t c = -1;
+	int saved_errno;
+
+	if (!job_setup_argv(j, &g, &argv, &file2exec)) {
+		return -1;
+	}
+	if (!(envp = job_envp(j))) {
+		job_free_argv(j, &g, argv);
+		errno = ENOMEM;
+		return -1;
+	}
+	// job_envp() leaves room for this, and we take it back out below.
+	if (trusted_fd != -1) {
+		snprintf(tfd, sizeof(tfd), "%s=%d", LAUNCHD_TRUSTED_FD_ENV, trusted_fd);
+		envp[j->envp_cnt] = tfd;
 	}
 
-#if TARGET_OS_EMBEDDED
-	/* Set jetsam attributes. POSIX_SPAWN_JETSAM_USE_EFFECTIVE_PRIORITY guards
-	 * against a race which arises if, during spawn, an initial jetsam property
-	 * update occurs before the values below are applied. In this case, the flag
-	 * ensures that the subsequent change is ignored; the explicit update should
-	 * be given priority.
+	(void)job_assumes_zero(j, posix_spawnattr_init(&spattr));
+	(void)job_assumes_zero(j, posix_spawn_file_actions_init(&fa));
+
+	/* See job_setup_attributes(). Children of PID 1 get a session of their
+	 * own, everyone else gets a process group.
 	 */
-	short flags = 0;
-	if (j->jetsam_properties) {
-		flags = POSIX_SPAWN_JETSAM_USE_EFFECTIVE_PRIORITY;
+#ifdef POSIX_SPAWN_SETSID
+	if (pid1_magic) {
+		spflags = POSIX_SPAWN_SETSID;
 	}
-
-	(void)job_assumes_zero(j, posix_spawnattr_setjetsam(&spattr, flags, j->jetsam_priority, j->jetsam_memlimit));
 #endif
+	(void)job_assumes_zero(j, posix_spawnattr_setpgroup(&spattr, 0));
+	job_setup_spawnattr(j, &spattr, spflags);
 
-	if (!j->app) {
-		(void)job_assumes_zero(j, posix_spawnattr_setcpumonitor(&spattr, 85, 5 * 60));
+	// What the child would otherwise have asked for in _vproc_post_fork_ping().
+	if (job_exception_port(j, &exc_port, &f)) {
+		(void)job_assumes_zero(j, posix_spawnattr_setexceptionports_np(&spattr, EXC_MASK_CRASH | EXC_MASK_RESOURCE, exc_port, EXCEPTION_STATE_IDENTITY | MACH_EXCEPTION_CODES, f));
+	}
+	SLIST_FOREACH(ms, &special_ports, special_port_sle) {
+		if (j->per_user && (ms->special_port_num != TASK_ACCESS_PORT)) {
+			// The TASK_ACCESS_PORT funny business is to workaround 5325399.
+			continue;
+		}
+		(void)job_assumes_zero(j, posix_spawnattr_setspecialport_np(&spattr, ms->port, ms->special_port_num));
+	}
+#if !TARGET_OS_EMBEDDED
+	if (!j->anonymous && !(j->mgr->properties & BOOTSTRAP_PROPERTY_XPC_DOMAIN)) {
+		(void)job_assumes_zero(j, posix_spawnattr_setauditsessionport_np(&spattr, j->asport));
 	}
+#endif
+
+	// Jobs with standard I/O paths or a umask are forked; see job_needs_fork().
+	if (j->stdin_fd) {
+		(void)job_assumes_zero(j, posix_spawn_file_actions_adddup2(&fa, j->stdin_fd, STDIN_FILENO));
+	}
+
+	c = runtime_spawn(j->weird_bootstrap ? j->j_port : j->mgr->jm_port, file2exec, !j->prog, &spattr, &fa, (char *const *)argv, envp);
+	saved_errno = errno;
+	envp[j->envp_cnt] = NULL;
+
+	if (c != -1) {
+		if (unlikely(j->setnice)) {
+			(void)job_assumes_zero_p(j, setpriority(PRIO_PROCESS, c, j->nice));
+		}
+		if (getuid() != 0) {
+			job_postfork_test_user(j);
+		}
+	}
+
+	(void)job_assumes_zero(j, posix_spawn_file_actions_destroy(&fa));
+	(void)job_assumes_zero(j, posix_spawnattr_destroy(&spattr));
+	job_free_argv(j, &g, argv);
+
+	errno = saved_errno;
+	return c;
+}
+
+/* The spawn helper is a copy of launchd that we fork(2) off before any jobs
+ * are loaded, while launchd is still small. Jobs that have to be set up by the
+ * child before exec(3) are described to it over a socket instead of having
+ * launchd fork itself. The helper forks twice so that the job ends up as our
+ * child, just as if we had forked it, and sends the PID back. The child then
+ * waits for us to uncork it exactly like a job we forked ourselves.
+ *
+ * The helper's bootstrap port is the root job manager's, which is what its
+ * children inherit, so only jobs in the root job manager can be started this
+ * way.
+ */
+bool
+spawn_helper_start(void)
+{
+	int sv[2];
+	int bufsz = SPAWN_HELPER_MAX_MSG;
+	pid_t c;
+
+	if (!launchd_use_spawn_helper || s_spawn_helper_fd != -1) {
+		return false;
+	}
+
+	if (jobmgr_assumes_zero_p(root_jobmgr, socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) == -1) {
+		return false;
+	}
+
+	switch (c = runtime_fork(root_jobmgr->jm_port)) {
+	case -1:
+		jobmgr_log(root_jobmgr, LOG_ERR, "Could not fork the spawn helper: %d: %s", errno, strerror(errno));
+		(void)jobmgr_assumes_zero(root_jobmgr, runtime_close(sv[0]));
+		(void)jobmgr_assumes_zero(root_jobmgr, runtime_close(sv[1]));
+		return false;
+	case 0:
+		(void)close(sv[0]);
+		spawn_helper_main(_fd(sv[1]));
+		break;
+	default:
+		break;
+	}
+
+	(void)jobmgr_assumes_zero(root_jobmgr, runtime_close(sv[1]));
+	s_spawn_helper_fd = _fd(sv[0]);
+	s_spawn_helper_pid = c;
+
+	(void)jobmgr_assumes_zero_p(root_jobmgr, fcntl(s_spawn_helper_fd, F_SETFL, O_NONBLOCK));
+	(void)jobmgr_assumes_zero_p(root_jobmgr, setsockopt(s_spawn_helper_fd, SOL_SOCKET, SO_SNDBUF, &bufsz, sizeof(bufsz)));
+	(void)jobmgr_assumes_zero_p(root_jobmgr, kevent_mod(s_spawn_helper_fd, EVFILT_READ, EV_ADD, 0, 0, &kqspawn_helper_callback));
+	if (kevent_mod(c, EVFILT_PROC, EV_ADD, NOTE_EXIT, 0, &kqspawn_helper_callback) == -1) {
+		(void)jobmgr_assumes(root_jobmgr, errno == ESRCH);
+		spawn_helper_stop();
+		return false;
+	}
+
+	jobmgr_log(root_jobmgr, LOG_DEBUG, "Started the spawn helper as PID: %u", c);
+	return true;
+}
+
+/* Stops using the helper. Jobs it was still forking for us are started over
+ * the usual way; their children see the uncork socket close and exit without
+ * running anything.
+ */
+void
+spawn_helper_stop(void)
+{
+	struct spawn_helper_orphan_s *sho;
+	job_t j;
+
+	if (s_spawn_helper_fd == -1) {
+		return;
+	}
+
+	// Take whatever replies the helper managed to send before it went.
+	(void)spawn_helper_drain();
+
+	jobmgr_log(root_jobmgr, LOG_DEBUG, "Stopping the spawn helper.");
+	(void)jobmgr_assumes_zero(root_jobmgr, runtime_close(s_spawn_helper_fd));
+	s_spawn_helper_fd = -1;
+
+	// No more replies are coming.
+	while ((sho = SLIST_FIRST(&s_spawn_helper_orphans))) {
+		SLIST_REMOVE_HEAD(&s_spawn_helper_orphans, sho_sle);
+		free(sho);
+	}
+
+	while ((j = LIST_FIRST(&s_spawn_helper_pending))) {
+		job_spawn_helper_cancel(j);
+		job_log(j, LOG_DEBUG, "Spawn helper went away before the job was started.");
+		(void)job_dispatch(j, true);
+	}
+}
+
+void
+spawn_helper_callback(void *obj __attribute__((unused)), struct kevent *kev)
+{
+	int status;
+
+	if (kev->filter == EVFILT_PROC) {
+		if ((pid_t)kev->ident != s_spawn_helper_pid) {
+			// One of the jobs reaped by spawn_helper_reap_orphan().
+			(void)jobmgr_assumes_zero_p(root_jobmgr, waitpid((pid_t)kev->ident, &status, 0));
+			return;
+		}
+		if (jobmgr_assumes_zero_p(root_jobmgr, waitpid((pid_t)kev->ident, &status, 0)) != -1) {
+			jobmgr_log(root_jobmgr, LOG_NOTICE, "Spawn helper exited with status: %d", WEXITSTATUS(status));
+		}
+		s_spawn_helper_pid = 0;
+		spawn_helper_stop();
+		return;
+	}
+
+	if (!spawn_helper_drain()) {
+		spawn_helper_stop();
+	}
+}
+
+/* Hands every reply waiting on the socket to its job. Returns false once the
+ * helper's end is gone or it has sent something we can't make sense of.
+ */
+bool
+spawn_helper_drain(void)
+{
+	struct spawn_helper_orphan_s *sho;
+	struct spawn_helper_reply_s shr;
+	ssize_t r;
+	job_t j;
+
+	while (s_spawn_helper_fd != -1) {
+		r = read(s_spawn_helper_fd, &shr, sizeof(shr));
+		if (r == -1 && errno == EAGAIN) {
+			return true;
+		}
+		if (r != sizeof(shr)) {
+			if (r != 0) {
+				jobmgr_log(root_jobmgr, LOG_ERR, "Bad reply from the spawn helper: %zd", r);
+			}
+			return false;
+		}
+
+		LIST_FOREACH(j, &s_spawn_helper_pending, spawn_helper_sle) {
+			if (j->spawn_helper_seq == shr.shr_seq) {
+				break;
+			}
+		}
+		if (j) {
+			job_spawn_helper_done(j, shr.shr_pid, shr.shr_errno);
+			continue;
+		}
+
+		SLIST_FOREACH(sho, &s_spawn_helper_orphans, sho_sle) {
+			if (sho->sho_seq == shr.shr_seq) {
+				break;
+			}
+		}
+		if (sho) {
+			SLIST_REMOVE(&s_spawn_helper_orphans, sho, spawn_helper_orphan_s, sho_sle);
+			free(sho);
+		} else {
+			jobmgr_log(root_jobmgr, LOG_ERR, "Spawn helper replied to unknown request: %llu", shr.shr_seq);
+		}
+
+		// Nobody is going to uncork it, so it is ours to reap.
+		if (shr.shr_pid > 0) {
+			spawn_helper_reap_orphan(shr.shr_pid);
+		}
+	}
+
+	return false;
+}
+
+void
+spawn_helper_reap_orphan(pid_t p)
+{
+	int status;
+
+	/* It is still waiting to be uncorked and has not run anything of the
+	 * job's yet.
+	 */
+	(void)jobmgr_assumes_zero_p(root_jobmgr, kill(p, SIGKILL));
+	if (kevent_mod(p, EVFILT_PROC, EV_ADD|EV_ONESHOT, NOTE_EXIT, 0, &kqspawn_helper_callback) == -1) {
+		// Already a zombie.
+		(void)jobmgr_assumes(root_jobmgr, errno == ESRCH);
+		(void)jobmgr_assumes_zero_p(root_jobmgr, waitpid(p, &status, 0));
+	}
+}
+
+bool
+job_spawn_helper_submit(job_t j, int *spair)
+{
+	struct spawn_helper_msg_s shm;
+	struct spawn_helper_buf_s sb = { NULL, 0, 0, false };
+	struct limititem *li;
+	char **envp = NULL;
+	char **tmp;
+	int execspair[2];
+	int fds[3];
+	int fd_cnt = 0;
+	size_t i;
+	ssize_t r;
+
+	if (s_spawn_helper_fd == -1 || j->mgr != root_jobmgr || j->weird_bootstrap || root_jobmgr->shutting_down) {
+		return false;
+	}
+
+	if (!(envp = job_envp(j))) {
+		return false;
+	}
+
+	memset(&shm, 0, sizeof(shm));
+	shm.shm_seq = ++s_spawn_helper_seq;
+	shm.shm_mach_uid = j->mach_uid;
+	shm.shm_nice = j->nice;
+	shm.shm_mask = j->mask;
+	shm.shm_pstype = j->pstype;
+#if TARGET_OS_EMBEDDED
+	shm.shm_jetsam_priority = j->jetsam_priority;
+	shm.shm_jetsam_memlimit = j->jetsam_memlimit;
+	shm.shm_main_thread_priority = j->main_thread_priority;
+#endif
+#if HAVE_SANDBOX
+	shm.shm_seatbelt_flags = j->seatbelt_flags;
+#endif
+	shm.shm_flags |= j->setnice ? SPAWN_HELPER_SETNICE : 0;
+	shm.shm_flags |= j->setmask ? SPAWN_HELPER_SETMASK : 0;
+	shm.shm_flags |= j->inetcompat ? SPAWN_HELPER_INETCOMPAT : 0;
+	shm.shm_flags |= j->session_create ? SPAWN_HELPER_SESSION_CREATE : 0;
+	shm.shm_flags |= j->low_pri_io ? SPAWN_HELPER_LOW_PRI_IO : 0;
+	shm.shm_flags |= j->no_init_groups ? SPAWN_HELPER_NO_INIT_GROUPS : 0;
+	shm.shm_flags |= j->globargv ? SPAWN_HELPER_GLOBARGV : 0;
+	shm.shm_flags |= (j->wait4debugger || j->wait4debugger_oneshot) ? SPAWN_HELPER_WAIT4DEBUGGER : 0;
+	shm.shm_flags |= j->legacy_LS_job ? SPAWN_HELPER_LEGACY_LS_JOB : 0;
+	shm.shm_flags |= j->disable_aslr ? SPAWN_HELPER_DISABLE_ASLR : 0;
+	shm.shm_flags |= j->app ? SPAWN_HELPER_APP : 0;
+	shm.shm_flags |= j->jetsam_properties ? SPAWN_HELPER_JETSAM_PROPERTIES : 0;
+	shm.shm_flags |= j->envp_sets_sessionid ? SPAWN_HELPER_ENVP_SESSIONID : 0;
+
+	spawn_helper_put_str(&sb, j->label);
+	spawn_helper_put_str(&sb, j->prog);
+	shm.shm_argc = j->argv ? (uint32_t)j->argc : 0;
+	for (i = 0; i < shm.shm_argc; i++) {
+		spawn_helper_put_str(&sb, j->argv[i]);
+	}
+	for (tmp = envp; *tmp; tmp++) {
+		spawn_helper_put_str(&sb, *tmp);
+		shm.shm_envc++;
+	}
+	spawn_helper_put_str(&sb, j->username);
+	spawn_helper_put_str(&sb, j->groupname);
+	spawn_helper_put_str(&sb, j->rootdir);
+	spawn_helper_put_str(&sb, j->workingdir);
+	spawn_helper_put_str(&sb, j->stdinpath);
+	spawn_helper_put_str(&sb, j->stdoutpath);
+	spawn_helper_put_str(&sb, j->stderrpath);
+#if HAVE_SANDBOX
+	spawn_helper_put_str(&sb, j->seatbelt_profile);
+#else
+	spawn_helper_put_str(&sb, NULL);
+#endif
+	SLIST_FOREACH(li, &j->limits, sle) {
+		struct spawn_helper_limit_s shl = {
+			.shl_which = li->which,
+			.shl_setsoft = li->setsoft,
+			.shl_sethard = li->sethard,
+			.shl_lim = li->lim,
+		};
+		spawn_helper_put(&sb, &shl, sizeof(shl));
+		shm.shm_limit_cnt++;
+	}
+	shm.shm_binpref_cnt = (uint32_t)j->j_binpref_cnt;
+	spawn_helper_put(&sb, j->j_binpref, j->j_binpref_cnt * sizeof(cpu_type_t));
+#if HAVE_QUARANTINE
+	shm.shm_quarantine_sz = (uint32_t)j->quarantine_data_sz;
+	spawn_helper_put(&sb, j->quarantine_data, j->quarantine_data_sz);
+#endif
+	if (j->cred) {
+		struct spawn_helper_cred_s shc = {
+			.shc_expire = j->cred->uc_expire,
+			.shc_uid = j->cred->uc_uid,
+			.shc_gid = j->cred_gid,
+			.shc_ngroups = j->no_init_groups ? 0 : j->cred->uc_ngroups,
+		};
+		memcpy(shc.shc_groups, j->cred->uc_groups, sizeof(shc.shc_groups));
+		spawn_helper_put(&sb, &shc, sizeof(shc));
+		spawn_helper_put_str(&sb, j->cred->uc_login);
+		spawn_helper_put_str(&sb, j->cred->uc_dir);
+		spawn_helper_put_str(&sb, j->cred->uc_shell);
+		shm.shm_flags |= SPAWN_HELPER_CRED;
+	}
+
+	if (sb.sb_failed || sizeof(shm) + sb.sb_len > SPAWN_HELPER_MAX_MSG) {
+		free(sb.sb_buf);
+		return false;
+	}
+	shm.shm_len = (uint32_t)sb.sb_len;
+
+	if (job_assumes_zero_p(j, socketpair(AF_UNIX, SOCK_STREAM, 0, execspair)) == -1) {
+		free(sb.sb_buf);
+		return false;
+	}
+
+	fds[fd_cnt++] = execspair[1];
+	if (spair) {
+		shm.shm_flags |= SPAWN_HELPER_TRUSTED_FD;
+		fds[fd_cnt++] = spair[1];
+	}
+	if (j->stdin_fd) {
+		shm.shm_flags |= SPAWN_HELPER_STDIN_FD;
+		fds[fd_cnt++] = j->stdin_fd;
+	}
+
+	r = spawn_helper_send(s_spawn_helper_fd, &shm, sb.sb_buf, sb.sb_len, fds, fd_cnt);
+	free(sb.sb_buf);
+	(void)job_assumes_zero(j, runtime_close(execspair[1]));
+
+	if (r != (ssize_t)(sizeof(shm) + shm.shm_len)) {
+		(void)job_assumes_zero(j, runtime_close(execspair[0]));
+		if (r == -1 && errno == EAGAIN) {
+			job_log(j, LOG_DEBUG, "Spawn helper is backed up.");
+		} else {
+			// We can't tell where the next message would start anymore.
+			job_log_error(j, LOG_ERR, "Could not send the job to the spawn helper");
+			spawn_helper_stop();
+		}
+		return false;
+	}
+
+	if (spair) {
+		(void)job_assumes_zero(j, runtime_close(spair[1]));
+	}
+	j->spawn_helper_ipc_fd = spair ? spair[0] : -1;
+	j->fork_fd = _fd(execspair[0]);
+	j->spawn_helper_seq = shm.shm_seq;
+	j->spawn_helper_start = runtime_get_opaque_time();
+	j->spawn_helper_pending = true;
+	LIST_INSERT_HEAD(&s_spawn_helper_pending, j, spawn_helper_sle);
+	if (++s_spawn_helper_inflight > s_spawn_helper_inflight_max) {
+		s_spawn_helper_inflight_max = s_spawn_helper_inflight;
+	}
+
+	job_log(j, LOG_DEBUG, "Handed the job to the spawn helper.");
+	return true;
+}
+
+void
+job_spawn_helper_done(job_t j, pid_t c, int error)
+{
+	int ipc_fd = j->spawn_helper_ipc_fd;
+
+	LIST_REMOVE(j, spawn_helper_sle);
+	j->spawn_helper_pending = false;
+	s_spawn_helper_inflight--;
+
+	if (c == -1) {
+		job_spawn_helper_close(j);
+		errno = error;
+		job_log_error(j, LOG_ERR, "fork() failed, will try again in one second");
+		runtime_timer_arm(&j->respawn_timer, (uintptr_t)j, 1, 0, j);
+		job_ignore(j);
+		return;
+	}
+
+	s_spawn_helper_cnt++;
+	s_spawn_helper_time += runtime_get_opaque_time() - j->spawn_helper_start;
+	j->spawn_helper_ipc_fd = -1;
+
+	job_start_parent(j, c, ipc_fd, false);
+	if (likely(!j->stall_before_exec)) {
+		job_uncork_fork(j);
+	}
+	if (j->p) {
+		job_dispatch_watchers(j, true);
+	}
+
+	// The job was asked to go away while we were waiting on the helper.
+	if (j->p && (j->removal_pending || j->mgr->shutting_down)) {
+		job_stop(j);
+	}
+}
+
+void
+job_spawn_helper_cancel(job_t j)
+{
+	struct spawn_helper_orphan_s *sho;
+
+	LIST_REMOVE(j, spawn_helper_sle);
+	j->spawn_helper_pending = false;
+	s_spawn_helper_inflight--;
+	job_spawn_helper_close(j);
+
+	// The reply is still on its way; see spawn_helper_drain().
+	if (s_spawn_helper_fd != -1 && job_assumes(j, (sho = malloc(sizeof(*sho))) != NULL)) {
+		sho->sho_seq = j->spawn_helper_seq;
+		SLIST_INSERT_HEAD(&s_spawn_helper_orphans, sho, sho_sle);
+	}
+}
+
+void
+job_spawn_helper_close(job_t j)
+{
+	if (j->spawn_helper_ipc_fd != -1) {
+		(void)job_assumes_zero(j, runtime_close(j->spawn_helper_ipc_fd));
+		j->spawn_helper_ipc_fd = -1;
+	}
+	if (j->fork_fd) {
+		(void)job_assumes_zero(j, runtime_close(j->fork_fd));
+		j->fork_fd = 0;
+	}
+}
+
+void
+spawn_helper_put(struct spawn_helper_buf_s *sb, const void *p, size_t sz)
+{
+	char *tmp;
+
+	if (sb->sb_failed || sz == 0) {
+		return;
+	}
+
+	if (sb->sb_len + sz > sb->sb_size) {
+		size_t nsize = sb->sb_size ? sb->sb_size : 4096;
+
+		while (sb->sb_len + sz > nsize) {
+			nsize *= 2;
+		}
+		if (!(tmp = realloc(sb->sb_buf, nsize))) {
+			sb->sb_failed = true;
+			return;
+		}
+		sb->sb_buf = tmp;
+		sb->sb_size = nsize;
+	}
+
+	memcpy(sb->sb_buf + sb->sb_len, p, sz);
+	sb->sb_len += sz;
+}
+
+// Strings go out as a presence byte followed by the string and its NUL.
+void
+spawn_helper_put_str(struct spawn_helper_buf_s *sb, const char *s)
+{
+	char present = s ? 1 : 0;
+
+	spawn_helper_put(sb, &present, 1);
+	if (s) {
+		spawn_helper_put(sb, s, strlen(s) + 1);
+	}
+}
+
+ssize_t
+spawn_helper_send(int fd, struct spawn_helper_msg_s *shm, const void *body, size_t body_len, int *fds, int fd_cnt)
+{
+	char cbuf[CMSG_SPACE(3 * sizeof(int))];
+	struct cmsghdr *cm;
+	struct msghdr mh;
+	struct iovec iov[2];
+
+	iov[0].iov_base = shm;
+	iov[0].iov_len = sizeof(*shm);
+	iov[1].iov_base = (void *)body;
+	iov[1].iov_len = body_len;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = iov;
+	mh.msg_iovlen = body_len ? 2 : 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = CMSG_SPACE(fd_cnt * sizeof(int));
+
+	cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_len = CMSG_LEN(fd_cnt * sizeof(int));
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	memcpy(CMSG_DATA(cm), fds, fd_cnt * sizeof(int));
+
+	return sendmsg(fd, &mh, 0);
+}
+
+/* Everything below runs in the helper and its children. */
+
+bool
+spawn_helper_read(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t r;
+
+	while (len) {
+		if ((r = read(fd, p, len)) <= 0) {
+			if (r == -1 && errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		p += r;
+		len -= (size_t)r;
+	}
+
+	return true;
+}
+
+void *
+spawn_helper_get(struct spawn_helper_buf_s *sb, size_t sz)
+{
+	void *p = sb->sb_buf + sb->sb_len;
+
+	if (sb->sb_size - sb->sb_len < sz) {
+		sb->sb_failed = true;
+		return NULL;
+	}
+
+	sb->sb_len += sz;
+	return p;
+}
+
+char *
+spawn_helper_get_str(struct spawn_helper_buf_s *sb)
+{
+	char *present;
+	char *s, *end;
+
+	if (!(present = spawn_helper_get(sb, 1)) || !*present) {
+		return NULL;
+	}
+
+	s = sb->sb_buf + sb->sb_len;
+	if (!(end = memchr(s, '\0', sb->sb_size - sb->sb_len))) {
+		sb->sb_failed = true;
+		return NULL;
+	}
+	sb->sb_len += (size_t)(end - s) + 1;
+
+	return s;
+}
+
+/* Rebuilds just enough of the job from the message for job_start_child(). The
+ * environment we were sent is already complete, so the job gets an empty job
+ * manager of its own and no environment items.
+ */
+job_t
+spawn_helper_decode(struct spawn_helper_msg_s *shm, struct spawn_helper_buf_s *sb, char ***envpp)
+{
+	const char *label;
+	char **envp;
+	jobmgr_t jm;
+	job_t j;
+	uint32_t i;
+
+	if (!(label = spawn_helper_get_str(sb))) {
+		return NULL;
+	}
+	if (!(j = calloc(1, sizeof(struct job_s) + strlen(label) + 1))) {
+		return NULL;
+	}
+	if (!(jm = calloc(1, sizeof(struct jobmgr_s) + strlen(root_jobmgr->name) + 1))) {
+		free(j);
+		return NULL;
+	}
+	strcpy(jm->name_init, root_jobmgr->name);
+	strcpy((char *)j->label, label);
+	j->mgr = jm;
+
+	j->prog = spawn_helper_get_str(sb);
+	if (shm->shm_argc) {
+		if (!(j->argv = calloc(shm->shm_argc + 1, sizeof(char *)))) {
+			goto out_bad;
+		}
+		for (i = 0; i < shm->shm_argc; i++) {
+			j->argv[i] = spawn_helper_get_str(sb);
+		}
+		j->argc = shm->shm_argc;
+	}
+	if (!(envp = calloc(shm->shm_envc + 1, sizeof(char *)))) {
+		goto out_bad;
+	}
+	for (i = 0; i < shm->shm_envc; i++) {
+		envp[i] = spawn_helper_get_str(sb);
+	}
+	*envpp = envp;
+
+	j->username = spawn_helper_get_str(sb);
+	j->groupname = spawn_helper_get_str(sb);
+	j->rootdir = spawn_helper_get_str(sb);
+	j->workingdir = spawn_helper_get_str(sb);
+	j->stdinpath = spawn_helper_get_str(sb);
+	j->stdoutpath = spawn_helper_get_str(sb);
+	j->stderrpath = spawn_helper_get_str(sb);
+#if HAVE_SANDBOX
+	j->seatbelt_profile = spawn_helper_get_str(sb);
+	j->seatbelt_flags = shm->shm_seatbelt_flags;
+#else
+	(void)spawn_helper_get_str(sb);
+#endif
+
+	for (i = 0; i < shm->shm_limit_cnt; i++) {
+		struct spawn_helper_limit_s shl;
+		struct limititem *li;
+		void *p;
+
+		if (!(p = spawn_helper_get(sb, sizeof(shl))) || !(li = calloc(1, sizeof(struct limititem)))) {
+			goto out_bad;
+		}
+		memcpy(&shl, p, sizeof(shl));
+		li->which = shl.shl_which;
+		li->setsoft = shl.shl_setsoft;
+		li->sethard = shl.shl_sethard;
+		li->lim = shl.shl_lim;
+		SLIST_INSERT_HEAD(&j->limits, li, sle);
+	}
+
+	if (shm->shm_binpref_cnt) {
+		void *p = spawn_helper_get(sb, shm->shm_binpref_cnt * sizeof(cpu_type_t));
+
+		if (!p || !(j->j_binpref = calloc(shm->shm_binpref_cnt, sizeof(cpu_type_t)))) {
+			goto out_bad;
+		}
+		memcpy(j->j_binpref, p, shm->shm_binpref_cnt * sizeof(cpu_type_t));
+		j->j_binpref_cnt = shm->shm_binpref_cnt;
+	}
+#if HAVE_QUARANTINE
+	if (shm->shm_quarantine_sz) {
+		j->quarantine_data = spawn_helper_get(sb, shm->shm_quarantine_sz);
+		j->quarantine_data_sz = shm->shm_quarantine_sz;
+	}
+#endif
+	if (shm->shm_flags & SPAWN_HELPER_CRED) {
+		struct spawn_helper_cred_s shc;
+		void *p;
+
+		if (!(p = spawn_helper_get(sb, sizeof(shc))) || !(j->cred = calloc(1, sizeof(struct usercred_s)))) {
+			goto out_bad;
+		}
+		memcpy(&shc, p, sizeof(shc));
+		if (shc.shc_ngroups < -1 || shc.shc_ngroups > NGROUPS) {
+			goto out_bad;
+		}
+		j->cred->uc_expire = (time_t)shc.shc_expire;
+		j->cred->uc_uid = shc.shc_uid;
+		j->cred->uc_gid = shc.shc_gid;
+		j->cred->uc_ngroups = shc.shc_ngroups;
+		j->cred->uc_groups_gid = shc.shc_gid;
+		memcpy(j->cred->uc_groups, shc.shc_groups, sizeof(j->cred->uc_groups));
+		j->cred->uc_login = spawn_helper_get_str(sb);
+		j->cred->uc_dir = spawn_helper_get_str(sb);
+		j->cred->uc_shell = spawn_helper_get_str(sb);
+		if (!j->cred->uc_login || !j->cred->uc_dir || !j->cred->uc_shell) {
+			goto out_bad;
+		}
+		j->cred_gid = shc.shc_gid;
+	}
+
+	j->mach_uid = shm->shm_mach_uid;
+	j->nice = shm->shm_nice;
+	j->mask = shm->shm_mask;
+	j->pstype = shm->shm_pstype;
+#if TARGET_OS_EMBEDDED
+	j->jetsam_priority = shm->shm_jetsam_priority;
+	j->jetsam_memlimit = shm->shm_jetsam_memlimit;
+	j->main_thread_priority = shm->shm_main_thread_priority;
+#endif
+	j->setnice = !!(shm->shm_flags & SPAWN_HELPER_SETNICE);
+	j->setmask = !!(shm->shm_flags & SPAWN_HELPER_SETMASK);
+	j->inetcompat = !!(shm->shm_flags & SPAWN_HELPER_INETCOMPAT);
+	j->session_create = !!(shm->shm_flags & SPAWN_HELPER_SESSION_CREATE);
+	j->low_pri_io = !!(shm->shm_flags & SPAWN_HELPER_LOW_PRI_IO);
+	j->no_init_groups = !!(shm->shm_flags & SPAWN_HELPER_NO_INIT_GROUPS);
+	j->globargv = !!(shm->shm_flags & SPAWN_HELPER_GLOBARGV);
+	j->wait4debugger = !!(shm->shm_flags & SPAWN_HELPER_WAIT4DEBUGGER);
+	j->legacy_LS_job = !!(shm->shm_flags & SPAWN_HELPER_LEGACY_LS_JOB);
+	j->disable_aslr = !!(shm->shm_flags & SPAWN_HELPER_DISABLE_ASLR);
+	j->app = !!(shm->shm_flags & SPAWN_HELPER_APP);
+	j->jetsam_properties = !!(shm->shm_flags & SPAWN_HELPER_JETSAM_PROPERTIES);
+	j->envp_sets_sessionid = !!(shm->shm_flags & SPAWN_HELPER_ENVP_SESSIONID);
+
+	if (sb->sb_failed) {
+		goto out_bad;
+	}
+
+	return j;
+
+out_bad:
+	spawn_helper_free(j);
+	return NULL;
+}
+
+void
+spawn_helper_free(job_t j)
+{
+	struct limititem *li;
+
+	while ((li = SLIST_FIRST(&j->limits))) {
+		SLIST_REMOVE_HEAD(&j->limits, sle);
+		free(li);
+	}
+	free(j->j_binpref);
+	free(j->argv);
+	free(j->cred);
+	free(j->mgr);
+	free(j);
+}
+
+/* Forks the job twice over, so that the middle process can exit and leave the
+ * job to be reparented to us (PID 1), and returns the job's PID.
+ */
+pid_t
+spawn_helper_fork(job_t j, char **envp, int *fds, uint32_t flags)
+{
+	int pfd[2];
+	pid_t c, mid;
+	int status;
+	struct {
+		pid_t p;
+		int error;
+	} res = { -1, 0 };
+
+	if (pipe(pfd) == -1) {
+		return -1;
+	}
+	(void)_fd(pfd[0]);
+	(void)_fd(pfd[1]);
+
+	switch (mid = fork()) {
+	case -1:
+		res.error = errno;
+		break;
+	case 0:
+		switch (c = fork()) {
+		case -1:
+			res.error = errno;
+			(void)write(pfd[1], &res, sizeof(res));
+			_exit(EXIT_FAILURE);
+		case 0:
+			break;
+		default:
+			res.p = c;
+			(void)write(pfd[1], &res, sizeof(res));
+			_exit(EXIT_SUCCESS);
+		}
+
+		// Wait for launchd to say it has attached a kevent to us.
+		if (read(fds[0], &c, sizeof(c)) != sizeof(c)) {
+			_exit(EXIT_FAILURE);
+		}
+		if (unlikely(_vproc_post_fork_ping())) {
+			_exit(EXIT_FAILURE);
+		}
+
+		environ = envp;
+		if (flags & SPAWN_HELPER_TRUSTED_FD) {
+			char nbuf[64];
+
+			snprintf(nbuf, sizeof(nbuf), "%d", fds[1]);
+			setenv(LAUNCHD_TRUSTED_FD_ENV, nbuf, 1);
+		}
+		job_start_child(j);
+		break;
+	default:
+		(void)close(pfd[1]);
+		pfd[1] = -1;
+		if (!spawn_helper_read(pfd[0], &res, sizeof(res))) {
+			res.p = -1;
+			res.error = ECHILD;
+		}
+		while (waitpid(mid, &status, 0) == -1 && errno == EINTR) { }
+		break;
+	}
+
+	(void)close(pfd[0]);
+	if (pfd[1] != -1) {
+		(void)close(pfd[1]);
+	}
+
+	errno = res.error;
+	return res.p;
+}
+
+void
+spawn_helper_main(int fd)
+{
+	struct spawn_helper_msg_s shm;
+	struct spawn_helper_buf_s sb;
+	struct spawn_helper_reply_s shr;
+	char cbuf[CMSG_SPACE(3 * sizeof(int))];
+	struct cmsghdr *cm;
+	struct msghdr mh;
+	struct iovec iov;
+	char **envp;
+	ssize_t r;
+	job_t j;
+	int fds[3];
+	int fd_cnt, i;
+
+	for (;;) {
+		memset(&mh, 0, sizeof(mh));
+		iov.iov_base = &shm;
+		iov.iov_len = sizeof(shm);
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = cbuf;
+		mh.msg_controllen = sizeof(cbuf);
+
+		if ((r = recvmsg(fd, &mh, 0)) <= 0) {
+			if (r == -1 && errno == EINTR) {
+				continue;
+			}
+			// launchd closed its end.
+			_exit(r == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+
+		fd_cnt = 0;
+		for (cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+			if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+				fd_cnt = (int)((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+				if (fd_cnt > 3) {
+					_exit(EXIT_FAILURE);
+				}
+				memcpy(fds, CMSG_DATA(cm), fd_cnt * sizeof(int));
+			}
+		}
+
+		if ((size_t)r < sizeof(shm) && !spawn_helper_read(fd, (char *)&shm + r, sizeof(shm) - (size_t)r)) {
+			_exit(EXIT_FAILURE);
+		}
+		if (fd_cnt < 1 || shm.shm_len > SPAWN_HELPER_MAX_MSG || !(sb.sb_buf = malloc(shm.shm_len + 1))) {
+			_exit(EXIT_FAILURE);
+		}
+		if (!spawn_helper_read(fd, sb.sb_buf, shm.shm_len)) {
+			_exit(EXIT_FAILURE);
+		}
+		sb.sb_len = 0;
+		sb.sb_size = shm.shm_len;
+		sb.sb_failed = false;
+
+		for (i = 0; i < fd_cnt; i++) {
+			(void)_fd(fds[i]);
+		}
+
+		shr.shr_seq = shm.shm_seq;
+		shr.shr_pid = -1;
+		shr.shr_errno = EINVAL;
+		envp = NULL;
+
+		if ((j = spawn_helper_decode(&shm, &sb, &envp))) {
+			i = 1;
+			if (shm.shm_flags & SPAWN_HELPER_TRUSTED_FD) {
+				// The job inherits this one, and knows it by number.
+				(void)fcntl(fds[i], F_SETFD, 0);
+				i++;
+			}
+			if (shm.shm_flags & SPAWN_HELPER_STDIN_FD) {
+				j->stdin_fd = fds[i];
+			}
+
+			shr.shr_pid = spawn_helper_fork(j, envp, fds, shm.shm_flags);
+			shr.shr_errno = shr.shr_pid == -1 ? errno : 0;
+		}
+
+		for (i = 0; i < fd_cnt; i++) {
+			(void)close(fds[i]);
+		}
+
+		if (j) {
+			spawn_helper_free(j);
+		}
+		free(envp);
+		free(sb.sb_buf);
+
+		if (write(fd, &shr, sizeof(shr)) != sizeof(shr)) {
+			_exit(EXIT_FAILURE);
+		}
+	}
+}
+
+void
+job_start_child(job_t j)
+{
+	typeof(posix_spawn) *psf;
+	const char *file2exec;
+	const char **argv;
+	posix_spawnattr_t spattr;
+	glob_t g;
+
+	(void)job_assumes_zero(j, posix_spawnattr_init(&spattr));
+
+	job_setup_attributes(j);
+
+	if (!job_setup_argv(j, &g, &argv, &file2exec)) {
+		exit(EXIT_FAILURE);
+	}
+
+	job_setup_spawnattr(j, &spattr, POSIX_SPAWN_SETEXEC);
 
 #if HAVE_QUARANTINE
 	if (j->quarantine_data) {
 		qtn_proc_t qp;
 
-		if (job_assumes(j, qp = qtn_proc_alloc())) {
-			if (job_assumes_zero(j, qtn_proc_init_with_data(qp, j->quarantine_data, j->quarantine_data_sz) == 0)) {
-				(void)job_assumes_zero(j, qtn_proc_apply_to_self(qp));
-			}
+		if (job_assumes(j, qp = qtn_proc_alloc())) {
+			if (job_assumes_zero(j, qtn_proc_init_with_data(qp, j->quarantine_data, j->quarantine_data_sz) == 0)) {
+				(void)job_assumes_zero(j, qtn_proc_apply_to_self(qp));
+			}
+		}
+	}
+#endif
+
+#if HAVE_SANDBOX
+	if (j->seatbelt_profile) {
+		char *seatbelt_err_buf = NULL;
+
+		if (job_assumes_zero_p(j, sandbox_init(j->seatbelt_profile, j->seatbelt_flags, &seatbelt_err_buf)) == -1) {
+			if (seatbelt_err_buf) {
+				job_log(j, LOG_ERR, "Sandbox failed to init: %s", seatbelt_err_buf);
+			}
+			goto out_bad;
+		}
+	}
+#endif
+
+	psf = j->prog ? posix_spawn : posix_spawnp;
+
+	errno = psf(NULL, file2exec, NULL, &spattr, (char *const *)argv, environ);
+
+#if HAVE_SANDBOX
+out_bad:
+#endif
+	_exit(errno);
+}
+
+bool
+job_setup_argv(job_t j, glob_t *g, const char ***argvp, const char **file2exec)
+{
+	int gflags = GLOB_NOSORT|GLOB_NOCHECK|GLOB_TILDE|GLOB_DOOFFS;
+	const char **argv;
+	size_t i;
+
+	*file2exec = "/usr/libexec/launchproxy";
+
+	if (unlikely(j->argv && j->globargv)) {
+		g->gl_offs = 1;
+		for (i = 0; i < j->argc; i++) {
+			if (i > 0) {
+				gflags |= GLOB_APPEND;
+			}
+			if (glob(j->argv[i], gflags, NULL, g) != 0) {
+				job_log_error(j, LOG_ERR, "glob(\"%s\")", j->argv[i]);
+				globfree(g);
+				return false;
+			}
+		}
+		g->gl_pathv[0] = (char *)*file2exec;
+		argv = (const char **)g->gl_pathv;
+	} else if (likely(j->argv)) {
+		if (!job_assumes(j, argv = malloc((j->argc + 2) * sizeof(char *)))) {
+			return false;
+		}
+		argv[0] = *file2exec;
+		for (i = 0; i < j->argc; i++) {
+			argv[i + 1] = j->argv[i];
+		}
+		argv[i + 1] = NULL;
+	} else {
+		if (!job_assumes(j, argv = malloc(3 * sizeof(char *)))) {
+			return false;
+		}
+		argv[0] = *file2exec;
+		argv[1] = j->prog;
+		argv[2] = NULL;
+	}
+
+	if (likely(!j->inetcompat)) {
+		argv++;
+		*file2exec = j->prog ? j->prog : argv[0];
+	}
+
+	*argvp = argv;
+	return true;
+}
+
+void
+job_free_argv(job_t j, glob_t *g, const char **argv)
+{
+	if (likely(!j->inetcompat)) {
+		argv--;
+	}
+
+	if (unlikely(j->argv && j->globargv)) {
+		globfree(g);
+	} else {
+		free(argv);
+	}
+}
+
+void
+job_setup_spawnattr(job_t j, posix_spawnattr_t *spattr, short spflags)
+{
+	size_t binpref_out_cnt = 0;
+
+	if (unlikely(j->wait4debugger || j->wait4debugger_oneshot)) {
+		if (!j->legacy_LS_job) {
+			job_log(j, LOG_WARNING, "Spawned and waiting for the debugger to attach before continuing...");
+		}
+		spflags |= POSIX_SPAWN_START_SUSPENDED;
+	}
+
+#if !TARGET_OS_EMBEDDED
+	if (unlikely(j->disable_aslr)) {
+		spflags |= _POSIX_SPAWN_DISABLE_ASLR;
+	}
+#endif
+	spflags |= j->pstype;
+
+	(void)job_assumes_zero(j, posix_spawnattr_setflags(spattr, spflags));
+	if (unlikely(j->j_binpref_cnt)) {
+		(void)job_assumes_zero(j, posix_spawnattr_setbinpref_np(spattr, j->j_binpref_cnt, j->j_binpref, &binpref_out_cnt));
+		(void)job_assumes(j, binpref_out_cnt == j->j_binpref_cnt);
+	}
+
+#if TARGET_OS_EMBEDDED
+	/* Set jetsam attributes. POSIX_SPAWN_JETSAM_USE_EFFECTIVE_PRIORITY guards
+	 * against a race which arises if, during spawn, an initial jetsam property
+	 * update occurs before the values below are applied. In this case, the flag
+	 * ensures that the subsequent change is ignored; the explicit update should
+	 * be given priority.
+	 */
+	short flags = 0;
+	if (j->jetsam_properties) {
+		flags = POSIX_SPAWN_JETSAM_USE_EFFECTIVE_PRIORITY;
+	}
+
+	(void)job_assumes_zero(j, posix_spawnattr_setjetsam(spattr, flags, j->jetsam_priority, j->jetsam_memlimit));
+#endif
+
+	if (!j->app) {
+		(void)job_assumes_zero(j, posix_spawnattr_setcpumonitor(spattr, 85, 5 * 60));
+	}
+}
+
+void
+jobmgr_export_env_from_other_jobs(jobmgr_t jm, launch_data_t dict)
+{
+	launch_data_t tmp;
+	struct envitem *ei;
+	job_t ji;
+
+	if (jm->parentmgr) {
+		jobmgr_export_env_from_other_jobs(jm->parentmgr, dict);
+	} else {
+		char **tmpenviron = environ;
+		for (; *tmpenviron; tmpenviron++) {
+			char envkey[1024];
+			launch_data_t s = launch_data_alloc(LAUNCH_DATA_STRING);
+			launch_data_set_string(s, strchr(*tmpenviron, '=') + 1);
+			strncpy(envkey, *tmpenviron, sizeof(envkey));
+			*(strchr(envkey, '=')) = '\0';
+			launch_data_dict_insert(dict, s, envkey);
+		}
+	}
+
+	LIST_FOREACH(ji, &jm->jobs, sle) {
+		SLIST_FOREACH(ei, &ji->global_env, sle) {
+			if ((tmp = launch_data_new_string(ei->value))) {
+				launch_data_dict_insert(dict, tmp, ei->key);
+			}
+		}
+	}
+}
+
+void
+jobmgr_setup_env_from_other_jobs(jobmgr_t jm)
+{
+	struct envitem *ei;
+	job_t ji;
+
+	if (jm->parentmgr) {
+		jobmgr_setup_env_from_other_jobs(jm->parentmgr);
+	}
+
+	LIST_FOREACH(ji, &jm->global_env_jobs, global_env_sle) {
+		SLIST_FOREACH(ei, &ji->global_env, sle) {
+			setenv(ei->key, ei->value, 1);
+		}
+	}
+}
+
+bool
+jobmgr_envp_from_other_jobs(jobmgr_t jm, char ***envp, size_t *cnt)
+{
+	struct envitem *ei;
+	job_t ji;
+
+	if (jm->parentmgr && !jobmgr_envp_from_other_jobs(jm->parentmgr, envp, cnt)) {
+		return false;
+	}
+
+	LIST_FOREACH(ji, &jm->global_env_jobs, global_env_sle) {
+		SLIST_FOREACH(ei, &ji->global_env, sle) {
+			if (!envp_set(envp, cnt, ei->key, ei->value)) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+/* Builds the environment job_setup_attributes() would have left in the child,
+ * without touching our own.
+ */
+char **
+job_setup_envp(job_t j, size_t *cntp)
+{
+	char **envp = NULL;
+	char **tmpenviron;
+	struct envitem *ei;
+	char *sessionid = NULL;
+	size_t cnt = 0;
+
+	for (tmpenviron = environ; *tmpenviron; tmpenviron++) {
+		char *eq = strchr(*tmpenviron, '=');
+		char envkey[1024];
+
+		if (!eq || (size_t)(eq - *tmpenviron) >= sizeof(envkey)) {
+			continue;
+		}
+		strlcpy(envkey, *tmpenviron, eq - *tmpenviron + 1);
+		if (!envp_set(&envp, &cnt, envkey, eq + 1)) {
+			goto out_bad;
 		}
 	}
-#endif
 
-#if HAVE_SANDBOX
-	if (j->seatbelt_profile) {
-		char *seatbelt_err_buf = NULL;
+	/* Set launchd's own SECURITYSESSIONID aside, so that we can tell whether
+	 * the job's configuration sets one.
+	 */
+	sessionid = envp_take(envp, &cnt, "SECURITYSESSIONID");
 
-		if (job_assumes_zero_p(j, sandbox_init(j->seatbelt_profile, j->seatbelt_flags, &seatbelt_err_buf)) == -1) {
-			if (seatbelt_err_buf) {
-				job_log(j, LOG_ERR, "Sandbox failed to init: %s", seatbelt_err_buf);
-			}
+	if (!jobmgr_envp_from_other_jobs(j->mgr, &envp, &cnt)) {
+		goto out_bad;
+	}
+
+	SLIST_FOREACH(ei, &j->env, sle) {
+		if (!envp_set(&envp, &cnt, ei->key, ei->value)) {
 			goto out_bad;
 		}
 	}
-#endif
 
-	psf = j->prog ? posix_spawn : posix_spawnp;
+	if (envp_has(envp, cnt, "SECURITYSESSIONID")) {
+		j->envp_sets_sessionid = true;
+	} else if (sessionid && !envp_set(&envp, &cnt, "SECURITYSESSIONID", strchr(sessionid, '=') + 1)) {
+		goto out_bad;
+	}
+	free(sessionid);
+	sessionid = NULL;
 
-	if (likely(!j->inetcompat)) {
-		file2exec = j->prog ? j->prog : argv[0];
+	if (!envp && !(envp = calloc(1, sizeof(char *)))) {
+		goto out_bad;
 	}
 
-	errno = psf(NULL, file2exec, NULL, &spattr, (char *const *)argv, environ);
+	*cntp = cnt;
+	return envp;
 
-#if HAVE_SANDBOX
 out_bad:
-#endif
-	_exit(errno);
+	free(sessionid);
+	envp_free(envp);
+	return NULL;
+}
+
+/* Returns the job's environment, building it only if something it was built
+ * from has changed since. There is always room for one more entry after the
+ * terminating NULL, for job_spawn() to pass a trusted fd along without making
+ * a copy.
+ */
+char **
+job_envp(job_t j)
+{
+	char **tmp;
+
+	if (j->envp && j->envp_gen == s_envp_gen) {
+		s_envp_reuse_cnt++;
+		return j->envp;
+	}
+
+	job_envp_flush(j);
+	if (!(j->envp = job_setup_envp(j, &j->envp_cnt))) {
+		return NULL;
+	}
+	if (!(tmp = realloc(j->envp, (j->envp_cnt + 2) * sizeof(char *)))) {
+		job_envp_flush(j);
+		return NULL;
+	}
+	tmp[j->envp_cnt + 1] = NULL;
+	j->envp = tmp;
+	j->envp_gen = s_envp_gen;
+	s_envp_rebuild_cnt++;
+
+	return j->envp;
 }
 
 void
-jobmgr_export_env_from_other_jobs(jobmgr_t jm, launch_data_t dict)
+job_envp_flush(job_t j)
 {
-	launch_data_t tmp;
-	struct envitem *ei;
-	job_t ji;
+	envp_free(j->envp);
+	j->envp = NULL;
+	j->envp_cnt = 0;
+	j->envp_sets_sessionid = false;
+}
 
-	if (jm->parentmgr) {
-		jobmgr_export_env_from_other_jobs(jm->parentmgr, dict);
-	} else {
-		char **tmpenviron = environ;
-		for (; *tmpenviron; tmpenviron++) {
-			char envkey[1024];
-			launch_data_t s = launch_data_alloc(LAUNCH_DATA_STRING);
-			launch_data_set_string(s, strchr(*tmpenviron, '=') + 1);
-			strncpy(envkey, *tmpenviron, sizeof(envkey));
-			*(strchr(envkey, '=')) = '\0';
-			launch_data_dict_insert(dict, s, envkey);
+void
+job_environ_changed(void)
+{
+	s_envp_gen++;
+}
+
+// Whether an array we own has an entry for key.
+bool
+envp_has(char **envp, size_t cnt, const char *key)
+{
+	size_t i, keylen = strlen(key);
+
+	for (i = 0; i < cnt; i++) {
+		if (strncmp(envp[i], key, keylen) == 0 && envp[i][keylen] == '=') {
+			return true;
 		}
 	}
 
-	LIST_FOREACH(ji, &jm->jobs, sle) {
-		SLIST_FOREACH(ei, &ji->global_env, sle) {
-			if ((tmp = launch_data_new_string(ei->value))) {
-				launch_data_dict_insert(dict, tmp, ei->key);
-			}
+	return false;
+}
+
+/* Removes key's "key=value" entry from an array we own and returns it for the
+ * caller to free. The last entry moves into its place.
+ */
+char *
+envp_take(char **envp, size_t *cnt, const char *key)
+{
+	size_t i, keylen = strlen(key);
+	char *kv;
+
+	for (i = 0; i < *cnt; i++) {
+		if (strncmp(envp[i], key, keylen) == 0 && envp[i][keylen] == '=') {
+			kv = envp[i];
+			envp[i] = envp[--(*cnt)];
+			envp[*cnt] = NULL;
+			return kv;
 		}
 	}
+
+	return NULL;
 }
 
-void
-jobmgr_setup_env_from_other_jobs(jobmgr_t jm)
+// Like setenv(3) with overwriting, but on a NULL-terminated array we own.
+bool
+envp_set(char ***envp, size_t *cnt, const char *key, const char *value)
 {
-	struct envitem *ei;
-	job_t ji;
+	size_t i, keylen;
+	char **tmp;
+	char *kv;
 
-	if (jm->parentmgr) {
-		jobmgr_setup_env_from_other_jobs(jm->parentmgr);
+	keylen = strlen(key);
+	if (asprintf(&kv, "%s=%s", key, value) == -1) {
+		return false;
 	}
 
-	LIST_FOREACH(ji, &jm->global_env_jobs, global_env_sle) {
-		SLIST_FOREACH(ei, &ji->global_env, sle) {
-			setenv(ei->key, ei->value, 1);
+	for (i = 0; i < *cnt; i++) {
+		if (strncmp((*envp)[i], key, keylen) == 0 && (*envp)[i][keylen] == '=') {
+			free((*envp)[i]);
+			(*envp)[i] = kv;
+			return true;
 		}
 	}
+
+	if (!(tmp = realloc(*envp, (*cnt + 2) * sizeof(char *)))) {
+		free(kv);
+		return false;
+	}
+
+	tmp[(*cnt)++] = kv;
+	tmp[*cnt] = NULL;
+	*envp = tmp;
+
+	return true;
+}
+
+void
+envp_free(char **envp)
+{
+	char **tmp;
+
+	if (!envp) {
+		return;
+	}
+
+	for (tmp = envp; *tmp; tmp++) {
+		free(*tmp);
+	}
+	free(envp);
 }
 
 void
@@ -4504,6 +6784,249 @@ job_getgrnam(job_t j, const char *name)
 #endif
 }
 
+bool
+usercred_stale(uint64_t resolved)
+{
+	return runtime_get_nanoseconds_since(resolved) >= USERCRED_TTL * NSEC_PER_SEC;
+}
+
+/* PID 1 must never wait on opendirectoryd, which may well be waiting on us to
+ * start it. So it only consults the local files here, and anyone who lives
+ * elsewhere is left for the child to look up, as job_getpwnam() does.
+ */
+void
+usercred_search_local(bool local)
+{
+#if !TARGET_OS_EMBEDDED
+	static int l1_cache_enabled;
+
+	if (!pid1_magic) {
+		return;
+	}
+
+	if (local) {
+		// 1 == SEARCH_MODULE_FLAG_DISABLED
+		si_search_module_set_flags("ds", 1);
+		l1_cache_enabled = gL1CacheEnabled;
+		gL1CacheEnabled = false;
+	} else {
+		si_search_module_set_flags("ds", 0);
+		gL1CacheEnabled = l1_cache_enabled;
+	}
+#else
+#pragma unused (local)
+#endif
+}
+
+/* Looks the account up by name, or by UID if name is NULL. The entry is only
+ * good until the next call, which may throw stale entries away.
+ */
+struct usercred_s *
+usercred_lookup(const char *name, uid_t uid)
+{
+	struct usercred_s *uc, *uc_next;
+	struct passwd *pwe;
+	size_t keysz, loginsz, dirsz, shellsz;
+	char *p;
+
+	LIST_FOREACH_SAFE(uc, &s_usercreds, uc_sle, uc_next) {
+		if (usercred_stale(uc->uc_resolved)) {
+			LIST_REMOVE(uc, uc_sle);
+			s_usercred_cnt--;
+			free(uc);
+		} else if (name ? (uc->uc_key && strcmp(uc->uc_key, name) == 0) : (!uc->uc_key && uc->uc_key_uid == uid)) {
+			s_usercred_hits++;
+			return uc;
+		}
+	}
+
+	s_usercred_misses++;
+
+	usercred_search_local(true);
+	pwe = name ? getpwnam(name) : getpwuid(uid);
+	if (pwe == NULL) {
+		usercred_search_local(false);
+		return NULL;
+	}
+
+	keysz = name ? strlen(name) + 1 : 0;
+	loginsz = strlen(pwe->pw_name) + 1;
+	dirsz = strlen(pwe->pw_dir) + 1;
+	shellsz = strlen(pwe->pw_shell) + 1;
+	if ((uc = calloc(1, sizeof(struct usercred_s) + keysz + loginsz + dirsz + shellsz))) {
+		uc->uc_resolved = runtime_get_opaque_time();
+		uc->uc_expire = pwe->pw_expire;
+		uc->uc_uid = pwe->pw_uid;
+		uc->uc_gid = pwe->pw_gid;
+		uc->uc_key_uid = uid;
+		uc->uc_ngroups = -1;
+
+		p = uc->uc_strings;
+		if (name) {
+			uc->uc_key = memcpy(p, name, keysz);
+			p += keysz;
+		}
+		uc->uc_login = memcpy(p, pwe->pw_name, loginsz);
+		p += loginsz;
+		uc->uc_dir = memcpy(p, pwe->pw_dir, dirsz);
+		p += dirsz;
+		uc->uc_shell = memcpy(p, pwe->pw_shell, shellsz);
+
+		LIST_INSERT_HEAD(&s_usercreds, uc, uc_sle);
+		s_usercred_cnt++;
+	}
+	usercred_search_local(false);
+
+	return uc;
+}
+
+/* Does what initgroups(3) would, so that the child can hand the list straight
+ * to the kernel. PID 1 only sees the local files, and a list built from them
+ * would leave out any directory service groups the user is in, so there the
+ * list is left for the child's own initgroups(3).
+ */
+bool
+usercred_groups(struct usercred_s *uc, gid_t gid)
+{
+	int ngroups = NGROUPS;
+
+#if !TARGET_OS_EMBEDDED
+	if (pid1_magic) {
+		uc->uc_ngroups = -1;
+		return true;
+	}
+#endif
+
+	if (uc->uc_ngroups != -1 && uc->uc_groups_gid == gid) {
+		s_usercred_hits++;
+		return true;
+	}
+
+	s_usercred_misses++;
+
+	usercred_search_local(true);
+	// A failure here isn't fatal, and we'll still get data we can use.
+	(void)getgrouplist(uc->uc_login, (int)gid, uc->uc_groups, &ngroups);
+	usercred_search_local(false);
+
+	if (ngroups < 1) {
+		uc->uc_ngroups = -1;
+		return false;
+	}
+
+	uc->uc_ngroups = ngroups > NGROUPS ? NGROUPS : ngroups;
+	uc->uc_groups_gid = gid;
+
+	return true;
+}
+
+bool
+groupcred_lookup(const char *name, gid_t *gid)
+{
+	struct groupcred_s *gc, *gc_next;
+	struct group *gre;
+	size_t namesz;
+
+	LIST_FOREACH_SAFE(gc, &s_groupcreds, gc_sle, gc_next) {
+		if (usercred_stale(gc->gc_resolved)) {
+			LIST_REMOVE(gc, gc_sle);
+			free(gc);
+		} else if (strcmp(gc->gc_name, name) == 0) {
+			s_usercred_hits++;
+			*gid = gc->gc_gid;
+			return true;
+		}
+	}
+
+	s_usercred_misses++;
+
+	usercred_search_local(true);
+	gre = getgrnam(name);
+	if (gre) {
+		*gid = gre->gr_gid;
+	}
+	usercred_search_local(false);
+
+	if (gre == NULL) {
+		return false;
+	}
+
+	namesz = strlen(name) + 1;
+	if ((gc = calloc(1, sizeof(struct groupcred_s) + namesz))) {
+		gc->gc_resolved = runtime_get_opaque_time();
+		gc->gc_gid = *gid;
+		memcpy(gc->gc_name, name, namesz);
+		LIST_INSERT_HEAD(&s_groupcreds, gc, gc_sle);
+	}
+
+	return true;
+}
+
+void
+usercred_flush(void)
+{
+	struct usercred_s *uc;
+	struct groupcred_s *gc;
+
+	while ((uc = LIST_FIRST(&s_usercreds))) {
+		LIST_REMOVE(uc, uc_sle);
+		free(uc);
+	}
+	while ((gc = LIST_FIRST(&s_groupcreds))) {
+		LIST_REMOVE(gc, gc_sle);
+		free(gc);
+	}
+
+	s_usercred_cnt = 0;
+	s_usercred_flushes++;
+}
+
+/* Resolves who the job will run as before we fork(2), for
+ * job_postfork_become_user() to use in the child. If any of it can't be
+ * resolved here, the child is left to look all of it up itself.
+ */
+void
+job_resolve_cred(job_t j)
+{
+	const char *name = j->username;
+	struct usercred_s *uc;
+	gid_t gid;
+
+	j->cred = NULL;
+
+	if (getuid() != 0) {
+		return;
+	}
+
+	// See job_postfork_become_user().
+	if (j->groupname && !name) {
+		name = "root";
+	}
+
+	if (name) {
+		uc = usercred_lookup(name, 0);
+	} else if (j->mach_uid) {
+		uc = usercred_lookup(NULL, j->mach_uid);
+	} else {
+		return;
+	}
+
+	if (uc == NULL) {
+		return;
+	}
+
+	gid = uc->uc_gid;
+	if (j->groupname && !groupcred_lookup(j->groupname, &gid)) {
+		return;
+	}
+	if (likely(!j->no_init_groups) && !usercred_groups(uc, gid)) {
+		return;
+	}
+
+	j->cred = uc;
+	j->cred_gid = gid;
+}
+
 void
 job_postfork_test_user(job_t j)
 {
@@ -4512,12 +7035,9 @@ job_postfork_test_user(job_t j)
 	const char *home_env_var = getenv("HOME");
 	const char *user_env_var = getenv("USER");
 	const char *logname_env_var = getenv("LOGNAME");
-	uid_t tmp_uid, local_uid = getuid();
-	gid_t tmp_gid, local_gid = getgid();
-	char shellpath[PATH_MAX];
-	char homedir[PATH_MAX];
-	char loginname[2000];
-	struct passwd *pwe;
+	uid_t local_uid = getuid();
+	gid_t local_gid = getgid();
+	struct usercred_s *uc;
 
 
 	if (!job_assumes(j, home_env_var && user_env_var && logname_env_var
@@ -4525,42 +7045,27 @@ job_postfork_test_user(job_t j)
 		goto out_bad;
 	}
 
-	if ((pwe = job_getpwnam(j, user_env_var)) == NULL) {
+	if ((uc = usercred_lookup(user_env_var, 0)) == NULL) {
 		job_log(j, LOG_ERR, "The account \"%s\" has been deleted out from under us!", user_env_var);
 		goto out_bad;
 	}
 
-	/*
-	 * We must copy the results of getpw*().
-	 *
-	 * Why? Because subsequent API calls may call getpw*() as a part of
-	 * their implementation. Since getpw*() returns a [now thread scoped]
-	 * global, we must therefore cache the results before continuing.
-	 */
-
-	tmp_uid = pwe->pw_uid;
-	tmp_gid = pwe->pw_gid;
-
-	strlcpy(shellpath, pwe->pw_shell, sizeof(shellpath));
-	strlcpy(loginname, pwe->pw_name, sizeof(loginname));
-	strlcpy(homedir, pwe->pw_dir, sizeof(homedir));
-
-	if (strcmp(loginname, logname_env_var) != 0) {
+	if (strcmp(uc->uc_login, logname_env_var) != 0) {
 		job_log(j, LOG_ERR, "The %s environmental variable changed out from under us!", "USER");
 		goto out_bad;
 	}
-	if (strcmp(homedir, home_env_var) != 0) {
+	if (strcmp(uc->uc_dir, home_env_var) != 0) {
 		job_log(j, LOG_ERR, "The %s environmental variable changed out from under us!", "HOME");
 		goto out_bad;
 	}
-	if (local_uid != tmp_uid) {
+	if (local_uid != uc->uc_uid) {
 		job_log(j, LOG_ERR, "The %cID of the account (%u) changed out from under us (%u)!",
-				'U', tmp_uid, local_uid);
+				'U', uc->uc_uid, local_uid);
 		goto out_bad;
 	}
-	if (local_gid != tmp_gid) {
+	if (local_gid != uc->uc_gid) {
 		job_log(j, LOG_ERR, "The %cID of the account (%u) changed out from under us (%u)!",
-				'G', tmp_gid, local_gid);
+				'G', uc->uc_gid, local_gid);
 		goto out_bad;
 	}
 
@@ -4581,7 +7086,9 @@ job_postfork_become_user(job_t j)
 	char tmpdirpath[PATH_MAX];
 	char shellpath[PATH_MAX];
 	char homedir[PATH_MAX];
+	struct usercred_s *uc = j->cred;
 	struct passwd *pwe;
+	time_t expire;
 	size_t r;
 	gid_t desired_gid = -1;
 	uid_t desired_uid = -1;
@@ -4598,37 +7105,49 @@ job_postfork_become_user(job_t j)
 		j->username = "root";
 	}
 
-	if (j->username) {
-		if ((pwe = job_getpwnam(j, j->username)) == NULL) {
-			job_log(j, LOG_ERR, "getpwnam(\"%s\") failed", j->username);
-			_exit(ESRCH);
-		}
-	} else if (j->mach_uid) {
-		if ((pwe = getpwuid(j->mach_uid)) == NULL) {
-			job_log(j, LOG_ERR, "getpwuid(\"%u\") failed", j->mach_uid);
-			job_log_pids_with_weird_uids(j);
-			_exit(ESRCH);
-		}
+	if (uc) {
+		// launchd already looked all of this up for us in job_resolve_cred().
+		desired_uid = uc->uc_uid;
+		desired_gid = j->cred_gid;
+		expire = uc->uc_expire;
+
+		strlcpy(shellpath, uc->uc_shell, sizeof(shellpath));
+		strlcpy(loginname, uc->uc_login, sizeof(loginname));
+		strlcpy(homedir, uc->uc_dir, sizeof(homedir));
 	} else {
-		return;
-	}
+		if (j->username) {
+			if ((pwe = job_getpwnam(j, j->username)) == NULL) {
+				job_log(j, LOG_ERR, "getpwnam(\"%s\") failed", j->username);
+				_exit(ESRCH);
+			}
+		} else if (j->mach_uid) {
+			if ((pwe = getpwuid(j->mach_uid)) == NULL) {
+				job_log(j, LOG_ERR, "getpwuid(\"%u\") failed", j->mach_uid);
+				job_log_pids_with_weird_uids(j);
+				_exit(ESRCH);
+			}
+		} else {
+			return;
+		}
 
-	/*
-	 * We must copy the results of getpw*().
-	 *
-	 * Why? Because subsequent API calls may call getpw*() as a part of
-	 * their implementation. Since getpw*() returns a [now thread scoped]
-	 * global, we must therefore cache the results before continuing.
-	 */
+		/*
+		 * We must copy the results of getpw*().
+		 *
+		 * Why? Because subsequent API calls may call getpw*() as a part of
+		 * their implementation. Since getpw*() returns a [now thread scoped]
+		 * global, we must therefore cache the results before continuing.
+		 */
 
-	desired_uid = pwe->pw_uid;
-	desired_gid = pwe->pw_gid;
+		desired_uid = pwe->pw_uid;
+		desired_gid = pwe->pw_gid;
+		expire = pwe->pw_expire;
 
-	strlcpy(shellpath, pwe->pw_shell, sizeof(shellpath));
-	strlcpy(loginname, pwe->pw_name, sizeof(loginname));
-	strlcpy(homedir, pwe->pw_dir, sizeof(homedir));
+		strlcpy(shellpath, pwe->pw_shell, sizeof(shellpath));
+		strlcpy(loginname, pwe->pw_name, sizeof(loginname));
+		strlcpy(homedir, pwe->pw_dir, sizeof(homedir));
+	}
 
-	if (unlikely(pwe->pw_expire && time(NULL) >= pwe->pw_expire)) {
+	if (unlikely(expire && time(NULL) >= expire)) {
 		job_log(j, LOG_ERR, "Expired account");
 		_exit(EXIT_FAILURE);
 	}
@@ -4640,7 +7159,7 @@ job_postfork_become_user(job_t j)
 		job_log(j, LOG_WARNING, "Suspicious setup: UID %u maps to UID %u", j->mach_uid, desired_uid);
 	}
 
-	if (j->groupname) {
+	if (!uc && j->groupname) {
 		struct group *gre;
 
 		if (unlikely((gre = job_getgrnam(j, j->groupname)) == NULL)) {
@@ -4664,7 +7183,11 @@ job_postfork_become_user(job_t j)
 	 * called after setgid(). See 4616864 for more information.
 	 */
 
-	if (likely(!j->no_init_groups)) {
+	if (likely(!j->no_init_groups) && uc && uc->uc_ngroups != -1) {
+		if (job_assumes_zero_p(j, syscall(SYS_initgroups, uc->uc_ngroups, uc->uc_groups, desired_uid)) == -1) {
+			_exit(EXIT_FAILURE);
+		}
+	} else if (likely(!j->no_init_groups)) {
 #if 1
 		if (job_assumes_zero_p(j, initgroups(loginname, desired_gid)) == -1) {
 			_exit(EXIT_FAILURE);
@@ -4731,7 +7254,20 @@ job_setup_attributes(job_t j)
 	}
 
 	if (unlikely(!j->inetcompat && j->session_create)) {
+		/* When environ is already the job's envp, a SECURITYSESSIONID from
+		 * its EnvironmentVariables must still win over the new session's,
+		 * as it does when they are set one by one below.
+		 */
+		char *sessionid = NULL;
+
+		if (j->envp_sets_sessionid && getenv("SECURITYSESSIONID")) {
+			sessionid = strdup(getenv("SECURITYSESSIONID"));
+		}
 		launchd_SessionCreate();
+		if (sessionid) {
+			setenv("SECURITYSESSIONID", sessionid, 1);
+			free(sessionid);
+		}
 	}
 
 	if (unlikely(j->low_pri_io)) {
@@ -4766,10 +7302,12 @@ job_setup_attributes(job_t j)
 	job_setup_fd(j, STDOUT_FILENO, j->stdoutpath, O_WRONLY|O_CREAT|O_APPEND);
 	job_setup_fd(j, STDERR_FILENO, j->stderrpath, O_WRONLY|O_CREAT|O_APPEND);
 
-	jobmgr_setup_env_from_other_jobs(j->mgr);
+	if (!j->envp_in_environ) {
+		jobmgr_setup_env_from_other_jobs(j->mgr);
 
-	SLIST_FOREACH(ei, &j->env, sle) {
-		setenv(ei->key, ei->value, 1);
+		SLIST_FOREACH(ei, &j->env, sle) {
+			setenv(ei->key, ei->value, 1);
+		}
 	}
 
 #if !TARGET_OS_EMBEDDED	
@@ -4804,29 +7342,48 @@ job_setup_fd(job_t j, int target_fd, const char *path, int flags)
 {
 	int fd;
 
-	if (!path) {
+	if ((fd = job_open_fd(j, path, flags)) == -1) {
 		return;
 	}
 
+	(void)job_assumes_zero_p(j, dup2(fd, target_fd));
+	(void)job_assumes_zero(j, runtime_close(fd));
+}
+
+int
+job_open_fd(job_t j, const char *path, int flags)
+{
+	int fd;
+
+	if (!path) {
+		return -1;
+	}
+
 	if ((fd = open(path, flags|O_NOCTTY, DEFFILEMODE)) == -1) {
 		job_log_error(j, LOG_WARNING, "open(\"%s\", ...)", path);
-		return;
 	}
 
-	(void)job_assumes_zero_p(j, dup2(fd, target_fd));
-	(void)job_assumes_zero(j, runtime_close(fd));
+	return fd;
 }
 
 void
 calendarinterval_setalarm(job_t j, struct calendarinterval *ci)
 {
-	struct calendarinterval *ci_iter, *ci_prev = NULL;
-	time_t later, head_later;
+	if (calendarinterval_schedule(j, ci)) {
+		calendarinterval_arm();
+	}
+}
+
+bool
+calendarinterval_schedule(job_t j, struct calendarinterval *ci)
+{
+	time_t now, later;
 
-	later = cronemu(ci->when.tm_mon, ci->when.tm_mday, ci->when.tm_hour, ci->when.tm_min);
+	now = time(NULL);
+	later = cronemu(now, ci->when.tm_mon, ci->when.tm_mday, ci->when.tm_hour, ci->when.tm_min);
 
 	if (ci->when.tm_wday != -1) {
-		time_t otherlater = cronemu_wday(ci->when.tm_wday, ci->when.tm_hour, ci->when.tm_min);
+		time_t otherlater = cronemu_wday(now, ci->when.tm_wday, ci->when.tm_hour, ci->when.tm_min);
 
 		if (ci->when.tm_mday == -1) {
 			later = otherlater;
@@ -4837,40 +7394,127 @@ calendarinterval_setalarm(job_t j, struct calendarinterval *ci)
 
 	ci->when_next = later;
 
-	LIST_FOREACH(ci_iter, &sorted_calendar_events, global_sle) {
-		if (ci->when_next < ci_iter->when_next) {
-			LIST_INSERT_BEFORE(ci_iter, ci, global_sle);
+	if (!job_assumes(j, calendar_heap_insert(ci))) {
+		return false;
+	}
+
+	char time_string[100];
+	size_t time_string_len;
+
+	ctime_r(&later, time_string);
+	time_string_len = strlen(time_string);
+
+	if (likely(time_string_len && time_string[time_string_len - 1] == '\n')) {
+		time_string[time_string_len - 1] = '\0';
+	}
+
+	job_log(j, LOG_INFO, "Scheduled to run again at %s", time_string);
+
+	return true;
+}
+
+void
+calendarinterval_arm(void)
+{
+	time_t head_later;
+
+	if (calendar_heap_cnt == 0) {
+		return;
+	}
+
+	head_later = calendar_heap[0]->when_next;
+	if (head_later == calendar_armed_at) {
+		return;
+	}
+
+	if (jobmgr_assumes_zero_p(root_jobmgr, kevent_mod((uintptr_t)&calendar_heap, EVFILT_TIMER, EV_ADD, NOTE_ABSOLUTE|NOTE_SECONDS, head_later, root_jobmgr)) != -1) {
+		calendar_armed_at = head_later;
+	}
+}
+
+void
+calendar_heap_sift_up(size_t i)
+{
+	struct calendarinterval *ci = calendar_heap[i];
+
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (calendar_heap[parent]->when_next <= ci->when_next) {
 			break;
 		}
+		calendar_heap[i] = calendar_heap[parent];
+		calendar_heap[i]->heap_index = i;
+		i = parent;
+	}
+
+	calendar_heap[i] = ci;
+	ci->heap_index = i;
+}
+
+void
+calendar_heap_sift_down(size_t i)
+{
+	struct calendarinterval *ci = calendar_heap[i];
 
-		ci_prev = ci_iter;
+	for (;;) {
+		size_t child = 2 * i + 1;
+		if (child >= calendar_heap_cnt) {
+			break;
+		}
+		if (child + 1 < calendar_heap_cnt && calendar_heap[child + 1]->when_next < calendar_heap[child]->when_next) {
+			child++;
+		}
+		if (ci->when_next <= calendar_heap[child]->when_next) {
+			break;
+		}
+		calendar_heap[i] = calendar_heap[child];
+		calendar_heap[i]->heap_index = i;
+		i = child;
 	}
 
-	if (ci_iter == NULL) {
-		// ci must want to fire after every other timer, or there are no timers
+	calendar_heap[i] = ci;
+	ci->heap_index = i;
+}
 
-		if (LIST_EMPTY(&sorted_calendar_events)) {
-			LIST_INSERT_HEAD(&sorted_calendar_events, ci, global_sle);
-		} else {
-			LIST_INSERT_AFTER(ci_prev, ci, global_sle);
+bool
+calendar_heap_insert(struct calendarinterval *ci)
+{
+	if (calendar_heap_cnt == calendar_heap_size) {
+		size_t nsize = calendar_heap_size ? calendar_heap_size * 2 : 64;
+		struct calendarinterval **nheap = realloc(calendar_heap, nsize * sizeof(*nheap));
+		if (!nheap) {
+			return false;
 		}
+		calendar_heap = nheap;
+		calendar_heap_size = nsize;
 	}
 
-	head_later = LIST_FIRST(&sorted_calendar_events)->when_next;
+	calendar_heap[calendar_heap_cnt] = ci;
+	calendar_heap_sift_up(calendar_heap_cnt++);
 
-	if (job_assumes_zero_p(j, kevent_mod((uintptr_t)&sorted_calendar_events, EVFILT_TIMER, EV_ADD, NOTE_ABSOLUTE|NOTE_SECONDS, head_later, root_jobmgr)) != -1) {
-		char time_string[100];
-		size_t time_string_len;
+	return true;
+}
 
-		ctime_r(&later, time_string);
-		time_string_len = strlen(time_string);
+void
+calendar_heap_remove(struct calendarinterval *ci)
+{
+	size_t i = ci->heap_index;
 
-		if (likely(time_string_len && time_string[time_string_len - 1] == '\n')) {
-			time_string[time_string_len - 1] = '\0';
-		}
+	if (i >= calendar_heap_cnt || calendar_heap[i] != ci) {
+		return;
+	}
 
-		job_log(j, LOG_INFO, "Scheduled to run again at %s", time_string);
+	struct calendarinterval *last = calendar_heap[--calendar_heap_cnt];
+	if (last != ci) {
+		calendar_heap[i] = last;
+		last->heap_index = i;
+		if (i > 0 && calendar_heap[(i - 1) / 2]->when_next > last->when_next) {
+			calendar_heap_sift_up(i);
+		} else {
+			calendar_heap_sift_down(i);
+		}
 	}
+	ci->heap_index = (size_t)-1;
 }
 
 bool
@@ -5069,6 +7713,32 @@ jobmgr_log_perf_statistics(jobmgr_t jm)
 		jobmgr_log(jm, LOG_PERF, "Created via bootstrap_subset()");
 	}
 
+	machservice_hash_log_stats(jm, &jm->ms_hash, "Mach service names");
+	if (jm == root_jobmgr) {
+		unsigned int i;
+
+		machservice_hash_log_stats(jm, &port_hash, "Mach service ports");
+		jobmgr_log(jm, LOG_PERF, "Active PIDs: %lu in %lu buckets, %u resize%s", s_pid_hash_cnt, s_pid_hash_size, s_pid_hash_resizes, s_pid_hash_resizes == 1 ? "" : "s");
+		jobmgr_log(jm, LOG_PERF, "MIG requests: %llu, resolved by walking the job managers: %llu (%lu ports indexed)", s_mig_intran_cnt, s_mig_intran_slow_cnt, s_mig_port_cnt);
+		runtime_timer_log_statistics();
+		jobmgr_log(jm, LOG_PERF, "Shutdown garbage collection: %llu passes, %llu job visits", s_gc_passes, s_gc_job_visits);
+		jobmgr_log(jm, LOG_PERF, "KeepAlive events: %llu, jobs dispatched: %llu (%lu network, %lu mount subscribers)", s_keepalive_event_cnt, s_keepalive_dispatch_cnt, s_keepalive_subscriber_cnt[KEEPALIVE_EVENT_NETWORK], s_keepalive_subscriber_cnt[KEEPALIVE_EVENT_MOUNT]);
+		jobmgr_log(jm, LOG_PERF, "Job launches: %llu spawned (%llu us average), %llu forked (%llu us average)",
+				s_spawn_direct_cnt, s_spawn_direct_cnt ? runtime_opaque_time_to_nano(s_spawn_direct_time / s_spawn_direct_cnt) / NSEC_PER_USEC : 0,
+				s_spawn_fork_cnt, s_spawn_fork_cnt ? runtime_opaque_time_to_nano(s_spawn_fork_time / s_spawn_fork_cnt) / NSEC_PER_USEC : 0);
+		jobmgr_log(jm, LOG_PERF, "Spawn helper: %llu jobs (%llu us average until the PID came back), %lu in flight at most",
+				s_spawn_helper_cnt, s_spawn_helper_cnt ? runtime_opaque_time_to_nano(s_spawn_helper_time / s_spawn_helper_cnt) / NSEC_PER_USEC : 0, s_spawn_helper_inflight_max);
+		jobmgr_log(jm, LOG_PERF, "Spawn scheduler: %u at a time, %lu in flight (%lu at most), %lu waiting (%lu at most), %llu never checked in",
+				launchd_spawn_concurrency, s_spawn_sched_inflight, s_spawn_sched_inflight_max, s_spawn_sched_depth, s_spawn_sched_depth_max, s_spawn_sched_settle_cnt);
+		for (i = 0; i < SPAWN_CLASS_CNT; i++) {
+			jobmgr_log(jm, LOG_PERF, "Spawn scheduler: %s: %llu waited (%llu ms average, %llu ms at most)", s_spawn_class_names[i], s_spawn_sched_wait_cnt[i],
+					s_spawn_sched_wait_cnt[i] ? runtime_opaque_time_to_nano(s_spawn_sched_wait_time[i] / s_spawn_sched_wait_cnt[i]) / NSEC_PER_MSEC : 0,
+					runtime_opaque_time_to_nano(s_spawn_sched_wait_max[i]) / NSEC_PER_MSEC);
+		}
+		jobmgr_log(jm, LOG_PERF, "Job environments: %llu built, %llu reused", s_envp_rebuild_cnt, s_envp_reuse_cnt);
+		jobmgr_log(jm, LOG_PERF, "Credential cache: %lu users, %llu hits, %llu misses, %llu flushes", s_usercred_cnt, s_usercred_hits, s_usercred_misses, s_usercred_flushes);
+	}
+
 	jobmgr_log(jm, LOG_PERF, "Jobs in job manager:");
 
 	job_t ji = NULL;
@@ -5254,7 +7924,7 @@ void
 calendarinterval_delete(job_t j, struct calendarinterval *ci)
 {
 	SLIST_REMOVE(&j->cal_intervals, ci, calendarinterval, sle);
-	LIST_REMOVE(ci, global_sle);
+	calendar_heap_remove(ci);
 
 	free(ci);
 
@@ -5264,7 +7934,7 @@ calendarinterval_delete(job_t j, struct calendarinterval *ci)
 void
 calendarinterval_sanity_check(void)
 {
-	struct calendarinterval *ci = LIST_FIRST(&sorted_calendar_events);
+	struct calendarinterval *ci = calendar_heap_cnt ? calendar_heap[0] : NULL;
 	time_t now = time(NULL);
 
 	if (unlikely(ci && (ci->when_next < now))) {
@@ -5275,22 +7945,29 @@ calendarinterval_sanity_check(void)
 void
 calendarinterval_callback(void)
 {
-	struct calendarinterval *ci, *ci_next;
+	struct calendarinterval *ci;
 	time_t now = time(NULL);
+	job_t j;
 
-	LIST_FOREACH_SAFE(ci, &sorted_calendar_events, global_sle, ci_next) {
-		job_t j = ci->job;
+	// The absolute timer is one-shot, so it has to be armed again.
+	calendar_armed_at = 0;
 
-		if (ci->when_next > now) {
-			break;
-		}
+	/* Rescheduled intervals always land after now, so this terminates. The
+	 * root is looked up again each time since job_dispatch() can delete
+	 * intervals.
+	 */
+	while (calendar_heap_cnt && (ci = calendar_heap[0])->when_next <= now) {
+		j = ci->job;
 
-		LIST_REMOVE(ci, global_sle);
-		calendarinterval_setalarm(j, ci);
+		calendar_heap_remove(ci);
+		(void)calendarinterval_schedule(j, ci);
 
 		j->start_pending = true;
 		job_dispatch(j, false);
 	}
+
+	// job_dispatch() may have removed the last job we looked at.
+	calendarinterval_arm();
 }
 
 bool
@@ -5415,8 +8092,10 @@ envitem_new(job_t j, const char *k, const char *v, bool global)
 			LIST_INSERT_HEAD(&j->mgr->global_env_jobs, j, global_env_sle);
 		}
 		SLIST_INSERT_HEAD(&j->global_env, ei, sle);
+		job_environ_changed();
 	} else {
 		SLIST_INSERT_HEAD(&j->env, ei, sle);
+		job_envp_flush(j);
 	}
 
 	job_log(j, LOG_DEBUG, "Added environmental variable: %s=%s", k, v);
@@ -5432,8 +8111,10 @@ envitem_delete(job_t j, struct envitem *ei, bool global)
 		if (SLIST_EMPTY(&j->global_env)) {
 			LIST_REMOVE(j, global_env_sle);
 		}
+		job_environ_changed();
 	} else {
 		SLIST_REMOVE(&j->env, ei, envitem, sle);
+		job_envp_flush(j);
 	}
 
 	free(ei);
@@ -5682,7 +8363,11 @@ job_keepalive(job_t j)
 		case OTHER_JOB_ENABLED:
 			wanted_state = true;
 		case OTHER_JOB_DISABLED:
-			if ((bool)job_find(NULL, si->what) == wanted_state) {
+			other_j = si->other;
+			if (other_j && (other_j->removing || other_j->removal_pending || other_j->mgr->shutting_down)) {
+				other_j = NULL;
+			}
+			if ((bool)other_j == wanted_state) {
 				job_log(j, LOG_DEBUG, "KeepAlive: The following job is %s: %s", wanted_state ? "enabled" : "disabled", si->what);
 				return true;
 			}
@@ -5690,7 +8375,7 @@ job_keepalive(job_t j)
 		case OTHER_JOB_ACTIVE:
 			wanted_state = true;
 		case OTHER_JOB_INACTIVE:
-			if ((other_j = job_find(NULL, si->what))) {
+			if ((other_j = si->other) && !other_j->removal_pending && !other_j->mgr->shutting_down) {
 				if ((bool)other_j->p == wanted_state) {
 					job_log(j, LOG_DEBUG, "KeepAlive: The following job is %s: %s", wanted_state ? "active" : "inactive", si->what);
 					return true;
@@ -5706,6 +8391,9 @@ job_keepalive(job_t j)
 const char *
 job_active(job_t j)
 {
+	if (j->spawn_helper_pending) {
+		return "Waiting on the spawn helper";
+	}
 	if (j->p && j->shutdown_monitor) {
 		return "Monitoring shutdown";
 	}
@@ -5758,14 +8446,14 @@ machservice_ignore(job_t j, struct machservice *ms)
 void
 machservice_resetport(job_t j, struct machservice *ms)
 {
-	LIST_REMOVE(ms, port_hash_sle);
+	machservice_hash_remove(&port_hash, ms);
 	(void)job_assumes_zero(j, launchd_mport_close_recv(ms->port));
 	(void)job_assumes_zero(j, launchd_mport_deallocate(ms->port));
 
 	ms->gen_num++;
 	(void)job_assumes_zero(j, launchd_mport_create_recv(&ms->port));
 	(void)job_assumes_zero(j, launchd_mport_make_send(ms->port));
-	LIST_INSERT_HEAD(&port_hash[HASH_PORT(ms->port)], ms, port_hash_sle);
+	machservice_hash_insert(&port_hash, ms);
 }
 
 void
@@ -5846,9 +8534,9 @@ machservice_new(job_t j, const char *name, mach_port_t *serviceport, bool pid_lo
 	 * uniquify the names ourselves to avoid collisions. This is just easier.
 	 */
 	if (!j->dedicated_instance) {
-		LIST_INSERT_HEAD(&where2put->ms_hash[hash_ms(ms->name)], ms, name_hash_sle);	
+		machservice_hash_insert(&where2put->ms_hash, ms);
 	}
-	LIST_INSERT_HEAD(&port_hash[HASH_PORT(ms->port)], ms, port_hash_sle);
+	machservice_hash_insert(&port_hash, ms);
 
 	if (ms->recv) {
 		machservice_stamp_port(j, ms);
@@ -5873,7 +8561,7 @@ machservice_new_alias(job_t j, struct machservice *orig)
 		ms->alias = orig;
 		ms->job = j;
 
-		LIST_INSERT_HEAD(&j->mgr->ms_hash[hash_ms(ms->name)], ms, name_hash_sle);
+		machservice_hash_insert(&j->mgr->ms_hash, ms);
 		SLIST_INSERT_HEAD(&j->machservices, ms, sle);
 		jobmgr_log(j->mgr, LOG_DEBUG, "Service aliased into job manager: %s", orig->name);
 	}
@@ -5881,6 +8569,200 @@ machservice_new_alias(job_t j, struct machservice *orig)
 	return ms;
 }
 
+void
+machservice_hash_init(struct machservice_hash *h)
+{
+	h->buckets = h->initial;
+	h->size = MACHSERVICE_HASH_SIZE;
+}
+
+void
+machservice_hash_destroy(struct machservice_hash *h)
+{
+	if (h->old_buckets && h->old_buckets != h->initial) {
+		free(h->old_buckets);
+	}
+	if (h->buckets && h->buckets != h->initial) {
+		free(h->buckets);
+	}
+	h->buckets = h->old_buckets = NULL;
+}
+
+size_t
+machservice_hash_key(struct machservice_hash *h, struct machservice *ms)
+{
+	return h->by_port ? MACH_PORT_INDEX(ms->port) : ms->name_hashval;
+}
+
+void
+machservice_hash_link(struct machservice_hash *h, struct machservice_list *bucket, struct machservice *ms)
+{
+	if (h->by_port) {
+		LIST_INSERT_HEAD(bucket, ms, port_hash_sle);
+	} else {
+		LIST_INSERT_HEAD(bucket, ms, name_hash_sle);
+	}
+}
+
+void
+machservice_hash_migrate(struct machservice_hash *h, size_t nbuckets)
+{
+	struct machservice *msi;
+
+	while (h->old_buckets && nbuckets--) {
+		struct machservice_list *from = &h->old_buckets[h->old_next];
+		while ((msi = LIST_FIRST(from))) {
+			if (h->by_port) {
+				LIST_REMOVE(msi, port_hash_sle);
+			} else {
+				LIST_REMOVE(msi, name_hash_sle);
+			}
+			machservice_hash_link(h, &h->buckets[machservice_hash_key(h, msi) & (h->size - 1)], msi);
+		}
+
+		if (++h->old_next == h->old_size) {
+			if (h->old_buckets != h->initial) {
+				free(h->old_buckets);
+			}
+			h->old_buckets = NULL;
+			h->old_size = 0;
+			h->old_next = 0;
+		}
+	}
+}
+
+void
+machservice_hash_insert(struct machservice_hash *h, struct machservice *ms)
+{
+	if (unlikely(h->old_buckets != NULL)) {
+		machservice_hash_migrate(h, MACHSERVICE_HASH_MIGRATE);
+	}
+
+	if (unlikely(h->count >= h->size * MACHSERVICE_HASH_LOAD)) {
+		machservice_hash_migrate(h, h->old_size);
+
+		// If this fails, we just keep using the current buckets.
+		struct machservice_list *nb = calloc(h->size * 2, sizeof(*nb));
+		if (nb) {
+			h->old_buckets = h->buckets;
+			h->old_size = h->size;
+			h->old_next = 0;
+			h->buckets = nb;
+			h->size *= 2;
+			h->resizes++;
+			machservice_hash_migrate(h, MACHSERVICE_HASH_MIGRATE);
+		}
+	}
+
+	if (!h->by_port) {
+		ms->name_hashval = our_strhash(ms->name);
+		ms->name_table = h;
+	}
+	h->per_pid_count += ms->per_pid ? 1 : 0;
+	machservice_hash_link(h, &h->buckets[machservice_hash_key(h, ms) & (h->size - 1)], ms);
+	if (++h->count > h->peak_count) {
+		h->peak_count = h->count;
+	}
+}
+
+/* Removal never moves other entries between buckets, so it is safe to call
+ * while walking a bucket with LIST_FOREACH_SAFE().
+ */
+void
+machservice_hash_remove(struct machservice_hash *h, struct machservice *ms)
+{
+	if (!h) {
+		return;
+	}
+
+	if (h->by_port) {
+		LIST_REMOVE(ms, port_hash_sle);
+	} else {
+		LIST_REMOVE(ms, name_hash_sle);
+		ms->name_table = NULL;
+	}
+	h->per_pid_count -= ms->per_pid ? 1 : 0;
+	h->count--;
+}
+
+struct machservice *
+machservice_hash_find_name(struct machservice_hash *h, const char *name)
+{
+	size_t hv = our_strhash(name);
+	struct machservice *ms;
+
+	if (unlikely(h->old_buckets != NULL)) {
+		machservice_hash_migrate(h, MACHSERVICE_HASH_MIGRATE);
+	}
+
+	LIST_FOREACH(ms, &h->buckets[hv & (h->size - 1)], name_hash_sle) {
+		if (!ms->per_pid && ms->name_hashval == hv && strcmp(name, ms->name) == 0) {
+			return ms;
+		}
+	}
+
+	if (h->old_buckets) {
+		LIST_FOREACH(ms, &h->old_buckets[hv & (h->old_size - 1)], name_hash_sle) {
+			if (!ms->per_pid && ms->name_hashval == hv && strcmp(name, ms->name) == 0) {
+				return ms;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+struct machservice *
+machservice_hash_find_recv(mach_port_t p)
+{
+	struct machservice *ms;
+
+	if (unlikely(port_hash.old_buckets != NULL)) {
+		machservice_hash_migrate(&port_hash, MACHSERVICE_HASH_MIGRATE);
+	}
+
+	LIST_FOREACH(ms, &port_hash.buckets[MACH_PORT_INDEX(p) & (port_hash.size - 1)], port_hash_sle) {
+		if (ms->recv && (ms->port == p)) {
+			return ms;
+		}
+	}
+
+	if (port_hash.old_buckets) {
+		LIST_FOREACH(ms, &port_hash.old_buckets[MACH_PORT_INDEX(p) & (port_hash.old_size - 1)], port_hash_sle) {
+			if (ms->recv && (ms->port == p)) {
+				return ms;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+void
+machservice_hash_log_stats(jobmgr_t jm, struct machservice_hash *h, const char *what)
+{
+	size_t i, used = 0, longest = 0;
+
+	for (i = 0; i < h->size; i++) {
+		size_t len = 0;
+		struct machservice *msi = NULL;
+		if (h->by_port) {
+			LIST_FOREACH(msi, &h->buckets[i], port_hash_sle) {
+				len++;
+			}
+		} else {
+			LIST_FOREACH(msi, &h->buckets[i], name_hash_sle) {
+				len++;
+			}
+		}
+
+		used += len ? 1 : 0;
+		longest = len > longest ? len : longest;
+	}
+
+	jobmgr_log(jm, LOG_PERF, "%s: %lu entries (%lu per-PID, peak %lu) in %lu/%lu buckets, longest chain %lu, %u resize%s%s", what, h->count, h->per_pid_count, h->peak_count, used, h->size, longest, h->resizes, h->resizes == 1 ? "" : "s", h->old_buckets ? ", resize in progress" : "");
+}
+
 bootstrap_status_t
 machservice_status(struct machservice *ms)
 {
@@ -5894,11 +8776,10 @@ machservice_status(struct machservice *ms)
 	}
 }
 
-void
-job_setup_exception_port(job_t j, task_t target_task)
+bool
+job_exception_port(job_t j, mach_port_t *port, thread_state_flavor_t *f)
 {
 	struct machservice *ms;
-	thread_state_flavor_t f = 0;
 	mach_port_t exc_port = the_exception_server;
 
 	if (unlikely(j->alt_exc_handler)) {
@@ -5911,19 +8792,33 @@ job_setup_exception_port(job_t j, task_t target_task)
 	} else if (unlikely(j->internal_exc_handler)) {
 		exc_port = runtime_get_kernel_port();
 	} else if (unlikely(!exc_port)) {
-		return;
+		return false;
 	}
 
 #if defined (__ppc__) || defined(__ppc64__)
-	f = PPC_THREAD_STATE64;
+	*f = PPC_THREAD_STATE64;
 #elif defined(__i386__) || defined(__x86_64__)
-	f = x86_THREAD_STATE;
+	*f = x86_THREAD_STATE;
 #elif defined(__arm__)
-	f = ARM_THREAD_STATE;
+	*f = ARM_THREAD_STATE;
 #else
 #error "unknown architecture"
 #endif
 
+	*port = exc_port;
+	return true;
+}
+
+void
+job_setup_exception_port(job_t j, task_t target_task)
+{
+	thread_state_flavor_t f = 0;
+	mach_port_t exc_port = MACH_PORT_NULL;
+
+	if (!job_exception_port(j, &exc_port, &f)) {
+		return;
+	}
+
 	if (likely(target_task)) {
 		kern_return_t kr = task_set_exception_ports(target_task, EXC_MASK_CRASH | EXC_MASK_RESOURCE, exc_port, EXCEPTION_STATE_IDENTITY | MACH_EXCEPTION_CODES, f);
 		if (kr) {
@@ -6049,73 +8944,82 @@ machservice_setup(launch_data_t obj, const char *key, void *context)
 	}
 }
 
+/* Work through the job managers queued since the last pass. Returns jm, or NULL
+ * if it was removed along the way.
+ */
 jobmgr_t
 jobmgr_do_garbage_collection(jobmgr_t jm)
 {
-	jobmgr_t jmi = NULL, jmn = NULL;
-	SLIST_FOREACH_SAFE(jmi, &jm->submgrs, sle, jmn) {
-		jobmgr_do_garbage_collection(jmi);
-	}
+	jobmgr_t jmi;
 
-	if (!jm->shutting_down) {
-		return jm;
-	}
+	while ((jmi = LIST_FIRST(&s_gc_queue))) {
+		bool target = (jmi == jm);
 
-	if (SLIST_EMPTY(&jm->submgrs)) {
-		jobmgr_log(jm, LOG_DEBUG, "No submanagers left.");
-	} else {
-		jobmgr_log(jm, LOG_DEBUG, "Still have submanagers.");
-		SLIST_FOREACH(jmi, &jm->submgrs, sle) {
-			jobmgr_log(jm, LOG_DEBUG, "Submanager: %s", jmi->name);
+		s_gc_passes++;
+		if (!jobmgr_collect(jmi)) {
+			if (target) {
+				jm = NULL;
+			}
+			continue;
 		}
+
+		/* Stay queued while collecting, so that jobs marked along the way just
+		 * land on gc_jobs and are picked up by the same pass.
+		 */
+		LIST_REMOVE(jmi, gc_sle);
+		jmi->gc_queued = false;
 	}
 
-	size_t actives = 0;
-	job_t ji = NULL, jn = NULL;
-	LIST_FOREACH_SAFE(ji, &jm->jobs, sle, jn) {
-		if (ji->anonymous) {
-			continue;
-		}
+	return jm;
+}
 
-		// Let the shutdown monitor be up until the very end.
-		if (ji->shutdown_monitor) {
-			continue;
-		}
+void
+jobmgr_gc_queue(jobmgr_t jm, bool all_jobs)
+{
+	if (!jm->shutting_down) {
+		return;
+	}
 
-		/* On our first pass through, open a transaction for all the jobs that
-		 * need to be dirty at shutdown. We'll close these transactions once the
-		 * jobs that do not need to be dirty at shutdown have all exited.
-		 */
-		if (ji->dirty_at_shutdown && !jm->shutdown_jobs_dirtied) {
-			job_open_shutdown_transaction(ji);
+	if (all_jobs) {
+		jobmgr_t jmi;
+
+		jm->gc_all_jobs = true;
+		SLIST_FOREACH(jmi, &jm->submgrs, sle) {
+			jobmgr_gc_queue(jmi, true);
 		}
+	}
 
-		const char *active = job_active(ji);
-		if (!active) {
-			job_remove(ji);
-		} else {
-			job_log(ji, LOG_DEBUG, "Job is active: %s", active);
-			job_stop(ji);
+	if (!jm->gc_queued) {
+		jm->gc_queued = true;
+		LIST_INSERT_HEAD(&s_gc_queue, jm, gc_sle);
+	}
+}
 
-			if (!ji->dirty_at_shutdown) {
-				actives++;
-			}
+jobmgr_t
+jobmgr_collect(jobmgr_t jm)
+{
+	job_t ji, jn;
 
-			if (ji->clean_kill) {
-				job_log(ji, LOG_DEBUG, "Job was killed cleanly.");
-			} else {
-				job_log(ji, LOG_DEBUG, "Job was sent SIGTERM%s.", ji->sent_sigkill ? " and SIGKILL" : "");
-			}
+again:
+	if (jm->gc_all_jobs) {
+		jm->gc_all_jobs = false;
+		LIST_FOREACH_SAFE(ji, &jm->jobs, sle, jn) {
+			job_collect(ji);
 		}
+		jm->shutdown_jobs_dirtied = true;
+	}
+
+	while ((ji = LIST_FIRST(&jm->gc_jobs))) {
+		job_collect(ji);
 	}
 
-	jm->shutdown_jobs_dirtied = true;
-	if (actives == 0) {
+	if (jm->gc_active_cnt == 0) {
 		if (!jm->shutdown_jobs_cleaned) {
 			/* Once all normal jobs have exited, we clean the dirty-at-shutdown
-			 * jobs and make them into normal jobs so that the above loop will
-			 * handle them appropriately.
+			 * jobs and make them into normal jobs so that they are waited on
+			 * like the others.
 			 */
+			jm->shutdown_jobs_exited = runtime_get_opaque_time();
 			LIST_FOREACH(ji, &jm->jobs, sle) {
 				if (ji->anonymous) {
 					continue;
@@ -6130,17 +9034,21 @@ jobmgr_do_garbage_collection(jobmgr_t jm)
 				}
 
 				job_close_shutdown_transaction(ji);
-				actives++;
+				job_gc_count(ji, true);
 			}
 
 			jm->shutdown_jobs_cleaned = true;
 		}
 
-		if (SLIST_EMPTY(&jm->submgrs) && actives == 0) {
+		if (SLIST_EMPTY(&jm->submgrs) && jm->gc_active_cnt == 0) {
+			if (!jm->shutdown_drained) {
+				jm->shutdown_drained = runtime_get_opaque_time();
+			}
+
 			/* We may be in a situation where the shutdown monitor is all that's
 			 * left, in which case we want to stop it. Like dirty-at-shutdown
-			 * jobs, we turn it back into a normal job so that the main loop
-			 * treats it appropriately.
+			 * jobs, we turn it back into a normal job so that it is waited on
+			 * like any other.
 			 *
 			 * See:
 			 * <rdar://problem/10756306>
@@ -6151,11 +9059,15 @@ jobmgr_do_garbage_collection(jobmgr_t jm)
 				/* The rest of shutdown has completed, so we can kill the shutdown
 				 * monitor now like it was any other job.
 				 */
-				_launchd_shutdown_monitor->shutdown_monitor = false;
-				
-				job_log(_launchd_shutdown_monitor, LOG_NOTICE | LOG_CONSOLE, "Stopping shutdown monitor.");
-				job_stop(_launchd_shutdown_monitor);
+				job_t monitor = _launchd_shutdown_monitor;
+
+				monitor->shutdown_monitor = false;
 				_launchd_shutdown_monitor = NULL;
+
+				job_log(monitor, LOG_NOTICE | LOG_CONSOLE, "Stopping shutdown monitor.");
+				job_stop(monitor);
+				job_gc_mark(monitor);
+				goto again;
 			} else {
 				jobmgr_log(jm, LOG_DEBUG, "Removing.");
 				jobmgr_remove(jm);
@@ -6167,6 +9079,90 @@ jobmgr_do_garbage_collection(jobmgr_t jm)
 	return jm;
 }
 
+void
+job_gc_mark(job_t j)
+{
+	if (!j->mgr->shutting_down) {
+		return;
+	}
+
+	if (!j->gc_dirty) {
+		j->gc_dirty = true;
+		LIST_INSERT_HEAD(&j->mgr->gc_jobs, j, gc_sle);
+	}
+	jobmgr_gc_queue(j->mgr, false);
+}
+
+void
+job_gc_forget(job_t j)
+{
+	if (j->gc_dirty) {
+		LIST_REMOVE(j, gc_sle);
+		j->gc_dirty = false;
+	}
+	job_gc_count(j, false);
+	jobmgr_gc_queue(j->mgr, false);
+}
+
+void
+job_gc_count(job_t j, bool count)
+{
+	if (count == j->gc_counted) {
+		return;
+	}
+
+	j->gc_counted = count;
+	if (count) {
+		j->mgr->gc_active_cnt++;
+	} else {
+		j->mgr->gc_active_cnt--;
+	}
+}
+
+// Stop or remove a job whose manager is shutting down.
+void
+job_collect(job_t j)
+{
+	jobmgr_t jm = j->mgr;
+
+	if (j->gc_dirty) {
+		LIST_REMOVE(j, gc_sle);
+		j->gc_dirty = false;
+	}
+	s_gc_job_visits++;
+
+	// Let the shutdown monitor be up until the very end.
+	if (j->anonymous || j->shutdown_monitor) {
+		job_gc_count(j, false);
+		return;
+	}
+
+	/* On our first pass through, open a transaction for all the jobs that
+	 * need to be dirty at shutdown. We'll close these transactions once the
+	 * jobs that do not need to be dirty at shutdown have all exited.
+	 */
+	if (j->dirty_at_shutdown && !jm->shutdown_jobs_dirtied) {
+		job_open_shutdown_transaction(j);
+	}
+
+	const char *active = job_active(j);
+	if (!active) {
+		job_gc_count(j, false);
+		job_remove(j);
+		return;
+	}
+
+	job_log(j, LOG_DEBUG, "Job is active: %s", active);
+	job_stop(j);
+	job_gc_count(j, !j->dirty_at_shutdown);
+
+	if (j->clean_kill) {
+		job_log(j, LOG_DEBUG, "Job was killed cleanly.");
+	} else {
+		job_log(j, LOG_DEBUG, "Job was sent SIGTERM%s.", j->sent_sigkill ? " and SIGKILL" : "");
+	}
+}
+
 void
 jobmgr_kill_stray_children(jobmgr_t jm, pid_t *p, size_t np)
 {
@@ -6317,6 +9313,8 @@ jobmgr_new(jobmgr_t jm, mach_port_t requestorport, mach_port_t transfer_port, bo
 
 	jmr->kqjobmgr_callback = jobmgr_callback;
 	strcpy(jmr->name_init, name ? name : "Under construction");
+	label_hash_init(&jmr->label_hash);
+	machservice_hash_init(&jmr->ms_hash);
 
 	jmr->req_port = requestorport;
 
@@ -6367,10 +9365,13 @@ jobmgr_new(jobmgr_t jm, mach_port_t requestorport, mach_port_t transfer_port, bo
 		sprintf(jmr->name_init, "%u", MACH_PORT_INDEX(jmr->jm_port));
 	}
 
+	jobmgr_mig_port_add(jmr);
+
 	if (!jm) {
 		(void)jobmgr_assumes_zero_p(jmr, kevent_mod(SIGTERM, EVFILT_SIGNAL, EV_ADD, 0, 0, jmr));
 		(void)jobmgr_assumes_zero_p(jmr, kevent_mod(SIGUSR1, EVFILT_SIGNAL, EV_ADD, 0, 0, jmr));
 		(void)jobmgr_assumes_zero_p(jmr, kevent_mod(SIGUSR2, EVFILT_SIGNAL, EV_ADD, 0, 0, jmr));
+		(void)jobmgr_assumes_zero_p(jmr, kevent_mod(SIGHUP, EVFILT_SIGNAL, EV_ADD, 0, 0, jmr));
 		(void)jobmgr_assumes_zero_p(jmr, kevent_mod(0, EVFILT_FS, EV_ADD, VQ_MOUNT|VQ_UNMOUNT|VQ_UPDATE, 0, jmr));
 	}
 
@@ -6564,7 +9565,11 @@ jobmgr_delete_anything_with_port(jobmgr_t jm, mach_port_t port)
 			return jobmgr_shutdown(jm);
 		}
 
-		LIST_FOREACH_SAFE(ms, &port_hash[HASH_PORT(port)], port_hash_sle, next_ms) {
+		/* Deleting services does not move anything between buckets, so once
+		 * any pending resize is finished the bucket is stable to walk.
+		 */
+		machservice_hash_migrate(&port_hash, port_hash.old_size);
+		LIST_FOREACH_SAFE(ms, &port_hash.buckets[MACH_PORT_INDEX(port) & (port_hash.size - 1)], port_hash_sle, next_ms) {
 			if (ms->port == port && !ms->recv) {
 				machservice_delete(ms->job, ms, true);
 			}
@@ -6623,10 +9628,8 @@ jobmgr_lookup_service(jobmgr_t jm, const char *name, bool check_parent, pid_t ta
 		}
 	}
 
-	LIST_FOREACH(ms, &where2look->ms_hash[hash_ms(name)], name_hash_sle) {
-		if (!ms->per_pid && strcmp(name, ms->name) == 0) {
-			return ms;
-		}
+	if ((ms = machservice_hash_find_name(&where2look->ms_hash, name))) {
+		return ms;
 	}
 
 	if (jm->parentmgr == NULL || !check_parent) {
@@ -6721,7 +9724,7 @@ machservice_delete(job_t j, struct machservice *ms, bool port_died)
 		 * pretty simple affair since they can't and shouldn't have any complex
 		 * behaviors associated with them.
 		 */
-		LIST_REMOVE(ms, name_hash_sle);
+		machservice_hash_remove(ms->name_table, ms);
 		SLIST_REMOVE(&j->machservices, ms, machservice, sle);
 		free(ms);
 		return;
@@ -6751,9 +9754,9 @@ machservice_delete(job_t j, struct machservice *ms, bool port_died)
 	SLIST_REMOVE(&j->machservices, ms, machservice, sle);
 
 	if (!(j->dedicated_instance || ms->event_channel)) {
-		LIST_REMOVE(ms, name_hash_sle);
+		machservice_hash_remove(ms->name_table, ms);
 	}
-	LIST_REMOVE(ms, port_hash_sle);
+	machservice_hash_remove(&port_hash, ms);
 
 	free(ms);
 }
@@ -6831,6 +9834,7 @@ void
 job_checkin(job_t j)
 {
 	j->checkedin = true;
+	job_spawn_sched_release(j);
 }
 
 bool job_is_god(job_t j)
@@ -6844,13 +9848,7 @@ job_ack_port_destruction(mach_port_t p)
 	struct machservice *ms;
 	job_t j;
 
-	LIST_FOREACH(ms, &port_hash[HASH_PORT(p)], port_hash_sle) {
-		if (ms->recv && (ms->port == p)) {
-			break;
-		}
-	}
-
-	if (!ms) {
+	if (!(ms = machservice_hash_find_recv(p))) {
 		launchd_syslog(LOG_WARNING, "Could not find MachService to match receive right: 0x%x", p);
 		return false;
 	}
@@ -6908,6 +9906,7 @@ job_ack_no_senders(job_t j)
 {
 	j->priv_port_has_senders = false;
 
+	job_mig_port_del(j);
 	(void)job_assumes_zero(j, launchd_mport_close_recv(j->j_port));
 	j->j_port = 0;
 
@@ -6938,10 +9937,27 @@ semaphoreitem_new(job_t j, semaphore_reason_t why, const char *what)
 
 	SLIST_INSERT_HEAD(&j->semaphores, si, sle);
 
-	if ((why == OTHER_JOB_ENABLED || why == OTHER_JOB_DISABLED) && !j->nosy) {
+	if (why == NETWORK_UP || why == NETWORK_DOWN) {
+		job_subscribe(j, KEEPALIVE_EVENT_NETWORK);
+	}
+
+	if (semaphoreitem_watches(si)) {
+		job_t closer;
+
 		job_log(j, LOG_DEBUG, "Job is interested in \"%s\".", what);
-		SLIST_INSERT_HEAD(&s_curious_jobs, j, curious_jobs_sle);
-		j->nosy = true;
+		si->job = j;
+		si->what_hashval = our_strhash(what);
+		si->other = root_jobmgr ? job_find(NULL, what) : NULL;
+		LIST_INSERT_HEAD(&s_semaphore_watchers[si->what_hashval & (SEMAPHORE_WATCH_HASH_SIZE - 1)], si, watch_sle);
+
+		/* Report a dependency loop when the edge closing it is added, rather
+		 * than when the jobs start dispatching each other.
+		 */
+		if (strcmp(what, j->label) == 0) {
+			job_log(j, LOG_WARNING, "KeepAlive criterion depends on this job's own state.");
+		} else if (si->other && (closer = semaphoreitem_find_cycle(si->other, j->label, ++s_semaphore_watch_pass))) {
+			job_log(j, LOG_WARNING, "KeepAlive criterion on \"%s\" is circular: \"%s\" depends on this job.", what, closer->label);
+		}
 	}
 
 	semaphoreitem_runtime_mod_ref(si, true);
@@ -6983,15 +9999,75 @@ semaphoreitem_delete(job_t j, struct semaphoreitem *si)
 
 	SLIST_REMOVE(&j->semaphores, si, semaphoreitem, sle);
 
-	// We'll need to rethink this if it ever becomes possible to dynamically add or remove semaphores.
-	if ((si->why == OTHER_JOB_ENABLED || si->why == OTHER_JOB_DISABLED) && j->nosy) {
-		j->nosy = false;
-		SLIST_REMOVE(&s_curious_jobs, j, job_s, curious_jobs_sle);
+	if (semaphoreitem_watches(si)) {
+		LIST_REMOVE(si, watch_sle);
+	}
+
+	if (si->why == NETWORK_UP || si->why == NETWORK_DOWN) {
+		struct semaphoreitem *sii;
+		bool network = false;
+
+		SLIST_FOREACH(sii, &j->semaphores, sle) {
+			network |= (sii->why == NETWORK_UP || sii->why == NETWORK_DOWN);
+		}
+		if (!network) {
+			job_unsubscribe(j, KEEPALIVE_EVENT_NETWORK);
+		}
 	}
 
 	free(si);
 }
 
+bool
+semaphoreitem_watches(struct semaphoreitem *si)
+{
+	switch (si->why) {
+	case OTHER_JOB_ENABLED:
+	case OTHER_JOB_DISABLED:
+	case OTHER_JOB_ACTIVE:
+	case OTHER_JOB_INACTIVE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Walk the OtherJob criteria outward from other, looking for one that refers
+ * back to label. Returns the job holding that criterion. Each job is visited
+ * once per pass, so this is linear in the number of criteria. Jobs waiting to
+ * be visited are chained through watch_next rather than the C stack, so no
+ * chain of jobs is too long to walk.
+ */
+job_t
+semaphoreitem_find_cycle(job_t other, const char *label, unsigned int pass)
+{
+	struct semaphoreitem *si;
+	job_t pending = other;
+
+	other->watch_pass = pass;
+	other->watch_next = NULL;
+
+	while ((other = pending)) {
+		pending = other->watch_next;
+
+		SLIST_FOREACH(si, &other->semaphores, sle) {
+			if (!semaphoreitem_watches(si)) {
+				continue;
+			}
+			if (strcmp(si->what, label) == 0) {
+				return other;
+			}
+			if (si->other && si->other->watch_pass != pass) {
+				si->other->watch_pass = pass;
+				si->other->watch_next = pending;
+				pending = si->other;
+			}
+		}
+	}
+
+	return NULL;
+}
+
 void
 semaphoreitem_setup_dict_iter(launch_data_t obj, const char *key, void *context)
 {
@@ -7216,193 +10292,60 @@ eventsystem_ping(void)
 }
 
 void
-jobmgr_dispatch_all_semaphores(jobmgr_t jm)
+job_subscribe(job_t j, keepalive_event_t ev)
 {
-	jobmgr_t jmi, jmn;
-	job_t ji, jn;
-
-
-	SLIST_FOREACH_SAFE(jmi, &jm->submgrs, sle, jmn) {
-		jobmgr_dispatch_all_semaphores(jmi);
+	if (j->keepalive_events & (1 << ev)) {
+		return;
 	}
 
-	LIST_FOREACH_SAFE(ji, &jm->jobs, sle, jn) {
-		if (!SLIST_EMPTY(&ji->semaphores)) {
-			job_dispatch(ji, false);
-		}
-	}
+	j->keepalive_events |= (1 << ev);
+	LIST_INSERT_HEAD(&s_keepalive_subscribers[ev], j, keepalive_sle[ev]);
+	s_keepalive_subscriber_cnt[ev]++;
 }
 
-time_t
-cronemu(int mon, int mday, int hour, int min)
+void
+job_unsubscribe(job_t j, keepalive_event_t ev)
 {
-	struct tm workingtm;
-	time_t now;
-
-	now = time(NULL);
-	workingtm = *localtime(&now);
-
-	workingtm.tm_isdst = -1;
-	workingtm.tm_sec = 0;
-	workingtm.tm_min++;
-
-	while (!cronemu_mon(&workingtm, mon, mday, hour, min)) {
-		workingtm.tm_year++;
-		workingtm.tm_mon = 0;
-		workingtm.tm_mday = 1;
-		workingtm.tm_hour = 0;
-		workingtm.tm_min = 0;
-		mktime(&workingtm);
+	if (!(j->keepalive_events & (1 << ev))) {
+		return;
 	}
 
-	return mktime(&workingtm);
+	j->keepalive_events &= ~(1 << ev);
+	LIST_REMOVE(j, keepalive_sle[ev]);
+	s_keepalive_subscriber_cnt[ev]--;
 }
 
-time_t
-cronemu_wday(int wday, int hour, int min)
+/* Dispatch only the jobs whose KeepAlive or launch criteria can change with
+ * this event. Criteria on a job's own exit status are re-evaluated when it
+ * exits, and the OtherJob ones through s_semaphore_watchers.
+ */
+void
+job_dispatch_subscribers(keepalive_event_t ev)
 {
-	struct tm workingtm;
-	time_t now;
-
-	now = time(NULL);
-	workingtm = *localtime(&now);
-
-	workingtm.tm_isdst = -1;
-	workingtm.tm_sec = 0;
-	workingtm.tm_min++;
-
-	if (wday == 7) {
-		wday = 0;
-	}
-
-	while (!(workingtm.tm_wday == wday && cronemu_hour(&workingtm, hour, min))) {
-		workingtm.tm_mday++;
-		workingtm.tm_hour = 0;
-		workingtm.tm_min = 0;
-		mktime(&workingtm);
-	}
-
-	return mktime(&workingtm);
-}
-
-bool
-cronemu_mon(struct tm *wtm, int mon, int mday, int hour, int min)
-{
-	if (mon == -1) {
-		struct tm workingtm = *wtm;
-		int carrytest;
-
-		while (!cronemu_mday(&workingtm, mday, hour, min)) {
-			workingtm.tm_mon++;
-			workingtm.tm_mday = 1;
-			workingtm.tm_hour = 0;
-			workingtm.tm_min = 0;
-			carrytest = workingtm.tm_mon;
-			mktime(&workingtm);
-			if (carrytest != workingtm.tm_mon) {
-				return false;
-			}
-		}
-		*wtm = workingtm;
-		return true;
-	}
-
-	if (mon < wtm->tm_mon) {
-		return false;
-	}
-
-	if (mon > wtm->tm_mon) {
-		wtm->tm_mon = mon;
-		wtm->tm_mday = 1;
-		wtm->tm_hour = 0;
-		wtm->tm_min = 0;
-	}
-
-	return cronemu_mday(wtm, mday, hour, min);
-}
-
-bool
-cronemu_mday(struct tm *wtm, int mday, int hour, int min)
-{
-	if (mday == -1) {
-		struct tm workingtm = *wtm;
-		int carrytest;
-
-		while (!cronemu_hour(&workingtm, hour, min)) {
-			workingtm.tm_mday++;
-			workingtm.tm_hour = 0;
-			workingtm.tm_min = 0;
-			carrytest = workingtm.tm_mday;
-			mktime(&workingtm);
-			if (carrytest != workingtm.tm_mday) {
-				return false;
-			}
-		}
-		*wtm = workingtm;
-		return true;
-	}
-
-	if (mday < wtm->tm_mday) {
-		return false;
-	}
+	LIST_HEAD(, job_s) pending = { NULL };
+	job_t ji;
 
-	if (mday > wtm->tm_mday) {
-		wtm->tm_mday = mday;
-		wtm->tm_hour = 0;
-		wtm->tm_min = 0;
+	/* Dispatching one job can remove others, so take the subscribers off the
+	 * list and put each back just before it is dispatched. A job that goes
+	 * away unlinks itself from whichever of the two lists it is on.
+	 */
+	while ((ji = LIST_FIRST(&s_keepalive_subscribers[ev]))) {
+		LIST_REMOVE(ji, keepalive_sle[ev]);
+		LIST_INSERT_HEAD(&pending, ji, keepalive_sle[ev]);
 	}
 
-	return cronemu_hour(wtm, hour, min);
-}
+	s_keepalive_event_cnt++;
+	while ((ji = LIST_FIRST(&pending))) {
+		LIST_REMOVE(ji, keepalive_sle[ev]);
+		LIST_INSERT_HEAD(&s_keepalive_subscribers[ev], ji, keepalive_sle[ev]);
 
-bool
-cronemu_hour(struct tm *wtm, int hour, int min)
-{
-	if (hour == -1) {
-		struct tm workingtm = *wtm;
-		int carrytest;
-
-		while (!cronemu_min(&workingtm, min)) {
-			workingtm.tm_hour++;
-			workingtm.tm_min = 0;
-			carrytest = workingtm.tm_hour;
-			mktime(&workingtm);
-			if (carrytest != workingtm.tm_hour) {
-				return false;
-			}
+		if (ev == KEEPALIVE_EVENT_MOUNT) {
+			ji->start_pending = true;
 		}
-		*wtm = workingtm;
-		return true;
-	}
-
-	if (hour < wtm->tm_hour) {
-		return false;
-	}
-
-	if (hour > wtm->tm_hour) {
-		wtm->tm_hour = hour;
-		wtm->tm_min = 0;
-	}
-
-	return cronemu_min(wtm, min);
-}
-
-bool
-cronemu_min(struct tm *wtm, int min)
-{
-	if (min == -1) {
-		return true;
-	}
-
-	if (min < wtm->tm_min) {
-		return false;
-	}
 
-	if (min > wtm->tm_min) {
-		wtm->tm_min = min;
+		s_keepalive_dispatch_cnt++;
+		job_dispatch(ji, false);
 	}
-
-	return true;
 }
 
 kern_return_t
@@ -7561,6 +10504,7 @@ job_mig_swap_complex(job_t j, vproc_gsk_t inkey, vproc_gsk_t outkey,
 {
 	const char *action;
 	launch_data_t input_obj = NULL, output_obj = NULL;
+	launch_data_arena_t arena = NULL;
 	size_t data_offset = 0;
 	size_t packed_size;
 	struct ldcred *ldc = runtime_get_caller_creds();
@@ -7618,7 +10562,14 @@ job_mig_swap_complex(job_t j, vproc_gsk_t inkey, vproc_gsk_t outkey,
 		launch_data_free(output_obj);
 		break;
 	case VPROC_GSK_ALLJOBS:
-		if (!job_assumes(j, (output_obj = job_export_all()) != NULL)) {
+		if ((arena = launch_data_arena_create(0))) {
+			launch_data_arena_t prev = launch_data_arena_set_current(arena);
+			output_obj = job_export_all();
+			launch_data_arena_set_current(prev);
+		} else {
+			output_obj = job_export_all();
+		}
+		if (!job_assumes(j, output_obj != NULL)) {
 			goto out_bad;
 		}
 		ipc_revoke_fds(output_obj);
@@ -7665,6 +10616,9 @@ job_mig_swap_complex(job_t j, vproc_gsk_t inkey, vproc_gsk_t outkey,
 	}
 
 	mig_deallocate(inval, invalCnt);
+	if (arena) {
+		launch_data_arena_free(arena);
+	}
 	return 0;
 
 out_bad:
@@ -7675,6 +10629,9 @@ out_bad:
 	if (output_obj) {
 		launch_data_free(output_obj);
 	}
+	if (arena) {
+		launch_data_arena_free(arena);
+	}
 
 	return 1;
 }
@@ -7786,9 +10743,9 @@ job_mig_swap_integer(job_t j, vproc_gsk_t inkey, vproc_gsk_t outkey, int64_t inv
 				runtime_add_weak_ref();
 			}
 			j->start_interval = (typeof(j->start_interval)) inval;
-			(void)job_assumes_zero_p(j, kevent_mod((uintptr_t)&j->start_interval, EVFILT_TIMER, EV_ADD, NOTE_SECONDS, j->start_interval, j));
+			job_arm_start_interval(j);
 		} else if (j->start_interval) {
-			(void)job_assumes_zero_p(j, kevent_mod((uintptr_t)&j->start_interval, EVFILT_TIMER, EV_DELETE, 0, 0, NULL));
+			runtime_timer_disarm(&j->start_interval_timer);
 			if (j->start_interval != 0) {
 				runtime_del_weak_ref();
 			}
@@ -8611,12 +11568,7 @@ job_mig_info(job_t j, name_array_t *servicenamesp,
 
 	unsigned int i = 0;
 	struct machservice *msi = NULL;
-	for (i = 0; i < MACHSERVICE_HASH_SIZE; i++) {
-		LIST_FOREACH(msi, &jm->ms_hash[i], name_hash_sle) {
-			cnt += !msi->per_pid ? 1 : 0;
-		}
-	}
-
+	cnt = jm->ms_hash.count - jm->ms_hash.per_pid_count;
 	if (cnt == 0) {
 		goto out;
 	}
@@ -8636,8 +11588,9 @@ job_mig_info(job_t j, name_array_t *servicenamesp,
 		goto out_bad;
 	}
 
-	for (i = 0; i < MACHSERVICE_HASH_SIZE; i++) {
-		LIST_FOREACH(msi, &jm->ms_hash[i], name_hash_sle) {
+	machservice_hash_migrate(&jm->ms_hash, jm->ms_hash.old_size);
+	for (i = 0; i < jm->ms_hash.size; i++) {
+		LIST_FOREACH(msi, &jm->ms_hash.buckets[i], name_hash_sle) {
 			if (!msi->per_pid) {
 				strlcpy(service_names[cnt2], machservice_name(msi), sizeof(service_names[0]));
 				msi = msi->alias ? msi->alias : msi;
@@ -8968,7 +11921,7 @@ job_mig_move_subset(job_t j, mach_port_t target_subset, name_t session_type, mac
 		return BOOTSTRAP_NO_MEMORY;
 	}
 
-	if (job_mig_intran2(root_jobmgr, target_subset, ldc->pid)) {
+	if (job_mig_intran_port(target_subset, ldc->pid)) {
 		job_log(j, LOG_ERR, "Moving a session to ourself is bogus.");
 
 		kr = BOOTSTRAP_NOT_PRIVILEGED;
@@ -9001,14 +11954,15 @@ job_mig_move_subset(job_t j, mach_port_t target_subset, name_t session_type, mac
 		// This is so awful.
 		// Remove the job from its current job manager.
 		LIST_REMOVE(j, sle);
-		LIST_REMOVE(j, pid_hash_sle);
+		job_gc_forget(j);
 
-		// Put the job into the target job manager.
+		// Put the job into the target job manager. The PID index is global.
 		LIST_INSERT_HEAD(&jmr->jobs, j, sle);
-		LIST_INSERT_HEAD(&jmr->active_jobs[ACTIVE_JOB_HASH(j->p)], j, pid_hash_sle);
 
 		j->mgr = jmr;
+		job_gc_mark(j);
 		job_set_global_on_demand(j, true);
+		job_environ_changed();
 
 		if (!j->holds_ref) {
 			job_log(j, LOG_PERF, "Job moved subset into: %s", j->mgr->name);
@@ -9173,7 +12127,6 @@ job_mig_switch_to_session(job_t j, mach_port_t requestor_port, name_t session_na
 
 	// Remove the job from it's current job manager.
 	LIST_REMOVE(j, sle);
-	LIST_REMOVE(j, pid_hash_sle);
 
 	job_t ji = NULL, jit = NULL;
 	LIST_FOREACH_SAFE(ji, &j->mgr->global_env_jobs, global_env_sle, jit) {
@@ -9185,7 +12138,6 @@ job_mig_switch_to_session(job_t j, mach_port_t requestor_port, name_t session_na
 
 	// Put the job into the target job manager.
 	LIST_INSERT_HEAD(&target_jm->jobs, j, sle);
-	LIST_INSERT_HEAD(&target_jm->active_jobs[ACTIVE_JOB_HASH(j->p)], j, pid_hash_sle);
 
 	if (ji) {
 		LIST_INSERT_HEAD(&target_jm->global_env_jobs, j, global_env_sle);
@@ -9195,12 +12147,15 @@ job_mig_switch_to_session(job_t j, mach_port_t requestor_port, name_t session_na
 	if (!launchd_flat_mach_namespace && !SLIST_EMPTY(&j->machservices)) {
 		struct machservice *msi = NULL, *msit = NULL;
 		SLIST_FOREACH_SAFE(msi, &j->machservices, sle, msit) {
-			LIST_REMOVE(msi, name_hash_sle);
-			LIST_INSERT_HEAD(&target_jm->ms_hash[hash_ms(msi->name)], msi, name_hash_sle);
+			machservice_hash_remove(msi->name_table, msi);
+			machservice_hash_insert(&target_jm->ms_hash, msi);
 		}
 	}
 
+	job_gc_forget(j);
 	j->mgr = target_jm;
+	job_environ_changed();
+	job_gc_mark(j);
 
 	if (!j->holds_ref) {
 		/* Anonymous jobs which move around are particularly interesting to us, so we want to
@@ -9336,6 +12291,7 @@ job_mig_take_subset(job_t j, mach_port_t *reqport, mach_port_t *rcvright,
 	*reqport = jm->req_port;
 	*rcvright = jm->jm_port;
 
+	jobmgr_mig_port_del(jm);
 	jm->req_port = 0;
 	jm->jm_port = 0;
 
@@ -9827,7 +12783,7 @@ xpc_event_find_channel(job_t j, const char *stream, struct machservice **ms)
 		 * bootstrap_look_up().
 		 */
 		if (!j->dedicated_instance) {
-			LIST_REMOVE(msi, name_hash_sle);
+			machservice_hash_remove(msi->name_table, msi);
 		}
 		msi->event_channel = true;
 
@@ -10589,8 +13545,16 @@ void
 jobmgr_init(bool sflag)
 {
 	const char *root_session_type = pid1_magic ? VPROCMGR_SESSION_SYSTEM : VPROCMGR_SESSION_BACKGROUND;
-	SLIST_INIT(&s_curious_jobs);
+	size_t i;
+
+	for (i = 0; i < SEMAPHORE_WATCH_HASH_SIZE; i++) {
+		LIST_INIT(&s_semaphore_watchers[i]);
+	}
+	for (i = 0; i < KEEPALIVE_EVENT_CNT; i++) {
+		LIST_INIT(&s_keepalive_subscribers[i]);
+	}
 	LIST_INIT(&s_needing_sessions);
+	LIST_INIT(&s_spawn_helper_pending);
 
 	osx_assert((root_jobmgr = jobmgr_new(NULL, MACH_PORT_NULL, MACH_PORT_NULL, sflag, root_session_type, false, MACH_PORT_NULL)) != NULL);
 	osx_assert((_s_xpc_system_domain = jobmgr_new_xpc_singleton_domain(root_jobmgr, "com.apple.xpc.system")) != NULL);
@@ -10609,6 +13573,8 @@ jobmgr_init(bool sflag)
 		}
 	}
 	s_no_hang_fd = _fd(s_no_hang_fd);
+
+	(void)spawn_helper_start();
 }
 
 size_t
@@ -10624,19 +13590,148 @@ our_strhash(const char *s)
 		r = ((r << 5) + r) + c; // hash*33 + c
 	}
 
+	/* The hash tables index with a power-of-two mask, and djb2's low bits
+	 * barely change between labels like "foo.1", "foo.2", so fold the high
+	 * bits back in.
+	 */
+	r = (r ^ (r >> 16)) * 0x45d9f3b;
+	r ^= r >> 16;
+
 	return r;
 }
 
-size_t
-hash_label(const char *label)
+void
+label_hash_init(struct label_hash *lh)
 {
-	return our_strhash(label) % LABEL_HASH_SIZE;
+	lh->buckets = lh->initial;
+	lh->size = LABEL_HASH_SIZE;
 }
 
-size_t
-hash_ms(const char *msstr)
+void
+label_hash_destroy(struct label_hash *lh)
+{
+	if (lh->old_buckets && lh->old_buckets != lh->initial) {
+		free(lh->old_buckets);
+	}
+	if (lh->buckets && lh->buckets != lh->initial) {
+		free(lh->buckets);
+	}
+	lh->buckets = lh->old_buckets = NULL;
+}
+
+void
+label_hash_migrate(struct label_hash *lh, size_t nbuckets)
+{
+	job_t ji;
+
+	while (lh->old_buckets && nbuckets--) {
+		struct label_hash_head *from = &lh->old_buckets[lh->old_next];
+		while ((ji = LIST_FIRST(from))) {
+			LIST_REMOVE(ji, label_hash_sle);
+			LIST_INSERT_HEAD(&lh->buckets[ji->label_hashval & (lh->size - 1)], ji, label_hash_sle);
+		}
+
+		if (++lh->old_next == lh->old_size) {
+			if (lh->old_buckets != lh->initial) {
+				free(lh->old_buckets);
+			}
+			lh->old_buckets = NULL;
+			lh->old_size = 0;
+			lh->old_next = 0;
+		}
+	}
+}
+
+void
+label_hash_insert(struct label_hash *lh, job_t j)
+{
+	if (unlikely(lh->old_buckets != NULL)) {
+		label_hash_migrate(lh, LABEL_HASH_MIGRATE);
+	}
+
+	if (unlikely(lh->count >= lh->size * LABEL_HASH_LOAD)) {
+		// The previous resize must be finished before starting another.
+		label_hash_migrate(lh, lh->old_size);
+
+		/* Failing to grow just leaves the chains longer. Lookups still work,
+		 * so this is not worth failing the insert over.
+		 */
+		struct label_hash_head *nb = calloc(lh->size * 2, sizeof(*nb));
+		if (nb) {
+			lh->old_buckets = lh->buckets;
+			lh->old_size = lh->size;
+			lh->old_next = 0;
+			lh->buckets = nb;
+			lh->size *= 2;
+			label_hash_migrate(lh, LABEL_HASH_MIGRATE);
+		}
+	}
+
+	j->label_hashval = our_strhash(j->label);
+	j->label_table = lh;
+	LIST_INSERT_HEAD(&lh->buckets[j->label_hashval & (lh->size - 1)], j, label_hash_sle);
+	lh->count++;
+
+	if (root_jobmgr && lh == &root_jobmgr->label_hash) {
+		semaphore_watchers_bind(j);
+	}
+}
+
+void
+label_hash_remove(job_t j)
+{
+	struct label_hash *lh = j->label_table;
+
+	if (!lh) {
+		return;
+	}
+
+	LIST_REMOVE(j, label_hash_sle);
+	j->label_table = NULL;
+	lh->count--;
+
+	if (unlikely(lh->old_buckets != NULL)) {
+		label_hash_migrate(lh, LABEL_HASH_MIGRATE);
+	}
+
+	if (root_jobmgr && lh == &root_jobmgr->label_hash) {
+		semaphore_watchers_unbind(j);
+	}
+}
+
+// Point the watchers of j's label at j, which now carries it in the root.
+void
+semaphore_watchers_bind(job_t j)
+{
+	struct semaphoreitem *si;
+
+	LIST_FOREACH(si, &s_semaphore_watchers[j->label_hashval & (SEMAPHORE_WATCH_HASH_SIZE - 1)], watch_sle) {
+		if (si->what_hashval == j->label_hashval && strcmp(si->what, j->label) == 0) {
+			si->other = j;
+		}
+	}
+}
+
+/* j has left the root label hash. Its watchers fall back to whichever job
+ * still carries the label, if any.
+ */
+void
+semaphore_watchers_unbind(job_t j)
 {
-	return our_strhash(msstr) % MACHSERVICE_HASH_SIZE;
+	struct semaphoreitem *si;
+	job_t other = NULL;
+	bool looked = false;
+
+	LIST_FOREACH(si, &s_semaphore_watchers[j->label_hashval & (SEMAPHORE_WATCH_HASH_SIZE - 1)], watch_sle) {
+		if (si->other != j) {
+			continue;
+		}
+		if (!looked) {
+			other = job_find(NULL, j->label);
+			looked = true;
+		}
+		si->other = other;
+	}
 }
 
 bool
@@ -28,6 +28,13 @@
 typedef struct job_s *job_t;
 typedef struct jobmgr_s *jobmgr_t;
 
+// Global events that jobs can subscribe to through their plist criteria.
+typedef enum {
+	KEEPALIVE_EVENT_NETWORK,
+	KEEPALIVE_EVENT_MOUNT,
+	KEEPALIVE_EVENT_CNT,
+} keepalive_event_t;
+
 extern jobmgr_t root_jobmgr;
 extern mach_port_t launchd_audit_port;
 extern au_asid_t launchd_audit_session;
@@ -36,13 +43,14 @@ extern bool launchd_embedded_handofgod;
 
 void jobmgr_init(bool);
 jobmgr_t jobmgr_shutdown(jobmgr_t jm);
-void jobmgr_dispatch_all_semaphores(jobmgr_t jm);
 void jobmgr_dispatch_all_interested(jobmgr_t jm, job_t j);
 jobmgr_t jobmgr_delete_anything_with_port(jobmgr_t jm, mach_port_t port);
 
 launch_data_t job_export_all(void);
 
 job_t job_dispatch(job_t j, bool kickstart); /* returns j on success, NULL on job removal */
+void job_dispatch_subscribers(keepalive_event_t ev);
+void job_environ_changed(void);
 job_t job_find(jobmgr_t jm, const char *label);
 job_t job_find_by_service_port(mach_port_t p);
 bool job_ack_port_destruction(mach_port_t p);
@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_START@
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ * @APPLE_APACHE_LICENSE_HEADER_END@
+ */
+
+#include <time.h>
+
+#include "cronemu.h"
+
+static int cronemu_mdays(int year, int mon);
+static void cronemu_start(struct tm *wtm, time_t now);
+static void cronemu_next_month(struct tm *wtm);
+static void cronemu_next_day(struct tm *wtm);
+static void cronemu_next_hour(struct tm *wtm);
+static time_t cronemu_mktime(struct tm *wtm, time_t now);
+
+time_t
+cronemu(time_t now, int mon, int mday, int hour, int min)
+{
+	struct tm workingtm;
+
+	cronemu_start(&workingtm, now);
+
+	/* Each pass either accepts a field or moves the candidate to the start of
+	 * the next unit above it, so this settles within a few passes. The
+	 * longest case is Feb 29, which may need to skip up to seven years to
+	 * reach the next leap year.
+	 */
+	for (;;) {
+		if (mon != -1 && workingtm.tm_mon != mon) {
+			if (workingtm.tm_mon > mon) {
+				workingtm.tm_year++;
+			}
+			workingtm.tm_mon = mon;
+			workingtm.tm_mday = 1;
+			workingtm.tm_hour = 0;
+			workingtm.tm_min = 0;
+		}
+
+		if (mday != -1 && workingtm.tm_mday != mday) {
+			if (mon != -1 && mday > cronemu_mdays(2000, mon)) {
+				/* A day that never exists in the requested month, like
+				 * February 30. Keep the old behavior of letting mktime(3)
+				 * roll it over into the next month rather than never firing.
+				 */
+				workingtm.tm_mday = mday;
+				workingtm.tm_hour = hour == -1 ? 0 : hour;
+				workingtm.tm_min = min == -1 ? 0 : min;
+				break;
+			}
+			if (workingtm.tm_mday > mday || mday > cronemu_mdays(workingtm.tm_year + 1900, workingtm.tm_mon)) {
+				cronemu_next_month(&workingtm);
+				continue;
+			}
+			workingtm.tm_mday = mday;
+			workingtm.tm_hour = 0;
+			workingtm.tm_min = 0;
+		}
+
+		if (hour != -1 && workingtm.tm_hour != hour) {
+			if (workingtm.tm_hour > hour) {
+				cronemu_next_day(&workingtm);
+				continue;
+			}
+			workingtm.tm_hour = hour;
+			workingtm.tm_min = 0;
+		}
+
+		if (min != -1 && workingtm.tm_min != min) {
+			if (workingtm.tm_min > min) {
+				cronemu_next_hour(&workingtm);
+				continue;
+			}
+			workingtm.tm_min = min;
+		}
+
+		break;
+	}
+
+	return cronemu_mktime(&workingtm, now);
+}
+
+time_t
+cronemu_wday(time_t now, int wday, int hour, int min)
+{
+	struct tm workingtm;
+
+	cronemu_start(&workingtm, now);
+
+	if (wday == 7) {
+		wday = 0;
+	}
+
+	for (;;) {
+		if (workingtm.tm_wday != wday) {
+			int days = (wday - workingtm.tm_wday + 7) % 7;
+			while (days--) {
+				cronemu_next_day(&workingtm);
+			}
+		}
+
+		if (hour != -1 && workingtm.tm_hour != hour) {
+			if (workingtm.tm_hour > hour) {
+				cronemu_next_day(&workingtm);
+				continue;
+			}
+			workingtm.tm_hour = hour;
+			workingtm.tm_min = 0;
+		}
+
+		if (min != -1 && workingtm.tm_min != min) {
+			if (workingtm.tm_min > min) {
+				cronemu_next_hour(&workingtm);
+				continue;
+			}
+			workingtm.tm_min = min;
+		}
+
+		break;
+	}
+
+	return cronemu_mktime(&workingtm, now);
+}
+
+int
+cronemu_mdays(int year, int mon)
+{
+	static const int mdays[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+	if (mon == 1 && ((year % 4 == 0 && year % 100 != 0) || year % 400 == 0)) {
+		return 29;
+	}
+
+	return mdays[mon];
+}
+
+/* The helpers below step a broken-down local time forward by whole units
+ * without calling mktime(3). Everything smaller than the unit is reset to
+ * zero, and tm_wday is kept up to date for cronemu_wday().
+ */
+void
+cronemu_start(struct tm *wtm, time_t now)
+{
+	(void)localtime_r(&now, wtm);
+	wtm->tm_sec = 0;
+
+	// The earliest candidate is the start of the next minute.
+	if (++wtm->tm_min == 60) {
+		wtm->tm_min = 0;
+		if (++wtm->tm_hour == 24) {
+			cronemu_next_day(wtm);
+		}
+	}
+}
+
+void
+cronemu_next_month(struct tm *wtm)
+{
+	static const int t[12] = { 0, 3, 2, 5, 0, 3, 5, 1, 4, 6, 2, 4 };
+	int y, m;
+
+	if (++wtm->tm_mon == 12) {
+		wtm->tm_mon = 0;
+		wtm->tm_year++;
+	}
+	wtm->tm_mday = 1;
+	wtm->tm_hour = 0;
+	wtm->tm_min = 0;
+
+	// Sakamoto's day of the week.
+	y = wtm->tm_year + 1900;
+	m = wtm->tm_mon;
+	if (m < 2) {
+		y--;
+	}
+	wtm->tm_wday = (y + y / 4 - y / 100 + y / 400 + t[m] + 1) % 7;
+}
+
+void
+cronemu_next_day(struct tm *wtm)
+{
+	if (++wtm->tm_mday > cronemu_mdays(wtm->tm_year + 1900, wtm->tm_mon)) {
+		cronemu_next_month(wtm);
+		return;
+	}
+	wtm->tm_wday = (wtm->tm_wday + 1) % 7;
+	wtm->tm_hour = 0;
+	wtm->tm_min = 0;
+}
+
+void
+cronemu_next_hour(struct tm *wtm)
+{
+	if (++wtm->tm_hour == 24) {
+		cronemu_next_day(wtm);
+		return;
+	}
+	wtm->tm_min = 0;
+}
+
+time_t
+cronemu_mktime(struct tm *wtm, time_t now)
+{
+	struct tm other;
+	time_t later, alt, before;
+
+	/* A time in a spring-forward gap exists under neither DST reading, and
+	 * mktime(3) moves it past the gap so that the job still runs that day.
+	 */
+	wtm->tm_sec = 0;
+	wtm->tm_isdst = -1;
+	other = *wtm;
+	later = mktime(wtm);
+	if (later > now && wtm->tm_isdst > 0) {
+		return later;
+	}
+
+	/* A time repeated at fall-back converts to either occurrence depending on
+	 * the DST hint. If we got standard time just after a transition, or an
+	 * occurrence that is already behind us, also try the DST reading and keep
+	 * the earliest one still ahead.
+	 */
+	before = later - 2 * 60 * 60;
+	if (later > now && localtime_r(&before, &other) && other.tm_isdst <= 0) {
+		return later;
+	}
+
+	other = *wtm;
+	other.tm_isdst = !wtm->tm_isdst;
+	alt = mktime(&other);
+	if (alt > now && (later <= now || alt < later) && other.tm_isdst != wtm->tm_isdst
+			&& other.tm_min == wtm->tm_min && other.tm_hour == wtm->tm_hour && other.tm_mday == wtm->tm_mday) {
+		later = alt;
+	}
+
+	return later;
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_APACHE_LICENSE_HEADER_START@
+ * 
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ * 
+ * @APPLE_APACHE_LICENSE_HEADER_END@
+ */
+#ifndef __LAUNCHD_CRONEMU_H__
+#define __LAUNCHD_CRONEMU_H__
+
+#include <time.h>
+
+/* The first time after 'now' that matches a StartCalendarInterval entry, in
+ * the local time zone. -1 in a field means any value, and a weekday of 7 is
+ * Sunday, like 0.
+ */
+time_t cronemu(time_t now, int mon, int mday, int hour, int min);
+time_t cronemu_wday(time_t now, int wday, int hour, int min);
+
+#endif /* __LAUNCHD_CRONEMU_H__ */
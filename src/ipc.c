@@ -56,10 +56,22 @@
 extern char **environ;
 
 static LIST_HEAD(, conncb) connections;
+/* The connection whose messages are being dispatched right now. If it gets
+ * closed along the way, ipc_callback() frees it once dispatch unwinds.
+ */
+static struct conncb *ipc_busy_conn;
+static bool ipc_busy_conn_closed;
+
+/* A client that keeps sending requests without reading the answers would
+ * otherwise grow its reply queue without bound. Past this many unsent bytes,
+ * launchd stops reading from the connection until the queue has drained.
+ */
+#define IPC_SENDQ_THROTTLE	(256 * 1024)
 
 static launch_data_t adjust_rlimits(launch_data_t in);
 
 static void ipc_readmsg2(launch_data_t data, const char *cmd, void *context);
+static launch_data_t ipc_hello(launch_data_t caps);
 static void ipc_readmsg(launch_data_t msg, void *context);
 
 static void ipc_listen_callback(void *obj __attribute__((unused)), struct kevent *kev);
@@ -217,11 +229,39 @@ ipc_callback(void *obj, struct kevent *kev)
 	int r;
 
 	if (kev->filter == EVFILT_READ) {
-		if (launchd_msg_recv(c->conn, ipc_readmsg, c) == -1 && errno != EAGAIN) {
+		/* One wakeup handles every message the client has queued up.
+		 * ipc_readmsg() only queues the replies; they go out together
+		 * at the end.
+		 */
+		ipc_busy_conn = c;
+		ipc_busy_conn_closed = false;
+		r = launchd_msg_recv(c->conn, ipc_readmsg, c);
+		ipc_busy_conn = NULL;
+
+		if (ipc_busy_conn_closed) {
+			free(c);
+			return;
+		}
+
+		if (r == -1 && errno != EAGAIN) {
 			if (errno != ECONNRESET) {
 				launchd_syslog(LOG_DEBUG, "%s(): recv: %s", __func__, strerror(errno));
 			}
 			ipc_close(c);
+			return;
+		}
+
+		if (launchd_msg_send(c->conn, NULL) == -1) {
+			if (errno == EAGAIN) {
+				kevent_mod(launchd_getfd(c->conn), EVFILT_WRITE, EV_ADD, 0, 0, &c->kqconn_callback);
+				if (launchd_msg_sendlen(c->conn) > IPC_SENDQ_THROTTLE) {
+					kevent_mod(launchd_getfd(c->conn), EVFILT_READ, EV_DISABLE, 0, 0, &c->kqconn_callback);
+					c->read_throttled = true;
+				}
+			} else {
+				launchd_syslog(LOG_DEBUG, "%s(): send: %s", __func__, strerror(errno));
+				ipc_close(c);
+			}
 		}
 	} else if (kev->filter == EVFILT_WRITE) {
 		r = launchd_msg_send(c->conn, NULL);
@@ -232,6 +272,10 @@ ipc_callback(void *obj, struct kevent *kev)
 			}
 		} else if (r == 0) {
 			kevent_mod(launchd_getfd(c->conn), EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+			if (c->read_throttled) {
+				kevent_mod(launchd_getfd(c->conn), EVFILT_READ, EV_ENABLE, 0, 0, &c->kqconn_callback);
+				c->read_throttled = false;
+			}
 		}
 	} else {
 		launchd_syslog(LOG_DEBUG, "%s(): unknown filter type!", __func__);
@@ -309,12 +353,13 @@ ipc_revoke_fds(launch_data_t o)
 struct readmsg_context {
 	struct conncb *c;
 	launch_data_t resp;
+	launch_data_arena_t arena;
 };
 
 void
 ipc_readmsg(launch_data_t msg, void *context)
 {
-	struct readmsg_context rmc = { context, NULL };
+	struct readmsg_context rmc = { context, NULL, NULL };
 
 	if (LAUNCH_DATA_DICTIONARY == launch_data_get_type(msg)) {
 		launch_data_dict_iterate(msg, ipc_readmsg2, &rmc);
@@ -330,15 +375,15 @@ ipc_readmsg(launch_data_t msg, void *context)
 
 	ipc_close_fds(msg);
 
-	if (launchd_msg_send(rmc.c->conn, rmc.resp) == -1) {
-		if (errno == EAGAIN) {
-			kevent_mod(launchd_getfd(rmc.c->conn), EVFILT_WRITE, EV_ADD, 0, 0, &rmc.c->kqconn_callback);
-		} else {
-			launchd_syslog(LOG_DEBUG, "launchd_msg_send() == -1: %s", strerror(errno));
-			ipc_close(rmc.c);
-		}
+	/* Don't answer a request that tore down its own connection. */
+	if (!ipc_busy_conn_closed && launchd_msg_queue(rmc.c->conn, rmc.resp) == -1) {
+		launchd_syslog(LOG_DEBUG, "launchd_msg_queue() == -1: %s", strerror(errno));
+		ipc_close(rmc.c);
 	}
 	launch_data_free(rmc.resp);
+	if (rmc.arena) {
+		launch_data_arena_free(rmc.arena);
+	}
 }
 
 void
@@ -362,7 +407,10 @@ ipc_readmsg2(launch_data_t data, const char *cmd, void *context)
 	bool allow_privileged_ops = !rmc->c->j;
 #endif
 
-	if (rmc->c->j && strcmp(cmd, LAUNCH_KEY_CHECKIN) == 0) {
+	if (data && strcmp(cmd, LAUNCH_KEY_HELLO) == 0) {
+		/* Harmless, so any connection may ask. */
+		resp = ipc_hello(data);
+	} else if (rmc->c->j && strcmp(cmd, LAUNCH_KEY_CHECKIN) == 0) {
 		resp = job_export(rmc->c->j);
 		job_checkin(rmc->c->j);
 	} else if (allow_privileged_ops) {
@@ -374,7 +422,17 @@ ipc_readmsg2(launch_data_t data, const char *cmd, void *context)
 				launchd_shutdown();
 				resp = launch_data_new_errno(0);
 			} else if (!strcmp(cmd, LAUNCH_KEY_GETJOBS)) {
+				/* The export is packed and thrown away as soon as it is
+				 * sent, so build it in an arena.
+				 */
+				launch_data_arena_t prev = NULL;
+				if ((rmc->arena = launch_data_arena_create(0))) {
+					prev = launch_data_arena_set_current(rmc->arena);
+				}
 				resp = job_export_all();
+				if (rmc->arena) {
+					launch_data_arena_set_current(prev);
+				}
 				ipc_revoke_fds(resp);
 			} else if (!strcmp(cmd, LAUNCH_KEY_GETRESOURCELIMITS)) {
 				resp = adjust_rlimits(NULL);
@@ -416,9 +474,11 @@ ipc_readmsg2(launch_data_t data, const char *cmd, void *context)
 				}
 			} else if (!strcmp(cmd, LAUNCH_KEY_UNSETUSERENVIRONMENT)) {
 				unsetenv(launch_data_get_string(data));
+				job_environ_changed();
 				resp = launch_data_new_errno(0);
 			} else if (!strcmp(cmd, LAUNCH_KEY_SETUSERENVIRONMENT)) {
 				launch_data_dict_iterate(data, set_user_env, NULL);
+				job_environ_changed();
 				resp = launch_data_new_errno(0);
 			} else if (!strcmp(cmd, LAUNCH_KEY_SETRESOURCELIMITS)) {
 				resp = adjust_rlimits(data);
@@ -447,6 +507,36 @@ ipc_readmsg2(launch_data_t data, const char *cmd, void *context)
 	rmc->resp = resp;
 }
 
+launch_data_t
+ipc_hello(launch_data_t caps)
+{
+	launch_data_t resp, v;
+
+	if (launch_data_get_type(caps) != LAUNCH_DATA_DICTIONARY) {
+		return launch_data_new_errno(EINVAL);
+	}
+
+	if (!(resp = launch_data_alloc(LAUNCH_DATA_DICTIONARY))) {
+		return NULL;
+	}
+
+	/* launchd_msg_recv() echoes the tag of the message being answered. */
+	if ((v = launch_data_dict_lookup(caps, LAUNCH_HELLO_KEY_TAGS)) && launch_data_get_type(v) == LAUNCH_DATA_BOOL && launch_data_get_bool(v)) {
+		launch_data_dict_insert(resp, launch_data_new_bool(true), LAUNCH_HELLO_KEY_TAGS);
+	}
+
+	/* The highest version both sides speak. Without an answer, or from an
+	 * older launchd, the client stays on v1.
+	 */
+	if ((v = launch_data_dict_lookup(caps, LAUNCH_HELLO_KEY_WIREVERSION)) && launch_data_get_type(v) == LAUNCH_DATA_INTEGER && launch_data_get_integer(v) > 1) {
+		long long wire = launch_data_get_integer(v);
+
+		launch_data_dict_insert(resp, launch_data_new_integer(wire < LAUNCHD_WIRE_VERSION_MAX ? wire : LAUNCHD_WIRE_VERSION_MAX), LAUNCH_HELLO_KEY_WIREVERSION);
+	}
+
+	return resp;
+}
+
 static int
 close_abi_fixup(int fd)
 {
@@ -458,7 +548,11 @@ ipc_close(struct conncb *c)
 {
 	LIST_REMOVE(c, sle);
 	launchd_close(c->conn, close_abi_fixup);
-	free(c);
+	if (c == ipc_busy_conn) {
+		ipc_busy_conn_closed = true;
+	} else {
+		free(c);
+	}
 }
 
 launch_data_t
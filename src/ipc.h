@@ -32,6 +32,7 @@ struct conncb {
 	LIST_ENTRY(conncb) sle;
 	launch_t conn;
 	job_t j;
+	bool read_throttled;
 };
 
 extern char *sockpath;
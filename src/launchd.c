@@ -653,6 +653,6 @@ pfsystem_callback(void *obj __attribute__((unused)), struct kevent *kev)
 
 	if (new_networking_state != network_up) {
 		network_up = new_networking_state;
-		jobmgr_dispatch_all_semaphores(root_jobmgr);
+		job_dispatch_subscribers(KEEPALIVE_EVENT_NETWORK);
 	}
 }
@@ -58,6 +58,7 @@
 #include <syslog.h>
 #include <signal.h>
 #include <dlfcn.h>
+#include <spawn.h>
 #include <assumes.h>
 
 #include "internalServer.h"
@@ -89,6 +90,40 @@ static int bulk_kev_cnt;
 
 static pthread_t kqueue_demand_thread;
 
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_PENDING ((unsigned int)-1)
+
+/* Per-job timers are kept in a hierarchical timer wheel with one-second ticks
+ * and a single EVFILT_TIMER behind it. Level 0 holds the next 64 seconds, one
+ * slot per second, and each level above it covers 64 times the span of the
+ * one below. A timer is filed at the lowest level whose span reaches its
+ * deadline and cascades down as the wheel turns. Every timer due in the same
+ * second fires from the same wakeup.
+ */
+LIST_HEAD(runtime_timer_list, runtime_timer_s);
+static struct {
+	struct runtime_timer_list slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+	uint64_t occupied[TIMER_WHEEL_LEVELS];
+	uint64_t now;
+	uint64_t armed;
+	size_t cnt;
+	bool firing;
+	uint64_t fired;
+	uint64_t wakeups;
+	uint64_t kevents;
+} timer_wheel;
+
+static uint64_t timer_wheel_tick(uint64_t *nsp);
+static void timer_wheel_insert(struct runtime_timer_s *rt);
+static uint64_t timer_wheel_next(void);
+static void timer_wheel_advance(uint64_t target);
+static void timer_wheel_rearm(uint64_t now);
+static void timer_wheel_callback(void);
+static kq_callback kqtimer_wheel_callback = (kq_callback)timer_wheel_callback;
+
 static void mportset_callback(void);
 static kq_callback kqmportset_callback = (kq_callback)mportset_callback;
 static void *kqueue_demand_loop(void *arg);
@@ -130,6 +165,8 @@ bool launchd_log_debug = false;
 bool launchd_trap_sigkill_bugs = false;
 bool launchd_osinstaller = false;
 bool launchd_allow_global_dyld_envvars = false;
+bool launchd_use_spawn_helper = false;
+uint32_t launchd_spawn_concurrency = 0;
 pid_t launchd_wsp = 0;
 size_t runtime_busy_cnt;
 
@@ -666,6 +703,54 @@ runtime_fork(mach_port_t bsport)
 	return r;
 }
 
+/* The posix_spawn(2) counterpart of runtime_fork(). The child gets the same
+ * bootstrap port, signal dispositions and signal mask that runtime_fork()
+ * would have given it, without launchd having to fork itself first.
+ */
+pid_t
+runtime_spawn(mach_port_t bsport, const char *path, bool search, posix_spawnattr_t *attr, const posix_spawn_file_actions_t *fa, char *const argv[], char *const envp[])
+{
+	sigset_t emptyset;
+	short flags = 0;
+	pid_t r = -1;
+	int error;
+
+	sigemptyset(&emptyset);
+
+	(void)posix_assumes_zero(posix_spawnattr_getflags(attr, &flags));
+	(void)posix_assumes_zero(posix_spawnattr_setflags(attr, flags | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK));
+	(void)posix_assumes_zero(posix_spawnattr_setsigdefault(attr, &sigign_set));
+	(void)posix_assumes_zero(posix_spawnattr_setsigmask(attr, &emptyset));
+
+	(void)osx_assumes_zero(launchd_mport_make_send(bsport));
+	(void)posix_assumes_zero(posix_spawnattr_setspecialport_np(attr, bsport, TASK_BOOTSTRAP_PORT));
+
+	if (search) {
+		error = posix_spawnp(&r, path, fa, attr, argv, envp);
+	} else {
+		error = posix_spawn(&r, path, fa, attr, argv, envp);
+	}
+
+	(void)osx_assumes_zero(launchd_mport_deallocate(bsport));
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+
+	/* runtime_fork() children set this on themselves before they exec(3).
+	 * A spawned child is already running by now, so we set it from here. Until
+	 * the call lands, the child can still block on an unresponsive remote
+	 * volume rather than get an error. This race is accepted. The window is
+	 * short and usually closes before the job's own code runs. Closing it
+	 * would cost every job the fork(2) that posix_spawn(2) is here to avoid.
+	 */
+	pid_t p = -r;
+	(void)posix_assumes_zero(sysctlbyname("vfs.generic.noremotehang", NULL, NULL, &p, sizeof(p)));
+
+	return r;
+}
+
 
 void
 runtime_set_timeout(timeout_callback to_cb, unsigned int sec)
@@ -823,6 +908,236 @@ kevent_mod(uintptr_t ident, short filter, u_short flags, u_int fflags, intptr_t
 	return r;
 }
 
+uint64_t
+timer_wheel_tick(uint64_t *nsp)
+{
+	uint64_t ns = runtime_opaque_time_to_nano(runtime_get_opaque_time());
+
+	if (nsp) {
+		*nsp = ns;
+	}
+
+	return ns / NSEC_PER_SEC;
+}
+
+void
+timer_wheel_insert(struct runtime_timer_s *rt)
+{
+	uint64_t deadline, delta;
+	unsigned int level, slot;
+
+	if (rt->rt_deadline <= timer_wheel.now) {
+		rt->rt_deadline = timer_wheel.now + 1;
+	}
+
+	deadline = rt->rt_deadline;
+	delta = deadline - timer_wheel.now;
+	for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+		if (delta < (1ULL << (TIMER_WHEEL_BITS * (level + 1)))) {
+			break;
+		}
+	}
+
+	/* Anything beyond the top level's reach is parked at its far edge and
+	 * filed again when that slot comes around.
+	 */
+	if (delta >= (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))) {
+		deadline = timer_wheel.now + (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+	}
+
+	slot = (deadline >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+	LIST_INSERT_HEAD(&timer_wheel.slots[level][slot], rt, rt_sle);
+	timer_wheel.occupied[level] |= 1ULL << slot;
+	rt->rt_slot = level * TIMER_WHEEL_SLOTS + slot;
+	rt->rt_armed = true;
+	timer_wheel.cnt++;
+}
+
+uint64_t
+timer_wheel_next(void)
+{
+	uint64_t next = 0;
+	unsigned int level;
+
+	/* For each level, find the first occupied slot after the current one.
+	 * The tick at which that slot's span begins is when it either fires (level
+	 * 0) or cascades, so the earliest of those is when we next need to wake.
+	 */
+	for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		unsigned int shift = TIMER_WHEEL_BITS * level;
+		unsigned int rot = ((timer_wheel.now >> shift) + 1) & TIMER_WHEEL_MASK;
+		uint64_t occ = timer_wheel.occupied[level];
+		uint64_t when;
+
+		if (!occ) {
+			continue;
+		}
+
+		if (rot) {
+			occ = (occ >> rot) | (occ << (TIMER_WHEEL_SLOTS - rot));
+		}
+
+		when = ((timer_wheel.now >> shift) + __builtin_ctzll(occ) + 1) << shift;
+		if (next == 0 || when < next) {
+			next = when;
+		}
+	}
+
+	return next;
+}
+
+void
+timer_wheel_advance(uint64_t target)
+{
+	struct runtime_timer_list pending;
+	struct runtime_timer_s *rt;
+	uint64_t next;
+	int level;
+
+	LIST_INIT(&pending);
+
+	while ((next = timer_wheel_next()) && next <= target) {
+		timer_wheel.now = next;
+
+		for (level = TIMER_WHEEL_LEVELS - 1; level >= 0; level--) {
+			unsigned int shift = TIMER_WHEEL_BITS * level;
+			unsigned int slot = (next >> shift) & TIMER_WHEEL_MASK;
+
+			if (next & ((1ULL << shift) - 1)) {
+				continue;
+			}
+			if (!(timer_wheel.occupied[level] & (1ULL << slot))) {
+				continue;
+			}
+
+			timer_wheel.occupied[level] &= ~(1ULL << slot);
+			while ((rt = LIST_FIRST(&timer_wheel.slots[level][slot]))) {
+				LIST_REMOVE(rt, rt_sle);
+				timer_wheel.cnt--;
+
+				if (rt->rt_deadline <= next) {
+					LIST_INSERT_HEAD(&pending, rt, rt_sle);
+					rt->rt_slot = TIMER_WHEEL_PENDING;
+				} else {
+					timer_wheel_insert(rt);
+				}
+			}
+		}
+	}
+
+	if (target > timer_wheel.now) {
+		timer_wheel.now = target;
+	}
+
+	/* Callbacks may arm or disarm any timer, including ones still on the
+	 * pending list, so take them off one at a time.
+	 */
+	timer_wheel.firing = true;
+	while ((rt = LIST_FIRST(&pending))) {
+		struct kevent kev;
+
+		LIST_REMOVE(rt, rt_sle);
+		rt->rt_armed = false;
+
+		if (rt->rt_interval) {
+			rt->rt_deadline += rt->rt_interval;
+			if (rt->rt_deadline <= timer_wheel.now) {
+				rt->rt_deadline = timer_wheel.now + rt->rt_interval;
+			}
+			timer_wheel_insert(rt);
+		}
+
+		EV_SET(&kev, rt->rt_ident, EVFILT_TIMER, 0, 0, 1, rt->rt_udata);
+		timer_wheel.fired++;
+		(*((kq_callback *)kev.udata))(kev.udata, &kev);
+	}
+	timer_wheel.firing = false;
+}
+
+void
+timer_wheel_rearm(uint64_t now)
+{
+	uint64_t next = timer_wheel_next();
+
+	/* If the kernel timer is already due no later than what we need, leave it
+	 * alone. It is one-shot, so a wakeup for a timer that has since been
+	 * disarmed costs one pass through here and nothing else.
+	 */
+	if (next == 0 || (timer_wheel.armed && timer_wheel.armed <= next)) {
+		return;
+	}
+
+	if (posix_assumes_zero(kevent_mod((uintptr_t)&timer_wheel, EVFILT_TIMER, EV_ADD|EV_ONESHOT, NOTE_SECONDS, next > now ? next - now : 0, &kqtimer_wheel_callback)) != -1) {
+		timer_wheel.armed = next;
+		timer_wheel.kevents++;
+	}
+}
+
+void
+timer_wheel_callback(void)
+{
+	uint64_t now = timer_wheel_tick(NULL);
+
+	timer_wheel.armed = 0;
+	timer_wheel.wakeups++;
+	timer_wheel_advance(now);
+	timer_wheel_rearm(now);
+}
+
+void
+runtime_timer_arm(struct runtime_timer_s *rt, uintptr_t ident, uint32_t first, uint32_t interval, void *udata)
+{
+	uint64_t ns, now;
+
+	runtime_timer_disarm(rt);
+
+	now = timer_wheel_tick(&ns);
+	if (timer_wheel.cnt == 0 && !timer_wheel.firing) {
+		timer_wheel.now = now;
+	}
+
+	/* Round the deadline up to the next tick so that the timer never fires
+	 * early, only up to a second late.
+	 */
+	rt->rt_ident = ident;
+	rt->rt_udata = udata;
+	rt->rt_interval = interval;
+	rt->rt_deadline = (ns + (uint64_t)first * NSEC_PER_SEC + NSEC_PER_SEC - 1) / NSEC_PER_SEC;
+	timer_wheel_insert(rt);
+
+	if (!timer_wheel.firing) {
+		timer_wheel_rearm(now);
+	}
+}
+
+void
+runtime_timer_disarm(struct runtime_timer_s *rt)
+{
+	unsigned int level, slot;
+
+	if (!rt->rt_armed) {
+		return;
+	}
+
+	LIST_REMOVE(rt, rt_sle);
+	rt->rt_armed = false;
+
+	if (rt->rt_slot != TIMER_WHEEL_PENDING) {
+		level = rt->rt_slot / TIMER_WHEEL_SLOTS;
+		slot = rt->rt_slot % TIMER_WHEEL_SLOTS;
+		if (LIST_EMPTY(&timer_wheel.slots[level][slot])) {
+			timer_wheel.occupied[level] &= ~(1ULL << slot);
+		}
+		timer_wheel.cnt--;
+	}
+}
+
+void
+runtime_timer_log_statistics(void)
+{
+	launchd_syslog(LOG_PERF, "Timer wheel: %lu armed, %llu fired, %llu wakeups, %llu kernel timer updates.", timer_wheel.cnt, timer_wheel.fired, timer_wheel.wakeups, timer_wheel.kevents);
+}
+
 boolean_t
 launchd_internal_demux(mach_msg_header_t *Request, mach_msg_header_t *Reply)
 {
@@ -1372,10 +1687,23 @@ do_file_init(void)
 		launchd_osinstaller = true;
 	}
 
+	if (pid1_magic && config_check(".launchd_use_spawn_helper", sb)) {
+		launchd_use_spawn_helper = true;
+	}
+
 	if (!pid1_magic && config_check(".launchd_allow_global_dyld_envvars", sb)) {
 		launchd_allow_global_dyld_envvars = true;
 	}
 
+	/* Enough jobs starting at once to keep every CPU busy while some of them
+	 * wait on the disk, and no more. The spawn scheduler is off if this is 0.
+	 */
+	int ncpu = 0;
+	size_t ncpu_sz = sizeof(ncpu);
+	if (sysctlbyname("hw.activecpu", &ncpu, &ncpu_sz, NULL, 0) == 0 && ncpu > 0) {
+		launchd_spawn_concurrency = 4 * (uint32_t)ncpu;
+	}
+
 	char bootargs[1024];
 	size_t len = sizeof(bootargs) - 1;
 	int r = pid1_magic ? sysctlbyname("kern.bootargs", bootargs, &len, NULL, 0) : -1;
@@ -1386,6 +1714,12 @@ do_file_init(void)
 		if (strnstr(bootargs, "launchd_trap_sigkill_bugs", len)) {
 			launchd_trap_sigkill_bugs = true;
 		}
+
+		char *spawn_concurrency = strnstr(bootargs, "launchd_spawn_concurrency=", len);
+		if (spawn_concurrency) {
+			bootargs[len] = '\0';
+			launchd_spawn_concurrency = (uint32_t)strtoul(spawn_concurrency + sizeof("launchd_spawn_concurrency=") - 1, NULL, 10);
+		}
 	}
 
 	if (pid1_magic && launchd_verbose_boot && config_check(".launchd_shutdown_debugging", sb)) {
@@ -24,10 +24,12 @@
 #include <xpc/xpc.h>
 #include <mach/mach.h>
 #include <sys/types.h>
+#include <sys/queue.h>
 #include <bsm/libbsm.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <float.h>
+#include <spawn.h>
 #include <syslog.h>
 
 #include "kill2.h"
@@ -51,6 +53,21 @@ typedef void (*kq_callback)(void *, struct kevent *);
 typedef boolean_t (*mig_callback)(mach_msg_header_t *, mach_msg_header_t *);
 typedef void (*timeout_callback)(void);
 
+/* A timer backed by the runtime's timer wheel instead of its own kevent.
+ * Callers embed one of these in the object that owns it; when it fires, the
+ * callback in udata is handed an EVFILT_TIMER kevent carrying ident, exactly
+ * as if the kernel had delivered it. Resolution is one second.
+ */
+struct runtime_timer_s {
+	LIST_ENTRY(runtime_timer_s) rt_sle;
+	uint64_t rt_deadline;
+	uint32_t rt_interval;
+	uintptr_t rt_ident;
+	void *rt_udata;
+	unsigned int rt_slot;
+	bool rt_armed;
+};
+
 extern bool launchd_verbose_boot;
 /* Configuration knobs set in do_file_init(). */
 extern bool launchd_shutdown_debugging;
@@ -62,6 +79,8 @@ extern bool launchd_log_perf;
 extern bool launchd_trap_sigkill_bugs;
 extern bool launchd_osinstaller;
 extern bool launchd_allow_global_dyld_envvars;
+extern bool launchd_use_spawn_helper;
+extern uint32_t launchd_spawn_concurrency;
 
 extern bool launchd_runtime_busy_time;
 extern mach_port_t inherited_bootstrap_port;
@@ -99,11 +118,16 @@ struct ldcred *runtime_get_caller_creds(void);
 const char *signal_to_C_name(unsigned int sig);
 const char *reboot_flags_to_C_names(unsigned int flags);
 
+void runtime_timer_arm(struct runtime_timer_s *rt, uintptr_t ident, uint32_t first, uint32_t interval, void *udata);
+void runtime_timer_disarm(struct runtime_timer_s *rt);
+void runtime_timer_log_statistics(void);
+
 int kevent_bulk_mod(struct kevent *kev, size_t kev_cnt);
 int kevent_mod(uintptr_t ident, short filter, u_short flags, u_int fflags, intptr_t data, void *udata);
 void log_kevent_struct(int level, struct kevent *kev_base, int indx);
 
 pid_t runtime_fork(mach_port_t bsport);
+pid_t runtime_spawn(mach_port_t bsport, const char *path, bool search, posix_spawnattr_t *attr, const posix_spawn_file_actions_t *fa, char *const argv[], char *const envp[]);
 
 mach_msg_return_t launchd_exc_runtime_once(mach_port_t port, mach_msg_size_t rcv_msg_size, mach_msg_size_t send_msg_size, mig_reply_error_t *bufRequest, mig_reply_error_t *bufReply, mach_msg_timeout_t to);
 
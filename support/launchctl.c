@@ -96,6 +96,7 @@ extern char **environ;
 
 struct load_unload_state {
 	launch_data_t pass1;
+	launch_data_arena_t arena;
 	char *session_type;
 	bool editondisk:1, load:1, forceload:1;
 };
@@ -2311,6 +2312,15 @@ load_and_unload_cmd(int argc, char *const argv[])
 		}
 	}
 
+	/* Every plist we read lives until the submit below, so carve the whole
+	 * batch (and the messages built from it) out of one arena and throw it
+	 * away in one go.
+	 */
+	launch_data_arena_t prev_arena = NULL;
+	if ((lus.arena = launch_data_arena_create(0))) {
+		prev_arena = launch_data_arena_set_current(lus.arena);
+	}
+
 	/* Only one pass! */
 	lus.pass1 = launch_data_alloc(LAUNCH_DATA_ARRAY);
 
@@ -2342,6 +2352,10 @@ load_and_unload_cmd(int argc, char *const argv[])
 			launchctl_log(LOG_ERR, "nothing found to %s", lus.load ? "load" : "unload");
 		}
 		launch_data_free(lus.pass1);
+		if (lus.arena) {
+			launch_data_arena_set_current(prev_arena);
+			launch_data_arena_free(lus.arena);
+		}
 		return _launchctl_is_managed ? 0 : 1;
 	}
 
@@ -2354,6 +2368,11 @@ load_and_unload_cmd(int argc, char *const argv[])
 		}
 	}
 
+	if (lus.arena) {
+		launch_data_arena_set_current(prev_arena);
+		launch_data_arena_free(lus.arena);
+	}
+
 	if (_launchctl_overrides_db_changed) {
 		WriteMyPropertyListToFile(_launchctl_overrides_db, _launchctl_job_overrides_db_path);
 	}
@@ -2580,7 +2599,8 @@ list_cmd(int argc, char *const argv[])
 		msg = launch_data_alloc(LAUNCH_DATA_DICTIONARY);
 		launch_data_dict_insert(msg, launch_data_new_string(label), LAUNCH_KEY_GETJOB);
 
-		resp = launch_msg(msg);
+		/* We only read the reply, so skip the deep copy. */
+		resp = launch_msg_borrowed(msg);
 		launch_data_free(msg);
 
 		if (resp == NULL) {